@@ -4,6 +4,13 @@
 #include "Application.h"
 #include <signal.h>
 #include <emu/System.h>
+#include <emu/cpu/ee/EEJit.h>
+#include <emu/cpu/ee/EEJitOpt.h>
+#include <emu/cpu/ee/EmotionEngine.h>
+#include <emu/cpu/ee/x64/CodeCache.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 
 bool Application::isRunning = false;
 int Application::exit_code = 0;
@@ -17,10 +24,76 @@ bool Application::Init(int argc, char** argv)
 {
 	if (argc < 2)
     {
-        printf("Usage: %s [bios]\n", argv[0]);
+        printf("Usage: %s [bios] [--jit-cache dir] [--jit-threshold n] [--jit-lockstep] [--jit-no-traces] [--jit-perf map|jitdump] [--jit-symbols file] [--jit-stats file.json|file.csv] [--jit-profile] [--jit-passes mask] [--jit-cache-size MB] [--jit-huge-pages] [--fpu-clamp none|store|full]\n", argv[0]);
         return false;
     }
 
+    for (int i = 2; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--jit-cache") && i + 1 < argc)
+            EEJit::cache_dir = argv[++i];
+        else if (!strcmp(argv[i], "--jit-threshold") && i + 1 < argc)
+            EEJit::promote_threshold = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--jit-lockstep"))
+            EEJit::lockstep = true;
+        else if (!strcmp(argv[i], "--jit-no-traces"))
+            EEJit::traces = false;
+        else if (!strcmp(argv[i], "--jit-perf") && i + 1 < argc)
+        {
+            const char* format = argv[++i];
+            if (!strcmp(format, "map"))
+                EEJit::perf_output = EEJit::PerfOutput::Map;
+            else if (!strcmp(format, "jitdump"))
+                EEJit::perf_output = EEJit::PerfOutput::JitDump;
+            else
+            {
+                printf("Invalid --jit-perf %s, expected map or jitdump\n", format);
+                return false;
+            }
+        }
+        else if (!strcmp(argv[i], "--jit-symbols") && i + 1 < argc)
+            EEJit::symbol_file = argv[++i];
+        else if (!strcmp(argv[i], "--jit-stats") && i + 1 < argc)
+        {
+            EEJit::block_stats = true;
+            EEJit::stats_file = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--jit-profile"))
+            EEJit::profile_blocks = true;
+        else if (!strcmp(argv[i], "--jit-passes") && i + 1 < argc)
+            EEJitOpt::enabled_passes = strtol(argv[++i], nullptr, 0);
+        else if (!strcmp(argv[i], "--jit-cache-size") && i + 1 < argc)
+        {
+            const char* mb = argv[++i];
+            char* end;
+            errno = 0;
+            unsigned long size = strtoul(mb, &end, 10);
+            if (strchr(mb, '-') || end == mb || *end || errno || !size || size > CodeCache::MAX_SIZE / (1024 * 1024))
+            {
+                printf("Invalid --jit-cache-size %s, expected 1 to %zu MB\n", mb, CodeCache::MAX_SIZE / (1024 * 1024));
+                return false;
+            }
+            CodeCache::size = size * 1024 * 1024;
+        }
+        else if (!strcmp(argv[i], "--jit-huge-pages"))
+            CodeCache::huge_pages = true;
+        else if (!strcmp(argv[i], "--fpu-clamp") && i + 1 < argc)
+        {
+            const char* mode = argv[++i];
+            if (!strcmp(mode, "none"))
+                EmotionEngine::fpu_clamp = EmotionEngine::FPUClamp::None;
+            else if (!strcmp(mode, "store"))
+                EmotionEngine::fpu_clamp = EmotionEngine::FPUClamp::OnStore;
+            else if (!strcmp(mode, "full"))
+                EmotionEngine::fpu_clamp = EmotionEngine::FPUClamp::Full;
+            else
+            {
+                printf("Invalid --fpu-clamp %s, expected none, store or full\n", mode);
+                return false;
+            }
+        }
+    }
+
     bool success = false;
 
     printf("[app/App]: %s: Initializing System\n", __FUNCTION__);
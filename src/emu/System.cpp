@@ -128,15 +128,13 @@ void System::Run()
 {
 	while (1)
 	{
+		// The EE runs up to the next event, or until it sits in an idle
+		// loop, which uses up the rest of the cycles in one go
 		size_t cycles = Scheduler::GetNextTimestamp();
 
-		printf("Running for a max of %ld cycles\n", cycles);
-
 		int true_cycles = EmotionEngine::Clock(cycles);
 		IOP_MANAGEMENT::Clock(true_cycles / 8);
 
-		printf("Actual block took %ld cycles\n", true_cycles);
-
 		Scheduler::CheckScheduler(true_cycles);
 	}
 }
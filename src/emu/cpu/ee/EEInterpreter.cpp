@@ -0,0 +1,1353 @@
+#include "EEInterpreter.h"
+#include <emu/cpu/ee/EEJit.h>
+#include <emu/cpu/ee/EmotionEngine.h>
+#include <emu/cpu/ee/vu.h>
+#include <emu/memory/Bus.h>
+
+#include <emu/cpu/iop/opcode.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+EEInterpreter::Stats EEInterpreter::stats;
+bool EEInterpreter::profile_branches = false;
+
+namespace EEInterpreter
+{
+
+typedef void (*Handler)(Opcode op);
+
+// Indexed by the primary opcode and by the function field of SPECIAL, MMI
+// and COP1.S. The MMI0-3 groups are indexed by the sa field
+Handler primary[64];
+Handler special[64];
+Handler mmi[64];
+Handler mmi0[32], mmi1[32], mmi2[32], mmi3[32];
+Handler cop1s[64];
+
+EmotionEngine::ProcessorState* state;
+
+// Address of the instruction being run
+uint32_t pc;
+
+// Set by branches, the block loop runs the delay slot before acting on them
+bool branched;
+bool taken;
+bool likely;
+uint32_t target;
+
+// Interrupts are only checked between blocks, this just keeps them coming
+// when there's no JIT to set the block size
+constexpr int MAX_BLOCK_INSTRS = 128;
+
+uint64_t GetReg(int r)
+{
+    return state->regs[r].u64[0];
+}
+
+// Writes to $zero are dropped, only the low 64 bits are touched
+void SetReg(int r, uint64_t value)
+{
+    if (r)
+        state->regs[r].u64[0] = value;
+}
+
+uint32_t GetAddress(Opcode op)
+{
+    return (uint32_t)(GetReg(op.i_type.rs) + (int16_t)op.i_type.imm);
+}
+
+// Shadowing, for lockstep checks
+bool shadowing;
+bool shadowReadIO;
+uint64_t shadowStores;
+// Bytes stored so far, by physical address
+std::map<uint32_t, ShadowByte> shadowMemory;
+
+uint128_t ShadowLoad(uint32_t addr, int size)
+{
+    uint128_t value = {};
+
+    for (int i = 0; i < size; i++)
+    {
+        auto it = shadowMemory.find(Translate(addr + i));
+        if (it != shadowMemory.end())
+            value.u8[i] = it->second.value;
+        else if (IsPlainMemory(addr + i))
+            value.u8[i] = Bus::Read8(addr + i);
+        else
+            shadowReadIO = true;
+    }
+
+    return value;
+}
+
+void ShadowStore(uint32_t addr, int size, uint128_t value)
+{
+    shadowStores++;
+
+    // Stores to IO aren't kept, the translated block does them for real
+    // and there's nothing to compare them against
+    if (!IsPlainMemory(addr))
+        return;
+
+    for (int i = 0; i < size; i++)
+        shadowMemory[Translate(addr + i)] = {addr + i, value.u8[i]};
+}
+
+uint8_t Load8(uint32_t addr) { return shadowing ? ShadowLoad(addr, 1).u8[0] : Bus::Read8(addr); }
+uint16_t Load16(uint32_t addr) { return shadowing ? ShadowLoad(addr, 2).u16[0] : Bus::Read16(addr); }
+uint32_t Load32(uint32_t addr) { return shadowing ? ShadowLoad(addr, 4).u32[0] : Bus::Read32(addr); }
+uint64_t Load64(uint32_t addr) { return shadowing ? ShadowLoad(addr, 8).u64[0] : Bus::Read64(addr); }
+uint128_t Load128(uint32_t addr) { return shadowing ? ShadowLoad(addr, 16) : Bus::Read128(addr); }
+
+void StoreValue(uint32_t addr, int size, uint64_t data)
+{
+    uint128_t value = {};
+    value.u64[0] = data;
+    ShadowStore(addr, size, value);
+}
+
+void Store8(uint32_t addr, uint8_t data) { if (shadowing) StoreValue(addr, 1, data); else Bus::Write8(addr, data); }
+void Store16(uint32_t addr, uint16_t data) { if (shadowing) StoreValue(addr, 2, data); else Bus::Write16(addr, data); }
+void Store32(uint32_t addr, uint32_t data) { if (shadowing) StoreValue(addr, 4, data); else Bus::Write32(addr, data); }
+void Store64(uint32_t addr, uint64_t data) { if (shadowing) StoreValue(addr, 8, data); else Bus::Write64(addr, data); }
+void Store128(uint32_t addr, uint128_t data) { if (shadowing) ShadowStore(addr, 16, data); else Bus::Write128(addr, data); }
+
+void Branch(bool condition, Opcode op, bool is_likely = false)
+{
+    branched = true;
+    taken = condition;
+    likely = is_likely;
+    target = pc + 4 + ((int32_t)(int16_t)op.i_type.imm << 2);
+}
+
+void Jump(uint32_t addr)
+{
+    branched = true;
+    taken = true;
+    likely = false;
+    target = addr;
+}
+
+void Unknown(Opcode op)
+{
+    printf("[EEINTERP]: Unknown opcode 0x%02x (0x%08x) at 0x%08x\n", op.opcode, op.full, pc);
+    exit(1);
+}
+
+void UnknownSpecial(Opcode op)
+{
+    printf("[EEINTERP]: Unknown special opcode 0x%02x (0x%08x) at 0x%08x\n", op.r_type.func, op.full, pc);
+    exit(1);
+}
+
+void UnknownCOP1(Opcode op)
+{
+    printf("[EEINTERP]: Unknown COP1 opcode 0x%02x/0x%02x (0x%08x) at 0x%08x\n", op.r_type.rs, op.r_type.func, op.full, pc);
+    exit(1);
+}
+
+void UnknownCOP2(Opcode op)
+{
+    printf("[EEINTERP]: Unknown COP2 opcode 0x%02x (0x%08x) at 0x%08x\n", op.r_type.rs, op.full, pc);
+    exit(1);
+}
+
+void UnknownMMI(Opcode op)
+{
+    printf("[EEINTERP]: Unknown MMI opcode 0x%02x/0x%02x (0x%08x) at 0x%08x\n", op.r_type.func, op.r_type.sa, op.full, pc);
+    exit(1);
+}
+
+// SPECIAL
+
+void SLL(Opcode op)
+{
+    SetReg(op.r_type.rd, (int64_t)(int32_t)((uint32_t)GetReg(op.r_type.rt) << op.r_type.sa));
+}
+
+void SRL(Opcode op)
+{
+    SetReg(op.r_type.rd, (int64_t)(int32_t)((uint32_t)GetReg(op.r_type.rt) >> op.r_type.sa));
+}
+
+void JR(Opcode op)
+{
+    Jump((uint32_t)GetReg(op.r_type.rs));
+}
+
+void JALR(Opcode op)
+{
+    // rs is read before the link is written, `jalr ra, ra` works
+    Jump((uint32_t)GetReg(op.r_type.rs));
+    SetReg(op.r_type.rd, (uint64_t)pc + 8);
+}
+
+void BREAK(Opcode)
+{
+    printf("[EEINTERP]: break at 0x%08x\n", pc);
+    exit(1);
+}
+
+void SYNC(Opcode)
+{
+}
+
+void MFLO(Opcode op)
+{
+    SetReg(op.r_type.rd, state->lo);
+}
+
+void MULT(Opcode op)
+{
+    int64_t product = (int64_t)(int32_t)GetReg(op.r_type.rs) * (int32_t)GetReg(op.r_type.rt);
+
+    state->lo = (int64_t)(int32_t)product;
+    state->hi = (int64_t)(int32_t)(product >> 32);
+    SetReg(op.r_type.rd, state->lo);
+}
+
+void DIVU(Opcode op)
+{
+    uint32_t rs = GetReg(op.r_type.rs);
+    uint32_t rt = GetReg(op.r_type.rt);
+
+    if (!rt)
+    {
+        state->lo = ~0ULL;
+        state->hi = (int64_t)(int32_t)rs;
+        return;
+    }
+
+    state->lo = (int64_t)(int32_t)(rs / rt);
+    state->hi = (int64_t)(int32_t)(rs % rt);
+}
+
+void OR(Opcode op)
+{
+    SetReg(op.r_type.rd, GetReg(op.r_type.rs) | GetReg(op.r_type.rt));
+}
+
+void DADDU(Opcode op)
+{
+    SetReg(op.r_type.rd, GetReg(op.r_type.rs) + GetReg(op.r_type.rt));
+}
+
+void Special(Opcode op)
+{
+    special[op.r_type.func](op);
+}
+
+// Primary
+
+void J(Opcode op)
+{
+    Jump(((pc + 4) & 0xF0000000) | (op.j_type.target << 2));
+}
+
+void JAL(Opcode op)
+{
+    J(op);
+    SetReg(31, (uint64_t)pc + 8);
+}
+
+void BEQ(Opcode op)
+{
+    Branch(GetReg(op.i_type.rs) == GetReg(op.i_type.rt), op);
+}
+
+void BNE(Opcode op)
+{
+    Branch(GetReg(op.i_type.rs) != GetReg(op.i_type.rt), op);
+}
+
+void BEQL(Opcode op)
+{
+    Branch(GetReg(op.i_type.rs) == GetReg(op.i_type.rt), op, true);
+}
+
+void BNEL(Opcode op)
+{
+    Branch(GetReg(op.i_type.rs) != GetReg(op.i_type.rt), op, true);
+}
+
+void ADDIU(Opcode op)
+{
+    SetReg(op.i_type.rt, (int64_t)(int32_t)((uint32_t)GetReg(op.i_type.rs) + (int16_t)op.i_type.imm));
+}
+
+void SLTI(Opcode op)
+{
+    SetReg(op.i_type.rt, (int64_t)GetReg(op.i_type.rs) < (int64_t)(int16_t)op.i_type.imm);
+}
+
+void SLTIU(Opcode op)
+{
+    SetReg(op.i_type.rt, GetReg(op.i_type.rs) < (uint64_t)(int64_t)(int16_t)op.i_type.imm);
+}
+
+void ANDI(Opcode op)
+{
+    SetReg(op.i_type.rt, GetReg(op.i_type.rs) & op.i_type.imm);
+}
+
+void ORI(Opcode op)
+{
+    SetReg(op.i_type.rt, GetReg(op.i_type.rs) | op.i_type.imm);
+}
+
+void LUI(Opcode op)
+{
+    SetReg(op.i_type.rt, (int64_t)(int32_t)(op.i_type.imm << 16));
+}
+
+void COP0(Opcode op)
+{
+    switch (op.r_type.rs)
+    {
+    case 0x00:
+        SetReg(op.r_type.rt, (int64_t)(int32_t)state->cop0_regs[op.r_type.rd]);
+        break;
+    case 0x04:
+        state->cop0_regs[op.r_type.rd] = GetReg(op.r_type.rt);
+        break;
+    case 0x10:
+        // TLBWI, there's no TLB yet
+        if (op.r_type.func == 0x02)
+            break;
+        printf("[EEINTERP]: Unknown COP0 TLB instruction 0x%02x at 0x%08x\n", op.r_type.func, pc);
+        exit(1);
+    default:
+        printf("[EEINTERP]: Unknown cop0 opcode 0x%02x at 0x%08x\n", op.r_type.rs, pc);
+        exit(1);
+    }
+}
+
+// Loads into $zero still go to the Bus, for the side effects
+
+void LB(Opcode op) { SetReg(op.i_type.rt, (int64_t)(int8_t)Load8(GetAddress(op))); }
+void LBU(Opcode op) { SetReg(op.i_type.rt, Load8(GetAddress(op))); }
+void LH(Opcode op) { SetReg(op.i_type.rt, (int64_t)(int16_t)Load16(GetAddress(op))); }
+void LHU(Opcode op) { SetReg(op.i_type.rt, Load16(GetAddress(op))); }
+void LW(Opcode op) { SetReg(op.i_type.rt, (int64_t)(int32_t)Load32(GetAddress(op))); }
+void LWU(Opcode op) { SetReg(op.i_type.rt, Load32(GetAddress(op))); }
+void LD(Opcode op) { SetReg(op.i_type.rt, Load64(GetAddress(op))); }
+
+void SB(Opcode op) { Store8(GetAddress(op), GetReg(op.i_type.rt)); }
+void SH(Opcode op) { Store16(GetAddress(op), GetReg(op.i_type.rt)); }
+void SW(Opcode op) { Store32(GetAddress(op), GetReg(op.i_type.rt)); }
+void SD(Opcode op) { Store64(GetAddress(op), GetReg(op.i_type.rt)); }
+
+void LWL(Opcode op) { SetReg(op.i_type.rt, LoadWordLeft(GetAddress(op), GetReg(op.i_type.rt))); }
+void LWR(Opcode op) { SetReg(op.i_type.rt, LoadWordRight(GetAddress(op), GetReg(op.i_type.rt))); }
+void LDL(Opcode op) { SetReg(op.i_type.rt, LoadDoubleLeft(GetAddress(op), GetReg(op.i_type.rt))); }
+void LDR(Opcode op) { SetReg(op.i_type.rt, LoadDoubleRight(GetAddress(op), GetReg(op.i_type.rt))); }
+void SWL(Opcode op) { StoreWordLeft(GetAddress(op), GetReg(op.i_type.rt)); }
+void SWR(Opcode op) { StoreWordRight(GetAddress(op), GetReg(op.i_type.rt)); }
+void SDL(Opcode op) { StoreDoubleLeft(GetAddress(op), GetReg(op.i_type.rt)); }
+void SDR(Opcode op) { StoreDoubleRight(GetAddress(op), GetReg(op.i_type.rt)); }
+
+// LQ/SQ move all 128 bits of rt, and ignore the low 4 bits of the address
+void LQ(Opcode op)
+{
+    uint128_t value = Load128(GetAddress(op) & ~0xF);
+    if (op.i_type.rt)
+        state->regs[op.i_type.rt] = value;
+}
+
+void SQ(Opcode op)
+{
+    uint128_t value = {};
+    if (op.i_type.rt)
+        value = state->regs[op.i_type.rt];
+    Store128(GetAddress(op) & ~0xF, value);
+}
+
+// MMI
+// 128-bit SIMD on the GPRs, in lanes of 8, 16 or 32 bits. HI and LO are 128
+// bits wide for them, with the multiplies using the even words
+
+uint128_t GetQuad(int r)
+{
+    return state->regs[r];
+}
+
+void SetQuad(int r, const uint128_t& value)
+{
+    if (r)
+        state->regs[r] = value;
+}
+
+uint128_t GetHI() { uint128_t v; v.u64[0] = state->hi; v.u64[1] = state->hi1; return v; }
+uint128_t GetLO() { uint128_t v; v.u64[0] = state->lo; v.u64[1] = state->lo1; return v; }
+void SetHI(const uint128_t& v) { state->hi = v.u64[0]; state->hi1 = v.u64[1]; }
+void SetLO(const uint128_t& v) { state->lo = v.u64[0]; state->lo1 = v.u64[1]; }
+
+template <typename T>
+T Saturate(int64_t value)
+{
+    return std::clamp<int64_t>(value, std::numeric_limits<T>::min(), std::numeric_limits<T>::max());
+}
+
+// rd = f(rs, rt), lane by lane
+template <typename T, typename F>
+void Lanes(Opcode op, F f)
+{
+    constexpr int N = 16 / sizeof(T);
+    uint128_t rs = GetQuad(op.r_type.rs), rt = GetQuad(op.r_type.rt), rd;
+    T a[N], b[N], d[N];
+
+    memcpy(a, &rs, 16);
+    memcpy(b, &rt, 16);
+    for (int i = 0; i < N; i++)
+        d[i] = f(a[i], b[i]);
+    memcpy(&rd, d, 16);
+    SetQuad(op.r_type.rd, rd);
+}
+
+// rd takes rt's lanes in `order`, within each half
+template <typename T>
+void Permute(Opcode op, const int (&order)[16 / sizeof(T)])
+{
+    constexpr int N = 16 / sizeof(T);
+    uint128_t rt = GetQuad(op.r_type.rt), rd;
+    T b[N], d[N];
+
+    memcpy(b, &rt, 16);
+    for (int i = 0; i < N; i++)
+        d[i] = b[order[i]];
+    memcpy(&rd, d, 16);
+    SetQuad(op.r_type.rd, rd);
+}
+
+// PEXTL/PEXTU, the lower or upper lanes of rt and rs interleaved
+template <typename T>
+void Interleave(Opcode op, bool upper)
+{
+    constexpr int N = 16 / sizeof(T);
+    uint128_t rs = GetQuad(op.r_type.rs), rt = GetQuad(op.r_type.rt), rd;
+    T a[N], b[N], d[N];
+
+    memcpy(a, &rs, 16);
+    memcpy(b, &rt, 16);
+    for (int i = 0; i < N / 2; i++)
+    {
+        d[i * 2] = b[i + (upper ? N / 2 : 0)];
+        d[i * 2 + 1] = a[i + (upper ? N / 2 : 0)];
+    }
+    memcpy(&rd, d, 16);
+    SetQuad(op.r_type.rd, rd);
+}
+
+// PPAC, the even lanes of rt then those of rs, truncated
+template <typename T>
+void Pack(Opcode op)
+{
+    constexpr int N = 16 / sizeof(T);
+    uint128_t rs = GetQuad(op.r_type.rs), rt = GetQuad(op.r_type.rt), rd;
+    T a[N], b[N], d[N];
+
+    memcpy(a, &rs, 16);
+    memcpy(b, &rt, 16);
+    for (int i = 0; i < N / 2; i++)
+    {
+        d[i] = b[i * 2];
+        d[i + N / 2] = a[i * 2];
+    }
+    memcpy(&rd, d, 16);
+    SetQuad(op.r_type.rd, rd);
+}
+
+// PMULTW, PMADDW, PMSUBW, PMULTUW, PMADDUW
+// The products of the even words, added to or subtracted from HI:LO if
+// `accumulate` is set, go to rd as doublewords. LO and HI get their low and
+// high words, sign extended
+void MultiplyWords(Opcode op, bool is_unsigned, int accumulate)
+{
+    uint128_t rs = GetQuad(op.r_type.rs), rt = GetQuad(op.r_type.rt);
+    uint128_t hi = GetHI(), lo = GetLO(), rd;
+
+    for (int i = 0; i < 2; i++)
+    {
+        uint64_t product;
+        if (is_unsigned)
+            product = (uint64_t)rs.u32[i * 2] * rt.u32[i * 2];
+        else
+            product = (int64_t)(int32_t)rs.u32[i * 2] * (int32_t)rt.u32[i * 2];
+
+        uint64_t acc = ((uint64_t)hi.u32[i * 2] << 32) | lo.u32[i * 2];
+        if (accumulate > 0)
+            product = acc + product;
+        else if (accumulate < 0)
+            product = acc - product;
+
+        rd.u64[i] = product;
+        lo.u64[i] = (int64_t)(int32_t)product;
+        hi.u64[i] = (int64_t)(int32_t)(product >> 32);
+    }
+
+    SetLO(lo);
+    SetHI(hi);
+    SetQuad(op.r_type.rd, rd);
+}
+
+// MMI0
+
+void PADDW(Opcode op) { Lanes<uint32_t>(op, [](uint32_t a, uint32_t b) { return a + b; }); }
+void PSUBW(Opcode op) { Lanes<uint32_t>(op, [](uint32_t a, uint32_t b) { return a - b; }); }
+void PCGTW(Opcode op) { Lanes<int32_t>(op, [](int32_t a, int32_t b) { return a > b ? -1 : 0; }); }
+void PMAXW(Opcode op) { Lanes<int32_t>(op, [](int32_t a, int32_t b) { return std::max(a, b); }); }
+void PADDH(Opcode op) { Lanes<uint16_t>(op, [](uint16_t a, uint16_t b) { return (uint16_t)(a + b); }); }
+void PSUBH(Opcode op) { Lanes<uint16_t>(op, [](uint16_t a, uint16_t b) { return (uint16_t)(a - b); }); }
+void PCGTH(Opcode op) { Lanes<int16_t>(op, [](int16_t a, int16_t b) { return (int16_t)(a > b ? -1 : 0); }); }
+void PMAXH(Opcode op) { Lanes<int16_t>(op, [](int16_t a, int16_t b) { return std::max(a, b); }); }
+void PADDB(Opcode op) { Lanes<uint8_t>(op, [](uint8_t a, uint8_t b) { return (uint8_t)(a + b); }); }
+void PSUBB(Opcode op) { Lanes<uint8_t>(op, [](uint8_t a, uint8_t b) { return (uint8_t)(a - b); }); }
+void PCGTB(Opcode op) { Lanes<int8_t>(op, [](int8_t a, int8_t b) { return (int8_t)(a > b ? -1 : 0); }); }
+void PADDSW(Opcode op) { Lanes<int32_t>(op, [](int32_t a, int32_t b) { return Saturate<int32_t>((int64_t)a + b); }); }
+void PSUBSW(Opcode op) { Lanes<int32_t>(op, [](int32_t a, int32_t b) { return Saturate<int32_t>((int64_t)a - b); }); }
+void PEXTLW(Opcode op) { Interleave<uint32_t>(op, false); }
+void PPACW(Opcode op) { Pack<uint32_t>(op); }
+void PADDSH(Opcode op) { Lanes<int16_t>(op, [](int16_t a, int16_t b) { return Saturate<int16_t>(a + b); }); }
+void PSUBSH(Opcode op) { Lanes<int16_t>(op, [](int16_t a, int16_t b) { return Saturate<int16_t>(a - b); }); }
+void PEXTLH(Opcode op) { Interleave<uint16_t>(op, false); }
+void PPACH(Opcode op) { Pack<uint16_t>(op); }
+void PADDSB(Opcode op) { Lanes<int8_t>(op, [](int8_t a, int8_t b) { return Saturate<int8_t>(a + b); }); }
+void PSUBSB(Opcode op) { Lanes<int8_t>(op, [](int8_t a, int8_t b) { return Saturate<int8_t>(a - b); }); }
+void PEXTLB(Opcode op) { Interleave<uint8_t>(op, false); }
+void PPACB(Opcode op) { Pack<uint8_t>(op); }
+
+// MMI1
+
+void PABSW(Opcode op) { Lanes<int32_t>(op, [](int32_t, int32_t b) { return b == INT32_MIN ? INT32_MAX : std::abs(b); }); }
+void PCEQW(Opcode op) { Lanes<uint32_t>(op, [](uint32_t a, uint32_t b) { return a == b ? ~0u : 0; }); }
+void PMINW(Opcode op) { Lanes<int32_t>(op, [](int32_t a, int32_t b) { return std::min(a, b); }); }
+void PABSH(Opcode op) { Lanes<int16_t>(op, [](int16_t, int16_t b) { return (int16_t)(b == INT16_MIN ? INT16_MAX : std::abs(b)); }); }
+void PCEQH(Opcode op) { Lanes<uint16_t>(op, [](uint16_t a, uint16_t b) { return (uint16_t)(a == b ? 0xFFFF : 0); }); }
+void PMINH(Opcode op) { Lanes<int16_t>(op, [](int16_t a, int16_t b) { return std::min(a, b); }); }
+void PCEQB(Opcode op) { Lanes<uint8_t>(op, [](uint8_t a, uint8_t b) { return (uint8_t)(a == b ? 0xFF : 0); }); }
+void PADDUW(Opcode op) { Lanes<uint32_t>(op, [](uint32_t a, uint32_t b) { return Saturate<uint32_t>((int64_t)a + b); }); }
+void PSUBUW(Opcode op) { Lanes<uint32_t>(op, [](uint32_t a, uint32_t b) { return Saturate<uint32_t>((int64_t)a - b); }); }
+void PEXTUW(Opcode op) { Interleave<uint32_t>(op, true); }
+void PADDUH(Opcode op) { Lanes<uint16_t>(op, [](uint16_t a, uint16_t b) { return Saturate<uint16_t>(a + b); }); }
+void PSUBUH(Opcode op) { Lanes<uint16_t>(op, [](uint16_t a, uint16_t b) { return Saturate<uint16_t>(a - b); }); }
+void PEXTUH(Opcode op) { Interleave<uint16_t>(op, true); }
+void PADDUB(Opcode op) { Lanes<uint8_t>(op, [](uint8_t a, uint8_t b) { return Saturate<uint8_t>(a + b); }); }
+void PSUBUB(Opcode op) { Lanes<uint8_t>(op, [](uint8_t a, uint8_t b) { return Saturate<uint8_t>(a - b); }); }
+void PEXTUB(Opcode op) { Interleave<uint8_t>(op, true); }
+
+// MMI2
+
+// PSLLVW, PSRLVW, PSRAVW shift the even words, by the even words of rs
+template <typename F>
+void ShiftVariable(Opcode op, F f)
+{
+    uint128_t rs = GetQuad(op.r_type.rs), rt = GetQuad(op.r_type.rt), rd;
+    for (int i = 0; i < 2; i++)
+        rd.u64[i] = (int64_t)(int32_t)f(rt.u32[i * 2], rs.u32[i * 2] & 31);
+    SetQuad(op.r_type.rd, rd);
+}
+
+void PSLLVW(Opcode op) { ShiftVariable(op, [](uint32_t v, int sa) { return v << sa; }); }
+void PSRLVW(Opcode op) { ShiftVariable(op, [](uint32_t v, int sa) { return v >> sa; }); }
+void PMFHI(Opcode op) { SetQuad(op.r_type.rd, GetHI()); }
+void PMFLO(Opcode op) { SetQuad(op.r_type.rd, GetLO()); }
+
+void PINTH(Opcode op)
+{
+    uint128_t rs = GetQuad(op.r_type.rs), rt = GetQuad(op.r_type.rt), rd;
+    for (int i = 0; i < 4; i++)
+    {
+        rd.u16[i * 2] = rt.u16[i];
+        rd.u16[i * 2 + 1] = rs.u16[i + 4];
+    }
+    SetQuad(op.r_type.rd, rd);
+}
+
+void PMULTW(Opcode op) { MultiplyWords(op, false, 0); }
+
+void PCPYLD(Opcode op)
+{
+    uint128_t rd;
+    rd.u64[0] = GetQuad(op.r_type.rt).u64[0];
+    rd.u64[1] = GetQuad(op.r_type.rs).u64[0];
+    SetQuad(op.r_type.rd, rd);
+}
+
+void PMADDW(Opcode op) { MultiplyWords(op, false, 1); }
+void PAND(Opcode op) { Lanes<uint64_t>(op, [](uint64_t a, uint64_t b) { return a & b; }); }
+void PXOR(Opcode op) { Lanes<uint64_t>(op, [](uint64_t a, uint64_t b) { return a ^ b; }); }
+void PMSUBW(Opcode op) { MultiplyWords(op, false, -1); }
+void PEXEH(Opcode op) { Permute<uint16_t>(op, {2, 1, 0, 3, 6, 5, 4, 7}); }
+void PREVH(Opcode op) { Permute<uint16_t>(op, {3, 2, 1, 0, 7, 6, 5, 4}); }
+void PEXEW(Opcode op) { Permute<uint32_t>(op, {2, 1, 0, 3}); }
+void PROT3W(Opcode op) { Permute<uint32_t>(op, {1, 2, 0, 3}); }
+
+// MMI3
+
+void PSRAVW(Opcode op) { ShiftVariable(op, [](uint32_t v, int sa) { return (uint32_t)((int32_t)v >> sa); }); }
+
+void PMTHI(Opcode op) { SetHI(GetQuad(op.r_type.rs)); }
+void PMTLO(Opcode op) { SetLO(GetQuad(op.r_type.rs)); }
+
+void PINTEH(Opcode op)
+{
+    uint128_t rs = GetQuad(op.r_type.rs), rt = GetQuad(op.r_type.rt), rd;
+    for (int i = 0; i < 4; i++)
+    {
+        rd.u16[i * 2] = rt.u16[i * 2];
+        rd.u16[i * 2 + 1] = rs.u16[i * 2];
+    }
+    SetQuad(op.r_type.rd, rd);
+}
+
+void PMULTUW(Opcode op) { MultiplyWords(op, true, 0); }
+
+void PCPYUD(Opcode op)
+{
+    uint128_t rd;
+    rd.u64[0] = GetQuad(op.r_type.rs).u64[1];
+    rd.u64[1] = GetQuad(op.r_type.rt).u64[1];
+    SetQuad(op.r_type.rd, rd);
+}
+
+void PMADDUW(Opcode op) { MultiplyWords(op, true, 1); }
+void POR(Opcode op) { Lanes<uint64_t>(op, [](uint64_t a, uint64_t b) { return a | b; }); }
+void PNOR(Opcode op) { Lanes<uint64_t>(op, [](uint64_t a, uint64_t b) { return ~(a | b); }); }
+void PEXCH(Opcode op) { Permute<uint16_t>(op, {0, 2, 1, 3, 4, 6, 5, 7}); }
+void PCPYH(Opcode op) { Permute<uint16_t>(op, {0, 0, 0, 0, 4, 4, 4, 4}); }
+void PEXCW(Opcode op) { Permute<uint32_t>(op, {0, 2, 1, 3}); }
+
+// MMI
+
+// Leading bits that match the sign bit, not counting it, of the two low
+// words. Only the low 64 bits of rd are written
+void PLZCW(Opcode op)
+{
+    uint64_t rs = GetReg(op.r_type.rs), rd = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        uint32_t w = rs >> (i * 32);
+        uint32_t x = w ^ (uint32_t)((int32_t)w >> 31);
+        rd |= (uint64_t)(x ? __builtin_clz(x) - 1 : 31) << (i * 32);
+    }
+    SetReg(op.r_type.rd, rd);
+}
+
+void MMI0(Opcode op) { mmi0[op.r_type.sa](op); }
+void MMI2(Opcode op) { mmi2[op.r_type.sa](op); }
+
+// Format in the sa field
+void PMFHL(Opcode op)
+{
+    uint128_t hi = GetHI(), lo = GetLO(), rd;
+
+    switch (op.r_type.sa)
+    {
+    case 0: // LW
+        rd.u32[0] = lo.u32[0]; rd.u32[1] = hi.u32[0];
+        rd.u32[2] = lo.u32[2]; rd.u32[3] = hi.u32[2];
+        break;
+    case 1: // UW
+        rd.u32[0] = lo.u32[1]; rd.u32[1] = hi.u32[1];
+        rd.u32[2] = lo.u32[3]; rd.u32[3] = hi.u32[3];
+        break;
+    case 2: // SLW
+        for (int i = 0; i < 2; i++)
+        {
+            int64_t value = ((uint64_t)hi.u32[i * 2] << 32) | lo.u32[i * 2];
+            rd.u64[i] = (int64_t)Saturate<int32_t>(value);
+        }
+        break;
+    case 3: // LH
+        for (int i = 0; i < 2; i++)
+        {
+            rd.u16[i * 4] = lo.u16[i * 4];
+            rd.u16[i * 4 + 1] = lo.u16[i * 4 + 2];
+            rd.u16[i * 4 + 2] = hi.u16[i * 4];
+            rd.u16[i * 4 + 3] = hi.u16[i * 4 + 2];
+        }
+        break;
+    case 4: // SH
+        for (int i = 0; i < 2; i++)
+        {
+            rd.u16[i * 4] = Saturate<int16_t>((int32_t)lo.u32[i * 2]);
+            rd.u16[i * 4 + 1] = Saturate<int16_t>((int32_t)lo.u32[i * 2 + 1]);
+            rd.u16[i * 4 + 2] = Saturate<int16_t>((int32_t)hi.u32[i * 2]);
+            rd.u16[i * 4 + 3] = Saturate<int16_t>((int32_t)hi.u32[i * 2 + 1]);
+        }
+        break;
+    default:
+        UnknownMMI(op);
+    }
+
+    SetQuad(op.r_type.rd, rd);
+}
+
+void PMTHL(Opcode op)
+{
+    if (op.r_type.sa != 0)
+        UnknownMMI(op);
+
+    uint128_t rs = GetQuad(op.r_type.rs), hi = GetHI(), lo = GetLO();
+    lo.u32[0] = rs.u32[0]; hi.u32[0] = rs.u32[1];
+    lo.u32[2] = rs.u32[2]; hi.u32[2] = rs.u32[3];
+    SetLO(lo);
+    SetHI(hi);
+}
+
+void PSLLH(Opcode op) { Lanes<uint16_t>(op, [sa = op.r_type.sa & 15](uint16_t, uint16_t b) { return (uint16_t)(b << sa); }); }
+void PSRLH(Opcode op) { Lanes<uint16_t>(op, [sa = op.r_type.sa & 15](uint16_t, uint16_t b) { return (uint16_t)(b >> sa); }); }
+void PSRAH(Opcode op) { Lanes<int16_t>(op, [sa = op.r_type.sa & 15](int16_t, int16_t b) { return (int16_t)(b >> sa); }); }
+void MMI1(Opcode op) { mmi1[op.r_type.sa](op); }
+void MMI3(Opcode op) { mmi3[op.r_type.sa](op); }
+void PSLLW(Opcode op) { Lanes<uint32_t>(op, [sa = op.r_type.sa](uint32_t, uint32_t b) { return b << sa; }); }
+void PSRLW(Opcode op) { Lanes<uint32_t>(op, [sa = op.r_type.sa](uint32_t, uint32_t b) { return b >> sa; }); }
+void PSRAW(Opcode op) { Lanes<int32_t>(op, [sa = op.r_type.sa](int32_t, int32_t b) { return b >> sa; }); }
+
+void MMI(Opcode op)
+{
+    mmi[op.r_type.func](op);
+}
+
+// COP1
+// Single precision only. FCR31 isn't kept beyond its C bit, and results
+// follow EmotionEngine::fpu_clamp, the same way the JIT emits them
+
+// Inf and NaN become +/-FLT_MAX. Two integer mins, like the JIT does it: a
+// signed one for positive values and an unsigned one for negative ones
+uint32_t Clamp(uint32_t value)
+{
+    value = std::min<int32_t>(value, 0x7F7FFFFF);
+    return std::min<uint32_t>(value, 0xFF7FFFFF);
+}
+
+float GetFPR(int r)
+{
+    uint32_t value = state->fprs[r].i;
+    if (EmotionEngine::fpu_clamp == EmotionEngine::FPUClamp::Full)
+        value = Clamp(value);
+
+    float f;
+    memcpy(&f, &value, 4);
+    return f;
+}
+
+float GetACC()
+{
+    uint32_t value = state->acc.u;
+    if (EmotionEngine::fpu_clamp == EmotionEngine::FPUClamp::Full)
+        value = Clamp(value);
+
+    float f;
+    memcpy(&f, &value, 4);
+    return f;
+}
+
+uint32_t ClampResult(float f)
+{
+    uint32_t value;
+    memcpy(&value, &f, 4);
+    if (EmotionEngine::fpu_clamp != EmotionEngine::FPUClamp::None)
+        value = Clamp(value);
+    return value;
+}
+
+void SetFPR(int r, float f) { state->fprs[r].i = ClampResult(f); }
+void SetACC(float f) { state->acc.u = ClampResult(f); }
+
+// The compiler is free to swap the operands of a commutative op, but SSE
+// hands back the first NaN operand, quieted. Pick it the same way here
+float Arith(float a, float b, float result)
+{
+    uint32_t value;
+    if (std::isnan(a))
+        memcpy(&value, &a, 4);
+    else if (std::isnan(b))
+        memcpy(&value, &b, 4);
+    else
+        return result;
+
+    value |= 0x400000;
+    memcpy(&result, &value, 4);
+    return result;
+}
+
+float Add(float a, float b) { return Arith(a, b, a + b); }
+float Sub(float a, float b) { return Arith(a, b, a - b); }
+float Mul(float a, float b) { return Arith(a, b, a * b); }
+float Div(float a, float b) { return Arith(a, b, a / b); }
+
+void LWC1(Opcode op) { state->fprs[op.i_type.rt].i = Load32(GetAddress(op)); }
+void SWC1(Opcode op) { Store32(GetAddress(op), state->fprs[op.i_type.rt].i); }
+
+// fd is in the sa field, fs in rd and ft in rt
+#define FD op.r_type.sa
+#define FS op.r_type.rd
+#define FT op.r_type.rt
+
+void ADD_S(Opcode op) { SetFPR(FD, Add(GetFPR(FS), GetFPR(FT))); }
+void SUB_S(Opcode op) { SetFPR(FD, Sub(GetFPR(FS), GetFPR(FT))); }
+void MUL_S(Opcode op) { SetFPR(FD, Mul(GetFPR(FS), GetFPR(FT))); }
+void DIV_S(Opcode op) { SetFPR(FD, Div(GetFPR(FS), GetFPR(FT))); }
+// The PS2 takes the root of the magnitude
+void SQRT_S(Opcode op) { SetFPR(FD, std::sqrt(std::fabs(GetFPR(FT)))); }
+void RSQRT_S(Opcode op) { SetFPR(FD, Div(GetFPR(FS), std::sqrt(std::fabs(GetFPR(FT))))); }
+// Sign bit operations, never clamped
+void ABS_S(Opcode op) { state->fprs[FD].i = state->fprs[FS].i & 0x7FFFFFFF; }
+void MOV_S(Opcode op) { state->fprs[FD].i = state->fprs[FS].i; }
+void NEG_S(Opcode op) { state->fprs[FD].i = state->fprs[FS].i ^ 0x80000000; }
+void ADDA_S(Opcode op) { SetACC(Add(GetFPR(FS), GetFPR(FT))); }
+void SUBA_S(Opcode op) { SetACC(Sub(GetFPR(FS), GetFPR(FT))); }
+void MULA_S(Opcode op) { SetACC(Mul(GetFPR(FS), GetFPR(FT))); }
+// The product is rounded before it's accumulated, there's no fused multiply-add
+void MADD_S(Opcode op) { float product = Mul(GetFPR(FS), GetFPR(FT)); SetFPR(FD, Add(GetACC(), product)); }
+void MSUB_S(Opcode op) { float product = Mul(GetFPR(FS), GetFPR(FT)); SetFPR(FD, Sub(GetACC(), product)); }
+void MADDA_S(Opcode op) { float product = Mul(GetFPR(FS), GetFPR(FT)); SetACC(Add(GetACC(), product)); }
+void MSUBA_S(Opcode op) { float product = Mul(GetFPR(FS), GetFPR(FT)); SetACC(Sub(GetACC(), product)); }
+// Written so they pick the same operand as MAXSS/MINSS
+void MAX_S(Opcode op) { float a = GetFPR(FS), b = GetFPR(FT); SetFPR(FD, a > b ? a : b); }
+void MIN_S(Opcode op) { float a = GetFPR(FS), b = GetFPR(FT); SetFPR(FD, a < b ? a : b); }
+
+// Truncates, and saturates anything out of range by its sign
+void CVT_W_S(Opcode op)
+{
+    float value = state->fprs[FS].f;
+    if (std::fabs(value) < 2147483648.0f)
+        state->fprs[FD].s = (int32_t)value;
+    else
+        state->fprs[FD].i = (state->fprs[FS].i & 0x80000000) ? 0x80000000 : 0x7FFFFFFF;
+}
+
+void CVT_S_W(Opcode op) { state->fprs[FD].f = (float)state->fprs[FS].s; }
+
+void C_F_S(Opcode) { state->c = false; }
+void C_EQ_S(Opcode op) { state->c = GetFPR(FS) == GetFPR(FT); }
+void C_LT_S(Opcode op) { state->c = GetFPR(FS) < GetFPR(FT); }
+void C_LE_S(Opcode op) { state->c = GetFPR(FS) <= GetFPR(FT); }
+
+#undef FD
+#undef FS
+#undef FT
+
+void COP1(Opcode op)
+{
+    switch (op.r_type.rs)
+    {
+    case 0x00: // MFC1
+        SetReg(op.r_type.rt, (int64_t)state->fprs[op.r_type.rd].s);
+        break;
+    case 0x02: // CFC1, FCR0 is the revision
+        if (op.r_type.rd == 0)
+            SetReg(op.r_type.rt, 0x2E00);
+        else if (op.r_type.rd == 31)
+            SetReg(op.r_type.rt, state->c ? 0x800000 : 0);
+        else
+            SetReg(op.r_type.rt, 0);
+        break;
+    case 0x04: // MTC1
+        state->fprs[op.r_type.rd].i = GetReg(op.r_type.rt);
+        break;
+    case 0x06: // CTC1
+        if (op.r_type.rd == 31)
+            state->c = (GetReg(op.r_type.rt) >> 23) & 1;
+        break;
+    case 0x08: // BC1F, BC1T, BC1FL, BC1TL
+        if (op.r_type.rt > 3)
+            UnknownCOP1(op);
+        Branch(state->c == (op.r_type.rt & 1), op, op.r_type.rt & 2);
+        break;
+    case 0x10:
+        cop1s[op.r_type.func](op);
+        break;
+    case 0x14:
+        if (op.r_type.func != 0x20)
+            UnknownCOP1(op);
+        CVT_S_W(op);
+        break;
+    default:
+        UnknownCOP1(op);
+    }
+}
+
+// COP2
+// VU0 in macro mode, the instructions themselves are in vu.cpp. LQC2/SQC2
+// ignore the low 4 bits of the address, like LQ/SQ
+void LQC2(Opcode op)
+{
+    uint128_t value = Load128(GetAddress(op) & ~0xF);
+    if (op.i_type.rt)
+        VectorUnit::VU0::vu0_state.vf[op.i_type.rt].u128 = value;
+}
+
+void SQC2(Opcode op)
+{
+    Store128(GetAddress(op) & ~0xF, VectorUnit::VU0::vu0_state.vf[op.i_type.rt].u128);
+}
+
+void COP2(Opcode op)
+{
+    auto& vf = VectorUnit::VU0::vu0_state.vf;
+
+    switch (op.r_type.rs)
+    {
+    case 0x01: // QMFC2
+        if (op.r_type.rt)
+            state->regs[op.r_type.rt] = vf[op.r_type.rd].u128;
+        break;
+    case 0x02: // CFC2
+        SetReg(op.r_type.rt, (int64_t)(int32_t)VectorUnit::VU0::ReadControl(op.r_type.rd));
+        break;
+    case 0x05: // QMTC2
+        if (op.r_type.rd)
+            vf[op.r_type.rd].u128 = state->regs[op.r_type.rt];
+        break;
+    case 0x06: // CTC2
+        VectorUnit::VU0::WriteControl(op.r_type.rd, GetReg(op.r_type.rt));
+        break;
+    case 0x10 ... 0x1F:
+        VectorUnit::VU0::Macro(op.full);
+        break;
+    default:
+        UnknownCOP2(op);
+    }
+}
+
+void BuildTables()
+{
+    for (int i = 0; i < 64; i++)
+    {
+        primary[i] = Unknown;
+        special[i] = UnknownSpecial;
+        mmi[i] = UnknownMMI;
+        cop1s[i] = UnknownCOP1;
+    }
+
+    for (int i = 0; i < 32; i++)
+        mmi0[i] = mmi1[i] = mmi2[i] = mmi3[i] = UnknownMMI;
+
+    special[0x00] = SLL;
+    special[0x02] = SRL;
+    special[0x08] = JR;
+    special[0x09] = JALR;
+    special[0x0D] = BREAK;
+    special[0x0F] = SYNC;
+    special[0x12] = MFLO;
+    special[0x18] = MULT;
+    special[0x1B] = DIVU;
+    special[0x25] = OR;
+    special[0x2D] = DADDU;
+
+    mmi[0x04] = PLZCW;
+    mmi[0x08] = MMI0;
+    mmi[0x09] = MMI2;
+    mmi[0x28] = MMI1;
+    mmi[0x29] = MMI3;
+    mmi[0x30] = PMFHL;
+    mmi[0x31] = PMTHL;
+    mmi[0x34] = PSLLH;
+    mmi[0x36] = PSRLH;
+    mmi[0x37] = PSRAH;
+    mmi[0x3C] = PSLLW;
+    mmi[0x3E] = PSRLW;
+    mmi[0x3F] = PSRAW;
+
+    mmi0[0x00] = PADDW;
+    mmi0[0x01] = PSUBW;
+    mmi0[0x02] = PCGTW;
+    mmi0[0x03] = PMAXW;
+    mmi0[0x04] = PADDH;
+    mmi0[0x05] = PSUBH;
+    mmi0[0x06] = PCGTH;
+    mmi0[0x07] = PMAXH;
+    mmi0[0x08] = PADDB;
+    mmi0[0x09] = PSUBB;
+    mmi0[0x0A] = PCGTB;
+    mmi0[0x10] = PADDSW;
+    mmi0[0x11] = PSUBSW;
+    mmi0[0x12] = PEXTLW;
+    mmi0[0x13] = PPACW;
+    mmi0[0x14] = PADDSH;
+    mmi0[0x15] = PSUBSH;
+    mmi0[0x16] = PEXTLH;
+    mmi0[0x17] = PPACH;
+    mmi0[0x18] = PADDSB;
+    mmi0[0x19] = PSUBSB;
+    mmi0[0x1A] = PEXTLB;
+    mmi0[0x1B] = PPACB;
+
+    mmi1[0x01] = PABSW;
+    mmi1[0x02] = PCEQW;
+    mmi1[0x03] = PMINW;
+    mmi1[0x05] = PABSH;
+    mmi1[0x06] = PCEQH;
+    mmi1[0x07] = PMINH;
+    mmi1[0x0A] = PCEQB;
+    mmi1[0x10] = PADDUW;
+    mmi1[0x11] = PSUBUW;
+    mmi1[0x12] = PEXTUW;
+    mmi1[0x14] = PADDUH;
+    mmi1[0x15] = PSUBUH;
+    mmi1[0x16] = PEXTUH;
+    mmi1[0x18] = PADDUB;
+    mmi1[0x19] = PSUBUB;
+    mmi1[0x1A] = PEXTUB;
+
+    mmi2[0x02] = PSLLVW;
+    mmi2[0x03] = PSRLVW;
+    mmi2[0x08] = PMFHI;
+    mmi2[0x09] = PMFLO;
+    mmi2[0x0A] = PINTH;
+    mmi2[0x0C] = PMULTW;
+    mmi2[0x0E] = PCPYLD;
+    mmi2[0x10] = PMADDW;
+    mmi2[0x12] = PAND;
+    mmi2[0x13] = PXOR;
+    mmi2[0x14] = PMSUBW;
+    mmi2[0x1A] = PEXEH;
+    mmi2[0x1B] = PREVH;
+    mmi2[0x1E] = PEXEW;
+    mmi2[0x1F] = PROT3W;
+
+    mmi3[0x03] = PSRAVW;
+    mmi3[0x08] = PMTHI;
+    mmi3[0x09] = PMTLO;
+    mmi3[0x0A] = PINTEH;
+    mmi3[0x0C] = PMULTUW;
+    mmi3[0x0E] = PCPYUD;
+    mmi3[0x10] = PMADDUW;
+    mmi3[0x12] = POR;
+    mmi3[0x13] = PNOR;
+    mmi3[0x1A] = PEXCH;
+    mmi3[0x1B] = PCPYH;
+    mmi3[0x1E] = PEXCW;
+
+    cop1s[0x00] = ADD_S;
+    cop1s[0x01] = SUB_S;
+    cop1s[0x02] = MUL_S;
+    cop1s[0x03] = DIV_S;
+    cop1s[0x04] = SQRT_S;
+    cop1s[0x05] = ABS_S;
+    cop1s[0x06] = MOV_S;
+    cop1s[0x07] = NEG_S;
+    cop1s[0x16] = RSQRT_S;
+    cop1s[0x18] = ADDA_S;
+    cop1s[0x19] = SUBA_S;
+    cop1s[0x1A] = MULA_S;
+    cop1s[0x1C] = MADD_S;
+    cop1s[0x1D] = MSUB_S;
+    cop1s[0x1E] = MADDA_S;
+    cop1s[0x1F] = MSUBA_S;
+    cop1s[0x24] = CVT_W_S;
+    cop1s[0x28] = MAX_S;
+    cop1s[0x29] = MIN_S;
+    cop1s[0x30] = C_F_S;
+    cop1s[0x32] = C_EQ_S;
+    cop1s[0x34] = C_LT_S;
+    cop1s[0x36] = C_LE_S;
+
+    primary[0x00] = Special;
+    primary[0x02] = J;
+    primary[0x03] = JAL;
+    primary[0x04] = BEQ;
+    primary[0x05] = BNE;
+    primary[0x09] = ADDIU;
+    primary[0x0A] = SLTI;
+    primary[0x0B] = SLTIU;
+    primary[0x0C] = ANDI;
+    primary[0x0D] = ORI;
+    primary[0x0F] = LUI;
+    primary[0x10] = COP0;
+    primary[0x11] = COP1;
+    primary[0x12] = COP2;
+    primary[0x14] = BEQL;
+    primary[0x15] = BNEL;
+    primary[0x1A] = LDL;
+    primary[0x1B] = LDR;
+    primary[0x1C] = MMI;
+    primary[0x1E] = LQ;
+    primary[0x1F] = SQ;
+    primary[0x20] = LB;
+    primary[0x21] = LH;
+    primary[0x22] = LWL;
+    primary[0x23] = LW;
+    primary[0x24] = LBU;
+    primary[0x25] = LHU;
+    primary[0x26] = LWR;
+    primary[0x27] = LWU;
+    primary[0x28] = SB;
+    primary[0x29] = SH;
+    primary[0x2A] = SWL;
+    primary[0x2B] = SW;
+    primary[0x2C] = SDL;
+    primary[0x2D] = SDR;
+    primary[0x2E] = SWR;
+    primary[0x31] = LWC1;
+    primary[0x36] = LQC2;
+    primary[0x37] = LD;
+    primary[0x39] = SWC1;
+    primary[0x3E] = SQC2;
+    primary[0x3F] = SD;
+}
+
+void Execute(uint32_t addr)
+{
+    pc = addr;
+
+    Opcode op;
+    op.full = Bus::Read32(addr);
+    primary[op.opcode](op);
+}
+
+// Counted on the EE thread without a lock. PublishBranchCounts copies the
+// ones that changed to where the compiler thread reads them
+struct LocalCounts
+{
+    BranchCounts counts;
+    bool dirty;
+};
+
+std::unordered_map<uint32_t, LocalCounts> branchCounts;
+std::vector<uint32_t> dirtyBranches;
+
+std::mutex profileLock;
+std::unordered_map<uint32_t, BranchCounts> publishedCounts;
+
+void CountBranch(uint32_t branch_pc, bool was_taken)
+{
+    auto& local = branchCounts[branch_pc];
+    if (was_taken)
+        local.counts.taken++;
+    else
+        local.counts.not_taken++;
+
+    if (!local.dirty)
+    {
+        local.dirty = true;
+        dirtyBranches.push_back(branch_pc);
+    }
+}
+
+void PublishBranchCounts()
+{
+    if (dirtyBranches.empty())
+        return;
+
+    std::lock_guard<std::mutex> lock(profileLock);
+    for (auto branch_pc : dirtyBranches)
+    {
+        auto& local = branchCounts[branch_pc];
+        publishedCounts[branch_pc] = local.counts;
+        local.dirty = false;
+    }
+    dirtyBranches.clear();
+}
+
+BranchCounts GetBranchCounts(uint32_t pc)
+{
+    std::lock_guard<std::mutex> lock(profileLock);
+    auto it = publishedCounts.find(pc);
+    return it == publishedCounts.end() ? BranchCounts{} : it->second;
+}
+
+int RunBlock(int max_instrs, const GuestSpan* trace, int span_count)
+{
+    static bool tablesBuilt = false;
+    if (!tablesBuilt)
+    {
+        BuildTables();
+        tablesBuilt = true;
+    }
+
+    state = EmotionEngine::GetState();
+
+    uint32_t addr = state->pc;
+    // Instruction slots walked, nullified delay slots count too
+    int instrs = 0;
+    // Span of the trace being run
+    int span = 0;
+
+    while (true)
+    {
+        Execute(addr);
+        instrs++;
+
+        if (!branched)
+        {
+            addr += 4;
+            if (instrs >= max_instrs)
+                break;
+            continue;
+        }
+
+        branched = false;
+        bool was_taken = taken;
+        uint32_t branch_target = target;
+
+        // Lockstep runs shadowed, and mustn't change what traces get formed
+        if (profile_branches && !shadowing)
+            CountBranch(addr, was_taken);
+
+        // Likely branches nullify the delay slot when not taken
+        if (was_taken || !likely)
+        {
+            Execute(addr + 4);
+            branched = false;
+        }
+        instrs++;
+        addr += 8;
+
+        // The trace goes on into the next span on this branch's taken edge,
+        // and the other one is its side exit
+        bool followed = span + 1 < span_count && addr == trace[span].addr + trace[span].size
+            && branch_target == trace[span + 1].addr;
+        if (followed)
+        {
+            if (!was_taken)
+                break;
+            addr = branch_target;
+            span++;
+        }
+        // Unconditional branches are always taken, so this ends the block
+        // on every kind of jump
+        else if (was_taken)
+        {
+            addr = branch_target;
+            break;
+        }
+        if (instrs >= max_instrs)
+            break;
+    }
+
+    state->pc = addr;
+    state->next_pc = addr + 4;
+
+    stats.blocks++;
+    stats.instructions += instrs;
+    return instrs;
+}
+
+int Clock(int cycles)
+{
+    state = EmotionEngine::GetState();
+    state->cycles_left = cycles;
+
+    do
+    {
+        EmotionEngine::CheckForInterrupt();
+        state->cycles_left -= RunBlock(MAX_BLOCK_INSTRS);
+    } while (state->cycles_left > 0);
+
+    return cycles - state->cycles_left;
+}
+
+uint64_t LoadWordLeft(uint32_t addr, uint64_t rt)
+{
+    int shift = (addr & 3) * 8;
+    uint32_t mem = Load32(addr & ~3);
+    return (int64_t)(int32_t)(((uint32_t)rt & (0x00FFFFFF >> shift)) | (mem << (24 - shift)));
+}
+
+uint64_t LoadWordRight(uint32_t addr, uint64_t rt)
+{
+    int shift = (addr & 3) * 8;
+    uint32_t mem = Load32(addr & ~3);
+
+    // Only the aligned case sign extends, otherwise the upper half is kept
+    if (!shift)
+        return (int64_t)(int32_t)mem;
+    uint32_t result = ((uint32_t)rt & (0xFFFFFFFF << (32 - shift))) | (mem >> shift);
+    return (rt & 0xFFFFFFFF00000000) | result;
+}
+
+uint64_t LoadDoubleLeft(uint32_t addr, uint64_t rt)
+{
+    int shift = (addr & 7) * 8;
+    uint64_t mem = Load64(addr & ~7);
+    return (rt & (0x00FFFFFFFFFFFFFF >> shift)) | (mem << (56 - shift));
+}
+
+uint64_t LoadDoubleRight(uint32_t addr, uint64_t rt)
+{
+    int shift = (addr & 7) * 8;
+    uint64_t mem = Load64(addr & ~7);
+
+    if (!shift)
+        return mem;
+    return (rt & (~0ULL << (64 - shift))) | (mem >> shift);
+}
+
+void StoreWordLeft(uint32_t addr, uint64_t rt)
+{
+    int shift = (addr & 3) * 8;
+    uint32_t mem = Load32(addr & ~3);
+    Store32(addr & ~3, ((uint32_t)rt >> (24 - shift)) | (mem & (0xFFFFFF00 << shift)));
+}
+
+void StoreWordRight(uint32_t addr, uint64_t rt)
+{
+    int shift = (addr & 3) * 8;
+    uint32_t mem = Load32(addr & ~3);
+    uint32_t mask = shift ? 0xFFFFFFFF >> (32 - shift) : 0;
+    Store32(addr & ~3, ((uint32_t)rt << shift) | (mem & mask));
+}
+
+void StoreDoubleLeft(uint32_t addr, uint64_t rt)
+{
+    int shift = (addr & 7) * 8;
+    uint64_t mem = Load64(addr & ~7);
+    Store64(addr & ~7, (rt >> (56 - shift)) | (mem & (0xFFFFFFFFFFFFFF00 << shift)));
+}
+
+void StoreDoubleRight(uint32_t addr, uint64_t rt)
+{
+    int shift = (addr & 7) * 8;
+    uint64_t mem = Load64(addr & ~7);
+    uint64_t mask = shift ? ~0ULL >> (64 - shift) : 0;
+    Store64(addr & ~7, (rt << shift) | (mem & mask));
+}
+
+bool IsPlainMemory(uint32_t addr)
+{
+    uint32_t phys = Translate(addr);
+    return phys < 0x2000000 || (phys >= 0x1fc00000 && phys < 0x20000000) || (phys >= 0x70000000 && phys < 0x70004000);
+}
+
+void BeginShadow()
+{
+    shadowing = true;
+    shadowReadIO = false;
+    shadowStores = 0;
+    shadowMemory.clear();
+}
+
+void EndShadow()
+{
+    shadowing = false;
+}
+
+bool ShadowReadIO()
+{
+    return shadowReadIO;
+}
+
+uint64_t GetShadowStores()
+{
+    return shadowStores;
+}
+
+const std::map<uint32_t, ShadowByte>& GetShadowMemory()
+{
+    return shadowMemory;
+}
+
+}
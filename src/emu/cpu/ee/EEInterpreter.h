@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+
+struct GuestSpan;
+
+// Table driven EE interpreter
+// Runs guest code straight out of memory, one block at a time, on the same
+// ProcessorState the JIT uses. Blocks have the same shape and cost the same
+// cycles as translated ones, so code can move from one tier to the other
+// between any two blocks. With the JIT it's the cold tier: blocks are
+// interpreted until they've been entered often enough to be worth compiling
+namespace EEInterpreter
+{
+
+// Run the block at the current pc, which runs up to the first unconditional
+// branch and its delay slot, or up to `max_instrs` instructions. Leaves the
+// pc at the next block and returns the cycles it took
+// With `trace`, runs it the way a JIT trace made of those spans would: the
+// branch at the end of each span carries on into the next one when taken,
+// and leaves the block when it isn't
+int RunBlock(int max_instrs, const GuestSpan* trace = nullptr, int span_count = 0);
+
+// For builds without the JIT. Checks for interrupts before each block and
+// for the end of the budget after it, like the dispatcher does
+int Clock(int cycles);
+
+// Unaligned loads and stores, merging part of rt with the aligned word or
+// doubleword around `addr`. Shared with the JIT, which calls them directly
+uint64_t LoadWordLeft(uint32_t addr, uint64_t rt);
+uint64_t LoadWordRight(uint32_t addr, uint64_t rt);
+uint64_t LoadDoubleLeft(uint32_t addr, uint64_t rt);
+uint64_t LoadDoubleRight(uint32_t addr, uint64_t rt);
+void StoreWordLeft(uint32_t addr, uint64_t rt);
+void StoreWordRight(uint32_t addr, uint64_t rt);
+void StoreDoubleLeft(uint32_t addr, uint64_t rt);
+void StoreDoubleRight(uint32_t addr, uint64_t rt);
+
+// Branch profile, for forming traces
+// While set, every branch the interpreter runs counts which way it went
+extern bool profile_branches;
+
+struct BranchCounts
+{
+    uint32_t taken, not_taken;
+};
+
+// Counts as of the last PublishBranchCounts, can be called from the
+// compiler thread
+BranchCounts GetBranchCounts(uint32_t pc);
+// Hand the counts over to GetBranchCounts. Called on the EE thread before
+// blocks are queued for compiling or compiled, so counting a branch never
+// takes a lock
+void PublishBranchCounts();
+
+// Code and plain data, memory that can be read without side effects
+bool IsPlainMemory(uint32_t addr);
+
+// Shadowing, for checking the JIT in lockstep
+// While shadowing the interpreter leaves the machine alone. Stores are kept
+// aside instead of going to the Bus, and loads see them on top of memory as
+// it was. Only RAM, BIOS and scratchpad can be read that way, anything else
+// reads as zero and is flagged
+struct ShadowByte
+{
+    uint32_t addr; // As the guest stored to it
+    uint8_t value;
+};
+
+void BeginShadow();
+void EndShadow();
+// The block read IO, so what it did can't be trusted
+bool ShadowReadIO();
+// Stores made while shadowing, IO included
+uint64_t GetShadowStores();
+// Final value of every byte of plain memory stored to, by physical address
+const std::map<uint32_t, ShadowByte>& GetShadowMemory();
+
+struct Stats
+{
+    uint64_t blocks;
+    uint64_t instructions;
+};
+
+extern Stats stats;
+
+}
@@ -1,13 +1,31 @@
 #include "EEJit.h"
+#include "EEJitOpt.h"
+#include "EEInterpreter.h"
 #include <emu/cpu/ee/EmotionEngine.h>
+#include <emu/cpu/ee/vu.h>
 #include <emu/memory/Bus.h>
 
 #if (EE_JIT == 64)
 #include <emu/cpu/ee/x64/EEJitx64.h>
 #endif
 
+#include <emu/cpu/ee/x64/GuestRegister.h>
 #include <emu/cpu/iop/opcode.h>
 
+#include <signal.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
 float convert(uint32_t value)
 {
     switch(value & 0x7F800000)
@@ -23,14 +41,27 @@ float convert(uint32_t value)
     }
 }
 
-Block *curBlock;
+IRArena ir;
+// Address of the instruction being decoded
+uint32_t decodePc;
+
+// Set while compiling a block nobody asked for yet. It might be data, or
+// code that hasn't been loaded, so running into something that can't be
+// decoded just drops the block instead of stopping the emulator
+bool speculating = false;
+bool decodeFailed = false;
 
-std::unordered_map<uint32_t, Block*> blocks;
+void DecodeFailed()
+{
+    if (!speculating)
+        exit(1);
+    decodeFailed = true;
+}
 
 void EmitPrologue()
 {
     IRInstruction instr = IRInstruction::Build({}, IRInstrs::PROLOGUE);
-    curBlock->instructions.push_back(instr);
+    ir.push_back(instr);
 }
 
 void EmitSLL(Opcode op)
@@ -47,9 +78,9 @@ void EmitSLL(Opcode op)
 	IRInstruction instr = IRInstruction::Build({rd, rt, sa}, SHIFT);
 	instr.is_logical = true;
 	instr.direction = IRInstruction::Direction::Left;
-	curBlock->instructions.push_back(instr);
+	ir.push_back(instr);
 
-	printf("sll %s,%s,%d\n", EmotionEngine::Reg(op.r_type.rd), EmotionEngine::Reg(op.r_type.rt), op.r_type.sa);
+	if (EmotionEngine::can_disassemble) printf("sll %s,%s,%d\n", EmotionEngine::Reg(op.r_type.rd), EmotionEngine::Reg(op.r_type.rt), op.r_type.sa);
 }
 
 // 0x02
@@ -67,9 +98,9 @@ void EmitSRL(Opcode op)
 	IRInstruction instr = IRInstruction::Build({rd, rt, sa}, SHIFT);
 	instr.is_logical = true;
 	instr.direction = IRInstruction::Direction::Right;
-	curBlock->instructions.push_back(instr);
+	ir.push_back(instr);
 
-	printf("srl %s,%s,%d\n", EmotionEngine::Reg(op.r_type.rd), EmotionEngine::Reg(op.r_type.rt), op.r_type.sa);
+	if (EmotionEngine::can_disassemble) printf("srl %s,%s,%d\n", EmotionEngine::Reg(op.r_type.rd), EmotionEngine::Reg(op.r_type.rt), op.r_type.sa);
 }
 
 void EmitJR(Opcode op)
@@ -79,9 +110,9 @@ void EmitJR(Opcode op)
 
     auto instr = IRInstruction::Build({reg}, JUMP);
     instr.should_link = false;
-    curBlock->instructions.push_back(instr);
+    ir.push_back(instr);
 
-    printf("jr %s\n", EmotionEngine::Reg(reg.GetReg()));
+    if (EmotionEngine::can_disassemble) printf("jr %s\n", EmotionEngine::Reg(reg.GetReg()));
 }
 
 // 0x09
@@ -94,18 +125,18 @@ void EmitJalr(Opcode op)
 
 	auto instr = IRInstruction::Build({rd, rs}, JUMP);
 	instr.should_link = true;
-	curBlock->instructions.push_back(instr);
+	ir.push_back(instr);
 
-	printf("jalr %s,%s\n", EmotionEngine::Reg(op.r_type.rd), EmotionEngine::Reg(op.r_type.rs));
+	if (EmotionEngine::can_disassemble) printf("jalr %s,%s\n", EmotionEngine::Reg(op.r_type.rd), EmotionEngine::Reg(op.r_type.rs));
 }
 
 // 0x0d
 void EmitBreak()
 {
 	auto instr = IRInstruction::Build({}, BREAK);
-	curBlock->instructions.push_back(instr);
+	ir.push_back(instr);
 
-	printf("break\n");
+	if (EmotionEngine::can_disassemble) printf("break\n");
 }
 
 void EmitMFLO(Opcode op)
@@ -118,9 +149,9 @@ void EmitMFLO(Opcode op)
 
 	IRInstruction instr = IRInstruction::Build({rd, lo}, MOVE);
 	instr.is_mmi_divmul = false;
-	curBlock->instructions.push_back(instr);
+	ir.push_back(instr);
 
-	printf("mflo %s\n", EmotionEngine::Reg(op.r_type.rd));
+	if (EmotionEngine::can_disassemble) printf("mflo %s\n", EmotionEngine::Reg(op.r_type.rd));
 }
 
 // 0x18
@@ -134,12 +165,12 @@ void EmitMULT(Opcode op)
 	rs.SetReg(op.r_type.rs);
 
 	auto instr = IRInstruction::Build({rd, rs, rt}, MULT);
-	instr.is_unsigned = true;
+	instr.is_unsigned = false;
 	instr.size = IRInstruction::InstrSize::Size32;
 	instr.is_mmi_divmul = false;
-	curBlock->instructions.push_back(instr);
+	ir.push_back(instr);
 
-	printf("mult %s,%s,%s\n", EmotionEngine::Reg(op.r_type.rd), EmotionEngine::Reg(op.r_type.rs), EmotionEngine::Reg(op.r_type.rt));
+	if (EmotionEngine::can_disassemble) printf("mult %s,%s,%s\n", EmotionEngine::Reg(op.r_type.rd), EmotionEngine::Reg(op.r_type.rs), EmotionEngine::Reg(op.r_type.rt));
 }
 
 // 0x1B
@@ -156,9 +187,9 @@ void EmitDIVU(Opcode op)
 	instr.is_unsigned = true;
 	instr.size = IRInstruction::InstrSize::Size32;
 	instr.is_mmi_divmul = false;
-	curBlock->instructions.push_back(instr);
+	ir.push_back(instr);
 
-	printf("divu %s,%s,%s\n", EmotionEngine::Reg(op.r_type.rd), EmotionEngine::Reg(op.r_type.rs), EmotionEngine::Reg(op.r_type.rt));
+	if (EmotionEngine::can_disassemble) printf("divu %s,%s,%s\n", EmotionEngine::Reg(op.r_type.rd), EmotionEngine::Reg(op.r_type.rs), EmotionEngine::Reg(op.r_type.rt));
 }
 
 // 0x25
@@ -175,9 +206,9 @@ void EmitOR(Opcode op)
 	instr.is_unsigned = true;
 	instr.size = IRInstruction::InstrSize::Size64;
 
-	curBlock->instructions.push_back(instr);
+	ir.push_back(instr);
 
-	printf("or %s,%s,%s\n", EmotionEngine::Reg(rd.GetReg()), EmotionEngine::Reg(rs.GetReg()), EmotionEngine::Reg(rt.GetReg()));
+	if (EmotionEngine::can_disassemble) printf("or %s,%s,%s\n", EmotionEngine::Reg(rd.GetReg()), EmotionEngine::Reg(rs.GetReg()), EmotionEngine::Reg(rt.GetReg()));
 }
 
 // 0x2d
@@ -194,9 +225,9 @@ void EmitDADDU(Opcode op)
 	instr.is_unsigned = true;
 	instr.size = IRInstruction::InstrSize::Size64;
 
-	curBlock->instructions.push_back(instr);
+	ir.push_back(instr);
 
-	printf("daddu %s,%s,%s\n", EmotionEngine::Reg(rd.GetReg()), EmotionEngine::Reg(rs.GetReg()), EmotionEngine::Reg(rt.GetReg()));
+	if (EmotionEngine::can_disassemble) printf("daddu %s,%s,%s\n", EmotionEngine::Reg(rd.GetReg()), EmotionEngine::Reg(rs.GetReg()), EmotionEngine::Reg(rt.GetReg()));
 }
 
 // 0x00
@@ -220,7 +251,8 @@ void EmitSpecial(Opcode op)
 		EmitBreak();
 		break;
     case 0x0f:
-        printf("sync\n");
+        ir.push_back(IRInstruction::Build({}, NOP));
+        if (EmotionEngine::can_disassemble) printf("sync\n");
         break;
 	case 0x12:
 		EmitMFLO(op);
@@ -239,10 +271,23 @@ void EmitSpecial(Opcode op)
 		break;
     default:
         printf("[EEJIT]: Cannot emit unknown special opcode 0x%02x (0x%08x)\n", op.r_type.func, op.full);
-        exit(1);
+        DecodeFailed();
     }
 }
 
+// 0x02
+void EmitJ(Opcode op)
+{
+	IRValue imm(IRValue::Imm);
+	imm.SetImm32Unsigned(op.j_type.target << 2);
+
+	auto instr = IRInstruction::Build({imm}, JUMP);
+	instr.should_link = false;
+	ir.push_back(instr);
+
+	if (EmotionEngine::can_disassemble) printf("j 0x%08x\n", ((decodePc + 4) & 0xF0000000) | imm.GetImm());
+}
+
 // 0x03
 void EmitJAL(Opcode op)
 {
@@ -251,16 +296,16 @@ void EmitJAL(Opcode op)
 
 	auto instr = IRInstruction::Build({imm}, JUMP);
 	instr.should_link = true;
-	curBlock->instructions.push_back(instr);
+	ir.push_back(instr);
 
-	printf("jal 0x%08x\n", (EmotionEngine::GetState()->pc & 0xF0000000) | imm.GetImm());
+	if (EmotionEngine::can_disassemble) printf("jal 0x%08x\n", ((decodePc + 4) & 0xF0000000) | imm.GetImm());
 }
 
 // 0x04
 void EmitBEQ(Opcode op)
 {
     IRValue imm(IRValue::Imm);
-    imm.SetImm32(op.i_type.imm << 2);
+    imm.SetImm32((int32_t)(int16_t)op.i_type.imm << 2);
 
     IRValue rt(IRValue::Reg);
     rt.SetReg(op.r_type.rt);
@@ -269,20 +314,20 @@ void EmitBEQ(Opcode op)
     rs.SetReg(op.r_type.rs);
 
     auto instr = IRInstruction::Build({rs, rt, imm}, IRInstrs::BRANCH);
-    if (op.r_type.rt == op.r_type.rs == 0)
+    if (op.r_type.rt == 0 && op.r_type.rs == 0)
         instr.b_type = IRInstruction::BranchType::AL;
     else
         instr.b_type = IRInstruction::BranchType::EQ;
-    curBlock->instructions.push_back(instr);
+    ir.push_back(instr);
 
-    printf("beq %s,%s,pc+%d\n", EmotionEngine::Reg(op.i_type.rs), EmotionEngine::Reg(op.i_type.rt), (int32_t)imm.GetImm());
+    if (EmotionEngine::can_disassemble) printf("beq %s,%s,pc+%d\n", EmotionEngine::Reg(op.i_type.rs), EmotionEngine::Reg(op.i_type.rt), (int32_t)imm.GetImm());
 }
 
 // 0x05
 void EmitBNE(Opcode op)
 {
     IRValue imm(IRValue::Imm);
-    imm.SetImm32(op.i_type.imm << 2);
+    imm.SetImm32((int32_t)(int16_t)op.i_type.imm << 2);
 
     IRValue rt(IRValue::Reg);
     rt.SetReg(op.r_type.rt);
@@ -292,9 +337,9 @@ void EmitBNE(Opcode op)
 
     auto instr = IRInstruction::Build({rs, rt, imm}, IRInstrs::BRANCH);
     instr.b_type = IRInstruction::BranchType::NE;
-    curBlock->instructions.push_back(instr);
+    ir.push_back(instr);
 
-    printf("bne %s,%s,pc+%d\n", EmotionEngine::Reg(op.i_type.rs), EmotionEngine::Reg(op.i_type.rt), (int32_t)imm.GetImm());
+    if (EmotionEngine::can_disassemble) printf("bne %s,%s,pc+%d\n", EmotionEngine::Reg(op.i_type.rs), EmotionEngine::Reg(op.i_type.rt), (int32_t)imm.GetImm());
 }
 
 // 0x09
@@ -312,9 +357,9 @@ void EmitADDIU(Opcode op)
     auto instr = IRInstruction::Build({dst, src, imm}, IRInstrs::ADD);
     instr.is_unsigned = true;
 	instr.size = IRInstruction::Size32;
-    curBlock->instructions.push_back(instr);
+    ir.push_back(instr);
 
-    printf("addiu %s,%s,0x%08lx\n", EmotionEngine::Reg(op.i_type.rt), EmotionEngine::Reg(op.i_type.rs), (int64_t)(int16_t)op.i_type.imm);
+    if (EmotionEngine::can_disassemble) printf("addiu %s,%s,0x%08lx\n", EmotionEngine::Reg(op.i_type.rt), EmotionEngine::Reg(op.i_type.rs), (int64_t)(int16_t)op.i_type.imm);
 }
 
 // 0x0A
@@ -331,9 +376,9 @@ void EmitSLTI(Opcode op)
 
     auto instr = IRInstruction::Build({dst, src, imm}, IRInstrs::SLT);
     instr.is_unsigned = false;
-    curBlock->instructions.push_back(instr);
+    ir.push_back(instr);
 
-    printf("slti %s,%s,0x%08lx\n", EmotionEngine::Reg(op.i_type.rt), EmotionEngine::Reg(op.i_type.rs), (int64_t)(int16_t)op.i_type.imm);
+    if (EmotionEngine::can_disassemble) printf("slti %s,%s,0x%08lx\n", EmotionEngine::Reg(op.i_type.rt), EmotionEngine::Reg(op.i_type.rs), (int64_t)(int16_t)op.i_type.imm);
 }
 
 // 0x0B
@@ -350,9 +395,9 @@ void EmitSLTIU(Opcode op)
 
     auto instr = IRInstruction::Build({dst, src, imm}, IRInstrs::SLT);
     instr.is_unsigned = true;
-    curBlock->instructions.push_back(instr);
+    ir.push_back(instr);
 
-    printf("sltiu %s,%s,0x%08lx\n", EmotionEngine::Reg(op.i_type.rt), EmotionEngine::Reg(op.i_type.rs), (int64_t)(int16_t)op.i_type.imm);
+    if (EmotionEngine::can_disassemble) printf("sltiu %s,%s,0x%08lx\n", EmotionEngine::Reg(op.i_type.rt), EmotionEngine::Reg(op.i_type.rs), (int64_t)(int16_t)op.i_type.imm);
 }
 
 // 0x0C
@@ -368,9 +413,9 @@ void EmitANDI(Opcode op)
     dst.SetReg(op.i_type.rt);
 
     auto instr = IRInstruction::Build({dst, src, imm}, IRInstrs::AND);
-    curBlock->instructions.push_back(instr);
+    ir.push_back(instr);
 
-    printf("andi %s,%s,0x%08lx\n", EmotionEngine::Reg(dst.GetReg()), EmotionEngine::Reg(src.GetReg()), imm.GetImm64());
+    if (EmotionEngine::can_disassemble) printf("andi %s,%s,0x%08lx\n", EmotionEngine::Reg(dst.GetReg()), EmotionEngine::Reg(src.GetReg()), imm.GetImm64());
 }
 
 // 0x0D
@@ -386,9 +431,9 @@ void EmitOri(Opcode op)
     dst.SetReg(op.i_type.rt);
 
     auto instr = IRInstruction::Build({dst, src, imm}, IRInstrs::OR);
-    curBlock->instructions.push_back(instr);
+    ir.push_back(instr);
 
-    printf("ori %s,%s,0x%08lx\n", EmotionEngine::Reg(dst.GetReg()), EmotionEngine::Reg(src.GetReg()), imm.GetImm64());
+    if (EmotionEngine::can_disassemble) printf("ori %s,%s,0x%08lx\n", EmotionEngine::Reg(dst.GetReg()), EmotionEngine::Reg(src.GetReg()), imm.GetImm64());
 }
 
 // 0x0F
@@ -401,9 +446,9 @@ void EmitLUI(Opcode op)
     imm.SetImm64From32(op.i_type.imm << 16);
 
     auto instr = IRInstruction::Build({rt, imm}, IRInstrs::MOVE);
-    curBlock->instructions.push_back(instr);
+    ir.push_back(instr);
 
-    printf("lui %s,0x%08lx\n", EmotionEngine::Reg(rt.GetReg()), imm.GetImm64());
+    if (EmotionEngine::can_disassemble) printf("lui %s,0x%08lx\n", EmotionEngine::Reg(rt.GetReg()), imm.GetImm64());
 }
 
 // 0x10 0x00
@@ -419,9 +464,9 @@ void EmitMFC0(Opcode op)
     src_val.SetReg(dest);
 
     auto instr = IRInstruction::Build({src_val, dst_val}, IRInstrs::MOVE);
-    curBlock->instructions.push_back(instr);
+    ir.push_back(instr);
 
-    printf("mfc0 %s,r%d\n", EmotionEngine::Reg(dest), src);
+    if (EmotionEngine::can_disassemble) printf("mfc0 %s,r%d\n", EmotionEngine::Reg(dest), src);
 }
 
 // 0x10 0x04
@@ -437,9 +482,9 @@ void EmitMTC0(Opcode op)
     dst_val.SetReg(dest);
 
     auto instr = IRInstruction::Build({src_val, dst_val}, IRInstrs::MOVE);
-    curBlock->instructions.push_back(instr);
+    ir.push_back(instr);
 
-    printf("mtc0 %s,r%d\n", EmotionEngine::Reg(dest), src);
+    if (EmotionEngine::can_disassemble) printf("mtc0 %s,r%d\n", EmotionEngine::Reg(dest), src);
 }
 
 // 0x10
@@ -458,17 +503,18 @@ void EmitCOP0(Opcode op)
         switch (op.r_type.func)
         {
         case 0x02:
-            printf("tlbwi\n");
+            ir.push_back(IRInstruction::Build({}, NOP));
+            if (EmotionEngine::can_disassemble) printf("tlbwi\n");
             break;
         default:
             printf("Unknown COP0 TLB instruction 0x%02x\n", op.r_type.func);
-            exit(1);
+            DecodeFailed();
         }
         break;
     }
     default:
         printf("[EEJIT]: Cannot emit unknown cop0 opcode 0x%08x\n", op.r_type.rs);
-        exit(1);
+        DecodeFailed();
     }
 }
 
@@ -476,7 +522,7 @@ void EmitCOP0(Opcode op)
 void EmitBEQL(Opcode op)
 {
     IRValue imm(IRValue::Imm);
-    imm.SetImm32(op.i_type.imm << 2);
+    imm.SetImm32((int32_t)(int16_t)op.i_type.imm << 2);
 
     IRValue rt(IRValue::Reg);
     rt.SetReg(op.i_type.rt);
@@ -490,16 +536,16 @@ void EmitBEQL(Opcode op)
     else
         instr.b_type = IRInstruction::BranchType::EQ;
 	instr.is_likely = true;
-    curBlock->instructions.push_back(instr);
+    ir.push_back(instr);
 
-    printf("beql %s,%s,pc+%d\n", EmotionEngine::Reg(op.i_type.rs), EmotionEngine::Reg(op.i_type.rt), (int32_t)imm.GetImm());
+    if (EmotionEngine::can_disassemble) printf("beql %s,%s,pc+%d\n", EmotionEngine::Reg(op.i_type.rs), EmotionEngine::Reg(op.i_type.rt), (int32_t)imm.GetImm());
 }
 
 // 0x15
 void EmitBNEL(Opcode op)
 {
     IRValue imm(IRValue::Imm);
-    imm.SetImm32(op.i_type.imm << 2);
+    imm.SetImm32((int32_t)(int16_t)op.i_type.imm << 2);
 
     IRValue rt(IRValue::Reg);
     rt.SetReg(op.i_type.rt);
@@ -510,47 +556,534 @@ void EmitBNEL(Opcode op)
     auto instr = IRInstruction::Build({rs, rt, imm}, IRInstrs::BRANCH);
     instr.b_type = IRInstruction::BranchType::NE;
 	instr.is_likely = true;
-    curBlock->instructions.push_back(instr);
+    ir.push_back(instr);
+
+    if (EmotionEngine::can_disassemble) printf("bnel %s,%s,pc+%d\n", EmotionEngine::Reg(op.i_type.rs), EmotionEngine::Reg(op.i_type.rt), (int32_t)imm.GetImm());
+}
+
+// Mnemonics, in MMIOp order
+const char* mmiNames[] = {
+    "paddw", "psubw", "pcgtw", "pmaxw", "paddh", "psubh", "pcgth", "pmaxh", "paddb", "psubb", "pcgtb",
+    "paddsw", "psubsw", "pextlw", "ppacw", "paddsh", "psubsh", "pextlh", "ppach", "paddsb", "psubsb", "pextlb", "ppacb",
+    "pabsw", "pceqw", "pminw", "pabsh", "pceqh", "pminh", "pceqb",
+    "padduw", "psubuw", "pextuw", "padduh", "psubuh", "pextuh", "paddub", "psubub", "pextub",
+    "psllvw", "psrlvw", "pmfhi", "pmflo", "pinth", "pmultw", "pcpyld", "pmaddw", "pand", "pxor", "pmsubw",
+    "pexeh", "prevh", "pexew", "prot3w",
+    "psravw", "pmthi", "pmtlo", "pinteh", "pmultuw", "pcpyud", "pmadduw", "por", "pnor", "pexch", "pcpyh", "pexcw",
+    "plzcw", "pmfhl.lw", "pmfhl.uw", "pmfhl.slw", "pmfhl.lh", "pmfhl.sh", "pmthl.lw",
+    "psllh", "psrlh", "psrah", "psllw", "psrlw", "psraw",
+};
+
+// Which MMI instruction `op` is, false for the ones that aren't handled
+bool DecodeMMI(Opcode op, MMIOp& out)
+{
+    using M = MMIOp;
+    int sa = op.r_type.sa;
+
+    // MMI0-3 groups, by the sa field
+    static const int8_t mmi0[32] = {
+        (int)M::PADDW, (int)M::PSUBW, (int)M::PCGTW, (int)M::PMAXW, (int)M::PADDH, (int)M::PSUBH, (int)M::PCGTH, (int)M::PMAXH,
+        (int)M::PADDB, (int)M::PSUBB, (int)M::PCGTB, -1, -1, -1, -1, -1,
+        (int)M::PADDSW, (int)M::PSUBSW, (int)M::PEXTLW, (int)M::PPACW, (int)M::PADDSH, (int)M::PSUBSH, (int)M::PEXTLH, (int)M::PPACH,
+        (int)M::PADDSB, (int)M::PSUBSB, (int)M::PEXTLB, (int)M::PPACB, -1, -1, -1, -1,
+    };
+    static const int8_t mmi1[32] = {
+        -1, (int)M::PABSW, (int)M::PCEQW, (int)M::PMINW, -1, (int)M::PABSH, (int)M::PCEQH, (int)M::PMINH,
+        -1, -1, (int)M::PCEQB, -1, -1, -1, -1, -1,
+        (int)M::PADDUW, (int)M::PSUBUW, (int)M::PEXTUW, -1, (int)M::PADDUH, (int)M::PSUBUH, (int)M::PEXTUH, -1,
+        (int)M::PADDUB, (int)M::PSUBUB, (int)M::PEXTUB, -1, -1, -1, -1, -1,
+    };
+    static const int8_t mmi2[32] = {
+        -1, -1, (int)M::PSLLVW, (int)M::PSRLVW, -1, -1, -1, -1,
+        (int)M::PMFHI, (int)M::PMFLO, (int)M::PINTH, -1, (int)M::PMULTW, -1, (int)M::PCPYLD, -1,
+        (int)M::PMADDW, -1, (int)M::PAND, (int)M::PXOR, (int)M::PMSUBW, -1, -1, -1,
+        -1, -1, (int)M::PEXEH, (int)M::PREVH, -1, -1, (int)M::PEXEW, (int)M::PROT3W,
+    };
+    static const int8_t mmi3[32] = {
+        -1, -1, -1, (int)M::PSRAVW, -1, -1, -1, -1,
+        (int)M::PMTHI, (int)M::PMTLO, (int)M::PINTEH, -1, (int)M::PMULTUW, -1, (int)M::PCPYUD, -1,
+        (int)M::PMADDUW, -1, (int)M::POR, (int)M::PNOR, -1, -1, -1, -1,
+        -1, -1, (int)M::PEXCH, (int)M::PCPYH, -1, -1, (int)M::PEXCW, -1,
+    };
+
+    int decoded = -1;
+
+    switch (op.r_type.func)
+    {
+    case 0x04: decoded = (int)M::PLZCW; break;
+    case 0x08: decoded = mmi0[sa]; break;
+    case 0x09: decoded = mmi2[sa]; break;
+    case 0x28: decoded = mmi1[sa]; break;
+    case 0x29: decoded = mmi3[sa]; break;
+    case 0x30:
+        if (sa <= 4)
+            decoded = (int)M::PMFHL_LW + sa;
+        break;
+    case 0x31:
+        if (sa == 0)
+            decoded = (int)M::PMTHL_LW;
+        break;
+    case 0x34: decoded = (int)M::PSLLH; break;
+    case 0x36: decoded = (int)M::PSRLH; break;
+    case 0x37: decoded = (int)M::PSRAH; break;
+    case 0x3C: decoded = (int)M::PSLLW; break;
+    case 0x3E: decoded = (int)M::PSRLW; break;
+    case 0x3F: decoded = (int)M::PSRAW; break;
+    }
+
+    if (decoded < 0)
+        return false;
+    out = (MMIOp)decoded;
+    return true;
+}
+
+// 0x1C
+void EmitMMI(Opcode op)
+{
+    MMIOp mmi_op;
+    if (!DecodeMMI(op, mmi_op))
+    {
+        printf("[EEJIT]: Cannot emit unknown MMI opcode 0x%02x/0x%02x (0x%08x)\n", op.r_type.func, op.r_type.sa, op.full);
+        DecodeFailed();
+        return;
+    }
+
+    IRValue rd(IRValue::Reg);
+    rd.SetReg(op.r_type.rd);
+    IRValue rs(IRValue::Reg);
+    rs.SetReg(op.r_type.rs);
+    IRValue rt(IRValue::Reg);
+    rt.SetReg(op.r_type.rt);
+
+    bool shift = mmi_op >= MMIOp::PSLLH;
+    if (shift)
+    {
+        rs = IRValue(IRValue::Imm);
+        rs.SetImm32Unsigned(op.r_type.sa);
+    }
+
+    auto instr = IRInstruction::Build({rd, rs, rt}, MMI);
+    instr.mmi_op = mmi_op;
+    ir.push_back(instr);
+
+    if (!EmotionEngine::can_disassemble)
+        return;
+    if (shift)
+        printf("%s %s,%s,%d\n", mmiNames[(int)mmi_op], EmotionEngine::Reg(op.r_type.rd), EmotionEngine::Reg(op.r_type.rt), op.r_type.sa);
+    else
+        printf("%s %s,%s,%s\n", mmiNames[(int)mmi_op], EmotionEngine::Reg(op.r_type.rd), EmotionEngine::Reg(op.r_type.rs), EmotionEngine::Reg(op.r_type.rt));
+}
+
+const char* fpuNames[] = {
+    "add.s", "sub.s", "mul.s", "div.s", "sqrt.s", "rsqrt.s", "abs.s", "mov.s", "neg.s",
+    "adda.s", "suba.s", "mula.s", "madd.s", "msub.s", "madda.s", "msuba.s", "max.s", "min.s",
+    "cvt.w.s", "cvt.s.w", "c.f.s", "c.eq.s", "c.lt.s", "c.le.s", "cfc1", "ctc1",
+};
+
+// Which COP1.S instruction the function field is, -1 for the ones that
+// aren't handled
+int8_t DecodeFPU(int func)
+{
+    using F = FPUOp;
+
+    static const int8_t ops[64] = {
+        (int)F::ADD, (int)F::SUB, (int)F::MUL, (int)F::DIV, (int)F::SQRT, (int)F::ABS, (int)F::MOV, (int)F::NEG,
+        -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, (int)F::RSQRT, -1,
+        (int)F::ADDA, (int)F::SUBA, (int)F::MULA, -1, (int)F::MADD, (int)F::MSUB, (int)F::MADDA, (int)F::MSUBA,
+        -1, -1, -1, -1, (int)F::CVT_W, -1, -1, -1,
+        (int)F::MAX, (int)F::MIN, -1, -1, -1, -1, -1, -1,
+        (int)F::C_F, -1, (int)F::C_EQ, -1, (int)F::C_LT, -1, (int)F::C_LE, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1,
+    };
+
+    return ops[func];
+}
 
-    printf("bnel %s,%s,pc+%d\n", EmotionEngine::Reg(op.i_type.rs), EmotionEngine::Reg(op.i_type.rt), (int32_t)imm.GetImm());
+void EmitFPU(FPUOp fpu_op, IRValue fd, IRValue fs, IRValue ft)
+{
+    auto instr = IRInstruction::Build({fd, fs, ft}, FPU);
+    instr.fpu_op = fpu_op;
+    ir.push_back(instr);
 }
 
-// 0x2B
-void EmitSW(Opcode op)
+// 0x11 0x08, BC1F, BC1T, BC1FL, BC1TL
+// A branch on the C bit, which is args[0]. args[1] is $zero so the branch
+// looks like any other to code that doesn't care what it compares
+void EmitBC1(Opcode op)
+{
+    IRValue imm(IRValue::Imm);
+    imm.SetImm32((int32_t)(int16_t)op.i_type.imm << 2);
+
+    IRValue c(IRValue::Cop1Reg);
+    c.SetReg(31);
+
+    IRValue zero(IRValue::Reg);
+    zero.SetReg(0);
+
+    bool on_true = op.i_type.rt & 1;
+
+    auto instr = IRInstruction::Build({c, zero, imm}, IRInstrs::BRANCH);
+    instr.b_type = on_true ? IRInstruction::BranchType::NE : IRInstruction::BranchType::EQ;
+    instr.is_likely = op.i_type.rt & 2;
+    ir.push_back(instr);
+
+    if (EmotionEngine::can_disassemble) printf("bc1%s%s pc+%d\n", on_true ? "t" : "f", instr.is_likely ? "l" : "", (int32_t)imm.GetImm());
+}
+
+// 0x11
+void EmitCOP1(Opcode op)
+{
+    IRValue gpr(IRValue::Reg);
+    gpr.SetReg(op.r_type.rt);
+    IRValue fs(IRValue::Cop1Reg);
+    fs.SetReg(op.r_type.rd);
+
+    switch (op.r_type.rs)
+    {
+    case 0x00:
+        // MFC1 and MTC1 are moves, like their COP0 counterparts
+        ir.push_back(IRInstruction::Build({gpr, fs}, MOVE));
+        if (EmotionEngine::can_disassemble) printf("mfc1 %s,f%d\n", EmotionEngine::Reg(op.r_type.rt), op.r_type.rd);
+        return;
+    case 0x04:
+        ir.push_back(IRInstruction::Build({fs, gpr}, MOVE));
+        if (EmotionEngine::can_disassemble) printf("mtc1 %s,f%d\n", EmotionEngine::Reg(op.r_type.rt), op.r_type.rd);
+        return;
+    case 0x02:
+    case 0x06:
+    {
+        IRValue fcr(IRValue::Imm);
+        fcr.SetImm32Unsigned(op.r_type.rd);
+        if (op.r_type.rs == 0x02)
+            EmitFPU(FPUOp::CFC1, gpr, fcr, IRValue());
+        else
+            EmitFPU(FPUOp::CTC1, fcr, gpr, IRValue());
+        if (EmotionEngine::can_disassemble) printf("%s %s,fcr%d\n", op.r_type.rs == 0x02 ? "cfc1" : "ctc1", EmotionEngine::Reg(op.r_type.rt), op.r_type.rd);
+        return;
+    }
+    case 0x08:
+        if (op.r_type.rt <= 3)
+        {
+            EmitBC1(op);
+            return;
+        }
+        break;
+    case 0x10:
+    case 0x14:
+    {
+        int8_t decoded = op.r_type.rs == 0x10 ? DecodeFPU(op.r_type.func) : (op.r_type.func == 0x20 ? (int)FPUOp::CVT_S : -1);
+        if (decoded < 0)
+            break;
+
+        auto fpu_op = (FPUOp)decoded;
+        IRValue fd(IRValue::Cop1Reg);
+        fd.SetReg(op.r_type.sa);
+        IRValue ft(IRValue::Cop1Reg);
+        ft.SetReg(op.r_type.rt);
+
+        EmitFPU(fpu_op, fd, fs, ft);
+        if (EmotionEngine::can_disassemble) printf("%s f%d,f%d,f%d\n", fpuNames[decoded], op.r_type.sa, op.r_type.rd, op.r_type.rt);
+        return;
+    }
+    }
+
+    printf("[EEJIT]: Cannot emit unknown COP1 opcode 0x%02x/0x%02x (0x%08x)\n", op.r_type.rs, op.r_type.func, op.full);
+    DecodeFailed();
+}
+
+const char* vuNames[] = {
+    "vadd", "vsub", "vmul", "vmadd", "vmsub", "vmax", "vmini",
+    "vadda", "vsuba", "vmula", "vmadda", "vmsuba", "vopmula", "vopmsub",
+    "vabs", "vmove", "vmr32", "vitof", "vftoi", "vclip",
+    "qmfc2", "qmtc2", "cfc2", "ctc2", "vcall",
+};
+
+// The upper instructions of special1 0x00-0x2F and special2, which share a
+// layout with special2 having the forms that write ACC. Returns false for
+// the rest, which are CALLs
+bool DecodeVU(int index, bool special2, VUOp& out, VUField& field)
+{
+    using V = VUOp;
+    using F = VUField;
+
+    static const V bc_ops[7] = {V::ADD, V::SUB, V::MADD, V::MSUB, V::MAX, V::MINI, V::MUL};
+    static const V iq_ops[8] = {V::ADD, V::MADD, V::ADD, V::MADD, V::SUB, V::MSUB, V::SUB, V::MSUB};
+    static const V vector_ops[8] = {V::ADD, V::MADD, V::MUL, V::MAX, V::SUB, V::MSUB, V::OPMSUB, V::MINI};
+    static const V iq_mul_ops[4] = {V::MUL, V::MAX, V::MUL, V::MINI};
+
+    field = F::Vector;
+    if (index < 0x1C)
+    {
+        out = bc_ops[index >> 2];
+        field = (F)(index & 3);
+    }
+    else if (index < 0x20)
+    {
+        out = iq_mul_ops[index & 3];
+        field = index == 0x1C ? F::Q : F::I;
+    }
+    else if (index < 0x28)
+    {
+        out = iq_ops[index & 7];
+        field = (index & 2) ? F::I : F::Q;
+    }
+    else if (index < 0x30)
+        out = vector_ops[index & 7];
+    else if (!special2)
+        return false;
+
+    if (!special2)
+        return true;
+
+    switch (index)
+    {
+    case 0x10 ... 0x13: out = V::ITOF; field = F::Vector; return true;
+    case 0x14 ... 0x17: out = V::FTOI; field = F::Vector; return true;
+    case 0x1D: out = V::ABS; field = F::Vector; return true;
+    case 0x1F: out = V::CLIP; field = F::Vector; return true;
+    case 0x2E: out = V::OPMULA; return true;
+    case 0x30: out = V::MOVE; return true;
+    case 0x31: out = V::MR32; return true;
+    }
+
+    if (index >= 0x30 || out == V::MAX || out == V::MINI)
+        return false;
+
+    // The same op writing ACC
+    switch (out)
+    {
+    case V::ADD: out = V::ADDA; break;
+    case V::SUB: out = V::SUBA; break;
+    case V::MUL: out = V::MULA; break;
+    case V::MADD: out = V::MADDA; break;
+    default: out = V::MSUBA; break;
+    }
+    return true;
+}
+
+IRInstruction& EmitVU(VUOp vu_op, IRArgs args)
+{
+    auto instr = IRInstruction::Build(args, VU);
+    instr.vu_op = vu_op;
+    instr.vu_dest = 0xF;
+    instr.vu_field = VUField::Vector;
+    ir.push_back(instr);
+    return ir.back();
+}
+
+// COP2 special1 and special2
+void EmitVUMacro(Opcode op)
+{
+    static const char* fieldNames[] = {"x", "y", "z", "w", "i", "q", ""};
+    static const int fractionBits[4] = {0, 4, 12, 15};
+
+    bool special2 = (op.full & 0x3C) == 0x3C;
+    int index = special2 ? (op.full & 3) | ((op.full >> 4) & 0x7C) : op.full & 0x3F;
+
+    // NOP, and WAITQ since Q is always ready
+    if (special2 && (index == 0x2F || index == 0x3B))
+    {
+        ir.push_back(IRInstruction::Build({}, NOP));
+        if (EmotionEngine::can_disassemble) printf("%s\n", index == 0x2F ? "vnop" : "vwaitq");
+        return;
+    }
+
+    IRValue fd(IRValue::Cop2Reg);
+    fd.SetReg((op.full >> 6) & 0x1F);
+    IRValue fs(IRValue::Cop2Reg);
+    fs.SetReg(op.r_type.rd);
+    IRValue ft(IRValue::Cop2Reg);
+    ft.SetReg(op.r_type.rt);
+
+    uint8_t dest = (op.full >> 21) & 0xF;
+    char lanes[5] = {};
+    for (int n = 3, len = 0; n >= 0; n--)
+        if (dest & (1 << n))
+            lanes[len++] = "wzyx"[n];
+
+    VUOp vu_op;
+    VUField field;
+    if (!DecodeVU(index, special2, vu_op, field))
+    {
+        EmitVU(VUOp::CALL, {}).opcode = op.full;
+        if (EmotionEngine::can_disassemble) printf("vcall 0x%08x\n", op.full);
+        return;
+    }
+
+    switch (vu_op)
+    {
+    case VUOp::ABS:
+    case VUOp::MOVE:
+    case VUOp::MR32:
+        EmitVU(vu_op, {ft, fs}).vu_dest = dest;
+        if (EmotionEngine::can_disassemble) printf("%s.%s vf%d,vf%d\n", vuNames[(int)vu_op], lanes, op.r_type.rt, op.r_type.rd);
+        return;
+    case VUOp::ITOF:
+    case VUOp::FTOI:
+    {
+        IRValue bits(IRValue::Imm);
+        bits.SetImm32Unsigned(fractionBits[index & 3]);
+        EmitVU(vu_op, {ft, fs, bits}).vu_dest = dest;
+        if (EmotionEngine::can_disassemble) printf("%s%d.%s vf%d,vf%d\n", vuNames[(int)vu_op], fractionBits[index & 3], lanes, op.r_type.rt, op.r_type.rd);
+        return;
+    }
+    case VUOp::CLIP:
+        EmitVU(vu_op, {fs, ft});
+        if (EmotionEngine::can_disassemble) printf("vclipw.xyz vf%d,vf%dw\n", op.r_type.rd, op.r_type.rt);
+        return;
+    default:
+    {
+        auto& instr = EmitVU(vu_op, {fd, fs, ft});
+        instr.vu_dest = dest;
+        instr.vu_field = field;
+        if (EmotionEngine::can_disassemble) printf("%s%s.%s vf%d,vf%d,vf%d\n", vuNames[(int)vu_op], fieldNames[(int)field], lanes, (op.full >> 6) & 0x1F, op.r_type.rd, op.r_type.rt);
+        return;
+    }
+    }
+}
+
+// 0x12
+// QMFC2/QMTC2 move all 128 bits, CFC2/CTC2 the VU0 control registers
+void EmitCOP2(Opcode op)
+{
+    IRValue gpr(IRValue::Reg);
+    gpr.SetReg(op.r_type.rt);
+    IRValue fs(IRValue::Cop2Reg);
+    fs.SetReg(op.r_type.rd);
+    IRValue control(IRValue::Imm);
+    control.SetImm32Unsigned(op.r_type.rd);
+
+    switch (op.r_type.rs)
+    {
+    case 0x01:
+        EmitVU(VUOp::QMFC2, {gpr, fs});
+        break;
+    case 0x02:
+        EmitVU(VUOp::CFC2, {gpr, control});
+        break;
+    case 0x05:
+        EmitVU(VUOp::QMTC2, {fs, gpr});
+        break;
+    case 0x06:
+        EmitVU(VUOp::CTC2, {control, gpr});
+        break;
+    case 0x10 ... 0x1F:
+        EmitVUMacro(op);
+        return;
+    default:
+        printf("[EEJIT]: Cannot emit unknown COP2 opcode 0x%02x (0x%08x)\n", op.r_type.rs, op.full);
+        DecodeFailed();
+        return;
+    }
+
+    if (EmotionEngine::can_disassemble) printf("%s %s,%s%d\n", vuNames[(int)ir.back().vu_op], EmotionEngine::Reg(op.r_type.rt), op.r_type.rs & 2 ? "vi" : "vf", op.r_type.rd);
+}
+
+// Loads and stores all take rt, offset(rs)
+// Args[0] = rt, Args[1] = offset, Args[2] = base
+void EmitMemoryOp(Opcode op, const char* name, uint8_t type, IRInstruction::AccessSize size, bool is_unsigned = false)
 {
     IRValue imm(IRValue::Imm);
     imm.SetImm64(op.i_type.imm);
 
-    IRValue src(IRValue::Reg);
-    src.SetReg(op.i_type.rs);
+    IRValue base(IRValue::Reg);
+    base.SetReg(op.i_type.rs);
 
-    IRValue dst(IRValue::Reg);
-    dst.SetReg(op.i_type.rt);
+    IRValue rt(IRValue::Reg);
+    rt.SetReg(op.i_type.rt);
+
+    auto instr = IRInstruction::Build({rt, imm, base}, type);
+    instr.access_size = size;
+    instr.is_unsigned = is_unsigned;
+    ir.push_back(instr);
 
-    auto instr = IRInstruction::Build({dst, imm, src}, IRInstrs::STORE);
-    instr.access_size = IRInstruction::AccessSize::U32;
-    curBlock->instructions.push_back(instr);
+    if (EmotionEngine::can_disassemble) printf("%s %s, %d(%s)\n", name, EmotionEngine::Reg(op.i_type.rt), (int16_t)op.i_type.imm, EmotionEngine::Reg(op.i_type.rs));
+}
 
-    printf("sw %s, %d(%s)\n", EmotionEngine::Reg(op.i_type.rt), (int16_t)op.i_type.imm, EmotionEngine::Reg(op.i_type.rs));
+// LWL, LWR, LDL, LDR, SWL, SWR, SDL, SDR
+void EmitPartialMemoryOp(Opcode op, const char* name, uint8_t type, IRInstruction::AccessSize size, IRInstruction::Direction direction)
+{
+    EmitMemoryOp(op, name, type, size);
+    ir.back().is_partial = true;
+    ir.back().direction = direction;
 }
 
-// 0x3F
-void EmitSD(Opcode op)
+// LWC1 and SWC1, rt is an FPR, and LQC2 and SQC2 where it's a VF register
+void EmitFloatMemoryOp(Opcode op, const char* name, uint8_t type, IRInstruction::AccessSize size = IRInstruction::U32)
 {
     IRValue imm(IRValue::Imm);
     imm.SetImm64(op.i_type.imm);
 
-    IRValue src(IRValue::Reg);
-    src.SetReg(op.i_type.rs);
+    IRValue base(IRValue::Reg);
+    base.SetReg(op.i_type.rs);
 
-    IRValue dst(IRValue::Reg);
-    dst.SetReg(op.i_type.rt);
+    IRValue ft(size == IRInstruction::U128 ? IRValue::Cop2Reg : IRValue::Cop1Reg);
+    ft.SetReg(op.i_type.rt);
+
+    auto instr = IRInstruction::Build({ft, imm, base}, type);
+    instr.access_size = size;
+    ir.push_back(instr);
+
+    if (EmotionEngine::can_disassemble) printf("%s %s%d, %d(%s)\n", name, size == IRInstruction::U128 ? "vf" : "f", op.i_type.rt, (int16_t)op.i_type.imm, EmotionEngine::Reg(op.i_type.rs));
+}
+
+// Emits any of the load/store opcodes, returns false for anything else
+bool EmitLoadStore(Opcode op)
+{
+    using AS = IRInstruction::AccessSize;
+    using Dir = IRInstruction::Direction;
 
-    auto instr = IRInstruction::Build({dst, imm, src}, IRInstrs::STORE);
-    instr.access_size = IRInstruction::AccessSize::U64;
-    curBlock->instructions.push_back(instr);
+    switch (op.opcode)
+    {
+    case 0x1A: EmitPartialMemoryOp(op, "ldl", LOAD, AS::U64, Dir::Left); break;
+    case 0x1B: EmitPartialMemoryOp(op, "ldr", LOAD, AS::U64, Dir::Right); break;
+    case 0x1E: EmitMemoryOp(op, "lq", LOAD, AS::U128); break;
+    case 0x1F: EmitMemoryOp(op, "sq", STORE, AS::U128); break;
+    case 0x20: EmitMemoryOp(op, "lb", LOAD, AS::U8); break;
+    case 0x21: EmitMemoryOp(op, "lh", LOAD, AS::U16); break;
+    case 0x22: EmitPartialMemoryOp(op, "lwl", LOAD, AS::U32, Dir::Left); break;
+    case 0x23: EmitMemoryOp(op, "lw", LOAD, AS::U32); break;
+    case 0x24: EmitMemoryOp(op, "lbu", LOAD, AS::U8, true); break;
+    case 0x25: EmitMemoryOp(op, "lhu", LOAD, AS::U16, true); break;
+    case 0x26: EmitPartialMemoryOp(op, "lwr", LOAD, AS::U32, Dir::Right); break;
+    case 0x27: EmitMemoryOp(op, "lwu", LOAD, AS::U32, true); break;
+    case 0x28: EmitMemoryOp(op, "sb", STORE, AS::U8); break;
+    case 0x29: EmitMemoryOp(op, "sh", STORE, AS::U16); break;
+    case 0x2A: EmitPartialMemoryOp(op, "swl", STORE, AS::U32, Dir::Left); break;
+    case 0x2B: EmitMemoryOp(op, "sw", STORE, AS::U32); break;
+    case 0x2C: EmitPartialMemoryOp(op, "sdl", STORE, AS::U64, Dir::Left); break;
+    case 0x2D: EmitPartialMemoryOp(op, "sdr", STORE, AS::U64, Dir::Right); break;
+    case 0x2E: EmitPartialMemoryOp(op, "swr", STORE, AS::U32, Dir::Right); break;
+    case 0x31: EmitFloatMemoryOp(op, "lwc1", LOAD); break;
+    case 0x36: EmitFloatMemoryOp(op, "lqc2", LOAD, AS::U128); break;
+    case 0x37: EmitMemoryOp(op, "ld", LOAD, AS::U64); break;
+    case 0x39: EmitFloatMemoryOp(op, "swc1", STORE); break;
+    case 0x3E: EmitFloatMemoryOp(op, "sqc2", STORE, AS::U128); break;
+    case 0x3F: EmitMemoryOp(op, "sd", STORE, AS::U64); break;
+    default:
+        return false;
+    }
 
-    printf("sd %s, %d(%s)\n", EmotionEngine::Reg(op.i_type.rt), (int16_t)op.i_type.imm, EmotionEngine::Reg(op.i_type.rs));
+    return true;
+}
+
+// Branches that can fall through, the block carries on past these
+bool IsConditionalBranch(Opcode op)
+{
+    switch (op.opcode)
+    {
+    case 0x04:
+    case 0x14:
+        return op.i_type.rs != 0 || op.i_type.rt != 0;
+    case 0x05:
+    case 0x15:
+        return true;
+    case 0x11:
+        return op.r_type.rs == 0x08;
+    }
+
+    return false;
 }
 
 bool IsBranch(Opcode op)
@@ -567,138 +1100,1159 @@ bool IsBranch(Opcode op)
             return false;
         }
         break;
+	case 0x02:
 	case 0x03:
+	case 0x04:
     case 0x05:
 	case 0x14:
 	case 0x15:
         return true;
+    case 0x11:
+        return op.r_type.rs == 0x08;
     }
 
     return false;
 }
 
 bool branchDelayed = false;
+bool blockEnding = false;
+
+int EEJit::max_block_instrs = 128;
+std::string EEJit::cache_dir;
+EEJit::PerfOutput EEJit::perf_output = EEJit::PerfOutput::None;
+std::string EEJit::symbol_file;
+bool EEJit::traces = true;
+
+// Traces
+// Once the interpreter has run a block often enough to promote it, its
+// branch counts say which way the hot path goes. Decoding follows direct
+// jumps the interpreter ran, and conditional branches it saw taken more
+// often than not, into their targets, so the whole path is one block and
+// its guest registers stay in host registers all the way. A conditional
+// branch that's followed leaves the block on its not taken edge instead
+// Each edge followed starts another span of guest code. Nothing that's
+// already in the trace is followed into, loops stay side exits
+uint32_t spanStart;
+// Where decoding carries on after the current delay slot, if the branch
+// before it is being followed
+bool following = false;
+uint32_t followTarget;
+int maxSpans = MAX_BLOCK_SPANS;
+// The trace ran out of instructions partway into a span it followed
+bool cutShort;
+
+// Reads an instruction for the decoder. Code only runs from RAM, BIOS and
+// scratchpad, which can be read without side effects, so the compiler thread
+// never ends up in an MMIO handler
+bool FetchInstruction(uint32_t addr, uint32_t& instr)
+{
+    if (!EEInterpreter::IsPlainMemory(addr))
+        return false;
 
-// Compile and dispatch `cycles` instructions
-// If we encounter a branch, return that as the true number of cycles
-int EEJit::Clock(int cycles)
+    instr = Bus::Read32(addr);
+    return true;
+}
+
+// Instruction words the current block was decoded from
+std::vector<uint32_t> fetched;
+
+bool AbortBlock()
 {
-    curBlock = EEJitX64::GetBlockForAddr(EmotionEngine::GetState()->pc);
-    if (curBlock)
+    ir.Reset();
+    branchDelayed = false;
+    blockEnding = false;
+    following = false;
+    return false;
+}
+
+bool InTrace(EEJitX64::TranslatedBlock& block, uint32_t addr, uint32_t end)
+{
+    for (auto& span : block.spans)
     {
+        if (addr >= span.addr && addr < span.addr + span.size)
+            return true;
     }
-    else
+    return addr >= spanStart && addr < end;
+}
+
+// Decide whether the trace follows the branch at `branch_pc` into its target
+bool FollowBranch(EEJitX64::TranslatedBlock& block, uint32_t branch_pc, Opcode op)
+{
+    if (!EEJit::traces || block.spans.size() + 2 > (size_t)maxSpans)
+        return false;
+
+    uint32_t target;
+    bool conditional = true;
+
+    switch (op.opcode)
+    {
+    case 0x02:
+    case 0x03:
+        target = ((branch_pc + 4) & 0xF0000000) | (op.j_type.target << 2);
+        conditional = false;
+        break;
+    case 0x04:
+    case 0x05:
+    case 0x14:
+    case 0x15:
+        target = branch_pc + 4 + ((int32_t)(int16_t)op.i_type.imm << 2);
+        conditional = op.opcode != 0x04 || op.i_type.rs || op.i_type.rt;
+        break;
+    case 0x11:
+        if (op.r_type.rs != 0x08)
+            return false;
+        target = branch_pc + 4 + ((int32_t)(int16_t)op.i_type.imm << 2);
+        break;
+    default:
+        // Register jumps can go anywhere
+        return false;
+    }
+
+    if (InTrace(block, target, branch_pc + 8) || !EEInterpreter::IsPlainMemory(target))
+        return false;
+
+    auto counts = EEInterpreter::GetBranchCounts(branch_pc);
+    if (conditional ? counts.taken <= counts.not_taken : !counts.taken)
+        return false;
+
+    following = true;
+    followTarget = target;
+    return true;
+}
+
+// Called after a delay slot, returns true if the block ends there
+bool EndDelaySlot(EEJitX64::TranslatedBlock& block, uint32_t& start)
+{
+    branchDelayed = false;
+
+    if (following)
     {
-        // Create a new block
-        curBlock = new Block();
-        curBlock->addr = EmotionEngine::GetState()->pc;
-        curBlock->instructions.clear();
-        curBlock->cycles = 0;
+        block.spans.push_back({spanStart, start - spanStart});
+        start = spanStart = followTarget;
+        following = false;
+    }
+
+    return blockEnding;
+}
+
+// Held while compiling a block, the decoder and translator state is shared
+// by both threads
+std::mutex compileLock;
 
-        uint32_t start = curBlock->addr;
+// Decode the guest code of the block starting at `pc` into `ir`
+bool DecodeSpans(uint32_t pc, EEJitX64::TranslatedBlock& block)
+{
+    decodeFailed = false;
+    fetched.clear();
+
+    block.addr = pc;
+    block.spans.clear();
+    spanStart = pc;
+    blockEnding = false;
 
-        EmitPrologue();
+    uint32_t start = block.addr;
 
-        int cycle = 0;
-        int instrs = 0;
-        for (; cycle < cycles && instrs < 12; cycle++, instrs++, curBlock->cycles++)
+    EmitPrologue();
+
+    int instrs = 0;
+    // A branch always takes its delay slot with it
+    for (; instrs < EEJit::max_block_instrs || branchDelayed; instrs++)
+    {
+        if (EmotionEngine::can_disassemble) printf("0x%08x:\t", start);
+        uint32_t instr;
+        if (!FetchInstruction(start, instr))
         {
-            printf("0x%08x:\t", start);
-            // TODO: Move this into its own assembly routine
-            uint32_t instr = Bus::Read32(start);
-            start += 4;
-
-            Opcode op;
-            op.full = instr;
-
-            if (!instr)
-            {
-                printf("nop\n");
-                curBlock->instructions.push_back(IRInstruction::Build({}, NOP));
-                if (branchDelayed)
-                {
-                    branchDelayed = false;
-                    break;
-                }
-                continue;
-            }
-
-            switch (op.opcode)
-            {
-            case 0x00:
-                EmitSpecial(op);
-                break;
-			case 0x03:
-				EmitJAL(op);
-				break;
-            case 0x04:
-                EmitBEQ(op);
-                break;
-            case 0x05:
-                EmitBNE(op);
-                break;
-            case 0x09:
-                EmitADDIU(op);
-                break;
-            case 0x0A:
-                EmitSLTI(op);
-                break;
-            case 0x0B:
-                EmitSLTIU(op);
-                break;
-			case 0x0C:
-				EmitANDI(op);
-				break;
-            case 0x0D:
-                EmitOri(op);
-                break;
-            case 0x0F:
-                EmitLUI(op);
-                break;
-            case 0x10:
-                EmitCOP0(op);
-                break;
-			case 0x14:
-				EmitBEQL(op);
-				break;
-			case 0x15:
-				EmitBNEL(op);
-				break;
-            case 0x2B:
-                EmitSW(op);
+            printf("[EEJIT]: Cannot fetch code from 0x%08x\n", start);
+            DecodeFailed();
+            return AbortBlock();
+        }
+        fetched.push_back(instr);
+        decodePc = start;
+        start += 4;
+
+        Opcode op;
+        op.full = instr;
+
+        if (!instr)
+        {
+            if (EmotionEngine::can_disassemble) printf("nop\n");
+            ir.push_back(IRInstruction::Build({}, NOP));
+            if (branchDelayed && EndDelaySlot(block, start))
                 break;
-            case 0x3F:
-                EmitSD(op);
+            continue;
+        }
+
+        switch (op.opcode)
+        {
+        case 0x00:
+            EmitSpecial(op);
+            break;
+		case 0x02:
+			EmitJ(op);
+			break;
+		case 0x03:
+			EmitJAL(op);
+			break;
+        case 0x04:
+            EmitBEQ(op);
+            break;
+        case 0x05:
+            EmitBNE(op);
+            break;
+        case 0x09:
+            EmitADDIU(op);
+            break;
+        case 0x0A:
+            EmitSLTI(op);
+            break;
+        case 0x0B:
+            EmitSLTIU(op);
+            break;
+		case 0x0C:
+			EmitANDI(op);
+			break;
+        case 0x0D:
+            EmitOri(op);
+            break;
+        case 0x0F:
+            EmitLUI(op);
+            break;
+        case 0x10:
+            EmitCOP0(op);
+            break;
+        case 0x11:
+            EmitCOP1(op);
+            break;
+        case 0x12:
+            EmitCOP2(op);
+            break;
+		case 0x14:
+			EmitBEQL(op);
+			break;
+		case 0x15:
+			EmitBNEL(op);
+			break;
+        case 0x1C:
+            EmitMMI(op);
+            break;
+        default:
+            if (EmitLoadStore(op))
                 break;
-            default:
-                printf("[EEJIT]: Cannot emit unknown opcode 0x%02x (0x%08x)\n", op.opcode, op.full);
-                exit(1);
-            }
-            
-            if (branchDelayed)
-            {
-                branchDelayed = false;
+            printf("[EEJIT]: Cannot emit unknown opcode 0x%02x (0x%08x)\n", op.opcode, op.full);
+            DecodeFailed();
+        }
+
+        if (decodeFailed)
+            return AbortBlock();
+        
+        if (branchDelayed)
+        {
+            if (EndDelaySlot(block, start))
                 break;
-            }
+            continue;
+        }
+
+        branchDelayed = IsBranch(op);
+        blockEnding = branchDelayed && !IsConditionalBranch(op);
 
-            branchDelayed = IsBranch(op);
+        if (branchDelayed && FollowBranch(block, start - 4, op))
+        {
+            ir.back().trace_taken = true;
+            blockEnding = false;
         }
+    }
 
-        // Emit epilogue
-        curBlock->instructions.push_back(IRInstruction::Build({}, IRInstrs::EPILOGUE));
-        // JIT the block into host code
+    cutShort = !blockEnding && !block.spans.empty() && start != spanStart;
+
+    // A trace that ran out of instructions right after following an edge
+    // has nothing in its last span
+    if (start != spanStart)
+        block.spans.push_back({spanStart, start - spanStart});
+
+    return true;
+}
+
+// Decode the block starting at `pc` into `ir` and optimize it
+// Blocks run up to the first unconditional branch and its delay slot, or up
+// to max_block_instrs, conditional branches become side exits. The block
+// shape never depends on the cycle budget, so every guest address has a
+// single translation
+// Returns false if a speculative compile ran into something it can't decode
+bool DecodeBlock(uint32_t pc, EEJitX64::TranslatedBlock& block)
+{
+    // A trace that runs out of instructions partway into code it followed
+    // leaves where no other block starts, and the straight line code after
+    // it gets translated all over again from there, shifted. Follow one edge
+    // fewer until it ends on a branch, or in its first span
+    for (maxSpans = MAX_BLOCK_SPANS; ; maxSpans--)
+    {
+        if (!DecodeSpans(pc, block))
+            return false;
+        if (!cutShort)
+            break;
+        ir.Reset();
+    }
+
+    block.size = fetched.size() * 4;
+    // Every instruction slot costs a cycle, the delay slot that ends the
+    // block included
+    block.cycles = fetched.size();
+    block.hash = EEJitX64::HashCode(fetched.data(), fetched.size());
+
+    // Emit epilogue
+    ir.push_back(IRInstruction::Build({}, IRInstrs::EPILOGUE));
+    EEJitOpt::Optimize(ir);
+    return true;
+}
+
+// Decode and translate the block starting at `pc`
+bool CompileBlock(uint32_t pc, EEJitX64::TranslatedBlock& block, bool speculative)
+{
+    std::lock_guard<std::mutex> lock(compileLock);
+
+    auto start = std::chrono::steady_clock::now();
+
+    speculating = speculative;
+    if (!DecodeBlock(pc, block))
+        return false;
+    if (block.spans.size() > 1)
+        EEJit::compiler_stats.traces++;
+
+    // JIT the block into host code
 #if EE_JIT == 64
-        EEJitX64::TranslateBlock(curBlock);
+    EEJitX64::TranslateBlock(block, ir);
 #endif
-        // Cache the block
-        EEJitX64::CacheBlock(curBlock);
+    block.ir_count = ir.size();
+    EEJitOpt::stats.guest_instrs += block.size / 4;
+    EEJitOpt::stats.host_bytes += block.code.size();
+    block.compile_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    ir.Reset();
+    return true;
+}
+
+static int GetGuestReg(IRValue& v)
+{
+    if (v.IsReg() || v.IsSpecial())
+        return v.GetReg();
+    if (v.IsCop0())
+        return v.GetReg() + COP0_OFFS;
+    return GuestRegister::NONE;
+}
+
+void IRInstruction::GetRegUsage(uint64_t& reads, uint64_t& writes, uint8_t* scalar_reads)
+{
+    uint8_t scalar = 0;
+    reads = writes = 0;
+
+    // GPRs read as 64 bits or less go through read(), ones read whole
+    // through readWide()
+    auto read = [&](int n)
+    {
+        reads |= 1ULL << GetGuestReg(args[n]);
+        if (args[n].IsReg())
+            scalar |= 1 << n;
+    };
+    auto readWide = [&](int n) { reads |= 1ULL << GetGuestReg(args[n]); };
+    auto write = [&](int n) { writes |= 1ULL << GetGuestReg(args[n]); };
+
+    switch (instr)
+    {
+    case MOVE:
+        read(1);
+        write(0);
+        break;
+    case SLT:
+    case OR:
+    case ADD:
+    case AND:
+    case SHIFT:
+        read(1);
+        read(2);
+        write(0);
+        break;
+    case FPU:
+        // FPRs live in the processor state, only CTC1 reads a GPR and CFC1
+        // writes one
+        read(1);
+        read(2);
+        write(0);
+        break;
+    case VU:
+        // So do the VF registers, in VU0's state. QMTC2 takes all 128 bits
+        if (vu_op == VUOp::QMTC2)
+            readWide(1);
+        else
+            read(1);
+        read(2);
+        write(0);
+        break;
+    case BRANCH:
+        // BC1T/BC1F test the C bit, which isn't tracked
+        read(0);
+        read(1);
+        break;
+    case JUMP:
+        if (args.size() == 2)
+        {
+            read(1);
+            write(0);
+        }
+        else
+        {
+            read(0);
+            if (should_link)
+                writes |= 1ULL << REG_RA;
+        }
+        break;
+    case STORE:
+        // SQ stores all 128 bits, SWC1 and SQC2 store a COP1/COP2 register
+        if (access_size == U128)
+            readWide(0);
+        else
+            read(0);
+        read(2);
+        break;
+    case LOAD:
+        read(2);
+        // Partial loads merge into the old value
+        if (is_partial)
+            readWide(0);
+        write(0);
+        break;
+    case MULT:
+        read(1);
+        read(2);
+        write(0);
+        writes |= 1ULL << (is_mmi_divmul ? LO1 : LO);
+        writes |= 1ULL << (is_mmi_divmul ? HI1 : HI);
+        break;
+    case DIV:
+        // args[0] is only there for the disassembly, nothing is written to it
+        read(1);
+        read(2);
+        writes |= 1ULL << (is_mmi_divmul ? LO1 : LO);
+        writes |= 1ULL << (is_mmi_divmul ? HI1 : HI);
+        break;
+    case MMI:
+        readWide(1);
+        readWide(2);
+        write(0);
+        // HI and LO are used from the processor state, this only keeps them
+        // from being dropped as dead before that
+        if (MMIUsesHiLo(mmi_op))
+            reads |= (1ULL << LO) | (1ULL << HI) | (1ULL << LO1) | (1ULL << HI1);
+        break;
+    }
+
+    // $zero is a constant, immediates map to it too
+    reads &= ~1ULL;
+    writes &= ~1ULL;
+    if (scalar_reads)
+        *scalar_reads = scalar;
+}
+
+const char* IRName(uint8_t instr)
+{
+    static const char* names[] = {"nop", "prologue", "epilogue", "move", "slt", "branch", "or", "jump",
+        "add", "store", "load", "and", "shift", "mult", "div", "break", "mmi", "fpu", "vu"};
+    return instr < sizeof(names) / sizeof(names[0]) ? names[instr] : "?";
+}
+
+void PrintIRValue(IRValue& v)
+{
+    switch (v.type)
+    {
+    case IRValue::Imm: printf("0x%lx", (unsigned long)v.GetImm64()); break;
+    case IRValue::Reg: printf("%s", EmotionEngine::Reg(v.GetReg())); break;
+    case IRValue::Cop0Reg: printf("cop0r%d", v.GetReg()); break;
+    case IRValue::Cop1Reg: printf("f%d", v.GetReg()); break;
+    case IRValue::Cop2Reg: printf("vf%d", v.GetReg()); break;
+    case IRValue::Special: printf("special%d", v.GetReg()); break;
+    default: printf("?"); break;
+    }
+}
+
+// Decode the block at `pc` again and print its IR as the backend gets it
+void PrintBlockIR(uint32_t pc)
+{
+    std::lock_guard<std::mutex> lock(compileLock);
+
+    static EEJitX64::TranslatedBlock block;
+    speculating = true;
+    if (!DecodeBlock(pc, block))
+    {
+        printf("[EEJIT]: Couldn't decode 0x%08x again\n", pc);
+        return;
+    }
+
+    for (auto& i : ir)
+    {
+        printf("    %s", IRName(i.instr));
+        for (size_t n = 0; n < i.args.size(); n++)
+        {
+            printf(n ? ", " : " ");
+            PrintIRValue(i.args[n]);
+        }
+        if (i.instr == BRANCH)
+            printf(" (cond %d%s%s)", i.b_type, i.is_likely ? ", likely" : "", i.is_idle_loop ? ", idle" : "");
+        if (i.instr == LOAD || i.instr == STORE)
+            printf(" (size %d%s%s)", i.access_size, i.is_unsigned ? ", unsigned" : "", i.is_partial ? ", partial" : "");
+        if (i.instr == JUMP && i.should_link)
+            printf(" (link)");
+        if (i.instr == MMI)
+            printf(" (%s)", mmiNames[(int)i.mmi_op]);
+        if (i.instr == FPU)
+            printf(" (%s)", fpuNames[(int)i.fpu_op]);
+        if (i.instr == VU)
+            printf(" (%s, dest 0x%x, field %d)", vuNames[(int)i.vu_op], i.vu_dest, (int)i.vu_field);
+        if (i.trace_taken)
+            printf(" (followed)");
+        printf("\n");
+    }
+
+    ir.Reset();
+}
+
+int EEJit::prefetch_depth = 2;
+int EEJit::promote_threshold = 16;
+
+// Background compilation
+// Blocks that a block can jump straight to are likely to run soon, so as
+// blocks get installed their successors are queued for a compiler thread, up
+// to prefetch_depth jumps ahead of code that actually ran. The compiler
+// thread only decodes and translates, installing into the code cache and
+// the lookup table is left to the emulation thread, which does it once the
+// dispatcher misses on the block. Without the compiler thread or the
+// interpreter tier, anything that wasn't compiled ahead of time is compiled
+// on the spot, like before
+struct CompiledBlock
+{
+    EEJitX64::TranslatedBlock block;
+    int depth; // Jumps away from code that ran
+};
+
+std::mutex queueLock;
+std::condition_variable queueCv;
+std::condition_variable compiledCv;
+std::deque<std::pair<uint32_t, int>> queue;
+std::unordered_map<uint32_t, CompiledBlock> compiled;
+// Compiled since the emulation thread last looked, their successors get
+// queued in turn
+std::vector<uint32_t> finished;
+// Queued, being compiled, or compiled and waiting
+std::unordered_set<uint32_t> requested;
+bool compiling = false;
+uint32_t compilingAddr;
+bool stopCompiler = false;
+std::thread compilerThread;
+// Blocks it couldn't compile ahead, which are compiled on the spot instead
+std::vector<uint32_t> failed;
+// Bumped every time the compiler thread is done with a block. Until it
+// moves, a miss on a block that's already been asked for has nothing new to
+// find, and skips the queue lock instead of starving the compiler thread of it
+std::atomic<uint64_t> compilerDone;
+
+EEJit::CompilerStats EEJit::compiler_stats;
+
+void CompilerThread()
+{
+    std::unique_lock<std::mutex> lock(queueLock);
+
+    while (true)
+    {
+        queueCv.wait(lock, [] { return stopCompiler || !queue.empty(); });
+        if (stopCompiler)
+            return;
+
+        auto [addr, depth] = queue.front();
+        queue.pop_front();
+        compiling = true;
+        compilingAddr = addr;
+        lock.unlock();
+
+        CompiledBlock result;
+        result.depth = depth;
+        bool ok = CompileBlock(addr, result.block, true);
+
+        lock.lock();
+        compiling = false;
+        compilerDone++;
+        if (ok)
+        {
+            compiled[addr] = std::move(result);
+            finished.push_back(addr);
+            EEJit::compiler_stats.compiled_ahead++;
+        }
+        else
+        {
+            requested.erase(addr);
+            failed.push_back(addr);
+        }
+        compiledCv.notify_all();
+    }
+}
+
+void StopCompiler()
+{
+    if (!compilerThread.joinable() || compilerThread.get_id() == std::this_thread::get_id())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(queueLock);
+        stopCompiler = true;
+    }
+    queueCv.notify_all();
+    compilerThread.join();
+}
+
+// Cold code tier
+// Blocks start out in the interpreter, which counts how often each one is
+// entered. Once it's been entered promote_threshold times it gets compiled,
+// so code that only runs a few times (boot code, ROMDIR parsing, clearing
+// memory) is never translated at all. Halfway there a block counts as warm,
+// and only warm blocks are compiled ahead, to have them ready when they're
+// promoted. A promoted block that isn't ready yet goes to the front of the
+// compiler thread's queue and keeps being interpreted in the meantime, the
+// emulation thread never waits on a compile. Lockstep does wait, so which
+// tier runs what doesn't depend on timing there
+// Only touched on the emulation thread
+std::unordered_map<uint32_t, uint32_t> entryCounts;
+// Blocks the emulation thread asked the compiler thread for that haven't
+// come back yet, and compilerDone when it last looked at what came back
+std::unordered_set<uint32_t> askedFor;
+std::unordered_set<uint32_t> failedAhead;
+uint64_t compilerSeen;
+
+bool IsWarm(uint32_t addr)
+{
+    if (!EEJit::promote_threshold)
+        return true;
+
+    auto it = entryCounts.find(addr);
+    return it != entryCounts.end() && it->second >= (uint32_t)EEJit::promote_threshold / 2;
+}
+
+// Queue lock held
+void Request(uint32_t addr, int depth)
+{
+    if (depth > EEJit::prefetch_depth || requested.count(addr) || !IsWarm(addr) || EEJitX64::GetSharedBlock(addr))
+        return;
+
+    requested.insert(addr);
+    queue.push_back({addr, depth});
+    queueCv.notify_one();
+}
+
+// Queue lock held. For a promoted block, ahead of anything compiled ahead
+void RequestNow(uint32_t addr)
+{
+    if (requested.count(addr))
+    {
+        // Already being compiled, or done
+        auto it = std::find_if(queue.begin(), queue.end(), [=](auto& r) { return r.first == addr; });
+        if (it == queue.end())
+            return;
+        queue.erase(it);
+    }
+
+    requested.insert(addr);
+    queue.push_front({addr, 0});
+    queueCv.notify_one();
+}
+
+// Queue lock held
+void RequestSuccessors(Block* block)
+{
+    for (uint32_t i = 0; i < block->link_count; i++)
+    {
+        if (!block->links[i].inline_cache)
+            Request(block->links[i].target, 1);
+    }
+}
+
+// The dispatcher has no block for `pc`, find or make one. Returns false if
+// the block is still cold and should be interpreted instead
+bool HandleMiss(uint32_t pc)
+{
+    // Already translated through another alias of the same code, which
+    // counts as hot enough
+    if (EEJitX64::MapAlias(pc))
+    {
+        askedFor.erase(pc);
+        return true;
+    }
+
+    bool promote = true;
+    if (EEJit::promote_threshold)
+    {
+        uint32_t count = ++entryCounts[pc];
+        promote = count >= (uint32_t)EEJit::promote_threshold;
+        if (count == (uint32_t)EEJit::promote_threshold)
+            EEJit::compiler_stats.promoted++;
+    }
+
+    // Promoted blocks are compiled on the spot without the interpreter tier
+    // or the compiler thread, and lockstep needs them promoted on the same
+    // entry every run. Otherwise they're interpreted until they're ready
+    bool wait = !EEJit::promote_threshold || !compilerThread.joinable() || EEJit::lockstep;
+
+    bool idle = !promote && (EEJit::prefetch_depth <= 0 || !IsWarm(pc));
+    if (!wait && (idle || askedFor.count(pc)) && compilerDone.load(std::memory_order_acquire) == compilerSeen)
+    {
+        if (promote)
+            EEJit::compiler_stats.pending++;
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(queueLock);
+    compilerSeen = compilerDone;
+    EEInterpreter::PublishBranchCounts();
+
+    // Waiting for it is quicker than compiling it again
+    if (promote && wait)
+        compiledCv.wait(lock, [=] { return !compiling || compilingAddr != pc; });
+
+    for (auto addr : failed)
+    {
+        askedFor.erase(addr);
+        failedAhead.insert(addr);
+    }
+    failed.clear();
+
+    for (auto addr : finished)
+    {
+        askedFor.erase(addr);
+        auto it = compiled.find(addr);
+        if (it == compiled.end())
+            continue;
+        // Raced with a translation of an alias of it
+        if (EEJitX64::GetSharedBlock(addr))
+        {
+            compiled.erase(it);
+            requested.erase(addr);
+            continue;
+        }
+        for (auto& link : it->second.block.links)
+            Request(link.target, it->second.depth + 1);
+    }
+    finished.clear();
+
+    if (!promote)
+    {
+        // Get it compiled in the background if it's warm by now
+        if (EEJit::prefetch_depth > 0 && IsWarm(pc) && !compiled.count(pc) && !failedAhead.count(pc))
+        {
+            Request(pc, 0);
+            askedFor.insert(pc);
+        }
+        return false;
+    }
+
+    Block* block = nullptr;
+
+    auto it = compiled.find(pc);
+    if (it != compiled.end())
+    {
+        block = EEJitX64::InstallBlock(it->second.block);
+        if (block)
+            EEJit::compiler_stats.used++;
+        else
+            EEJit::compiler_stats.stale++;
+        compiled.erase(it);
+        requested.erase(pc);
+    }
+
+    // Warm starts reuse blocks translated by an earlier run
+    if (!block)
+        block = EEJitX64::LoadCachedBlock(pc);
+
+    if (!block && !wait && !failedAhead.count(pc))
+    {
+        RequestNow(pc);
+        askedFor.insert(pc);
+        EEJit::compiler_stats.pending++;
+        return false;
+    }
+
+    // A translation still on its way is dropped once it's done
+    std::erase_if(queue, [=](auto& r) { return r.first == pc; });
+    requested.erase(pc);
+    askedFor.erase(pc);
+    failedAhead.erase(pc);
+
+    if (!block)
+    {
+        lock.unlock();
+
+        static EEJitX64::TranslatedBlock translated;
+        CompileBlock(pc, translated, false);
+        EEJit::compiler_stats.compiled_now++;
+
+        lock.lock();
+        block = EEJitX64::InstallBlock(translated);
+        if (!block)
+        {
+            // A write to the code raced the translation, the interpreter
+            // runs it this time and the next miss compiles it again
+            EEJit::compiler_stats.raced++;
+            return false;
+        }
+    }
+
+    RequestSuccessors(block);
+    return true;
+}
+
+bool EEJit::lockstep = false;
+EEJit::LockstepStats EEJit::lockstep_stats;
+
+// Lockstep mode
+// Every translated block is checked against the interpreter as it runs. The
+// interpreter goes first, shadowing memory so the machine doesn't change,
+// then the processor state is put back and the translated block runs for
+// real, alone, since the dispatcher only gets one cycle. GPRs, COP0, HI/LO,
+// FPRs, VU0's registers, the next pc and the cycles charged have to match,
+// and so does every byte the interpreter stored to RAM or scratchpad. The
+// first difference stops the emulator with a report on the block
+// Slow, it's for trying out JIT changes, not for playing
+bool CompareState(const char* name, const void* jit, const void* ref, const void* before, size_t size)
+{
+    if (!memcmp(jit, ref, size))
+        return true;
+
+    auto print = [=](const void* v)
+    {
+        for (size_t i = size; i-- > 0;)
+            printf("%02x", ((const uint8_t*)v)[i]);
+    };
+
+    printf("    %-8s jit 0x", name);
+    print(jit);
+    printf(", interpreter 0x");
+    print(ref);
+    printf(", before 0x");
+    print(before);
+    printf("\n");
+    return false;
+}
+
+// The VU0 registers COP2 can change
+bool SameVUState(const VectorUnit::VU0::VectorState& a, const VectorUnit::VU0::VectorState& b)
+{
+    return !memcmp(a.vf, b.vf, sizeof(a.vf)) && a.acc.u128.u128 == b.acc.u128.u128
+        && !memcmp(a.vi, b.vi, sizeof(a.vi)) && a.i == b.i && a.q == b.q
+        && a.clipping.val == b.clipping.val && a.status == b.status && a.r == b.r;
+}
+
+void ReportDivergence(Block* block, const EmotionEngine::ProcessorState& before, const EmotionEngine::ProcessorState& ref,
+    const VectorUnit::VU0::VectorState& vu_before, const VectorUnit::VU0::VectorState& vu_ref, int jit_cycles, int ref_cycles)
+{
+    auto jit = EmotionEngine::GetState();
+
+    printf("[EEJIT]: Lockstep: block 0x%08x (%u bytes of guest code) diverged from the interpreter after %lu good blocks\n",
+        block->addr, block->size, (unsigned long)EEJit::lockstep_stats.checked);
+
+    CompareState("pc", &jit->pc, &ref.pc, &before.pc, sizeof(jit->pc));
+    if (jit_cycles != ref_cycles)
+        printf("    cycles   jit %d, interpreter %d\n", jit_cycles, ref_cycles);
+    for (int i = 0; i < 32; i++)
+        CompareState(EmotionEngine::Reg(i), &jit->regs[i], &ref.regs[i], &before.regs[i], sizeof(uint128_t));
+    CompareState("hi", &jit->hi, &ref.hi, &before.hi, sizeof(uint64_t));
+    CompareState("lo", &jit->lo, &ref.lo, &before.lo, sizeof(uint64_t));
+    CompareState("hi1", &jit->hi1, &ref.hi1, &before.hi1, sizeof(uint64_t));
+    CompareState("lo1", &jit->lo1, &ref.lo1, &before.lo1, sizeof(uint64_t));
+    CompareState("acc", &jit->acc, &ref.acc, &before.acc, sizeof(uint32_t));
+    CompareState("c", &jit->c, &ref.c, &before.c, sizeof(bool));
+    for (int i = 0; i < 32; i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "cop0r%d", i);
+        CompareState(name, &jit->cop0_regs[i], &ref.cop0_regs[i], &before.cop0_regs[i], sizeof(uint32_t));
+        snprintf(name, sizeof(name), "f%d", i);
+        CompareState(name, &jit->fprs[i], &ref.fprs[i], &before.fprs[i], sizeof(uint32_t));
+    }
+
+    auto& vu = VectorUnit::VU0::vu0_state;
+    for (int i = 0; i < 32; i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "vf%d", i);
+        CompareState(name, &vu.vf[i], &vu_ref.vf[i], &vu_before.vf[i], sizeof(uint128_t));
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), "vi%d", i);
+        CompareState(name, &vu.vi[i], &vu_ref.vi[i], &vu_before.vi[i], sizeof(uint16_t));
+    }
+    CompareState("vuacc", &vu.acc, &vu_ref.acc, &vu_before.acc, sizeof(uint128_t));
+    CompareState("i", &vu.i, &vu_ref.i, &vu_before.i, sizeof(uint32_t));
+    CompareState("q", &vu.q, &vu_ref.q, &vu_before.q, sizeof(uint32_t));
+    CompareState("clip", &vu.clipping.val, &vu_ref.clipping.val, &vu_before.clipping.val, sizeof(uint32_t));
+    CompareState("status", &vu.status, &vu_ref.status, &vu_before.status, sizeof(uint32_t));
+    CompareState("r", &vu.r, &vu_ref.r, &vu_before.r, sizeof(uint32_t));
+
+    for (auto& [phys, byte] : EEInterpreter::GetShadowMemory())
+    {
+        uint8_t value = Bus::Read8(byte.addr);
+        if (value != byte.value)
+            printf("    mem 0x%08x jit 0x%02x, interpreter 0x%02x\n", byte.addr, value, byte.value);
+    }
+
+    printf("[EEJIT]: Guest code and IR:\n");
+    PrintBlockIR(block->addr);
+
+    std::ofstream file("lockstep.out", std::ios::binary);
+    file.write((const char*)block->entryPoint, block->host_size);
+    printf("[EEJIT]: %u bytes of host code at %p written to lockstep.out\n", block->host_size, block->entryPoint);
+
+    exit(1);
+}
+
+// Runs `block` both ways, returns the cycles it took
+int RunLockstep(Block* block)
+{
+    auto state = EmotionEngine::GetState();
+    EmotionEngine::ProcessorState before = *state;
+    auto vu_before = VectorUnit::VU0::vu0_state;
+
+    // A block shared with another alias runs its spans through this one
+    GuestSpan spans[MAX_BLOCK_SPANS];
+    for (uint32_t i = 0; i < block->span_count; i++)
+        spans[i] = {block->spans[i].addr + (state->pc - block->addr), block->spans[i].size};
+
+    EEInterpreter::BeginShadow();
+    int ref_cycles = EEInterpreter::RunBlock(EEJit::max_block_instrs, spans, block->span_count);
+    EEInterpreter::EndShadow();
+    EmotionEngine::ProcessorState ref = *state;
+    auto vu_ref = VectorUnit::VU0::vu0_state;
+
+    // The block can invalidate itself
+    Block info = *block;
+
+    *state = before;
+    VectorUnit::VU0::vu0_state = vu_before;
+    state->cycles_left = 1;
+    if (EEJitX64::Dispatch() != EEJitX64::DispatchExit::OutOfCycles)
+    {
+        printf("[EEJIT]: Lockstep: dispatcher didn't run block 0x%08x\n", info.addr);
+        exit(1);
+    }
+    int jit_cycles = 1 - state->cycles_left;
+
+    // What it did depends on IO the interpreter couldn't read
+    if (EEInterpreter::ShadowReadIO())
+    {
+        EEJit::lockstep_stats.unverifiable++;
+        return jit_cycles;
+    }
+
+    bool same = jit_cycles == ref_cycles && state->pc == ref.pc
+        && !memcmp(state->regs, ref.regs, sizeof(ref.regs))
+        && !memcmp(state->cop0_regs, ref.cop0_regs, sizeof(ref.cop0_regs))
+        && !memcmp(state->fprs, ref.fprs, sizeof(ref.fprs))
+        && state->hi == ref.hi && state->lo == ref.lo && state->hi1 == ref.hi1 && state->lo1 == ref.lo1
+        && state->acc.u == ref.acc.u && state->c == ref.c
+        && SameVUState(VectorUnit::VU0::vu0_state, vu_ref);
+
+    for (auto& [phys, byte] : EEInterpreter::GetShadowMemory())
+        same = same && Bus::Read8(byte.addr) == byte.value;
+
+    if (!same)
+        ReportDivergence(&info, before, ref, vu_before, vu_ref, jit_cycles, ref_cycles);
+
+    EEJit::lockstep_stats.checked++;
+    EEJit::lockstep_stats.stores += EEInterpreter::GetShadowStores();
+    return jit_cycles;
+}
+
+// Clock for lockstep mode, one block at a time with the interrupt check the
+// dispatcher would do before each
+int ClockLockstep(int cycles)
+{
+    auto state = EmotionEngine::GetState();
+    int executed = 0;
+
+    do
+    {
+        EmotionEngine::CheckForInterrupt();
+
+        Block* block = EEJitX64::GetBlockForAddr(state->pc);
+        if (!block && HandleMiss(state->pc))
+            block = EEJitX64::GetBlockForAddr(state->pc);
+
+        if (block)
+            executed += RunLockstep(block);
+        else
+        {
+            EEJit::compiler_stats.interpreted++;
+            executed += EEInterpreter::RunBlock(EEJit::max_block_instrs);
+        }
+    } while (executed < cycles);
+
+    state->cycles_left = cycles - executed;
+    return executed;
+}
+
+// Block stats
+// Records live in a deque so translated code can count into them through a
+// fixed address. They're only added and written on the emulation thread
+bool EEJit::block_stats = false;
+bool EEJit::profile_blocks = false;
+std::string EEJit::stats_file;
+
+std::deque<EEJit::BlockStats> blockStats;
+std::unordered_map<uint32_t, EEJit::BlockStats*> latestStats;
+volatile sig_atomic_t statsRequested = 0;
+
+EEJit::BlockStats* EEJit::AddBlockStats(const Block& block, uint32_t ir_count, uint32_t cold_size, uint64_t compile_ns, bool cached)
+{
+    if (!block_stats)
+        return nullptr;
+
+    auto& stats = blockStats.emplace_back();
+    stats.addr = block.addr;
+    stats.span_count = block.span_count;
+    for (uint32_t i = 0; i < block.span_count; i++)
+        stats.spans[i] = block.spans[i];
+    stats.guest_size = block.size;
+    stats.ir_count = ir_count;
+    stats.host_size = block.host_size;
+    stats.cold_size = cold_size;
+    stats.compile_ns = compile_ns;
+    stats.cached = cached;
+    stats.live = true;
+
+    latestStats[block.addr] = &stats;
+    return &stats;
+}
+
+std::vector<EEJit::BlockStats> EEJit::GetBlockStats()
+{
+    return std::vector<BlockStats>(blockStats.begin(), blockStats.end());
+}
+
+const EEJit::BlockStats* EEJit::FindBlockStats(uint32_t addr)
+{
+    auto it = latestStats.find(addr);
+    return it != latestStats.end() ? it->second : nullptr;
+}
+
+bool EEJit::WriteBlockStats(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file)
+    {
+        printf("[EEJIT]: Couldn't write block stats to %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    static const char* exitNames[] = {"static", "side", "return", "indirect"};
+    bool csv = path.size() >= 4 && !path.compare(path.size() - 4, 4, ".csv");
+
+    if (csv)
+    {
+        fprintf(file, "addr,spans,guest_size,ir_count,host_size,cold_size,compile_ns,cached,live,executions");
+        for (auto name : exitNames)
+            fprintf(file, ",exit_%s", name);
+        fprintf(file, "\n");
+    }
+    else
+        fprintf(file, "[\n");
+
+    for (size_t n = 0; n < blockStats.size(); n++)
+    {
+        auto& b = blockStats[n];
+
+        // Spans as addr:size, separated by spaces
+        std::string spans;
+        for (uint32_t i = 0; i < b.span_count; i++)
+        {
+            char span[32];
+            snprintf(span, sizeof(span), "%s0x%08x:%u", i ? " " : "", b.spans[i].addr, b.spans[i].size);
+            spans += span;
+        }
+
+        if (csv)
+        {
+            fprintf(file, "0x%08x,%s,%u,%u,%u,%u,%lu,%d,%d,%lu", b.addr, spans.c_str(), b.guest_size, b.ir_count,
+                b.host_size, b.cold_size, (unsigned long)b.compile_ns, b.cached, b.live, (unsigned long)b.executions);
+            for (int i = 0; i < (int)ExitKind::Count; i++)
+                fprintf(file, ",%lu", (unsigned long)b.exits[i]);
+            fprintf(file, "\n");
+            continue;
+        }
+
+        fprintf(file, "  {\"addr\": \"0x%08x\", \"spans\": \"%s\", \"guest_size\": %u, \"ir_count\": %u, "
+            "\"host_size\": %u, \"cold_size\": %u, \"compile_ns\": %lu, \"cached\": %s, \"live\": %s, "
+            "\"executions\": %lu, \"exits\": {", b.addr, spans.c_str(), b.guest_size, b.ir_count, b.host_size,
+            b.cold_size, (unsigned long)b.compile_ns, b.cached ? "true" : "false", b.live ? "true" : "false",
+            (unsigned long)b.executions);
+        for (int i = 0; i < (int)ExitKind::Count; i++)
+            fprintf(file, "%s\"%s\": %lu", i ? ", " : "", exitNames[i], (unsigned long)b.exits[i]);
+        fprintf(file, "}}%s\n", n + 1 < blockStats.size() ? "," : "");
     }
-    // Run it
-    curBlock->entryPoint(EmotionEngine::GetState(), curBlock->addr);
 
-	printf("Block returned at pc = 0x%08x\n", EmotionEngine::GetState()->pc);
+    if (!csv)
+        fprintf(file, "]\n");
 
-    return curBlock->cycles;
+    fclose(file);
+    printf("[EEJIT]: %zu block records written to %s\n", blockStats.size(), path.c_str());
+    return true;
+}
+
+// SIGUSR1 asks for the stats, they're written once the emulation thread
+// comes back out of translated code
+void RequestBlockStats(int)
+{
+    statsRequested = 1;
+}
+
+void CheckBlockStatsRequest()
+{
+    if (!statsRequested)
+        return;
+
+    statsRequested = 0;
+    if (!EEJit::stats_file.empty())
+        EEJit::WriteBlockStats(EEJit::stats_file);
+}
+
+// Run guest code for `cycles` cycles, interpreting blocks until they get hot
+// Linked blocks keep running until the budget is used up, so the returned
+// number of cycles actually executed can overshoot it by up to one block
+int EEJit::Clock(int cycles)
+{
+    if (lockstep)
+        return ClockLockstep(cycles);
+
+    auto state = EmotionEngine::GetState();
+    state->cycles_left = cycles;
+
+    CheckBlockStatsRequest();
+
+    while (true)
+    {
+        switch (EEJitX64::Dispatch())
+        {
+        case EEJitX64::DispatchExit::OutOfCycles:
+            return cycles - state->cycles_left;
+        case EEJitX64::DispatchExit::Interrupt:
+            EmotionEngine::CheckForInterrupt();
+            break;
+        case EEJitX64::DispatchExit::BlockMiss:
+            if (HandleMiss(state->pc))
+                break;
+
+            // Back to the dispatcher afterwards, which checks for
+            // interrupts before the next block, same as after a compiled one
+            EEJit::compiler_stats.interpreted++;
+            state->cycles_left -= EEInterpreter::RunBlock(max_block_instrs);
+            if (state->cycles_left <= 0)
+                return cycles - state->cycles_left;
+            break;
+        }
+    }
 }
 
 void EEJit::Initialize()
@@ -707,12 +2261,58 @@ void EEJit::Initialize()
     EEJitX64::Initialize();
 #else
 #error Please use x64! x86/AARCH64 currently unsupported!
+#endif
+
+    {
+        // Anything compiled ahead for the last run is useless now
+        std::lock_guard<std::mutex> lock(queueLock);
+        queue.clear();
+        compiled.clear();
+        finished.clear();
+        requested.clear();
+    }
+    entryCounts.clear();
+    EEInterpreter::profile_branches = traces && promote_threshold > 0;
+
+    block_stats |= profile_blocks;
+    if (block_stats)
+        signal(SIGUSR1, RequestBlockStats);
+
+    if (prefetch_depth > 0 && !compilerThread.joinable())
+    {
+        compilerThread = std::thread(CompilerThread);
+        atexit(StopCompiler);
+    }
+}
+
+void EEJit::InvalidateRange(uint32_t addr, uint32_t size)
+{
+#if EE_JIT == 64
+    EEJitX64::InvalidateRange(addr, size);
 #endif
 }
 
 void EEJit::Dump()
 {
+    EEJitOpt::DumpStats();
+    printf("[EEJIT]: Compiler: %lu compiled ahead (%lu used, %lu stale), %lu compiled on a miss (%lu stale)\n",
+        (unsigned long)compiler_stats.compiled_ahead, (unsigned long)compiler_stats.used,
+        (unsigned long)compiler_stats.stale, (unsigned long)compiler_stats.compiled_now,
+        (unsigned long)compiler_stats.raced);
+    printf("[EEJIT]: Interpreter: %lu block entries (%lu instructions), %lu blocks promoted (%lu entries before they were ready), %lu traces\n",
+        (unsigned long)compiler_stats.interpreted, (unsigned long)EEInterpreter::stats.instructions,
+        (unsigned long)compiler_stats.promoted, (unsigned long)compiler_stats.pending, (unsigned long)compiler_stats.traces);
+    if (lockstep)
+        printf("[EEJIT]: Lockstep: %lu blocks checked (%lu stores), %lu read IO and couldn't be\n",
+            (unsigned long)lockstep_stats.checked, (unsigned long)lockstep_stats.stores,
+            (unsigned long)lockstep_stats.unverifiable);
+    printf("[EEJIT]: Idle loops: skipped ahead %lu times, %lu cycles\n",
+        (unsigned long)idle_stats.skips, (unsigned long)idle_stats.cycles);
 #if EE_JIT == 64
+    EEJitX64::DumpStats();
     EEJitX64::Dump();
 #endif
+
+    if (block_stats && !stats_file.empty())
+        WriteBlockStats(stats_file);
 }
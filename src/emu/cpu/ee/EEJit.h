@@ -1,6 +1,10 @@
 #pragma once
 
 #include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <string>
 #include <vector>
 
 enum IRInstrs
@@ -15,13 +19,77 @@ enum IRInstrs
     JUMP, // Either a jump to an imm, or else a jump to a register
 	ADD, // Add two pieces of data (reg+imm, reg+reg)
 	STORE, // Store memory op
+	LOAD, // Load memory op
 	AND, // Bitwise AND
 	SHIFT, // Shift logical, arithmetic, left, right, etc...
 	MULT, // Multiply
 	DIV, // Divide
 	BREAK, // We make this translate to ud2 to prevent BREAK from being executed, as it's purely used for asserts and the like, which we should never hit
+	MMI, // 128-bit SIMD on the GPRs, `mmi_op` says which
+	FPU, // COP1 arithmetic, conversions and compares, `fpu_op` says which
+	VU, // COP2, VU0 in macro mode, `vu_op` says which
 };
 
+// MMI instructions, args are rd, rs, rt. The shifts by an immediate come
+// last, and have it in place of rs
+enum class MMIOp : uint8_t
+{
+	PADDW, PSUBW, PCGTW, PMAXW, PADDH, PSUBH, PCGTH, PMAXH, PADDB, PSUBB, PCGTB,
+	PADDSW, PSUBSW, PEXTLW, PPACW, PADDSH, PSUBSH, PEXTLH, PPACH, PADDSB, PSUBSB, PEXTLB, PPACB,
+	PABSW, PCEQW, PMINW, PABSH, PCEQH, PMINH, PCEQB,
+	PADDUW, PSUBUW, PEXTUW, PADDUH, PSUBUH, PEXTUH, PADDUB, PSUBUB, PEXTUB,
+	PSLLVW, PSRLVW, PMFHI, PMFLO, PINTH, PMULTW, PCPYLD, PMADDW, PAND, PXOR, PMSUBW,
+	PEXEH, PREVH, PEXEW, PROT3W,
+	PSRAVW, PMTHI, PMTLO, PINTEH, PMULTUW, PCPYUD, PMADDUW, POR, PNOR, PEXCH, PCPYH, PEXCW,
+	PLZCW, PMFHL_LW, PMFHL_UW, PMFHL_SLW, PMFHL_LH, PMFHL_SH, PMTHL_LW,
+	PSLLH, PSRLH, PSRAH, PSLLW, PSRLW, PSRAW,
+};
+
+// COP1 instructions that aren't moves, loads, stores or branches. Args are
+// fd, fs, ft as COP1 registers. The ones ending in A write ACC and have no
+// fd, CFC1 is rt, fs and CTC1 is fs, rt with rt a GPR
+enum class FPUOp : uint8_t
+{
+	ADD, SUB, MUL, DIV, SQRT, RSQRT, ABS, MOV, NEG,
+	ADDA, SUBA, MULA, MADD, MSUB, MADDA, MSUBA, MAX, MIN,
+	CVT_W, CVT_S, C_F, C_EQ, C_LT, C_LE, CFC1, CTC1,
+};
+
+// COP2 instructions. The upper ones are fd, fs, ft as COP2 registers, with
+// `vu_dest` the lanes written and `vu_field` where ft comes from. The ones
+// ending in A write ACC and have no fd. ABS, MOVE, MR32, ITOF and FTOI are
+// ft, fs, with the fraction bits of ITOF/FTOI as an immediate after them,
+// and CLIP is fs, ft. QMFC2/CFC2 are rt, fs and QMTC2/CTC2 fs, rt, with fs an immediate for
+// the control registers. CALL runs anything else through vu.cpp
+enum class VUOp : uint8_t
+{
+	ADD, SUB, MUL, MADD, MSUB, MAX, MINI,
+	ADDA, SUBA, MULA, MADDA, MSUBA, OPMULA, OPMSUB,
+	ABS, MOVE, MR32, ITOF, FTOI, CLIP,
+	QMFC2, QMTC2, CFC2, CTC2, CALL,
+};
+
+// What ft is broadcast from, Vector if it's used as it is
+enum class VUField : uint8_t
+{
+	X, Y, Z, W, I, Q, Vector,
+};
+
+// MMI instructions that read or write the 128-bit HI and LO
+inline bool MMIUsesHiLo(MMIOp op)
+{
+	switch (op)
+	{
+	case MMIOp::PMFHI: case MMIOp::PMFLO: case MMIOp::PMTHI: case MMIOp::PMTLO:
+	case MMIOp::PMULTW: case MMIOp::PMADDW: case MMIOp::PMSUBW: case MMIOp::PMULTUW: case MMIOp::PMADDUW:
+	case MMIOp::PMFHL_LW: case MMIOp::PMFHL_UW: case MMIOp::PMFHL_SLW: case MMIOp::PMFHL_LH: case MMIOp::PMFHL_SH:
+	case MMIOp::PMTHL_LW:
+		return true;
+	default:
+		return false;
+	}
+}
+
 struct IRValue
 {
 public:
@@ -31,6 +99,7 @@ public:
 		Reg,
 		Cop0Reg,
 		Cop1Reg,
+		Cop2Reg, // A VU0 VF register
 		Float,
 		Special // Used for LO, HI, LO1, HI1
 	};
@@ -45,16 +114,19 @@ private:
 public:
 	Type type;
 public:
+	IRValue()
+	: type(Imm) {value.imm = 0;}
 	IRValue(Type type)
 	: type(type) {}
 
 	bool IsImm() {return type == Imm;}
 	bool IsCop0() {return type == Cop0Reg;}
 	bool IsCop1() {return type == Cop1Reg;}
+	bool IsCop2() {return type == Cop2Reg;}
 	bool IsReg() {return type == Reg;}
 	bool IsFloat() {return type == Float;}
 	bool IsSpecial() {return type == Special;}
-	// Can be used for guest, COP0, and COP1 registers
+	// Can be used for guest, COP0, COP1 and COP2 registers
 	void SetReg(uint32_t reg) {value.register_num = reg;}
 	void SetImm(uint16_t imm) {value.imm = (int32_t)(int16_t)imm;}
 	void SetImm64(uint16_t imm) {value.imm = (int64_t)(int16_t)imm;}
@@ -62,6 +134,7 @@ public:
 	void SetImm32(uint32_t imm) {value.imm = imm;}
 	void SetImmUnsigned(uint16_t imm) {value.imm = (uint32_t)imm;}
 	void SetImm32Unsigned(uint32_t imm) {value.imm = imm;}
+	void SetImm64Unsigned(uint64_t imm) {value.imm = imm;}
 	
 
 	uint32_t GetImm() {return value.imm;}
@@ -69,18 +142,39 @@ public:
 	uint32_t GetReg() {return value.register_num;}
 };
 
+// Arguments of an IR instruction, kept inline since there are never more than three
+struct IRArgs
+{
+	IRValue values[3];
+	uint8_t count = 0;
+
+	IRArgs() {}
+	IRArgs(std::initializer_list<IRValue> args)
+	{
+		for (auto& arg : args)
+			values[count++] = arg;
+	}
+
+	size_t size() const {return count;}
+	bool empty() const {return count == 0;}
+	IRValue& operator[](size_t i) {return values[i];}
+};
+
 struct IRInstruction
 {
 	// The IR instruction
 	uint8_t instr;
 	// Arguments are left -> right
-	std::vector<IRValue> args;
+	IRArgs args;
 
 	bool should_link = false;
 	bool is_logical = false;
 	bool is_unsigned = false;
 	bool is_likely = false;
 	bool is_mmi_divmul = false;
+	bool is_partial = false; // LWL, SDR, etc. `direction` says which half
+	bool is_idle_loop = false; // Branch back into a loop that only waits, see EEJitOpt::MarkIdleLoop
+	bool trace_taken = false; // The block carries on at the target, the other way out is the side exit
 
 	// Shift direction
 	enum Direction
@@ -124,7 +218,20 @@ struct IRInstruction
 		Size32
 	} size = Size32;
 
-	static IRInstruction Build(std::vector<IRValue> args, uint8_t i_type)
+	MMIOp mmi_op;
+	FPUOp fpu_op;
+	VUOp vu_op;
+	uint8_t vu_dest; // x is bit 3
+	VUField vu_field;
+
+	// Guest registers the instruction reads and writes as the backend
+	// translates it, bit n for GuestRegister n, so the GPRs are the low 32
+	// bits. $zero and immediates are never in them. Bit n of `scalar_reads`
+	// is set for every args[n] that's a GPR read as 64 bits or less, which
+	// a copy of that GPR's low half can stand in for
+	void GetRegUsage(uint64_t& reads, uint64_t& writes, uint8_t* scalar_reads = nullptr);
+
+	static IRInstruction Build(IRArgs args, uint8_t i_type)
 	{
 		IRInstruction i;
 		i.instr = i_type;
@@ -136,20 +243,205 @@ struct IRInstruction
 	uint32_t opcode;
 };
 
-typedef void (*blockEntry)(void* statePtr, uint32_t blockPC);
+// IR for the block being compiled. Instructions are bump allocated from a
+// buffer that Reset() rewinds once the block has been translated, so after
+// the first few blocks compiling doesn't allocate anything for IR
+class IRArena
+{
+public:
+	~IRArena() {delete[] data;}
+
+	void push_back(const IRInstruction& i)
+	{
+		if (count == capacity)
+			Grow();
+		data[count++] = i;
+	}
+
+	IRInstruction& operator[](size_t i) {return data[i];}
+	IRInstruction& back() {return data[count - 1];}
+	IRInstruction* begin() {return data;}
+	IRInstruction* end() {return data + count;}
+	size_t size() const {return count;}
+
+	void erase(IRInstruction* first, IRInstruction* last)
+	{
+		memmove((void*)first, (void*)last, (end() - last) * sizeof(IRInstruction));
+		count -= last - first;
+	}
+
+	void Reset() {count = 0;}
+private:
+	void Grow()
+	{
+		capacity = capacity ? capacity * 2 : 256;
+		IRInstruction* grown = new IRInstruction[capacity];
+		memcpy((void*)grown, (void*)data, count * sizeof(IRInstruction));
+		delete[] data;
+		data = grown;
+	}
+
+	IRInstruction* data = nullptr;
+	size_t count = 0, capacity = 0;
+};
+
+// Host code for a block, only ever entered from the dispatcher or a link
+typedef const uint8_t* blockEntry;
+
+// A patchable jump from the end of one block straight into another
+struct BlockLink
+{
+	uint32_t target;
+	uint8_t* patch; // rel32 operand of the jump
+	uint8_t* unlinked; // Where the jump goes while the target isn't compiled
+	bool inline_cache; // Goes wherever the exit last jumped to, `target` changes
+};
+
+// A run of contiguous guest code. Blocks are one, traces that follow hot
+// edges are a few, in the order they run
+struct GuestSpan
+{
+    uint32_t addr, size;
+};
+
+constexpr int MAX_BLOCK_SPANS = 4;
+
+namespace EEJit
+{
+struct BlockStats;
+}
 
+// What's kept of a block once it has been translated, the IR is gone by then
 struct Block
 {
     uint32_t addr, cycles;
-    std::vector<IRInstruction> instructions;
+    uint32_t size; // Bytes of guest code the block was translated from, all spans
+    GuestSpan spans[MAX_BLOCK_SPANS];
+    uint32_t span_count;
+    uint32_t host_size; // Bytes of hot host code, the slow paths are elsewhere
     blockEntry entryPoint;
+	BlockLink* links; // Patchable exits, link_count of them
+	uint32_t link_count;
+	EEJit::BlockStats* stats; // Null unless block stats are kept
 };
 
 namespace EEJit
 {
 
+// Upper bound on guest instructions per block
+extern int max_block_instrs;
+// Where translated blocks are kept between runs, empty to not keep them
+extern std::string cache_dir;
+
+// Tell Linux perf about translated blocks as they're installed, so host
+// time in them is put down to guest code: Map for /tmp/perf-<pid>.map,
+// JitDump for a jitdump with the code bytes, for perf inject
+enum class PerfOutput
+{
+    None, Map, JitDump,
+};
+
+extern PerfOutput perf_output;
+// Guest symbols to name blocks by in perf output, "address name" lines
+extern std::string symbol_file;
+// How many jumps ahead of running code the compiler thread works, 0 to
+// compile everything on the emulation thread when it's reached
+extern int prefetch_depth;
+// Times a block is entered through the interpreter before it's compiled,
+// 0 to compile everything the first time it's reached
+extern int promote_threshold;
+// Form traces: a block follows taken branches and jumps the interpreter saw
+// go that way most of the time into their targets, leaving the cold edge
+// as a side exit. Needs the interpreter tier for the branch counts
+extern bool traces;
+
+struct CompilerStats
+{
+    uint64_t compiled_ahead; // By the compiler thread
+    uint64_t used; // Compiled ahead, then reached
+    uint64_t stale; // Compiled ahead, but the code changed before it was reached
+    uint64_t compiled_now; // On the emulation thread, nothing had it ready
+    uint64_t raced; // Compiled on the emulation thread, but the code changed before it was installed
+    uint64_t interpreted; // Block entries run by the interpreter
+    uint64_t promoted; // Blocks that ran often enough to get compiled
+    uint64_t pending; // Entries of promoted blocks interpreted while they compile
+    uint64_t traces; // Compiled blocks made of more than one span
+};
+
+extern CompilerStats compiler_stats;
+
+// Check every translated block against the interpreter as it runs, and
+// stop at the first one that comes out different
+extern bool lockstep;
+
+struct LockstepStats
+{
+    uint64_t checked; // Blocks that matched
+    uint64_t stores; // Stores in them, IO included
+    uint64_t unverifiable; // Read IO, so the interpreter couldn't run them
+};
+
+extern LockstepStats lockstep_stats;
+
+struct IdleStats
+{
+    uint64_t skips; // Times an idle loop gave up the rest of the budget
+    uint64_t cycles; // Cycles skipped that way
+};
+
+extern IdleStats idle_stats;
+
+// Per block statistics, one record for every time a block is installed in
+// the code cache. Records stay around after their block is dropped, so a
+// block that keeps getting retranslated shows up as many
+extern bool block_stats;
+// Count block entries and the exits taken in the translated code itself,
+// for the execution counts in the block stats. Implies block_stats
+extern bool profile_blocks;
+// Where the block stats are written on exit, and on SIGUSR1. Ending in
+// .csv gets CSV, anything else JSON. Empty to only keep them in memory
+extern std::string stats_file;
+
+// Ways out of a block, as counted by profile_blocks
+enum class ExitKind
+{
+    Static, // A branch, jump or the end of the block, to a known address
+    Side, // The cold edge of a branch a trace follows
+    Return, // JR $ra
+    Indirect, // Any other jump to a register
+    Count,
+};
+
+struct BlockStats
+{
+    uint32_t addr;
+    GuestSpan spans[MAX_BLOCK_SPANS];
+    uint32_t span_count;
+    uint32_t guest_size; // Bytes, all spans
+    uint32_t ir_count; // 0 for blocks loaded from the translation cache
+    uint32_t host_size, cold_size;
+    uint64_t compile_ns; // Decoding, optimizing and translating, 0 if loaded
+    bool cached; // Loaded from the translation cache
+    bool live; // Still in the code cache
+    // Only counted with profile_blocks
+    uint64_t executions;
+    uint64_t exits[(int)ExitKind::Count];
+};
+
+// Record for a block that was just installed
+BlockStats* AddBlockStats(const Block& block, uint32_t ir_count, uint32_t cold_size, uint64_t compile_ns, bool cached);
+// Every record so far, in the order the blocks were installed
+std::vector<BlockStats> GetBlockStats();
+// The latest record for a block at `addr`, or nullptr
+const BlockStats* FindBlockStats(uint32_t addr);
+// Write the records to `path`, as CSV if it ends in .csv and JSON otherwise
+bool WriteBlockStats(const std::string& path);
+
 int Clock(int cycles);
 
+// Drop every block translated from guest memory in [addr, addr+size)
+void InvalidateRange(uint32_t addr, uint32_t size);
+
 void Initialize();
 void Dump();
 
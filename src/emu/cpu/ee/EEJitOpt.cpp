@@ -0,0 +1,460 @@
+#include "EEJitOpt.h"
+#include "EEJit.h"
+#include "EEInterpreter.h"
+#include <emu/memory/Bus.h>
+
+#include <cstdio>
+
+int EEJitOpt::enabled_passes = EEJitOpt::AllPasses;
+EEJitOpt::Stats EEJitOpt::stats;
+
+namespace EEJitOpt
+{
+
+// What's known about the current value of a guest GPR
+// Every write gives the register a new version, so the IR is treated as SSA
+// with one value per (register, version). A copy only stays valid while the
+// version of its source is the one it was copied from
+struct RegValue
+{
+    bool known;
+    uint64_t value;
+    int copy_of; // -1 if it isn't a copy of another register
+    uint32_t copy_version;
+};
+
+RegValue values[32];
+uint32_t versions[32];
+
+void Define(int reg)
+{
+    if (reg <= 0)
+        return;
+
+    versions[reg]++;
+    values[reg] = {false, 0, -1, 0};
+}
+
+bool GetConstant(IRValue& v, uint64_t& out)
+{
+    if (v.IsImm())
+    {
+        out = v.GetImm64();
+        return true;
+    }
+
+    if (!v.IsReg())
+        return false;
+
+    int reg = v.GetReg();
+    if (reg == 0)
+    {
+        out = 0;
+        return true;
+    }
+    if (!values[reg].known)
+        return false;
+
+    out = values[reg].value;
+    return true;
+}
+
+// Oldest register still holding the same value as `reg`
+int GetCopySource(int reg)
+{
+    if (reg <= 0 || values[reg].copy_of < 0)
+        return reg;
+    if (versions[values[reg].copy_of] != values[reg].copy_version)
+        return reg;
+    return values[reg].copy_of;
+}
+
+// Instructions that only write args[0], and can be dropped if nothing reads it
+bool IsPure(IRInstruction& i)
+{
+    switch (i.instr)
+    {
+    case MOVE:
+        return i.args[0].IsReg();
+    case SLT:
+    case OR:
+    case ADD:
+    case AND:
+    case SHIFT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Guest GPRs an instruction writes and reads, see IRInstruction::GetRegUsage
+uint32_t GetWrittenMask(IRInstruction& i)
+{
+    uint64_t reads, writes;
+    i.GetRegUsage(reads, writes);
+    return (uint32_t)writes;
+}
+
+uint32_t GetReadMask(IRInstruction& i)
+{
+    uint64_t reads, writes;
+    i.GetRegUsage(reads, writes);
+    return (uint32_t)reads;
+}
+
+// Result of a pure instruction whose inputs are all known
+bool Fold(IRInstruction& i, uint64_t& result)
+{
+    uint64_t a, b;
+
+    if (i.instr == MOVE)
+        return i.args[1].IsImm() && GetConstant(i.args[1], result);
+
+    if (!GetConstant(i.args[1], a) || !GetConstant(i.args[2], b))
+        return false;
+
+    switch (i.instr)
+    {
+    case OR:
+        result = a | b;
+        return true;
+    case AND:
+        result = a & b;
+        return true;
+    case ADD:
+        if (i.size == IRInstruction::Size32)
+            result = (int64_t)(int32_t)(a + b);
+        else
+            result = a + b;
+        return true;
+    case SLT:
+        result = i.is_unsigned ? a < b : (int64_t)a < (int64_t)b;
+        return true;
+    case SHIFT:
+        if (!i.is_logical)
+            return false;
+        if (i.direction == IRInstruction::Left)
+            result = (int64_t)(int32_t)((uint32_t)a << (b & 31));
+        else
+            result = (int64_t)(int32_t)((uint32_t)a >> (b & 31));
+        return true;
+    }
+
+    return false;
+}
+
+// Register `i` copies unchanged into args[0], or -1
+int GetCopiedReg(IRInstruction& i)
+{
+    if (i.instr == OR && i.args[2].IsImm() && i.args[2].GetImm64() == 0)
+        return i.args[1].GetReg();
+
+    if ((i.instr == OR || (i.instr == ADD && i.size == IRInstruction::Size64)) && i.args[2].IsReg())
+    {
+        if (i.args[1].GetReg() == 0)
+            return i.args[2].GetReg();
+        if (i.args[2].GetReg() == 0)
+            return i.args[1].GetReg();
+    }
+
+    return -1;
+}
+
+// Decide branches on known values, returns false if the rest of the block
+// can't be reached
+bool FoldBranch(IRArena& instrs, size_t idx)
+{
+    auto& i = instrs[idx];
+    uint64_t a, b;
+
+    if (i.b_type == IRInstruction::AL || !GetConstant(i.args[0], a) || !GetConstant(i.args[1], b))
+        return true;
+
+    bool taken;
+    switch (i.b_type)
+    {
+    case IRInstruction::EQ: taken = a == b; break;
+    case IRInstruction::NE: taken = a != b; break;
+    default: return true;
+    }
+
+    // A branch the trace follows goes on in the block when it's taken
+    if (i.trace_taken && taken)
+    {
+        i.b_type = IRInstruction::AL;
+        return true;
+    }
+
+    if (i.trace_taken)
+    {
+        // Always leaves through the side exit, which is just the end of the
+        // block now
+        if (i.is_likely)
+            instrs[idx + 1] = IRInstruction::Build({}, NOP);
+        i = IRInstruction::Build({}, NOP);
+        instrs.erase(instrs.begin() + idx + 2, instrs.end() - 1);
+        return false;
+    }
+
+    if (taken)
+    {
+        // Everything after the delay slot is dead
+        i.b_type = IRInstruction::AL;
+        instrs.erase(instrs.begin() + idx + 2, instrs.end() - 1);
+        return false;
+    }
+
+    // Never taken, the delay slot runs inline unless the branch is likely
+    if (i.is_likely)
+        instrs[idx + 1] = IRInstruction::Build({}, NOP);
+    i = IRInstruction::Build({}, NOP);
+    return true;
+}
+
+void PropagateValues(IRArena& instrs)
+{
+    for (int r = 0; r < 32; r++)
+    {
+        versions[r] = 0;
+        values[r] = {false, 0, -1, 0};
+    }
+
+    for (size_t idx = 0; idx < instrs.size(); idx++)
+    {
+        auto& i = instrs[idx];
+
+        uint64_t reads, writes;
+        uint8_t scalar_reads;
+        i.GetRegUsage(reads, writes, &scalar_reads);
+
+        if (enabled_passes & CopyPropagation)
+        {
+            // A copy only covers the low 64 bits, wider reads keep their
+            // register
+            for (size_t n = 0; n < i.args.size(); n++)
+            {
+                if (scalar_reads & (1 << n))
+                    i.args[n].SetReg(GetCopySource(i.args[n].GetReg()));
+            }
+        }
+
+        // Loads and stores from an address known at compile time, which is
+        // mostly LUI followed by ORI/ADDIU to reach an MMIO register, take
+        // it as an immediate
+        uint64_t base;
+        if ((enabled_passes & ConstantFolding) && (i.instr == LOAD || i.instr == STORE) && i.args[2].IsReg() && GetConstant(i.args[2], base))
+        {
+            IRValue imm(IRValue::Imm);
+            imm.SetImm32Unsigned(base);
+            i.args[2] = imm;
+        }
+
+        if (i.instr == BRANCH)
+        {
+            if ((enabled_passes & ConstantFolding) && !FoldBranch(instrs, idx))
+                return;
+            continue;
+        }
+
+        uint32_t written = (uint32_t)writes;
+
+        uint64_t result;
+        int dst = i.args.empty() ? 0 : i.args[0].GetReg();
+        bool folded = (enabled_passes & ConstantFolding) && IsPure(i) && dst && Fold(i, result);
+        int copied = IsPure(i) && dst ? GetCopiedReg(i) : -1;
+
+        if (folded && i.instr != MOVE)
+        {
+            IRValue rd(IRValue::Reg);
+            rd.SetReg(dst);
+            IRValue imm(IRValue::Imm);
+            imm.SetImm64Unsigned(result);
+
+            auto opcode = i.opcode;
+            i = IRInstruction::Build({rd, imm}, MOVE);
+            i.opcode = opcode;
+        }
+
+        // An OR of a register with itself and $zero changes nothing
+        if (copied == dst && !folded)
+            continue;
+
+        for (int r = 1; r < 32; r++)
+        {
+            if (written & (1u << r))
+                Define(r);
+        }
+
+        // The delay slot of a likely branch doesn't run on the fall-through
+        // path, so nothing it writes is known afterwards
+        if (idx > 0 && instrs[idx - 1].instr == BRANCH && instrs[idx - 1].is_likely && !instrs[idx - 1].trace_taken)
+            continue;
+
+        if (folded)
+        {
+            values[dst].known = true;
+            values[dst].value = result;
+        }
+        else if (copied >= 0 && (enabled_passes & CopyPropagation))
+        {
+            values[dst].copy_of = copied;
+            values[dst].copy_version = versions[copied];
+        }
+    }
+}
+
+// Walks the block backwards, tracking registers that are written again
+// before anything reads them. Every exit reads all of them
+void RemoveDeadStores(IRArena& instrs)
+{
+    uint32_t overwritten = 0;
+
+    for (size_t idx = instrs.size(); idx-- > 0;)
+    {
+        auto& i = instrs[idx];
+
+        switch (i.instr)
+        {
+        case EPILOGUE:
+        case BRANCH:
+        case JUMP:
+        case BREAK:
+            overwritten = 0;
+            break;
+        }
+
+        // The delay slot runs before the taken exit of its branch
+        if (idx > 0 && instrs[idx - 1].instr == BRANCH)
+            overwritten = 0;
+
+        if (IsPure(i) && i.args[0].GetReg() && (overwritten & (1u << i.args[0].GetReg())))
+        {
+            i = IRInstruction::Build({}, NOP);
+            continue;
+        }
+
+        overwritten |= GetWrittenMask(i);
+        overwritten &= ~GetReadMask(i);
+    }
+}
+
+// Loads an idle loop can poll: memory, and status registers reading doesn't
+// change. FIFOs, timers and the SIF mailboxes can return something new on
+// every read, or count the reads. The address has to be known at compile
+// time, PropagateValues has made the base an immediate if it is
+bool IsIdleSafeLoad(IRInstruction& i)
+{
+    if (!i.args[2].IsImm())
+        return false;
+
+    uint32_t addr = i.args[2].GetImm() + i.args[1].GetImm();
+    if (EEInterpreter::IsPlainMemory(addr))
+        return true;
+
+    switch (Translate(addr))
+    {
+    case 0x1000e000: // D_CTRL
+    case 0x1000e010: // D_STAT
+    case 0x1000e020: // D_PCR
+    case 0x1000f000: // INTC_STAT
+    case 0x1000f010: // INTC_MASK
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Instructions an idle loop can be made of. They only touch registers, or
+// read memory that nothing but the scheduler changes
+bool IsIdleSafe(IRInstruction& i)
+{
+    switch (i.instr)
+    {
+    case NOP:
+    case SLT:
+    case OR:
+    case ADD:
+    case AND:
+    case SHIFT:
+        return true;
+    case MOVE:
+        // Reading COP0 is fine too, Count only moves between dispatches.
+        // MTC1 writes an FPR, which isn't tracked
+        return i.args[0].IsReg();
+    case LOAD:
+        // LWC1 writes an FPR too
+        return i.args[0].IsReg() && IsIdleSafeLoad(i);
+    default:
+        return false;
+    }
+}
+
+// Find a loop at the start of the block that branches back to the block's
+// own start, polling INTC_STAT, DMAC or some flag in memory. If it writes
+// nothing but registers, and none of those carry over from one iteration to
+// the next, every iteration does the same thing until a load sees something
+// new. Nothing else runs while the EE is in the dispatcher, so that can't
+// happen before the scheduler gets to run, and the backend can skip to the
+// end of the cycle budget instead of going around
+void MarkIdleLoop(IRArena& instrs)
+{
+    // instrs[0] is the prologue, the instruction at idx is at addr + (idx-1)*4
+    size_t idx = 1;
+    while (idx < instrs.size() && IsIdleSafe(instrs[idx]))
+        idx++;
+
+    if (idx + 1 >= instrs.size() || instrs[idx].instr != BRANCH || !IsIdleSafe(instrs[idx + 1]))
+        return;
+
+    auto& branch = instrs[idx];
+    if ((int32_t)branch.args[2].GetImm() != -4 * (int32_t)idx)
+        return;
+
+    uint32_t written = 0;
+    for (size_t n = 1; n <= idx + 1; n++)
+        written |= GetWrittenMask(instrs[n]);
+
+    // Registers read before the loop writes them have to stay the same
+    uint32_t defined = 0;
+    for (size_t n = 1; n <= idx + 1; n++)
+    {
+        if (GetReadMask(instrs[n]) & written & ~defined)
+            return;
+        defined |= GetWrittenMask(instrs[n]);
+    }
+
+    branch.is_idle_loop = true;
+}
+
+size_t CountInstrs(IRArena& instrs)
+{
+    size_t count = 0;
+    for (auto& i : instrs)
+        count += i.instr != NOP;
+    return count;
+}
+
+void Optimize(IRArena& instrs)
+{
+    stats.ir_before += CountInstrs(instrs);
+
+    if (enabled_passes & (ConstantFolding | CopyPropagation))
+        PropagateValues(instrs);
+    // After the load addresses are resolved
+    if (enabled_passes & IdleLoops)
+        MarkIdleLoop(instrs);
+    if (enabled_passes & DeadStores)
+        RemoveDeadStores(instrs);
+
+    stats.ir_after += CountInstrs(instrs);
+}
+
+void DumpStats()
+{
+    printf("[EEJIT]: Optimizer: passes 0x%x, %lu guest instructions, %lu IR instructions (%lu before the passes), %lu bytes of host code (%.2f per guest instruction)\n",
+        enabled_passes, (unsigned long)stats.guest_instrs, (unsigned long)stats.ir_after,
+        (unsigned long)stats.ir_before, (unsigned long)stats.host_bytes,
+        stats.guest_instrs ? (double)stats.host_bytes / stats.guest_instrs : 0.0);
+}
+
+}
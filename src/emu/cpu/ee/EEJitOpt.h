@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+class IRArena;
+
+// IR passes run on a block between decoding and translation
+namespace EEJitOpt
+{
+
+enum Pass
+{
+    ConstantFolding = 1 << 0, // Constant propagation and folding, branches included
+    CopyPropagation = 1 << 1, // Read the original register instead of a copy of it
+    DeadStores = 1 << 2, // Drop register writes overwritten before the block exits
+    IdleLoops = 1 << 3, // Skip ahead to the next event in loops that only wait
+    AllPasses = ConstantFolding | CopyPropagation | DeadStores | IdleLoops,
+};
+
+// Passes that run, each one can be turned off with --jit-passes to measure
+// what it saves
+extern int enabled_passes;
+
+// What the passes come to, in the code they leave. Comparing runs with
+// different enabled_passes shows what each one saves
+struct Stats
+{
+    uint64_t guest_instrs; // In the blocks compiled
+    uint64_t ir_before, ir_after; // IR instructions going into the passes and coming out, NOPs left out
+    uint64_t host_bytes; // Host code translated from them, cold code included
+};
+
+extern Stats stats;
+
+void Optimize(IRArena& instrs);
+void DumpStats();
+
+}
@@ -3,6 +3,7 @@
 
 #include "EmotionEngine.h"
 #include "EEJit.h"
+#include "EEInterpreter.h"
 #include <emu/memory/Bus.h>
 
 
@@ -13,6 +14,7 @@ namespace EmotionEngine
 	ProcessorState state;
 	bool can_dump = false;
 	bool can_disassemble = false;
+	FPUClamp fpu_clamp = FPUClamp::OnStore;
 }
 
 namespace EmotionEngine
@@ -33,11 +35,12 @@ void Reset()
 int Clock(int cycles)
 {
 #ifdef EE_JIT
-	GetState()->cop0_regs[9] += cycles;
-	return EEJit::Clock(cycles);
+	int true_cycles = EEJit::Clock(cycles);
 #else
-	#error TODO: EE Interpreter clock
+	int true_cycles = EEInterpreter::Clock(cycles);
 #endif
+	GetState()->cop0_regs[9] += true_cycles;
+	return true_cycles;
 }
 
 void Dump()
@@ -70,6 +73,9 @@ ProcessorState* GetState()
 
 void MarkDirty(uint32_t address, uint32_t size)
 {
+#ifdef EE_JIT
+	EEJit::InvalidateRange(address, size);
+#endif
 }
 
 union COP0CAUSE
@@ -225,6 +231,7 @@ void SetIp1Pending()
 	cause.value = EmotionEngine::GetState()->cop0_regs[13];
 	cause.ip1_pending = true;
 	EmotionEngine::GetState()->cop0_regs[13] = cause.value;
+	EmotionEngine::GetState()->check_interrupt = true;
 }
 
 void ClearIp1Pending()
@@ -241,13 +248,22 @@ void SetIp0Pending()
 	cause.value = EmotionEngine::GetState()->cop0_regs[13];
 	cause.ip0_pending = true;
 	EmotionEngine::GetState()->cop0_regs[13] = cause.value;
-	// We try and do an exception here
+	// This can be called from a store in the middle of a JIT block, so the
+	// exception itself is taken once the dispatcher notices it's pending
+	EmotionEngine::GetState()->check_interrupt = true;
+}
+
+void CheckForInterrupt()
+{
+	COP0CAUSE cause;
 	COP0Status status;
+	cause.value = EmotionEngine::GetState()->cop0_regs[13];
 	status.value = EmotionEngine::GetState()->cop0_regs[12];
 	bool int_enabled = status.eie && status.ie && !status.erl && !status.exl;
 
 	bool pending = (cause.ip0_pending && status.im0)
-					|| (cause.ip1_pending && status.im1);
+					|| (cause.ip1_pending && status.im1)
+					|| (cause.timer_ip_pending && status.im7);
 	
 	if (int_enabled && pending)
 	{
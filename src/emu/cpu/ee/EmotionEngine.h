@@ -23,8 +23,10 @@ struct ProcessorState
 		int32_t i;
 	} acc;
 	uint32_t pc, next_pc;
-	uint64_t hi1, hi;
-	uint64_t lo1, lo;
+	// HI and LO are 128 bits wide for the MMI, hi1 and lo1 are their upper
+	// halves, so each pair can be accessed as one
+	uint64_t hi, hi1;
+	uint64_t lo, lo1;
 	union FPR
 	{
 		uint32_t i;
@@ -34,10 +36,30 @@ struct ProcessorState
 	bool c = false;
 
 	uint32_t pc_at;
+
+	// Counted down by JIT blocks as they exit, linked blocks only chain
+	// while this is still positive
+	int32_t cycles_left;
+	// Set when Cause.IP or Status may have changed. Linked JIT exits go back
+	// through the dispatcher while it's set, which clears it and checks for
+	// a pending interrupt
+	bool check_interrupt;
 };
 
 extern bool can_disassemble;
 
+// How closely COP1 follows the PS2 FPU, which has no Inf or NaN and
+// saturates to +/-FLT_MAX instead. Both the interpreter and the JIT honour
+// it, the JIT bakes it into blocks as they're compiled
+enum class FPUClamp
+{
+	None, // Plain IEEE results, fastest
+	OnStore, // Results are clamped as they're written to an FPR or ACC
+	Full, // Operands are clamped too
+};
+
+extern FPUClamp fpu_clamp;
+
 void Reset();
 int Clock(int cycles);
 void Dump();
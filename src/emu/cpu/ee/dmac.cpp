@@ -16,6 +16,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cassert>
+#include <vector>
 #include "dmac.hpp"
 
 namespace DMAC
@@ -522,6 +523,9 @@ void HandleSIF0Transfer()
  
     if (c.qwc > 0)
 	{
+        // Pull everything the FIFO has ready, then write it in one go
+        std::vector<uint128_t> burst;
+
         while (c.qwc)
         {
             if (SIF::FIFO0_size() >= 4)
@@ -532,14 +536,16 @@ void HandleSIF0Transfer()
                 
                 __uint128_t qword = *(__uint128_t*)data;
                 
-                Bus::Write128(c.madr, {qword});
+                burst.push_back({qword});
 
                 c.qwc--;
-                c.madr += 16;
             }
             else
                 break;
         }
+
+        Bus::WriteBurst128(c.madr, burst.data(), burst.size());
+        c.madr += burst.size() * 16;
 	}
 	else if (irq_on_done)
 	{
@@ -3,6 +3,8 @@
 #include <emu/memory/Bus.h>
 #include <emu/cpu/ee/EmotionEngine.h>
 #include <cassert>
+#include <cmath>
+#include <cstring>
 
 extern float convert(uint32_t value);
 
@@ -103,7 +105,7 @@ void Dump()
 		printf("[emu/VU0]: VI%02d:\t->\t0x%04x\n", i, VU0::vu0_state.vi[i]);
 	for (int i = 0; i < 32; i++)
 		printf("[emu/VU0]: VF%02d:\t->\t{x = %f, y = %f, z = %f, w = %f}\n", i, convert(VU0::vu0_state.vf[i].xi), convert(VU0::vu0_state.vf[i].yi), convert(VU0::vu0_state.vf[i].zi), convert(VU0::vu0_state.vf[i].wi));
-	printf("[emu/VU0]: I:\t->\t%f\n", VU0::vu0_state.i);
+	printf("[emu/VU0]: I:\t->\t%f\n", convert(VU0::vu0_state.i));
 }
 
 namespace VU0
@@ -115,8 +117,20 @@ uint32_t ReadControl(int index)
 {
 	switch (index)
 	{
-	case 1 ... 15:
+	case 0 ... 15:
 		return vu0_state.vi[index];
+	case 16:
+		return vu0_state.status;
+	case 18:
+		return vu0_state.clipping.val;
+	case 20:
+		return vu0_state.r;
+	case 21:
+		return vu0_state.i;
+	case 22:
+		return vu0_state.q;
+	case 27:
+		return vu0_state.cmsar0;
 	case 28:
 		return vu0_state.fbrst;
 	default:
@@ -129,6 +143,8 @@ void WriteControl(int index, uint32_t data)
 {
 	switch (index)
 	{
+	case 0: // VI0 is always zero
+		break;
 	case 1 ... 15:
 		printf("Writing 0x%08x to vi%02d\n", data, index);
 		vu0_state.vi[index] = data;
@@ -191,452 +207,343 @@ void SQC2(uint32_t instr)
 	Bus::Write128(EmotionEngine::GetState()->regs[base].u32[0]+offs, vu0_state.vf[ft].u128);
 }
 
-void Vmaddz(uint32_t instr)
+// COP2 macro mode
+// Operands go through convert(), which is how the VUs see Inf, NaN and
+// denormals, results are kept as they come out. VF0 and VI0 are constant,
+// writes to them are dropped
+
+enum class Arith
 {
-	uint8_t dest = (instr >> 21) & 0xf;
-	bool x = (dest >> 3) & 1;
-	bool y = (dest >> 2) & 1;
-	bool z = (dest >> 1) & 1;
-	bool w = (dest >> 0) & 1;
-
-	std::string dest_;
-	if (x)
-		dest_ += "x";
-	if (y)
-		dest_ += "y";
-	if (z)
-		dest_ += "z";
-	if (w)
-		dest_ += "w";
-	
-	int fd = (instr >> 6) & 0x1F;
-	int ft = (instr >> 16) & 0x1F;
-	int fs = (instr >> 11) & 0x1F;
+	Add, Sub, Mul, Madd, Msub, Max, Mini
+};
 
-	float op = convert(vu0_state.vf[ft].zi);
+// What ft is broadcast from, if anything
+enum Field
+{
+	FieldX, FieldY, FieldZ, FieldW, FieldI, FieldQ, FieldNone
+};
 
-	if (x)
-	{
-		vu0_state.vf[fd].x = convert(vu0_state.acc.xi) + (convert(vu0_state.vf[fs].xi) * op);
-	}
-	if (y)
-	{
-		vu0_state.vf[fd].y = convert(vu0_state.acc.yi) + (convert(vu0_state.vf[fs].yi) * op);
-	}
-	if (z)
+// Fraction bits of ITOF0/4/12/15 and FTOI0/4/12/15
+const int fraction_bits[4] = {0, 4, 12, 15};
+
+uint32_t Bits(float f)
+{
+	uint32_t value;
+	memcpy(&value, &f, 4);
+	return value;
+}
+
+float Lane(const VectorState::Register& r, int lane)
+{
+	return convert(r.words[lane]);
+}
+
+float Broadcast(int field, int ft)
+{
+	switch (field)
 	{
-		vu0_state.vf[fd].z = convert(vu0_state.acc.zi) + (convert(vu0_state.vf[fs].zi) * op);
+	case FieldI: return convert(vu0_state.i);
+	case FieldQ: return convert(vu0_state.q);
+	default: return Lane(vu0_state.vf[ft], field);
 	}
-	if (w)
+}
+
+float Apply(Arith op, float acc, float s, float t)
+{
+	// Products are rounded before they're accumulated
+	float product = s * t;
+
+	switch (op)
 	{
-		vu0_state.vf[fd].w = convert(vu0_state.acc.wi) + (convert(vu0_state.vf[fs].wi) * op);
+	case Arith::Add: return s + t;
+	case Arith::Sub: return s - t;
+	case Arith::Mul: return product;
+	case Arith::Madd: return acc + product;
+	case Arith::Msub: return acc - product;
+	case Arith::Max: return s > t ? s : t;
+	default: return s < t ? s : t;
 	}
+}
 
-	printf("vmaddz.%s vf%02d.%s, vf%02d.%s, vf%02dz\n", dest_.c_str(), fd, dest_.c_str(), fs, dest_.c_str(), ft);
+void SetVI(int index, uint16_t value)
+{
+	if (index)
+		vu0_state.vi[index] = value;
 }
 
-void Vmaddw(uint32_t instr)
+void Write(int fd, bool to_acc, const VectorState::Register& result)
 {
-	uint8_t dest = (instr >> 21) & 0xf;
-	bool x = (dest >> 3) & 1;
-	bool y = (dest >> 2) & 1;
-	bool z = (dest >> 1) & 1;
-	bool w = (dest >> 0) & 1;
-
-	std::string dest_;
-	if (x)
-		dest_ += "x";
-	if (y)
-		dest_ += "y";
-	if (z)
-		dest_ += "z";
-	if (w)
-		dest_ += "w";
-	
-	int fd = (instr >> 6) & 0x1F;
-	int ft = (instr >> 16) & 0x1F;
-	int fs = (instr >> 11) & 0x1F;
+	if (to_acc)
+		vu0_state.acc = result;
+	else if (fd)
+		vu0_state.vf[fd] = result;
+}
 
-	float op = convert(vu0_state.vf[ft].wi);
+// The FMAC instructions of special1 0x00-0x2F, and of special2 where they
+// have an A form that writes ACC instead of fd. Both are laid out the same
+bool DecodeUpper(int index, bool to_acc, Arith& op, int& field)
+{
+	using A = Arith;
+	static const A bc_ops[7] = {A::Add, A::Sub, A::Madd, A::Msub, A::Max, A::Mini, A::Mul};
+	static const A iq_ops[8] = {A::Add, A::Madd, A::Add, A::Madd, A::Sub, A::Msub, A::Sub, A::Msub};
+	static const A vector_ops[8] = {A::Add, A::Madd, A::Mul, A::Max, A::Sub, A::Msub, A::Mul, A::Mini};
 
-	if (x)
+	if (index < 0x1C)
 	{
-		vu0_state.vf[fd].x = convert(vu0_state.acc.xi) + (convert(vu0_state.vf[fs].xi) * op);
+		op = bc_ops[index >> 2];
+		field = index & 3;
 	}
-	if (y)
+	else if (index < 0x20)
 	{
-		vu0_state.vf[fd].y = convert(vu0_state.acc.yi) + (convert(vu0_state.vf[fs].yi) * op);
+		// MULq, MAXi, MULi, MINIi
+		static const A ops[4] = {A::Mul, A::Max, A::Mul, A::Mini};
+		op = ops[index & 3];
+		field = index == 0x1C ? FieldQ : FieldI;
 	}
-	if (z)
+	else if (index < 0x28)
 	{
-		vu0_state.vf[fd].z = convert(vu0_state.acc.zi) + (convert(vu0_state.vf[fs].zi) * op);
+		op = iq_ops[index & 7];
+		field = (index & 2) ? FieldI : FieldQ;
 	}
-	if (w)
+	else if (index < 0x30 && index != 0x2E)
 	{
-		vu0_state.vf[fd].w = convert(vu0_state.acc.wi) + (convert(vu0_state.vf[fs].wi) * op);
+		op = vector_ops[index & 7];
+		field = FieldNone;
 	}
+	else
+		return false;
 
-	printf("vmaddw.%s vf%02d.%s, vf%02d.%s, vf%02dw\n", dest_.c_str(), fd, dest_.c_str(), fs, dest_.c_str(), ft);
+	// There's no MAXA or MINIA, special2 has other things there
+	return !to_acc || (op != A::Max && op != A::Mini);
 }
 
-void Vsub(uint32_t instr)
+void Upper(uint32_t instr, Arith op, int field, bool to_acc)
 {
-	uint8_t dest = (instr >> 21) & 0xf;
-	bool x = (dest >> 3) & 1;
-	bool y = (dest >> 2) & 1;
-	bool z = (dest >> 1) & 1;
-	bool w = (dest >> 0) & 1;
-
-	std::string dest_;
-	if (x)
-		dest_ += "x";
-	if (y)
-		dest_ += "y";
-	if (z)
-		dest_ += "z";
-	if (w)
-		dest_ += "w";
-
+	int dest = (instr >> 21) & 0xF;
 	int ft = (instr >> 16) & 0x1F;
 	int fs = (instr >> 11) & 0x1F;
 	int fd = (instr >> 6) & 0x1F;
 
-	if (x)
-		vu0_state.vf[fd].x = convert(vu0_state.vf[fs].xi) - convert(vu0_state.vf[ft].xi);
-	if (y)
-		vu0_state.vf[fd].y = convert(vu0_state.vf[fs].yi) - convert(vu0_state.vf[ft].yi);
-	if (z)
-		vu0_state.vf[fd].z = convert(vu0_state.vf[fs].zi) - convert(vu0_state.vf[ft].zi);
-	if (w)
-		vu0_state.vf[fd].w = convert(vu0_state.vf[fs].wi) - convert(vu0_state.vf[ft].wi);
-	
-	printf("vsub.%s vf%02d.%s, vf%02d.%s, vf%02d.%s\n", dest_.c_str(), fd, dest_.c_str(), fs, dest_.c_str(), ft, dest_.c_str());
-
-	// TODO: Handle VU0 flags
-}
-
-void Viadd(uint32_t instr)
-{
-	int it = (instr >> 16) & 0x1F;
-	int is = (instr >> 11) & 0x1F;
-	int id = (instr >> 6) & 0x1F;
+	auto result = to_acc ? vu0_state.acc : vu0_state.vf[fd];
+	for (int lane = 0; lane < 4; lane++)
+	{
+		if (!(dest & (8 >> lane)))
+			continue;
 
-	vu0_state.vi[id] = vu0_state.vi[is] + vu0_state.vi[it];
+		float t = field == FieldNone ? Lane(vu0_state.vf[ft], lane) : Broadcast(field, ft);
+		result.components[lane] = Apply(op, Lane(vu0_state.acc, lane), Lane(vu0_state.vf[fs], lane), t);
+	}
 
-	printf("viadd vi%02d, vi%02d, vi%02d\n", id, is, it);
+	Write(fd, to_acc, result);
 }
 
-void Vmaddax(uint32_t instr)
+// OPMULA and OPMSUB, the halves of a cross product. The lanes of fs and ft
+// are rotated so that x is fs.y * ft.z, y is fs.z * ft.x and z is fs.x * ft.y
+void OuterProduct(uint32_t instr, bool to_acc)
 {
-	uint8_t dest = (instr >> 21) & 0xf;
-	bool x = (dest >> 3) & 1;
-	bool y = (dest >> 2) & 1;
-	bool z = (dest >> 1) & 1;
-	bool w = (dest >> 0) & 1;
-
-	std::string dest_;
-	if (x)
-		dest_ += "x";
-	if (y)
-		dest_ += "y";
-	if (z)
-		dest_ += "z";
-	if (w)
-		dest_ += "w";
-	
+	static const int s_lanes[4] = {1, 2, 0, 3};
+	static const int t_lanes[4] = {2, 0, 1, 3};
+
+	int dest = (instr >> 21) & 0xF;
 	int ft = (instr >> 16) & 0x1F;
 	int fs = (instr >> 11) & 0x1F;
+	int fd = (instr >> 6) & 0x1F;
 
-	float op = convert(vu0_state.vf[ft].xi);
-
-	if (x)
+	auto result = to_acc ? vu0_state.acc : vu0_state.vf[fd];
+	for (int lane = 0; lane < 4; lane++)
 	{
-		vu0_state.acc.x = convert(vu0_state.acc.xi) + (convert(vu0_state.vf[fs].xi) * op);
-	}
-	if (y)
-	{
-		vu0_state.acc.y = convert(vu0_state.acc.yi) + (convert(vu0_state.vf[fs].yi) * op);
-	}
-	if (z)
-	{
-		vu0_state.acc.z = convert(vu0_state.acc.zi) + (convert(vu0_state.vf[fs].zi) * op);
-	}
-	if (w)
-	{
-		vu0_state.acc.w = convert(vu0_state.acc.wi) + (convert(vu0_state.vf[fs].wi) * op);
+		if (!(dest & (8 >> lane)))
+			continue;
+
+		float product = Lane(vu0_state.vf[fs], s_lanes[lane]) * Lane(vu0_state.vf[ft], t_lanes[lane]);
+		result.components[lane] = to_acc ? product : Lane(vu0_state.acc, lane) - product;
 	}
 
-	printf("vmaddax.%s acc, vf%02d.%s, vf%02dx\n", dest_.c_str(), fs, dest_.c_str(), ft);
+	Write(fd, to_acc, result);
 }
 
-void Vmadday(uint32_t instr)
+// MOVE, MR32, ABS, ITOF, FTOI and MFIR, which write the dest lanes of ft
+template <typename F>
+void Transfer(uint32_t instr, F lane_value)
 {
-	uint8_t dest = (instr >> 21) & 0xf;
-	bool x = (dest >> 3) & 1;
-	bool y = (dest >> 2) & 1;
-	bool z = (dest >> 1) & 1;
-	bool w = (dest >> 0) & 1;
-
-	std::string dest_;
-	if (x)
-		dest_ += "x";
-	if (y)
-		dest_ += "y";
-	if (z)
-		dest_ += "z";
-	if (w)
-		dest_ += "w";
-	
+	int dest = (instr >> 21) & 0xF;
 	int ft = (instr >> 16) & 0x1F;
 	int fs = (instr >> 11) & 0x1F;
 
-	float op = convert(vu0_state.vf[ft].yi);
-
-	if (x)
-	{
-		vu0_state.acc.x = convert(vu0_state.acc.xi) + (convert(vu0_state.vf[fs].xi) * op);
-	}
-	if (y)
-	{
-		vu0_state.acc.y = convert(vu0_state.acc.yi) + (convert(vu0_state.vf[fs].yi) * op);
-	}
-	if (z)
-	{
-		vu0_state.acc.z = convert(vu0_state.acc.zi) + (convert(vu0_state.vf[fs].zi) * op);
-	}
-	if (w)
+	auto& s = vu0_state.vf[fs];
+	auto result = vu0_state.vf[ft];
+	for (int lane = 0; lane < 4; lane++)
 	{
-		vu0_state.acc.w = convert(vu0_state.acc.wi) + (convert(vu0_state.vf[fs].wi) * op);
+		if (dest & (8 >> lane))
+			result.words[lane] = lane_value(s, lane);
 	}
 
-	printf("vmadday.%s acc, vf%02d.%s, vf%02dy\n", dest_.c_str(), fs, dest_.c_str(), ft);
+	if (ft)
+		vu0_state.vf[ft] = result;
 }
 
-void Vmaddaz(uint32_t instr)
+// Truncates, and saturates anything out of range by its sign
+uint32_t FloatToFixed(float value)
+{
+	if (std::fabs(value) < 2147483648.0f)
+		return (int32_t)value;
+	return std::signbit(value) ? 0x80000000 : 0x7FFFFFFF;
+}
+
+void Clip(uint32_t instr)
 {
-	uint8_t dest = (instr >> 21) & 0xf;
-	bool x = (dest >> 3) & 1;
-	bool y = (dest >> 2) & 1;
-	bool z = (dest >> 1) & 1;
-	bool w = (dest >> 0) & 1;
-
-	std::string dest_;
-	if (x)
-		dest_ += "x";
-	if (y)
-		dest_ += "y";
-	if (z)
-		dest_ += "z";
-	if (w)
-		dest_ += "w";
-	
 	int ft = (instr >> 16) & 0x1F;
 	int fs = (instr >> 11) & 0x1F;
 
-	float op = convert(vu0_state.vf[ft].zi);
+	float w = std::fabs(Lane(vu0_state.vf[ft], 3));
 
-	if (x)
-	{
-		vu0_state.acc.x = convert(vu0_state.acc.xi) + (convert(vu0_state.vf[fs].xi) * op);
-	}
-	if (y)
-	{
-		vu0_state.acc.y = convert(vu0_state.acc.yi) + (convert(vu0_state.vf[fs].yi) * op);
-	}
-	if (z)
-	{
-		vu0_state.acc.z = convert(vu0_state.acc.zi) + (convert(vu0_state.vf[fs].zi) * op);
-	}
-	if (w)
+	// +x, -x, +y, -y, +z, -z, each judged against +/-|w|
+	uint32_t flags = 0;
+	for (int n = 0; n < 3; n++)
 	{
-		vu0_state.acc.w = convert(vu0_state.acc.wi) + (convert(vu0_state.vf[fs].wi) * op);
+		float value = Lane(vu0_state.vf[fs], n);
+		flags |= (value > +w) << (n * 2);
+		flags |= (value < -w) << (n * 2 + 1);
 	}
 
-	printf("vmaddaz.%s acc, vf%02d.%s, vf%02dz\n", dest_.c_str(), fs, dest_.c_str(), ft);
+	vu0_state.clipping.val = ((vu0_state.clipping.val << 6) | flags) & 0xFFFFFF;
 }
 
-void Vmulax(uint32_t instr)
+// DIV, SQRT and RSQRT take single fields, fsf and ftf, and write Q
+void DivideQ(uint32_t instr, int func)
 {
-	uint8_t dest = (instr >> 21) & 0xf;
-	bool x = (dest >> 3) & 1;
-	bool y = (dest >> 2) & 1;
-	bool z = (dest >> 1) & 1;
-	bool w = (dest >> 0) & 1;
-
-	std::string dest_;
-	if (x)
-		dest_ += "x";
-	if (y)
-		dest_ += "y";
-	if (z)
-		dest_ += "z";
-	if (w)
-		dest_ += "w";
-	
 	int ft = (instr >> 16) & 0x1F;
 	int fs = (instr >> 11) & 0x1F;
+	float s = Lane(vu0_state.vf[fs], (instr >> 21) & 3);
+	float t = Lane(vu0_state.vf[ft], (instr >> 23) & 3);
 
-	float op = convert(vu0_state.vf[ft].xi);
-
-	if (x)
-	{
-		vu0_state.acc.x = convert(vu0_state.vf[fs].xi) * op;
-	}
-	if (y)
+	switch (func)
 	{
-		vu0_state.acc.y = convert(vu0_state.vf[fs].yi) * op;
+	case 0x38: vu0_state.q = Bits(s / t); break;
+	case 0x39: vu0_state.q = Bits(std::sqrt(std::fabs(t))); break;
+	case 0x3A: vu0_state.q = Bits(s / std::sqrt(std::fabs(t))); break;
 	}
-	if (z)
+}
+
+void Special1(uint32_t instr)
+{
+	int func = instr & 0x3F;
+	int it = (instr >> 16) & 0xF;
+	int is = (instr >> 11) & 0xF;
+	int id = (instr >> 6) & 0xF;
+
+	Arith op;
+	int field;
+	if (DecodeUpper(func, false, op, field))
 	{
-		vu0_state.acc.z = convert(vu0_state.vf[fs].zi) * op;
+		Upper(instr, op, field, false);
+		return;
 	}
-	if (w)
+
+	auto& vi = vu0_state.vi;
+	switch (func)
 	{
-		vu0_state.acc.w = convert(vu0_state.vf[fs].wi) * op;
+	case 0x2E: OuterProduct(instr, false); break;
+	case 0x30: SetVI(id, vi[is] + vi[it]); break;
+	case 0x31: SetVI(id, vi[is] - vi[it]); break;
+	case 0x32: SetVI(it, vi[is] + ((((instr >> 6) & 0x1F) ^ 0x10) - 0x10)); break;
+	case 0x34: SetVI(id, vi[is] & vi[it]); break;
+	case 0x35: SetVI(id, vi[is] | vi[it]); break;
+	default:
+		printf("[emu/VU0]: Unknown special1 instruction 0x%02x (0x%08x)\n", func, instr);
+		exit(1);
 	}
-
-	printf("vmulax.%s acc, vf%02d.%s, vf%02dx\n", dest_.c_str(), fs, dest_.c_str(), ft);
 }
 
-void Vmulaw(uint32_t instr)
+void Special2(uint32_t instr)
 {
-	uint8_t dest = (instr >> 21) & 0xf;
-	bool x = (dest >> 3) & 1;
-	bool y = (dest >> 2) & 1;
-	bool z = (dest >> 1) & 1;
-	bool w = (dest >> 0) & 1;
-
-	std::string dest_;
-	if (x)
-		dest_ += "x";
-	if (y)
-		dest_ += "y";
-	if (z)
-		dest_ += "z";
-	if (w)
-		dest_ += "w";
-	
-	int ft = (instr >> 16) & 0x1F;
-	int fs = (instr >> 11) & 0x1F;
-
-	float op = convert(vu0_state.vf[ft].wi);
+	int index = (instr & 3) | ((instr >> 4) & 0x7C);
+	int dest = (instr >> 21) & 0xF;
+	int it = (instr >> 16) & 0xF;
+	int is = (instr >> 11) & 0xF;
 
-	if (x)
+	Arith op;
+	int field;
+	if (DecodeUpper(index, true, op, field))
 	{
-		vu0_state.acc.x = convert(vu0_state.vf[fs].xi) * op;
+		Upper(instr, op, field, true);
+		return;
 	}
-	if (y)
+
+	switch (index)
 	{
-		vu0_state.acc.y = convert(vu0_state.vf[fs].yi) * op;
-	}
-	if (z)
+	case 0x10 ... 0x13:
 	{
-		vu0_state.acc.z = convert(vu0_state.vf[fs].zi) * op;
+		float scale = 1.0f / (1 << fraction_bits[index & 3]);
+		Transfer(instr, [=](auto& s, int lane) { return Bits((float)(int32_t)s.words[lane] * scale); });
+		break;
 	}
-	if (w)
+	case 0x14 ... 0x17:
 	{
-		vu0_state.acc.w = convert(vu0_state.vf[fs].wi) * op;
+		float scale = 1 << fraction_bits[index & 3];
+		Transfer(instr, [=](auto& s, int lane) { return FloatToFixed(Lane(s, lane) * scale); });
+		break;
+	}
+	case 0x1D:
+		Transfer(instr, [](auto& s, int lane) { return s.words[lane] & 0x7FFFFFFF; });
+		break;
+	case 0x1F:
+		Clip(instr);
+		break;
+	case 0x2E:
+		OuterProduct(instr, true);
+		break;
+	case 0x2F: // NOP
+	case 0x3B: // WAITQ, Q is always ready
+		break;
+	case 0x30:
+		Transfer(instr, [](auto& s, int lane) { return s.words[lane]; });
+		break;
+	case 0x31:
+		// MR32 rotates, x takes y, y takes z, z takes w and w takes x
+		Transfer(instr, [](auto& s, int lane) { return s.words[(lane + 1) & 3]; });
+		break;
+	case 0x35:
+	{
+		// SQI
+		auto& f = vu0_state.vf[(instr >> 11) & 0x1F];
+		for (int n = 0; n < 4; n++)
+		{
+			if (dest & (8 >> n))
+				WriteDataMem32(0, vu0_state.vi[it] * 16 + n * 4, f.words[n]);
+		}
+		SetVI(it, vu0_state.vi[it] + 1);
+		break;
+	}
+	case 0x38 ... 0x3A:
+		DivideQ(instr, index);
+		break;
+	case 0x3C:
+		SetVI(it, vu0_state.vf[(instr >> 11) & 0x1F].words[(instr >> 21) & 3]);
+		break;
+	case 0x3D:
+		Transfer(instr, [=](auto&, int) { return (uint32_t)(int32_t)(int16_t)vu0_state.vi[is]; });
+		break;
+	case 0x3F:
+		// ISWR writes vi[it] to every field in dest
+		for (int n = 0; n < 4; n++)
+		{
+			if (dest & (8 >> n))
+				WriteDataMem32(0, vu0_state.vi[is] * 16 + n * 4, vu0_state.vi[it]);
+		}
+		break;
+	default:
+		printf("[emu/VU0]: Unknown special2 instruction 0x%02x (0x%08x)\n", index, instr);
+		exit(1);
 	}
-
-	printf("vmulaw.%s acc, vf%02d.%s, vf%02dw\n", dest_.c_str(), fs, dest_.c_str(), ft);
-}
-
-void Vclipw(uint32_t instr)
-{
-	vu0_state.clipping.val <<= 6;
-	
-	int ft = (instr >> 16) & 0x1F;
-	int fs = (instr >> 11) & 0x1F;
-
-	float value = fabs(convert(vu0_state.vf[ft].wi));
-
-	float x = convert(vu0_state.vf[fs].xi);
-	float y = convert(vu0_state.vf[fs].yi);
-	float z = convert(vu0_state.vf[fs].zi);
-
-	vu0_state.clipping.val |= (x > +value);
-	vu0_state.clipping.val |= (x < -value) << 1;
-	vu0_state.clipping.val |= (y > +value) << 2;
-	vu0_state.clipping.val |= (y > -value) << 3;
-	vu0_state.clipping.val |= (z > +value) << 4;
-	vu0_state.clipping.val |= (z > -value) << 5;
-
-	printf("vclipw.xyz vf%02d.xyz, vf%02d.w\n", fs, ft);
 }
 
-void Vsqi(uint32_t instr)
+void Macro(uint32_t instr)
 {
-	uint8_t dest = (instr >> 21) & 0xf;
-	bool x = (dest >> 3) & 1;
-	bool y = (dest >> 2) & 1;
-	bool z = (dest >> 1) & 1;
-	bool w = (dest >> 0) & 1;
-
-	std::string dest_;
-	if (x)
-		dest_ += "x";
-	if (y)
-		dest_ += "y";
-	if (z)
-		dest_ += "z";
-	if (w)
-		dest_ += "w";
-	
-	int it = (instr >> 16) & 0x1F;
-	int fs = (instr >> 11) & 0x1F;
-
-	auto& f = vu0_state.vf[fs];
-
-	if (x)
-		WriteDataMem32(0, vu0_state.vi[it]*16+0x0, f.x);
-	if (y)
-		WriteDataMem32(0, vu0_state.vi[it]*16+0x4, f.y);
-	if (z)
-		WriteDataMem32(0, vu0_state.vi[it]*16+0x8, f.z);
-	if (w)
-		WriteDataMem32(0, vu0_state.vi[it]*16+0xc, f.w);
-	
-	VU0::vu0_state.vi[it]++;
-
-	printf("sqi.%s vf%02d, (vi%02d++).%s\n", dest_.c_str(), fs, it, dest_.c_str());
+	if ((instr & 0x3C) == 0x3C)
+		Special2(instr);
+	else
+		Special1(instr);
 }
-
-void Viswr(uint32_t instr)
-{
-	uint8_t dest = (instr >> 21) & 0xf;
-	bool x = (dest >> 3) & 1;
-	bool y = (dest >> 2) & 1;
-	bool z = (dest >> 1) & 1;
-	bool w = (dest >> 0) & 1;
-
-	std::string dest_;
-	if (x)
-		dest_ += "x";
-	if (y)
-		dest_ += "y";
-	if (z)
-		dest_ += "z";
-	if (w)
-		dest_ += "w";
-
-	// Make sure only one dest bit is set
-	assert((x && !y && !z && !w) || (!x && y && !z && !w) || (!x && !y && z && !w) || (!x && !y && !z && w));
-
-	int it = (instr >> 16) & 0x1F;
-	int is = (instr >> 11) & 0x1F;
-
-	printf("viswr.%s vi%02d, (vi%02d).%s\n", dest_.c_str(), it, is, dest_.c_str());
-	
-	uint16_t addr = vu0_state.vi[is];
-
-	if (y)
-		addr += 4;
-	if (z)
-		addr += 8;
-	if (w)
-		addr += 12;
-	
-	WriteDataMem32(0, addr, vu0_state.vi[it]);
 }
 }
-}
\ No newline at end of file
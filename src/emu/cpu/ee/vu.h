@@ -40,27 +40,30 @@ struct VectorState
     } clipping;
 
     uint32_t r;
-    float i, q;
+    uint32_t i, q; // Floats, kept as their bits
 
     uint16_t cmsar0;
 
-    union
+    // Laid out as in memory, x is the low word. Dest fields go the other
+    // way, x is bit 3
+    union Register
     {
         uint128_t u128;
         float components[4];
+        uint32_t words[4];
         struct
         {
-            float w;
-            float z;
-            float y;
             float x;
+            float y;
+            float z;
+            float w;
         };
         struct
         {
-            uint32_t wi;
-            uint32_t zi;
-            uint32_t yi;
             uint32_t xi;
+            uint32_t yi;
+            uint32_t zi;
+            uint32_t wi;
         };
     } vf[32], acc;
 };
@@ -83,21 +86,9 @@ void WriteReg(int index, __uint128_t val);
 void LQC2(uint32_t instr);
 void SQC2(uint32_t instr);
 
-// Special 1
-void Vmaddz(uint32_t instr); // 0x0a
-void Vmaddw(uint32_t instr); // 0x0b
-void Vsub(uint32_t instr); // 0x2c
-void Viadd(uint32_t instr); // 0x30
-
-// Special2
-void Vmaddax(uint32_t instr); // 0x08
-void Vmadday(uint32_t instr); // 0x09
-void Vmaddaz(uint32_t instr); // 0x0A
-void Vmulax(uint32_t instr); // 0x18
-void Vmulaw(uint32_t instr); // 0x1B
-void Vclipw(uint32_t instr); // 0x1F
-void Vsqi(uint32_t instr); // 0x35
-void Viswr(uint32_t instr); // 0x3f
+// COP2 macro mode, any special1 or special2 instruction. Covers the upper
+// FMAC instructions, and the VI, Q and data memory ones games use from the EE
+void Macro(uint32_t instr);
 
 }
 
@@ -0,0 +1,190 @@
+#include "CodeCache.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <linux/memfd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+size_t CodeCache::size = 256 * 1024 * 1024;
+bool CodeCache::huge_pages = false;
+
+namespace CodeCache
+{
+
+constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+// Smallest cache that still leaves every region room for a few blocks
+constexpr size_t MIN_SIZE = 16 * 1024 * 1024;
+
+uint8_t* writeBase;
+const uint8_t* execBase;
+size_t cacheSize;
+size_t regionSize;
+
+int currentRegion;
+// Offset each region's hot code ends at, equal to its start while it's empty
+size_t regionEnd[REGION_COUNT];
+// Offset each region's cold code starts at, equal to its end while it's empty
+size_t regionCold[REGION_COUNT];
+Stats stats;
+
+size_t RegionStart(int region)
+{
+    return STATIC_SIZE + STAGING_SIZE + region * regionSize;
+}
+
+void Initialize()
+{
+    if (writeBase)
+        return;
+
+    cacheSize = std::clamp(size, MIN_SIZE, MAX_SIZE);
+    cacheSize = (cacheSize + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+    int fd = -1;
+    bool hugetlb = false;
+
+    if (huge_pages)
+    {
+        fd = memfd_create("ee-code-cache", MFD_CLOEXEC | MFD_HUGETLB | MFD_HUGE_2MB);
+        if (fd >= 0 && ftruncate(fd, cacheSize) == 0)
+            hugetlb = true;
+        else
+        {
+            printf("[EEJIT_X64]: No 2 MB pages for the code cache (%s), asking for transparent ones\n", strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd < 0)
+        fd = memfd_create("ee-code-cache", MFD_CLOEXEC);
+
+    if (fd < 0 || (!hugetlb && ftruncate(fd, cacheSize) < 0))
+    {
+        printf("[EEJIT_X64]: Failed to create the code cache! %s\n", strerror(errno));
+        exit(1);
+    }
+
+    writeBase = (uint8_t*)mmap(nullptr, cacheSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    execBase = (const uint8_t*)mmap(nullptr, cacheSize, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (writeBase == MAP_FAILED || execBase == MAP_FAILED)
+    {
+        printf("[EEJIT_X64]: Failed to map the code cache! %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if (huge_pages && !hugetlb)
+    {
+        madvise(writeBase, cacheSize, MADV_HUGEPAGE);
+        madvise((void*)execBase, cacheSize, MADV_HUGEPAGE);
+    }
+
+    regionSize = (cacheSize - STATIC_SIZE - STAGING_SIZE) / REGION_COUNT;
+    stats.size = cacheSize;
+    Reset();
+    stats.full_flushes = 0;
+}
+
+uint8_t* GetWriteBase()
+{
+    return writeBase;
+}
+
+uint8_t* GetStagingBase()
+{
+    return writeBase + STATIC_SIZE;
+}
+
+size_t GetSize()
+{
+    return cacheSize;
+}
+
+const uint8_t* ToExec(const uint8_t* ptr)
+{
+    return execBase + (ptr - writeBase);
+}
+
+uint8_t* ToWrite(const uint8_t* ptr)
+{
+    return writeBase + (ptr - execBase);
+}
+
+// Cold code is kept 16 byte aligned
+size_t ColdOffset(int region, size_t cold_bytes)
+{
+    return (regionCold[region] - cold_bytes) & ~(size_t)15;
+}
+
+size_t Allocate(size_t bytes, size_t cold_bytes, size_t& cold_offset, Range& flushed)
+{
+    flushed = {nullptr, nullptr};
+
+    size_t offset = regionEnd[currentRegion];
+    if (bytes + cold_bytes + 15 <= regionCold[currentRegion] - offset)
+    {
+        cold_offset = ColdOffset(currentRegion, cold_bytes);
+        return offset;
+    }
+
+    // Move on to the next region, dropping the generation of code in it
+    currentRegion = (currentRegion + 1) % REGION_COUNT;
+    stats.generation++;
+
+    size_t start = RegionStart(currentRegion);
+    size_t end = start + regionSize;
+    if (regionEnd[currentRegion] != start || regionCold[currentRegion] != end)
+    {
+        flushed = {execBase + start, execBase + end};
+        stats.used -= (regionEnd[currentRegion] - start) + (end - regionCold[currentRegion]);
+        regionEnd[currentRegion] = start;
+        regionCold[currentRegion] = end;
+        stats.region_flushes++;
+    }
+
+    cold_offset = ColdOffset(currentRegion, cold_bytes);
+    return start;
+}
+
+void Commit(size_t offset, size_t cold_offset)
+{
+    if (offset > cold_offset || cold_offset > regionCold[currentRegion])
+    {
+        printf("[EEJIT_X64]: Block overflowed code cache region %d\n", currentRegion);
+        exit(1);
+    }
+
+    stats.used += (offset - regionEnd[currentRegion]) + (regionCold[currentRegion] - cold_offset);
+    regionEnd[currentRegion] = offset;
+    regionCold[currentRegion] = cold_offset;
+
+    size_t end = RegionStart(currentRegion) + regionSize;
+    stats.high_water = std::max(stats.high_water, cold_offset < end ? end : offset);
+}
+
+void Reset()
+{
+    for (int i = 0; i < REGION_COUNT; i++)
+    {
+        regionEnd[i] = RegionStart(i);
+        regionCold[i] = RegionStart(i) + regionSize;
+    }
+
+    currentRegion = 0;
+    stats.used = 0;
+    stats.full_flushes++;
+}
+
+Stats GetStats()
+{
+    return stats;
+}
+
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Memory for translated EE code
+// The cache is one shared memory file mapped twice: a writable view that code
+// is emitted into, and an executable view that it runs from. Neither view is
+// both writable and executable. Pointers into the cache are in one view or
+// the other, ToExec/ToWrite convert between them
+// Past a small static area (the dispatcher) and the staging area blocks are
+// translated into, the cache is split into regions that fill up in turn.
+// When the last one is full, the oldest generation of code gets dropped, one
+// region at a time
+// Each region holds hot code from its start up and cold code (slow paths and
+// the like) from its end down, so the code blocks run through most of the
+// time stays packed together. Both halves of a block go in the same region
+namespace CodeCache
+{
+
+// Used by the next Initialize()
+extern size_t size;
+extern bool huge_pages; // Back the cache with 2 MB pages, if the host has them
+
+constexpr int REGION_COUNT = 8;
+// Bytes at the start of the cache that are never flushed
+constexpr size_t STATIC_SIZE = 64 * 1024;
+// Right after the static area. Blocks are translated here, then copied into
+// a region. Being in the cache keeps jumps to the dispatcher in rel32 range
+constexpr size_t STAGING_SIZE = 256 * 1024;
+// Largest cache, `size` is clamped to it. Block exits, host calls and jumps
+// to cold code are rel32 jumps into the static area, so none of the cache
+// can be 2 GB away from it
+constexpr size_t MAX_SIZE = 2048ULL * 1024 * 1024 - 2 * 1024 * 1024;
+
+void Initialize();
+
+uint8_t* GetWriteBase();
+uint8_t* GetStagingBase();
+size_t GetSize();
+
+const uint8_t* ToExec(const uint8_t* ptr);
+uint8_t* ToWrite(const uint8_t* ptr);
+
+// A range of code in the executable view
+struct Range
+{
+    const uint8_t* start;
+    const uint8_t* end;
+};
+
+// Offset to emit the next block's hot code at, with room for `bytes` of it
+// and `cold_bytes` of cold code, which goes at `cold_offset`. If that moves
+// into a region that still holds code, its range is returned in `flushed`
+// and every block in it has to be dropped before emitting. Otherwise
+// `flushed` is empty
+size_t Allocate(size_t bytes, size_t cold_bytes, size_t& cold_offset, Range& flushed);
+// Hot code up to `offset`, and cold code from `cold_offset`, has been emitted
+void Commit(size_t offset, size_t cold_offset);
+// Drop all code in the regions, returns the offset to emit at
+void Reset();
+
+struct Stats
+{
+    size_t size;
+    size_t used; // Bytes of code currently held
+    size_t high_water; // Furthest offset ever emitted to, cold code included
+    uint32_t generation; // Regions filled so far
+    uint64_t region_flushes;
+    uint64_t full_flushes;
+};
+
+Stats GetStats();
+
+}
@@ -1,95 +1,764 @@
 #include "EEJitx64.h"
 #include "RegAllocator.h"
+#include "CodeCache.h"
+#include "TranslationCache.h"
+#include "PerfMap.h"
 #include <emu/cpu/ee/EEJit.h>
+#include <emu/cpu/ee/EEJitOpt.h>
+#include <emu/cpu/ee/EEInterpreter.h>
 #include <emu/cpu/ee/EmotionEngine.h>
+#include <emu/cpu/ee/vu.h>
 #include <emu/memory/Bus.h>
+#include <emu/memory/FastMem.h>
 
+#include <signal.h>
+#include <ucontext.h>
 #include <cstdio>
 #include <cstdlib>
 #include <3rdparty/xbyak/xbyak.h>
+#include <3rdparty/xbyak/xbyak_util.h>
+#include <algorithm>
 #include <cerrno>
 #include <cstring>
 #include <fstream>
+#include <functional>
+#include <map>
 #include <unordered_map>
+#include <vector>
 
-std::unordered_map<uint32_t, Block*> blockMap;
+// Two-level block lookup table. The top level is indexed by 4 KB guest page,
+// and each page holds one slot per instruction word, so finding a block is
+// just two dependent loads
+constexpr int BLOCK_PAGE_SHIFT = 12;
+constexpr int BLOCK_PAGE_COUNT = 1 << (32 - BLOCK_PAGE_SHIFT);
+constexpr int BLOCK_PAGE_ENTRIES = (1 << BLOCK_PAGE_SHIFT) / 4;
+
+struct BlockPage
+{
+    blockEntry entries[BLOCK_PAGE_ENTRIES];
+    Block* blocks[BLOCK_PAGE_ENTRIES];
+};
+
+BlockPage* blockPages[BLOCK_PAGE_COUNT];
+
+// Translations are shared by every address the same code can be run
+// through: KSEG0 and KSEG1, the uncached RAM mirrors and so on. Nothing in
+// a block depends on the virtual address it was translated at. The pc is in
+// R8 and only ever moves relative to itself, jumps keep its segment bits,
+// and links go by the key below. A block is in the lookup table at the
+// address it was translated for, and at every alias the dispatcher has
+// missed on since
+struct SharedBlock
+{
+    Block* block;
+    std::vector<uint32_t> aliases;
+};
+
+std::unordered_map<uint32_t, SharedBlock> sharedBlocks;
+uint64_t aliasesMapped;
+
+// Physical address, plus whatever about the segment would change how the
+// code is translated. Cached and uncached segments run the same here, so
+// for now that's nothing
+uint32_t BlockKey(uint32_t addr)
+{
+    return Translate(addr);
+}
+
+Block* EEJitX64::GetSharedBlock(uint32_t addr)
+{
+    auto it = sharedBlocks.find(BlockKey(addr));
+    return it != sharedBlocks.end() ? it->second.block : nullptr;
+}
+
+// Block records come out of slabs and are recycled through a free list, so
+// compiling and invalidating blocks stays off the heap once it's warmed up
+constexpr int BLOCK_SLAB_SIZE = 4096;
+std::vector<Block*> freeBlocks;
+
+Block* EEJitX64::AllocBlock()
+{
+    if (freeBlocks.empty())
+    {
+        Block* slab = new Block[BLOCK_SLAB_SIZE];
+        for (int i = BLOCK_SLAB_SIZE - 1; i >= 0; i--)
+            freeBlocks.push_back(&slab[i]);
+    }
+
+    Block* block = freeBlocks.back();
+    freeBlocks.pop_back();
+    *block = {};
+    return block;
+}
+
+// Return address prediction
+// Calls push the address they return to, along with a stub in the calling
+// block that jumps there. The stub is an exit like any other, linked once
+// the block it returns to is compiled. A JR $ra that goes back to the
+// address on top goes through the stub instead of the dispatcher. Entries
+// are only checked by guest address, so the stack is dropped whenever a
+// block is freed, in case one of its stubs is on it
+constexpr int RETURN_STACK_SIZE = 16;
+
+struct ReturnStack
+{
+    struct Entry
+    {
+        uint32_t guest;
+        const uint8_t* host;
+    } entries[RETURN_STACK_SIZE];
+    uint32_t top;
+    uint64_t hits, misses;
+};
+
+static_assert(sizeof(ReturnStack::Entry) == 16, "Return stack entries are indexed with a shift");
+
+ReturnStack returnStack;
+
+void ClearReturnStack()
+{
+    for (auto& entry : returnStack.entries)
+        entry = {0xFFFFFFFF, nullptr};
+}
+
+void FreeBlock(Block* block)
+{
+    freeBlocks.push_back(block);
+    ClearReturnStack();
+}
+
+
+// Every block exit that wants to jump to a given guest address, linked or
+// not, by BlockKey
+std::unordered_map<uint32_t, std::vector<BlockLink*>> linksTo;
+
+// Links are patched through the writable view of the code cache, so they
+// point at code by its writable address too. Jumps within the cache are
+// relative, so they work the same from either view
+void PatchLink(BlockLink* link, uint8_t* dest)
+{
+    *(int32_t*)link->patch = (int32_t)(dest - (link->patch + 4));
+}
+
+void LinkBlock(Block* block)
+{
+    for (uint32_t i = 0; i < block->link_count; i++)
+    {
+        auto& link = block->links[i];
+        linksTo[BlockKey(link.target)].push_back(&link);
+
+        if (Block* target = EEJitX64::GetSharedBlock(link.target))
+            PatchLink(&link, CodeCache::ToWrite(target->entryPoint));
+    }
+
+    auto it = linksTo.find(BlockKey(block->addr));
+    if (it == linksTo.end())
+        return;
+
+    for (auto link : it->second)
+        PatchLink(link, CodeCache::ToWrite(block->entryPoint));
+}
+
+// Inline caches
+// Other register jumps leave through a compare against the last address
+// they went to and a jump straight into its block, linked like any other
+// exit. When the compare fails, the cache is pointed at the new address
+//     cmp r8d, imm32
+//     jne miss
+//     jmp rel32
+// Caches are found by the executable address of their cmp
+constexpr int INLINE_CACHE_PATCH = 14; // From the cmp to the rel32 of the jmp
+std::unordered_map<const uint8_t*, BlockLink*> inlineCaches;
+uint64_t inlineCacheMisses;
+
+const uint8_t* GetInlineCacheSite(BlockLink* link)
+{
+    return CodeCache::ToExec(link->patch - INLINE_CACHE_PATCH);
+}
+
+// Called from the miss path of the cache at `site`, which just jumped to `target`
+void UpdateInlineCache(const uint8_t* site, uint32_t target)
+{
+    auto it = inlineCaches.find(site);
+    if (it == inlineCaches.end())
+        return;
+
+    BlockLink* link = it->second;
+    std::erase(linksTo[BlockKey(link->target)], link);
+    link->target = target;
+    linksTo[BlockKey(target)].push_back(link);
+
+    *(uint32_t*)(CodeCache::ToWrite(site) + 3) = target;
+    Block* block = EEJitX64::GetSharedBlock(target);
+    PatchLink(link, block ? CodeCache::ToWrite(block->entryPoint) : link->unlinked);
+    inlineCacheMisses++;
+}
+
+void UnlinkBlock(Block* block)
+{
+    auto it = linksTo.find(BlockKey(block->addr));
+    if (it != linksTo.end())
+        for (auto link : it->second)
+            PatchLink(link, link->unlinked);
+
+    for (uint32_t i = 0; i < block->link_count; i++)
+    {
+        auto& link = block->links[i];
+        auto& incoming = linksTo[BlockKey(link.target)];
+        std::erase(incoming, &link);
+        if (link.inline_cache)
+            inlineCaches.erase(GetInlineCacheSite(&link));
+    }
+}
+
+// Physical 4 KB pages that translated code was read from, along with the
+// blocks overlapping each one. A write to any other page only costs a bit
+// test. Code pages in RAM and the scratchpad are also write-protected in the
+// fastmem arena, so inline stores to them fault, get patched to the slow
+// path and invalidate through the Bus instead of going unnoticed
+constexpr int CODE_PAGE_SHIFT = 12;
+uint64_t codePages[(1 << (32 - CODE_PAGE_SHIFT)) / 64];
+std::unordered_map<uint32_t, std::vector<Block*>> pageBlocks;
+
+bool IsCodePage(uint32_t page)
+{
+    return codePages[page / 64] & (1ULL << (page % 64));
+}
+
+void AddCodePages(Block* block)
+{
+    for (uint32_t i = 0; i < block->span_count; i++)
+    {
+        uint32_t start = Translate(block->spans[i].addr);
+        uint32_t end = start + block->spans[i].size;
+
+        for (uint32_t page = start >> CODE_PAGE_SHIFT; page <= (end - 1) >> CODE_PAGE_SHIFT; page++)
+        {
+            // Spans of a trace can share a page
+            auto& blocks = pageBlocks[page];
+            if (std::find(blocks.begin(), blocks.end(), block) == blocks.end())
+                blocks.push_back(block);
+
+            if (!IsCodePage(page))
+            {
+                codePages[page / 64] |= (1ULL << (page % 64));
+                if (FastMem::IsWritable(page << CODE_PAGE_SHIFT))
+                    FastMem::SetWriteProtected(page << CODE_PAGE_SHIFT, true);
+            }
+        }
+    }
+}
+
+void RemoveCodePages(Block* block)
+{
+    for (uint32_t i = 0; i < block->span_count; i++)
+    {
+        uint32_t start = Translate(block->spans[i].addr);
+        uint32_t end = start + block->spans[i].size;
+
+        for (uint32_t page = start >> CODE_PAGE_SHIFT; page <= (end - 1) >> CODE_PAGE_SHIFT; page++)
+        {
+            auto it = pageBlocks.find(page);
+            if (it == pageBlocks.end())
+                continue;
+
+            std::erase(it->second, block);
+            if (!it->second.empty())
+                continue;
+
+            pageBlocks.erase(it);
+            codePages[page / 64] &= ~(1ULL << (page % 64));
+            if (FastMem::IsWritable(page << CODE_PAGE_SHIFT))
+                FastMem::SetWriteProtected(page << CODE_PAGE_SHIFT, false);
+        }
+    }
+}
 
 Xbyak::CodeGenerator* generator;
-uint8_t* base;
 RegAllocatorX64 reg_alloc;
 
 #include "EEJitX64_Aliases.inl"
 
-void EEJitX64::JitStoreReg(GuestRegister reg)
+void EEJitX64::JitStoreReg(GuestRegister reg, int hostReg)
 {
     auto offs = reg_alloc.GetRegOffset(reg);
 
-    if (reg >= COP0_OFFS && reg < COP0_OFFS+32)
-        MOV(generator->dword[generator->rbp + offs], Xbyak::Reg32(reg_alloc.GetHostReg(reg)));
+    if (reg >= COP0_OFFS && reg < LO)
+        MOV(generator->dword[generator->rbp + offs], Xbyak::Reg32(hostReg));
     else
-        MOV(generator->qword[generator->rbp + offs], Xbyak::Reg64(reg_alloc.GetHostReg(reg)));
+        MOV(generator->qword[generator->rbp + offs], Xbyak::Reg64(hostReg));
 }
 
 void EEJitX64::JitLoadReg(GuestRegister reg, int hostReg)
 {
-    if (reg >= COP0_OFFS && reg < COP0_OFFS+32)
+    if (reg >= COP0_OFFS && reg < LO)
         MOV(Xbyak::Reg32(hostReg), generator->dword[generator->rbp + reg_alloc.GetRegOffset(reg)]);
     else
         MOV(Xbyak::Reg64(hostReg), generator->qword[generator->rbp + reg_alloc.GetRegOffset(reg)]);
 }
 
-void SaveHostRegisters()
+void EEJitX64::JitZeroReg(int hostReg)
 {
-    generator->push(generator->rbx);
-    generator->push(generator->rdx);
+    generator->xor_(Xbyak::Reg32(hostReg), Xbyak::Reg32(hostReg));
+}
+
+void EEJitX64::JitStoreXmm(GuestRegister reg, int xmm)
+{
+    generator->movdqu(generator->xword[generator->rbp + reg_alloc.GetRegOffset(reg)], Xbyak::Xmm(xmm));
+}
+
+void EEJitX64::JitLoadXmm(GuestRegister reg, int xmm)
+{
+    generator->movdqu(Xbyak::Xmm(xmm), generator->xword[generator->rbp + reg_alloc.GetRegOffset(reg)]);
+}
+
+void EEJitX64::JitZeroXmm(int xmm)
+{
+    generator->pxor(Xbyak::Xmm(xmm), Xbyak::Xmm(xmm));
+}
+
+// Block being translated and the guest pc of the current instruction
+// Blocks are emitted into the staging area, and everything in them that
+// depends on where they are in memory is recorded as they go, so they can
+// be copied into the code cache later. Jumps within the block are relative
+// and need nothing
+EEJitX64::TranslatedBlock* translating;
+// Writable address of the block's code
+const uint8_t* blockCode;
+uint32_t guest_pc;
+
+void AddReloc(const uint8_t* at, TranslationCache::RelocType type, int64_t value)
+{
+    translating->relocs.push_back({(uint32_t)(at - blockCode), type, value});
+}
+
+// Loads the address of something in the emulator into RAX, relocated the
+// same way
+void JitLoadHostAddress(const void* ptr)
+{
+    generator->db(0x48);
+    generator->db(0xB8);
+    AddReloc(generator->getCurr(), TranslationCache::RelocType::HostPointer, TranslationCache::ToImageOffset(ptr));
+    generator->dq(reinterpret_cast<uint64_t>(ptr));
+}
+
+// With profile_blocks, bump one of the block's counters: 0 counts entries,
+// 1 + an ExitKind the exits taken that way. Clobbers RAX and the flags
+void JitCount(int counter)
+{
+    if (!EEJit::profile_blocks)
+        return;
+
+    generator->db(0x48);
+    generator->db(0xB8);
+    AddReloc(generator->getCurr(), TranslationCache::RelocType::BlockCounter, counter);
+    generator->dq(0);
+    generator->inc(generator->qword[generator->rax]);
+}
+
+// Fastmem: guest memory accesses are emitted as a single mov off R14, the
+// base of the FastMem arena. When one hits MMIO or read-only memory it
+// faults, and the SIGSEGV handler patches the access into a jmp to a slow
+// path that goes through the Bus instead. Each site maps to its slow path,
+// both by their executable address
+std::map<const uint8_t*, const uint8_t*> fastmemSites;
+
+// Slow paths for the block being translated, emitted after its last exit
+// They're the block's cold code, which is put apart from the hot code when
+// the block is installed. Jumps between the two are relocated for that
+std::vector<std::function<void()>> slowPaths;
+
+void AddColdCrossing(const uint8_t* rel32, bool to_cold)
+{
+    AddReloc(rel32, TranslationCache::RelocType::ColdCrossing, to_cold ? 1 : -1);
+}
+
+// Jumps to `cold_path`, emitted with the slow paths, if the flags match
+// `jcc`, the second byte of a jcc rel32 opcode, or always if it's 0
+void JitColdPath(uint8_t jcc, std::function<void()> cold_path)
+{
+    if (jcc)
+    {
+        generator->db(0x0F);
+        generator->db(jcc);
+    }
+    else
+        generator->db(0xE9);
+    uint8_t* rel32 = (uint8_t*)generator->getCurr();
+    generator->dd(0);
+
+    slowPaths.push_back([=]()
+    {
+        *(int32_t*)rel32 = (int32_t)(generator->getCurr() - (rel32 + 4));
+        AddColdCrossing(rel32, true);
+        cold_path();
+    });
+}
+
+constexpr uint8_t JCC_NE = 0x85;
+constexpr uint8_t JCC_G = 0x8F;
+
+// Back from cold code to `resume` in the hot code
+void JitResumeHot(const uint8_t* resume)
+{
+    generator->jmp((const void*)resume, Xbyak::CodeGenerator::T_NEAR);
+    AddColdCrossing(generator->getCurr() - 4, false);
+}
+
+struct sigaction oldSegvAction;
+
+// Only patches the faulting site, so nothing else is touched in signal
+// context. Stores to code pages take the slow path from then on, and the
+// Bus drops the code they overwrite through MarkDirty
+void SegvHandler(int sig, siginfo_t* info, void* ctx)
+{
+    auto uc = reinterpret_cast<ucontext_t*>(ctx);
+    auto rip = reinterpret_cast<uint8_t*>(uc->uc_mcontext.gregs[REG_RIP]);
+
+    auto it = fastmemSites.find(rip);
+    if (it != fastmemSites.end() && FastMem::Contains(info->si_addr))
+    {
+        // jmp rel32 over the access, which is always at least 5 bytes
+        uint8_t* patch = CodeCache::ToWrite(rip);
+        patch[0] = 0xE9;
+        *(int32_t*)(patch + 1) = (int32_t)(it->second - (rip + 5));
+        return;
+    }
+
+    // Not ours, hand it to whoever had SIGSEGV before us
+    if (oldSegvAction.sa_flags & SA_SIGINFO)
+        oldSegvAction.sa_sigaction(sig, info, ctx);
+    else if (oldSegvAction.sa_handler != SIG_DFL && oldSegvAction.sa_handler != SIG_IGN)
+        oldSegvAction.sa_handler(sig);
+    else
+    {
+        // Let the fault happen again and kill us
+        signal(sig, SIG_DFL);
+    }
+}
+
+// Dispatcher entry points, emitted once into the static area of the code cache
+// Translated code runs with RBP pointing at the processor state, R8 holding
+// pc, R14 holding the fastmem base and R15 holding the cycles left in this
+// dispatch
+typedef int (*dispatcherEntry)(EmotionEngine::ProcessorState* state);
+
+dispatcherEntry dispatcher;
+// Jump targets for emitted code, by their writable address
+const uint8_t* dispatchLoop; // Looks up the block at R8 and jumps to it
+const uint8_t* dispatchOutOfCycles;
+// Calls the function in RCX, keeping the pc and the caller saved registers
+// the allocator hands out, XMM ones included. Every call out of translated
+// code goes through here, instead of saving and restoring them around each
+// one. RDX is scratch, and carries the top half of 128-bit results back
+const uint8_t* hostCall;
+
+const uint8_t* GetStaticTarget(int64_t target)
+{
+    switch (target)
+    {
+    case TranslationCache::DispatchLoop: return dispatchLoop;
+    case TranslationCache::DispatchOutOfCycles: return dispatchOutOfCycles;
+    default: return hostCall;
+    }
+}
+
+void EmitHostCall()
+{
+    hostCall = generator->getCurr();
+
+    // The call here leaves the stack 8 bytes off, put it back in line
     generator->push(generator->r8);
     generator->push(generator->r9);
     generator->push(generator->r10);
     generator->push(generator->r11);
-}
-
-void RestoreHostRegisters()
-{
+    generator->sub(generator->rsp, 8 + 6 * 16);
+    for (int i = 0; i < 6; i++)
+        generator->movdqa(generator->xword[generator->rsp + i * 16], Xbyak::Xmm(2 + i));
+    generator->call(generator->rcx);
+    for (int i = 0; i < 6; i++)
+        generator->movdqa(Xbyak::Xmm(2 + i), generator->xword[generator->rsp + i * 16]);
+    generator->add(generator->rsp, 8 + 6 * 16);
     generator->pop(generator->r11);
     generator->pop(generator->r10);
     generator->pop(generator->r9);
     generator->pop(generator->r8);
-    generator->pop(generator->rdx);
-    generator->pop(generator->rbx);
+    generator->ret();
+}
+
+// Calls into the emulator through RCX and the host call thunk, which keeps
+// the registers translated code needs. Always the 10 byte mov, so there's a
+// full imm64 to relocate
+void JitCallHost(const void* func)
+{
+    generator->db(0x48);
+    generator->db(0xB9);
+    AddReloc(generator->getCurr(), TranslationCache::RelocType::HostPointer, TranslationCache::ToImageOffset(func));
+    generator->dq(reinterpret_cast<uint64_t>(func));
+    generator->call((const void*)hostCall);
+    AddReloc(generator->getCurr() - 4, TranslationCache::RelocType::StaticJump, TranslationCache::HostCall);
+}
+
+Xbyak::Address JitCheckInterrupt()
+{
+    return generator->byte[generator->rbp + offsetof(EmotionEngine::ProcessorState, check_interrupt)];
+}
+
+// Linked exits and cache hits jump straight into the next block, this sends
+// them through the dispatcher's interrupt check instead when it's needed
+void JitInterruptExit()
+{
+    generator->cmp(JitCheckInterrupt(), 0);
+    generator->jne((const void*)dispatchLoop);
+    AddReloc(generator->getCurr() - 4, TranslationCache::RelocType::StaticJump, TranslationCache::DispatchLoop);
 }
 
-void JitPrologue()
+void EmitDispatcher()
 {
-    // Load RBP with the state pointer, passed in RDI
-    for (int i = 0; i < 16; i++)
-        if (i != 4)
-            generator->push(Xbyak::Reg64(i));
+    Xbyak::Label loop, exit, out_of_cycles, interrupt, miss;
+
+    dispatcher = (dispatcherEntry)CodeCache::ToExec(generator->getCurr());
+
+    // Save host state once for the whole dispatch
+    generator->push(generator->rbx);
+    generator->push(generator->rbp);
+    generator->push(generator->r12);
+    generator->push(generator->r13);
+    generator->push(generator->r14);
+    generator->push(generator->r15);
+    // Keep the stack 16-byte aligned for calls out of translated code
+    generator->sub(generator->rsp, 8);
+
     MOV(generator->rbp, generator->rdi);
-    MOV(generator->r8, generator->rsi);
+    MOV(generator->r14, reinterpret_cast<uint64_t>(FastMem::GetBase()));
+    MOV(generator->r8d, generator->dword[generator->rbp + offsetof(EmotionEngine::ProcessorState, pc)]);
+    generator->movsxd(generator->r15, generator->dword[generator->rbp + offsetof(EmotionEngine::ProcessorState, cycles_left)]);
+
+    // Always run at least one block, so the guest makes progress
+    generator->L(loop);
+    dispatchLoop = generator->getCurr();
+
+    // Leave if an enabled interrupt is pending
+    // Cause.IP & Status.IM, with Status.IE and EIE set and EXL and ERL clear
+    Xbyak::Label no_interrupt;
+    MOV(JitCheckInterrupt(), 0);
+    MOV(generator->eax, generator->dword[generator->rbp + offsetof(EmotionEngine::ProcessorState, cop0_regs[12])]);
+    MOV(generator->ecx, generator->dword[generator->rbp + offsetof(EmotionEngine::ProcessorState, cop0_regs[13])]);
+    generator->and_(generator->ecx, generator->eax);
+    generator->test(generator->ecx, 0x8C00);
+    generator->jz(no_interrupt);
+    generator->and_(generator->eax, 0x10007);
+    generator->cmp(generator->eax, 0x10001);
+    generator->je(interrupt, Xbyak::CodeGenerator::T_NEAR);
+    generator->L(no_interrupt);
+
+    // blockPages[pc >> 12]->entries[(pc & 0xfff) >> 2]
+    MOV(generator->eax, generator->r8d);
+    generator->shr(generator->eax, BLOCK_PAGE_SHIFT);
+    MOV(generator->rcx, reinterpret_cast<uint64_t>(blockPages));
+    MOV(generator->rax, generator->qword[generator->rcx + generator->rax * 8]);
+    generator->test(generator->rax, generator->rax);
+    generator->jz(miss);
+    MOV(generator->ecx, generator->r8d);
+    generator->and_(generator->ecx, (1 << BLOCK_PAGE_SHIFT) - 4);
+    MOV(generator->rax, generator->qword[generator->rax + generator->rcx * 2]);
+    generator->test(generator->rax, generator->rax);
+    generator->jz(miss);
+    generator->jmp(generator->rax);
+
+    generator->L(out_of_cycles);
+    dispatchOutOfCycles = generator->getCurr();
+    MOV(generator->eax, (int)EEJitX64::DispatchExit::OutOfCycles);
+    generator->jmp(exit);
+
+    generator->L(interrupt);
+    MOV(generator->eax, (int)EEJitX64::DispatchExit::Interrupt);
+    generator->jmp(exit);
+
+    generator->L(miss);
+    MOV(generator->eax, (int)EEJitX64::DispatchExit::BlockMiss);
+
+    generator->L(exit);
+    MOV(generator->dword[generator->rbp + offsetof(EmotionEngine::ProcessorState, pc)], generator->r8d);
+    generator->lea(generator->ecx, generator->ptr[generator->r8 + 4]);
+    MOV(generator->dword[generator->rbp + offsetof(EmotionEngine::ProcessorState, next_pc)], generator->ecx);
+    MOV(generator->dword[generator->rbp + offsetof(EmotionEngine::ProcessorState, cycles_left)], generator->r15d);
+
+    generator->add(generator->rsp, 8);
+    generator->pop(generator->r15);
+    generator->pop(generator->r14);
+    generator->pop(generator->r13);
+    generator->pop(generator->r12);
+    generator->pop(generator->rbp);
+    generator->pop(generator->rbx);
+    generator->ret();
+}
+
+EEJit::IdleStats EEJit::idle_stats;
+
+void IdleLoopSkipped(int64_t cycles)
+{
+    EEJit::idle_stats.skips++;
+    EEJit::idle_stats.cycles += cycles;
 }
 
-void JitEpilogue()
+// Leave the block with R8 holding the next pc, charging the cycles executed
+// on the way to this exit
+// If the successor is known at compile time, the exit gets a jump that is
+// patched to go straight into the successor once it has been compiled
+// `idle` exits go back into a loop that only waits, see EEJitOpt::MarkIdleLoop.
+// Going around again can't change anything before the scheduler runs, so
+// the rest of the budget is used up at once, and the budget ends at the next
+// scheduler event. With no more than this exit's cycles left it's charged as
+// usual, which keeps lockstep's one block runs exact
+void JitExit(uint32_t target, bool linkable, uint32_t cycles, bool idle = false, EEJit::ExitKind kind = EEJit::ExitKind::Static)
 {
     // First, we need to writeback all registers to memory
     reg_alloc.DoWriteback();
+    JitCount(1 + (int)kind);
+
+    if (idle)
+    {
+        generator->cmp(generator->r15, cycles);
+        JitColdPath(JCC_G, [=]()
+        {
+            MOV(generator->rdi, generator->r15);
+            JitCallHost((const void*)&IdleLoopSkipped);
+            generator->xor_(generator->r15d, generator->r15d);
+            generator->jmp((const void*)dispatchOutOfCycles, Xbyak::CodeGenerator::T_NEAR);
+            AddReloc(generator->getCurr() - 4, TranslationCache::RelocType::StaticJump, TranslationCache::DispatchOutOfCycles);
+        });
+    }
+
+    generator->sub(generator->r15, cycles);
+    // Out of cycles, go back to the scheduler
+    generator->jle((const void*)dispatchOutOfCycles);
+    AddReloc(generator->getCurr() - 4, TranslationCache::RelocType::StaticJump, TranslationCache::DispatchOutOfCycles);
+    if (linkable)
+        JitInterruptExit();
+    generator->jmp((const void*)dispatchLoop, Xbyak::CodeGenerator::T_NEAR);
+    AddReloc(generator->getCurr() - 4, TranslationCache::RelocType::StaticJump, TranslationCache::DispatchLoop);
+
+    if (linkable)
+        translating->links.push_back({target, (uint32_t)(generator->getCurr() - 4 - blockCode)});
+}
+
+// Push the return address of the call at guest_pc, R8 holds the pc of its
+// delay slot
+void JitPushReturn()
+{
+    uint32_t return_pc = guest_pc + 8;
+    auto entries = offsetof(ReturnStack, entries);
+
+    JitLoadHostAddress(&returnStack);
+    MOV(generator->ecx, generator->dword[generator->rax + offsetof(ReturnStack, top)]);
+    generator->inc(generator->ecx);
+    generator->and_(generator->ecx, RETURN_STACK_SIZE - 1);
+    MOV(generator->dword[generator->rax + offsetof(ReturnStack, top)], generator->ecx);
+    generator->shl(generator->ecx, 4);
+    generator->lea(generator->edx, generator->ptr[generator->r8 + 4]);
+    MOV(generator->dword[generator->rax + generator->rcx + entries], generator->edx);
+    // Pointed at the stub once it's emitted
+    generator->lea(generator->rdx, generator->ptr[generator->rip]);
+    uint8_t* stub_disp = (uint8_t*)generator->getCurr() - 4;
+    MOV(generator->qword[generator->rax + generator->rcx + entries + 8], generator->rdx);
+
+    slowPaths.push_back([=]()
+    {
+        *(int32_t*)stub_disp = (int32_t)(generator->getCurr() - (stub_disp + 4));
+        AddColdCrossing(stub_disp, true);
+        generator->jmp((const void*)dispatchLoop, Xbyak::CodeGenerator::T_NEAR);
+        AddReloc(generator->getCurr() - 4, TranslationCache::RelocType::StaticJump, TranslationCache::DispatchLoop);
+        translating->links.push_back({return_pc, (uint32_t)(generator->getCurr() - 4 - blockCode)});
+    });
+}
+
+// Exit through a JR $ra, with R8 holding where it returns to
+void JitReturnExit(uint32_t cycles)
+{
+    auto entries = offsetof(ReturnStack, entries);
+
+    reg_alloc.DoWriteback();
+    JitCount(1 + (int)EEJit::ExitKind::Return);
 
-    // Write R8 back to pc
-    MOV(generator->qword[generator->rbp + offsetof(EmotionEngine::ProcessorState, pc)], generator->r8);
-    MOV(generator->qword[generator->rbp + offsetof(EmotionEngine::ProcessorState, next_pc)], generator->r8);
-    ADD(generator->qword[generator->rbp + offsetof(EmotionEngine::ProcessorState, next_pc)], 4);
+    // Popped whichever way the block leaves, so the stack stays in step
+    // with the guest's calls when a slice ends on a return
+    JitLoadHostAddress(&returnStack);
+    MOV(generator->ecx, generator->dword[generator->rax + offsetof(ReturnStack, top)]);
+    generator->lea(generator->edx, generator->ptr[generator->rcx - 1]);
+    generator->and_(generator->edx, RETURN_STACK_SIZE - 1);
+    MOV(generator->dword[generator->rax + offsetof(ReturnStack, top)], generator->edx);
+    generator->shl(generator->ecx, 4);
 
-    // Now restore all host registers
-    for (int i = 15; i >= 0; i--)
-        if (i != 4)
-            generator->pop(Xbyak::Reg64(i));
-    generator->ret();
+    generator->sub(generator->r15, cycles);
+    generator->jle((const void*)dispatchOutOfCycles);
+    AddReloc(generator->getCurr() - 4, TranslationCache::RelocType::StaticJump, TranslationCache::DispatchOutOfCycles);
+    JitInterruptExit();
+
+    generator->cmp(generator->r8d, generator->dword[generator->rax + generator->rcx + entries]);
+    JitColdPath(JCC_NE, [=]()
+    {
+        generator->inc(generator->qword[generator->rax + offsetof(ReturnStack, misses)]);
+        generator->jmp((const void*)dispatchLoop, Xbyak::CodeGenerator::T_NEAR);
+        AddReloc(generator->getCurr() - 4, TranslationCache::RelocType::StaticJump, TranslationCache::DispatchLoop);
+    });
+    generator->inc(generator->qword[generator->rax + offsetof(ReturnStack, hits)]);
+    generator->jmp(generator->qword[generator->rax + generator->rcx + entries + 8]);
+}
+
+// Exit through any other register jump, with R8 holding its target
+void JitIndirectExit(uint32_t cycles)
+{
+    reg_alloc.DoWriteback();
+    JitCount(1 + (int)EEJit::ExitKind::Indirect);
+
+    generator->sub(generator->r15, cycles);
+    generator->jle((const void*)dispatchOutOfCycles);
+    AddReloc(generator->getCurr() - 4, TranslationCache::RelocType::StaticJump, TranslationCache::DispatchOutOfCycles);
+    JitInterruptExit();
+
+    // Always the imm32 form, it gets patched
+    const uint8_t* site = generator->getCurr();
+    generator->db(0x41);
+    generator->db(0x81);
+    generator->db(0xF8);
+    generator->dd(TranslationCache::INLINE_CACHE);
+
+    JitColdPath(JCC_NE, [=]()
+    {
+        generator->lea(generator->rdi, generator->ptr[generator->rip + site]);
+        AddColdCrossing(generator->getCurr() - 4, false);
+        MOV(generator->esi, generator->r8d);
+        JitCallHost((const void*)&UpdateInlineCache);
+        generator->jmp((const void*)dispatchLoop, Xbyak::CodeGenerator::T_NEAR);
+        AddReloc(generator->getCurr() - 4, TranslationCache::RelocType::StaticJump, TranslationCache::DispatchLoop);
+    });
+    generator->jmp((const void*)dispatchLoop, Xbyak::CodeGenerator::T_NEAR);
+    AddReloc(generator->getCurr() - 4, TranslationCache::RelocType::StaticJump, TranslationCache::DispatchLoop);
+    translating->links.push_back({TranslationCache::INLINE_CACHE, (uint32_t)(generator->getCurr() - 4 - blockCode)});
+}
+
+// COP1 registers, FPRs and ACC are always used from the processor state
+Xbyak::Address JitFpr(IRValue& v)
+{
+    return generator->dword[generator->rbp + offsetof(EmotionEngine::ProcessorState, fprs) + v.GetReg() * 4];
+}
+
+Xbyak::Address JitAcc()
+{
+    return generator->dword[generator->rbp + offsetof(EmotionEngine::ProcessorState, acc)];
+}
+
+Xbyak::Address JitFpuCondition()
+{
+    return generator->byte[generator->rbp + offsetof(EmotionEngine::ProcessorState, c)];
 }
 
 void JitMov(IRInstruction& i)
 {
     if (i.args[0].IsReg() && i.args[1].IsCop0())
     {
-        if (i.args[1].GetReg() == 0)
+        if (i.args[0].GetReg() == 0)
         {
             printf("WARNING: Mov cop0 -> $zero\n");
             return;
@@ -97,19 +766,33 @@ void JitMov(IRInstruction& i)
         else
         {
             auto src = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)(i.args[1].GetReg()+COP0_OFFS)));
-            auto dst = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
-            MOV(dst, src);
+            auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
+            generator->movsxd(dst, src);
         }
     }
+    else if (i.args[0].IsReg() && i.args[1].IsCop1())
+    {
+        // MFC1 sign extends
+        if (i.args[0].GetReg())
+            generator->movsxd(Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true)), JitFpr(i.args[1]));
+    }
+    else if (i.args[1].IsReg() && i.args[0].IsCop1())
+    {
+        auto src = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
+        MOV(JitFpr(i.args[0]), src);
+    }
     else if (i.args[1].IsReg() && i.args[0].IsCop0())
     {
         auto src = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
         auto dst = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)(i.args[0].GetReg()+COP0_OFFS), true));
         MOV(dst, src);
+        // Status or Cause, might unmask a pending interrupt
+        if (i.args[0].GetReg() == 12 || i.args[0].GetReg() == 13)
+            MOV(JitCheckInterrupt(), 1);
     }
     else if (i.args[0].IsReg() && i.args[1].IsImm())
     {
-        if (i.args[1].GetReg() == 0)
+        if (i.args[0].GetReg() == 0)
         {
             printf("WARNING: Mov imm -> $zero\n");
             return;
@@ -129,8 +812,8 @@ void JitMov(IRInstruction& i)
         }
         else
         {
-            auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)(i.args[0].GetReg()), true));
             auto src = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)(i.args[1].GetReg())));
+            auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)(i.args[0].GetReg()), true));
 			MOV(dst, src);
         }
     }
@@ -146,30 +829,16 @@ void JitSlt(IRInstruction& i)
     // Args[0] = dst, Args[1] = op1, Args[2] = op2
     if (i.args[2].IsImm())
     {
-        auto dst = Xbyak::Reg8(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
-        if (i.args[1].GetReg() == 0)
-        {
-            int32_t imm = i.args[2].GetImm();
-            MOV(generator->rdi, 0);
-            generator->cmp(generator->rdi, imm);
-			if (i.is_unsigned)
-				generator->seta(dst);
-			else
-	        	generator->setl(dst);
-            generator->movzx(Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true)), dst);
-        }
-        else
-        {
-            auto src = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
-            int32_t imm = i.args[2].GetImm();
+        auto src = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
+        auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
+        int32_t imm = i.args[2].GetImm();
 
-            generator->cmp(src, imm);
-			if (i.is_unsigned)
-				generator->seta(dst);
-			else
-	        	generator->setl(dst);
-            generator->movzx(Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true)), dst);
-        }
+        generator->cmp(src, imm);
+		if (i.is_unsigned)
+			generator->setb(dst.cvt8());
+		else
+	        generator->setl(dst.cvt8());
+        generator->movzx(dst.cvt32(), dst.cvt8());
     }
     else
     {
@@ -178,94 +847,127 @@ void JitSlt(IRInstruction& i)
     }
 }
 
-void JitBranch(IRInstruction& i)
+// Jumps to `label` if the branch condition doesn't hold, or if it does with
+// `on_taken`
+void JitBranchCondition(IRInstruction& i, Xbyak::Label& label, bool on_taken = false)
 {
-    auto op1 = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg()));
+    int rs = i.args[0].GetReg();
+    int rt = i.args[1].GetReg();
 
-    Xbyak::Label cond_failed;
+    // Compare against $zero without going through the allocator
+    if (i.args[0].IsCop1())
+        generator->cmp(JitFpuCondition(), 0);
+    else if (rt == 0 && rs == 0)
+        generator->cmp(generator->rdi, generator->rdi);
+    else if (rt == 0)
+        generator->cmp(Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)rs)), 0);
+    else if (rs == 0)
+        generator->cmp(Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)rt)), 0);
+    else
+    {
+        auto op1 = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)rs));
+        auto op2 = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)rt));
+        generator->cmp(op1, op2);
+    }
 
+    bool jump_if_equal;
 	switch (i.b_type)
     {
     case IRInstruction::BranchType::EQ:
-    {
-        if (i.args[1].GetReg() == 0)
-        {
-            generator->cmp(op1, 0);
-            generator->jne(cond_failed);
-        }
-        else if (i.args[0].GetReg() == 0)
-        {
-            auto op2 = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
-            generator->cmp(op2, 0);
-            generator->jne(cond_failed);
-        }
-        else
-        {
-            auto op2 = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
-            generator->cmp(op1, op2);
-            generator->jne(cond_failed);
-        }
+        jump_if_equal = on_taken;
         break;
-    }
     case IRInstruction::BranchType::NE:
-    {
-        if (i.args[1].GetReg() == 0)
-        {
-            generator->cmp(op1, 0);
-            generator->je(cond_failed);
-        }
-        else if (i.args[0].GetReg() == 0)
-        {
-            auto op2 = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
-            MOV(generator->rdi, 0);
-            generator->cmp(generator->rdi, i.args[1].GetImm());
-            generator->je(cond_failed);
-        }
-        else
-        {
-            auto op2 = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
-            generator->cmp(op1, op2);
-            generator->je(cond_failed);
-        }
-        break;
-    }
-    case IRInstruction::BranchType::AL:
+        jump_if_equal = !on_taken;
         break;
     default:
         printf("Unknown branch condition %d\n", i.b_type);
         exit(1);
     }
 
-    Xbyak::Label done;
+    if (jump_if_equal)
+        generator->je(label, Xbyak::CodeGenerator::T_NEAR);
+    else
+        generator->jne(label, Xbyak::CodeGenerator::T_NEAR);
+}
 
-    ADD(generator->r8, i.args[2].GetImm()-4);
-    generator->jmp(done);
-    generator->L(cond_failed);
-    ADD(generator->r8, 4);
-	if (i.is_likely)
-	{
-	    ADD(generator->r8, 4);
-		JitEpilogue();
-	}
-    generator->L(done);
+void JitInstruction(IRInstruction& i);
+
+// Emits a branch together with its delay slot, R8 holds the pc of the branch
+// itself here. `cycles` is what the block has cost once the delay slot has
+// run. The taken arm runs its own copy of the delay slot and leaves through
+// a linkable side exit. The other arm either exits the same way, if the
+// branch ends the block, or carries on with the rest of the block
+// For a branch the trace follows it's the other way around: the not taken
+// arm is the side exit, and the taken one carries on at the target
+void JitBranch(IRInstruction& i, IRInstruction& delay_slot, bool ends_block, uint32_t cycles)
+{
+    uint32_t taken_pc = guest_pc + 4 + (int32_t)i.args[2].GetImm();
+    uint32_t not_taken_pc = guest_pc + 8;
+
+    Xbyak::Label cond_failed;
+    size_t delay_pos = reg_alloc.GetPosition() + 1;
+
+    if (i.trace_taken)
+    {
+        if (i.b_type != IRInstruction::BranchType::AL)
+        {
+            Xbyak::Label taken;
+            JitBranchCondition(i, taken, true);
+
+            auto state = reg_alloc.Save();
+
+            ADD(generator->r8, 8);
+            reg_alloc.SetPosition(delay_pos);
+            if (!i.is_likely)
+                JitInstruction(delay_slot);
+            JitExit(not_taken_pc, true, cycles, false, EEJit::ExitKind::Side);
+
+            generator->L(taken);
+            reg_alloc.Restore(state);
+        }
+
+        ADD(generator->r8, taken_pc - guest_pc);
+        reg_alloc.SetPosition(delay_pos);
+        JitInstruction(delay_slot);
+        return;
+    }
+
+    if (i.b_type != IRInstruction::BranchType::AL)
+        JitBranchCondition(i, cond_failed);
+
+    auto state = reg_alloc.Save();
+
+    ADD(generator->r8, taken_pc - guest_pc);
+    reg_alloc.SetPosition(delay_pos);
+    JitInstruction(delay_slot);
+    JitExit(taken_pc, true, cycles, i.is_idle_loop);
+
+    if (i.b_type == IRInstruction::BranchType::AL)
+        return;
+
+    generator->L(cond_failed);
+    reg_alloc.Restore(state);
+
+    ADD(generator->r8, 8);
+	// Likely branches nullify the delay slot when not taken
+	reg_alloc.SetPosition(delay_pos);
+	if (!i.is_likely)
+		JitInstruction(delay_slot);
+
+    if (ends_block)
+        JitExit(not_taken_pc, true, cycles);
 }
 
 void JitOr(IRInstruction& i)
 {
     if (i.args[2].IsImm())
     {
-        if (i.args[1].GetReg() == i.args[0].GetReg())
-        {
-            auto src = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
-            generator->or_(src, i.args[2].GetImm());
-            return;
-        }
         auto src = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
         auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
 
-        MOV(generator->rdi, src);
-        generator->or_(generator->rdi, i.args[2].GetImm());
-        MOV(dst, generator->rdi);
+        if (dst != src)
+            MOV(dst, src);
+        generator->or_(dst, i.args[2].GetImm());
     }
     else
     {
@@ -286,40 +988,49 @@ void JitOr(IRInstruction& i)
 			auto src1 = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
 	        auto src2 = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[2].GetReg()));
 	        auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
-			generator->or_(src1, src2);
-			MOV(dst, src1);
+			MOV(generator->rdi, src1);
+			generator->or_(generator->rdi, src2);
+			MOV(dst, generator->rdi);
 		}
     }
 }
 
+// R8 holds the pc of the delay slot here
 void JitJump(IRInstruction& i)
 {
+    if (i.should_link)
+        JitPushReturn();
+
     if (i.args[0].IsReg() && i.args.size() == 1)
     {
+        auto src = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg()));
+
         if (i.should_link)
         {
+            MOV(generator->edi, src);
             auto lr = Xbyak::Reg64(reg_alloc.GetHostReg(REG_RA, true));
-            MOV(lr, generator->r8);
+            generator->lea(lr, generator->ptr[generator->r8 + 4]);
+            MOV(generator->r8d, generator->edi);
         }
-
-        auto src = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg()));
-        MOV(generator->r8, src);
+        else
+            MOV(generator->r8d, src);
     }
 	else if (i.args[0].IsReg() && i.args.size() == 2)
     {
 		assert(i.should_link);
-       	auto lr = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
-        MOV(lr, generator->r8);
-    
         auto src = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
-        generator->mov(generator->r8d, src);
+        MOV(generator->edi, src);
+
+       	auto lr = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
+        generator->lea(lr, generator->ptr[generator->r8 + 4]);
+        MOV(generator->r8d, generator->edi);
     }
     else
     {
 		if (i.should_link)
 		{
 			auto lr = Xbyak::Reg64(reg_alloc.GetHostReg(REG_RA, true));
-            MOV(lr, generator->r8);
+            generator->lea(lr, generator->ptr[generator->r8 + 4]);
 		}
 
 		generator->and_(generator->r8, 0xF0000000);
@@ -333,19 +1044,18 @@ void JitAdd(IRInstruction instr)
     {
         if (instr.args[1].GetReg() == 0)
         {
-            auto dst = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)instr.args[0].GetReg(), true));
-            auto imm = instr.args[2].GetImm();
-            MOV(dst, imm);
+            auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[0].GetReg(), true));
+            MOV(dst, instr.args[2].GetImm64());
         }
         else
         {
-            auto src = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)instr.args[1].GetReg()));
-            auto dst = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)instr.args[0].GetReg(), true));
-            auto imm = instr.args[2].GetImm();
+            auto src = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[1].GetReg()));
+            auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[0].GetReg(), true));
+            int32_t imm = instr.args[2].GetImm();
 
-            MOV(generator->rdi, src);
-            ADD(generator->rdi, imm);
-            MOV(dst, generator->rdi);
+            // 32-bit add, sign extended into the 64-bit register
+            generator->lea(generator->edi, generator->ptr[src + imm]);
+            generator->movsxd(dst, generator->edi);
         }
     }
     else if (instr.args[1].IsReg() && instr.args[2].IsReg() && instr.size == IRInstruction::Size64)
@@ -353,29 +1063,27 @@ void JitAdd(IRInstruction instr)
 		if (instr.args[1].GetReg() == 0 && instr.args[2].GetReg() == 0)
 		{
 			auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[0].GetReg(), true));
-            MOV(dst, 0);
+            generator->xor_(dst.cvt32(), dst.cvt32());
 		}
         else if (instr.args[1].GetReg() == 0)
         {
-            auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[0].GetReg(), true));
             auto imm = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[2].GetReg()));
+            auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[0].GetReg(), true));
             MOV(dst, imm);
         }
 		else if (instr.args[2].GetReg() == 0)
         {
-            auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[0].GetReg(), true));
             auto imm = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[1].GetReg()));
+            auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[0].GetReg(), true));
             MOV(dst, imm);
         }
         else
         {
             auto src = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[1].GetReg()));
-            auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[0].GetReg(), true));
             auto src2 = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[2].GetReg()));
+            auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[0].GetReg(), true));
 
-            MOV(generator->rdi, src);
-            ADD(generator->rdi, src2);
-            MOV(dst, generator->rdi);
+            generator->lea(dst, generator->ptr[src + src2]);
         }
     }
     else
@@ -385,63 +1093,388 @@ void JitAdd(IRInstruction instr)
     }
 }
 
-void JitStore(IRInstruction instr)
+// Emits the inline half of a fastmem access. `access` must touch guest
+// memory through [R14+RAX] exactly once, and `slow_path` does the same access
+// through the Bus, with the guest address still in EAX
+void JitFastmemAccess(std::function<void()> access, std::function<void()> slow_path)
 {
-    if (instr.access_size == IRInstruction::U32)
+    const uint8_t* site = generator->getCurr();
+    access();
+    // Leave room for the jmp the fault handler writes
+    while (generator->getCurr() - site < 5)
+        generator->nop();
+    const uint8_t* resume = generator->getCurr();
+
+    slowPaths.push_back([=]()
     {
-        auto src = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)instr.args[2].GetReg()));
-        auto dst = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)instr.args[0].GetReg()));
-        auto imm = instr.args[1].GetImm();
+        translating->sites.push_back({(uint32_t)(site - blockCode), (uint32_t)(generator->getCurr() - blockCode)});
+        slow_path();
+        JitResumeHot(resume);
+    });
+}
+
+// Leaves the guest address of a load/store (base + offset) in EAX, wrapped
+// to 32 bits. The base is an immediate if it was known at compile time
+void JitAddress(IRInstruction& instr)
+{
+    int32_t offset = instr.args[1].GetImm();
+
+    if (instr.args[2].IsImm())
+        MOV(generator->eax, instr.args[2].GetImm() + offset);
+    else if (instr.args[2].GetReg() == 0)
+        MOV(generator->eax, offset);
+    else
+        generator->lea(generator->eax, generator->ptr[Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[2].GetReg())) + offset]);
+}
+
+// Calls `func(addr, rt)` with the address in EAX, leaving the result in RAX
+void JitCallMemoryHelper(void* func, int rt)
+{
+    int value = rt ? reg_alloc.GetHostReg((GuestRegister)rt) : -1;
 
-        SaveHostRegisters();
+    MOV(generator->edi, generator->eax);
+    if (value < 0)
+        generator->xor_(generator->esi, generator->esi);
+    else
+        MOV(generator->rsi, Xbyak::Reg64(value));
+    JitCallHost(func);
+}
 
-        MOV(generator->rdi, src);
-        ADD(generator->rdi, imm);
-        MOV(generator->rsi, dst);
-        MOV(generator->rcx, reinterpret_cast<uint64_t>(Bus::Write32));
-        generator->call(generator->rcx);
+// Unaligned accesses are rare enough to just go through the Bus, with the
+// same helpers the interpreter uses
+void* GetPartialHelper(IRInstruction& instr)
+{
+    bool left = instr.direction == IRInstruction::Direction::Left;
+    bool dword = instr.access_size == IRInstruction::U64;
 
-        RestoreHostRegisters();
+    if (instr.instr == LOAD)
+    {
+        if (dword)
+            return left ? (void*)EEInterpreter::LoadDoubleLeft : (void*)EEInterpreter::LoadDoubleRight;
+        return left ? (void*)EEInterpreter::LoadWordLeft : (void*)EEInterpreter::LoadWordRight;
     }
-    else if (instr.access_size == IRInstruction::U64)
+
+    if (dword)
+        return left ? (void*)EEInterpreter::StoreDoubleLeft : (void*)EEInterpreter::StoreDoubleRight;
+    return left ? (void*)EEInterpreter::StoreWordLeft : (void*)EEInterpreter::StoreWordRight;
+}
+
+Xbyak::Address FastmemOperand(IRInstruction::AccessSize size)
+{
+    switch (size)
+    {
+    case IRInstruction::U8: return generator->byte[generator->r14 + generator->rax];
+    case IRInstruction::U16: return generator->word[generator->r14 + generator->rax];
+    case IRInstruction::U32: return generator->dword[generator->r14 + generator->rax];
+    case IRInstruction::U64: return generator->qword[generator->r14 + generator->rax];
+    default: return generator->xword[generator->r14 + generator->rax];
+    }
+}
+
+// Moves a loaded value into `dest`, sign or zero extending it to 64 bits
+void JitExtendLoad(int dest, const Xbyak::Operand& src, IRInstruction::AccessSize size, bool is_unsigned)
+{
+    auto dst = Xbyak::Reg64(dest);
+
+    switch (size)
+    {
+    case IRInstruction::U8:
+        if (is_unsigned)
+            generator->movzx(dst.cvt32(), src);
+        else
+            generator->movsx(dst, src);
+        break;
+    case IRInstruction::U16:
+        if (is_unsigned)
+            generator->movzx(dst.cvt32(), src);
+        else
+            generator->movsx(dst, src);
+        break;
+    case IRInstruction::U32:
+        if (is_unsigned)
+            MOV(dst.cvt32(), src);
+        else
+            generator->movsxd(dst, src);
+        break;
+    default:
+        MOV(dst, src);
+        break;
+    }
+}
+
+Xbyak::Address JitVf(int reg);
+
+// LQ/SQ move all 128 bits of rt, in an XMM register, and ignore the low 4
+// bits of the address. LQC2/SQC2 go through XMM0 to a VF register
+void JitLoadQuad(IRInstruction& instr)
+{
+    JitAddress(instr);
+    generator->and_(generator->eax, ~0xF);
+
+    bool vector = instr.args[0].IsCop2();
+    auto dst = vector ? generator->xmm0 : Xbyak::Xmm(reg_alloc.GetXmmReg((GuestRegister)instr.args[0].GetReg(), true));
+
+    JitFastmemAccess([=]()
+    {
+        generator->movdqu(dst, FastmemOperand(IRInstruction::U128));
+    },
+    [=]()
+    {
+        MOV(generator->edi, generator->eax);
+        JitCallHost(reinterpret_cast<const void*>(Bus::Read128));
+        generator->movq(dst, generator->rax);
+        generator->movq(generator->xmm1, generator->rdx);
+        generator->punpcklqdq(dst, generator->xmm1);
+    });
+
+    if (vector && instr.args[0].GetReg())
+    {
+        JitLoadHostAddress(&VectorUnit::VU0::vu0_state);
+        generator->movdqu(JitVf(instr.args[0].GetReg()), dst);
+    }
+}
+
+void JitStoreQuad(IRInstruction& instr)
+{
+    bool vector = instr.args[0].IsCop2();
+    if (vector)
+    {
+        JitLoadHostAddress(&VectorUnit::VU0::vu0_state);
+        generator->movdqu(generator->xmm0, JitVf(instr.args[0].GetReg()));
+    }
+
+    JitAddress(instr);
+    generator->and_(generator->eax, ~0xF);
+
+    auto src = vector ? generator->xmm0 : Xbyak::Xmm(reg_alloc.GetXmmReg((GuestRegister)instr.args[0].GetReg()));
+
+    JitFastmemAccess([=]()
+    {
+        generator->movdqu(FastmemOperand(IRInstruction::U128), src);
+    },
+    [=]()
+    {
+        // The 128-bit value goes in RSI:RDX
+        MOV(generator->edi, generator->eax);
+        generator->movq(generator->rsi, src);
+        generator->movdqa(generator->xmm0, src);
+        generator->punpckhqdq(generator->xmm0, generator->xmm0);
+        generator->movq(generator->rdx, generator->xmm0);
+        JitCallHost(reinterpret_cast<const void*>(Bus::Write128));
+    });
+}
+
+// LWC1 and SWC1 go through ECX
+void JitLoadFloat(IRInstruction& instr)
+{
+    JitAddress(instr);
+    auto dst = JitFpr(instr.args[0]);
+
+    JitFastmemAccess([=]()
+    {
+        MOV(generator->ecx, FastmemOperand(IRInstruction::U32));
+    },
+    [=]()
+    {
+        MOV(generator->edi, generator->eax);
+        JitCallHost(reinterpret_cast<const void*>(Bus::Read32));
+        MOV(generator->ecx, generator->eax);
+    });
+
+    MOV(dst, generator->ecx);
+}
+
+void JitStoreFloat(IRInstruction& instr)
+{
+    JitAddress(instr);
+    MOV(generator->ecx, JitFpr(instr.args[0]));
+
+    JitFastmemAccess([=]()
+    {
+        MOV(FastmemOperand(IRInstruction::U32), generator->ecx);
+    },
+    [=]()
+    {
+        MOV(generator->edi, generator->eax);
+        MOV(generator->esi, generator->ecx);
+        JitCallHost(reinterpret_cast<const void*>(Bus::Write32));
+    });
+}
+
+void JitLoad(IRInstruction instr)
+{
+    // Args[0] = rt, Args[1] = offset, Args[2] = base
+    int rt = instr.args[0].GetReg();
+
+    if (instr.access_size == IRInstruction::U128)
     {
-        auto src = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)instr.args[2].GetReg()));
-        auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)instr.args[0].GetReg()));
-        auto imm = instr.args[1].GetImm();
+        JitLoadQuad(instr);
+        return;
+    }
 
-        SaveHostRegisters();
+    if (instr.args[0].IsCop1())
+    {
+        JitLoadFloat(instr);
+        return;
+    }
 
-        MOV(generator->rdi, src);
-        ADD(generator->rdi, imm);
-        MOV(generator->rsi, dst);
-        MOV(generator->rcx, reinterpret_cast<uint64_t>(Bus::Write64));
-        generator->call(generator->rcx);
+    if (instr.is_partial)
+    {
+        JitAddress(instr);
+        JitCallMemoryHelper(GetPartialHelper(instr), rt);
+        if (rt)
+            MOV(Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)rt, true)), generator->rax);
+        return;
+    }
 
-        RestoreHostRegisters();
+    void* read;
+    switch (instr.access_size)
+    {
+    case IRInstruction::U8: read = reinterpret_cast<void*>(Bus::Read8); break;
+    case IRInstruction::U16: read = reinterpret_cast<void*>(Bus::Read16); break;
+    case IRInstruction::U32: read = reinterpret_cast<void*>(Bus::Read32); break;
+    case IRInstruction::U64: read = reinterpret_cast<void*>(Bus::Read64); break;
+    default:
+        printf("Unknown load access size %d\n", (int)instr.access_size);
+        exit(1);
     }
+
+    JitAddress(instr);
+
+    // Loads into $zero still happen, for the side effects
+    int dest = rt ? reg_alloc.GetHostReg((GuestRegister)rt, true) : (int)HostRegisters::RCX;
+    auto size = instr.access_size;
+    bool is_unsigned = instr.is_unsigned;
+
+    JitFastmemAccess([=]()
+    {
+        JitExtendLoad(dest, FastmemOperand(size), size, is_unsigned);
+    },
+    [=]()
+    {
+        MOV(generator->edi, generator->eax);
+        JitCallHost(read);
+
+        switch (size)
+        {
+        case IRInstruction::U8: JitExtendLoad(dest, generator->al, size, is_unsigned); break;
+        case IRInstruction::U16: JitExtendLoad(dest, generator->ax, size, is_unsigned); break;
+        case IRInstruction::U32: JitExtendLoad(dest, generator->eax, size, is_unsigned); break;
+        default: JitExtendLoad(dest, generator->rax, size, is_unsigned); break;
+        }
+    });
+}
+
+// Stores to an MMIO register known at compile time call its handler directly
+bool JitBoundStore(IRInstruction& instr)
+{
+    if (!instr.args[2].IsImm() || instr.is_partial)
+        return false;
+
+    uint32_t addr = Translate(instr.args[2].GetImm() + (int32_t)instr.args[1].GetImm());
+    void* handler = nullptr;
+
+    if (instr.access_size == IRInstruction::U32)
+        handler = reinterpret_cast<void*>(Bus::GetWrite32Handler(addr));
+    else if (instr.access_size == IRInstruction::U64)
+        handler = reinterpret_cast<void*>(Bus::GetWrite64Handler(addr));
+
+    if (!handler)
+        return false;
+
+    int rt = instr.args[0].GetReg();
+    int value = rt ? reg_alloc.GetHostReg((GuestRegister)rt) : -1;
+
+    MOV(generator->edi, addr);
+    if (value < 0)
+        generator->xor_(generator->esi, generator->esi);
     else
+        MOV(generator->rsi, Xbyak::Reg64(value));
+    JitCallHost(handler);
+    return true;
+}
+
+void JitStore(IRInstruction instr)
+{
+    // Args[0] = value, Args[1] = offset, Args[2] = base
+    int rt = instr.args[0].GetReg();
+
+    if (instr.access_size == IRInstruction::U128)
+    {
+        JitStoreQuad(instr);
+        return;
+    }
+
+    if (instr.args[0].IsCop1())
+    {
+        JitStoreFloat(instr);
+        return;
+    }
+
+    if (instr.is_partial)
+    {
+        JitAddress(instr);
+        JitCallMemoryHelper(GetPartialHelper(instr), rt);
+        return;
+    }
+
+    if (JitBoundStore(instr))
+        return;
+
+    void* write;
+    switch (instr.access_size)
     {
+    case IRInstruction::U8: write = reinterpret_cast<void*>(Bus::Write8); break;
+    case IRInstruction::U16: write = reinterpret_cast<void*>(Bus::Write16); break;
+    case IRInstruction::U32: write = reinterpret_cast<void*>(Bus::Write32); break;
+    case IRInstruction::U64: write = reinterpret_cast<void*>(Bus::Write64); break;
+    default:
         printf("Unknown store access size %d\n", (int)instr.access_size);
-        assert(0);
+        exit(1);
     }
+
+    // $zero is stored as an immediate
+    int value = rt ? reg_alloc.GetHostReg((GuestRegister)rt) : -1;
+    JitAddress(instr);
+
+    auto size = instr.access_size;
+
+    JitFastmemAccess([=]()
+    {
+        auto mem = FastmemOperand(size);
+
+        if (value < 0)
+            MOV(mem, 0);
+        else if (size == IRInstruction::U8)
+            MOV(mem, Xbyak::Reg8(value));
+        else if (size == IRInstruction::U16)
+            MOV(mem, Xbyak::Reg16(value));
+        else if (size == IRInstruction::U32)
+            MOV(mem, Xbyak::Reg32(value));
+        else
+            MOV(mem, Xbyak::Reg64(value));
+    },
+    [=]()
+    {
+        MOV(generator->edi, generator->eax);
+        if (value < 0)
+            generator->xor_(generator->esi, generator->esi);
+        else
+            MOV(generator->rsi, Xbyak::Reg64(value));
+        JitCallHost(write);
+    });
 }
 
 void JitAnd(IRInstruction& i)
 {
     if (i.args[2].IsImm())
     {
-        if (i.args[1].GetReg() == i.args[0].GetReg())
-        {
-            auto src = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
-            generator->and_(src, i.args[2].GetImm());
-            return;    
-        }
-        auto src = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
+        auto src = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
         auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
 
-        MOV(generator->edi, src);
-        generator->and_(generator->edi, i.args[2].GetImm());
-        generator->movsxd(dst, generator->edi);
+        if (dst != src)
+            MOV(dst, src);
+        generator->and_(dst, i.args[2].GetImm());
     }
     else
     {
@@ -456,20 +1489,20 @@ void JitShift(IRInstruction i)
 	if (i.args[2].IsImm() && i.is_logical && i.direction == IRInstruction::Direction::Left)
 	{
 		auto src = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
-        auto dst = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
+        auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
 
-		MOV(generator->cl, i.args[2].GetImm());
-		generator->shl(src, generator->cl);
-		generator->mov(dst, src);
+		MOV(generator->edi, src);
+		generator->shl(generator->edi, i.args[2].GetImm() & 31);
+		generator->movsxd(dst, generator->edi);
 	}
 	else if (i.args[2].IsImm() && i.is_logical && i.direction == IRInstruction::Direction::Right)
 	{
 		auto src = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
-        auto dst = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
+        auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
 
-		MOV(generator->cl, i.args[2].GetImm());
-		generator->shr(src, generator->cl);
-		generator->mov(dst, src);
+		MOV(generator->edi, src);
+		generator->shr(generator->edi, i.args[2].GetImm() & 31);
+		generator->movsxd(dst, generator->edi);
 	}
 	else
 	{
@@ -485,29 +1518,29 @@ void JitMULT(IRInstruction i)
 
 	auto src = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
 	auto src2 = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[2].GetReg()));
-	auto lo = Xbyak::Reg64(reg_alloc.GetHostReg(lo_reg));
-	auto hi = Xbyak::Reg64(reg_alloc.GetHostReg(hi_reg));
-
-	reg_alloc.InvalidateRegister(HostRegisters::RDX);
+	auto lo = Xbyak::Reg64(reg_alloc.GetHostReg(lo_reg, true));
+	auto hi = Xbyak::Reg64(reg_alloc.GetHostReg(hi_reg, true));
 
+	// The full 64-bit product fits in RAX, so RDX stays out of it
 	if (i.is_unsigned)
 	{
-		generator->xor_(generator->rdx, generator->rdx);
-		generator->movsxd(generator->rax, src);
-		generator->mul(src2);
-		generator->movsxd(lo, generator->eax);
-		generator->movsxd(hi, generator->edx);
-
-		if (i.args[0].GetReg())
-		{
-			auto dst = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg()));
-			MOV(dst, lo);
-		}
+		MOV(generator->eax, src);
+		MOV(generator->edi, src2);
 	}
 	else
 	{
-		printf("TODO: MULT");
-		assert(0);
+		generator->movsxd(generator->rax, src);
+		generator->movsxd(generator->rdi, src2);
+	}
+	generator->imul(generator->rax, generator->rdi);
+	generator->movsxd(lo, generator->eax);
+	generator->shr(generator->rax, 32);
+	generator->movsxd(hi, generator->eax);
+
+	if (i.args[0].GetReg())
+	{
+		auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
+		MOV(dst, lo);
 	}
 }
 
@@ -518,18 +1551,26 @@ void JitDIV(IRInstruction i)
 
 	auto src = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
 	auto src2 = Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[2].GetReg()));
-	auto lo = Xbyak::Reg64(reg_alloc.GetHostReg(lo_reg));
-	auto hi = Xbyak::Reg64(reg_alloc.GetHostReg(hi_reg));
-
-	reg_alloc.InvalidateRegister(HostRegisters::RDX);
+	auto lo = Xbyak::Reg64(reg_alloc.GetHostReg(lo_reg, true));
+	auto hi = Xbyak::Reg64(reg_alloc.GetHostReg(hi_reg, true));
 
 	if (i.is_unsigned)
 	{
-		generator->xor_(generator->rdx, generator->rdx);
-		MOV(generator->rax, src);
+		Xbyak::Label div_zero, done;
+
+		// Dividing by zero gives LO = -1 and HI = rs instead of a host fault
+		generator->test(src2, src2);
+		generator->jz(div_zero);
+		MOV(generator->eax, src);
+		generator->xor_(generator->edx, generator->edx);
 		generator->div(src2);
-		MOV(lo, generator->rax);
-		MOV(hi, generator->rdx);
+		generator->movsxd(lo, generator->eax);
+		generator->movsxd(hi, generator->edx);
+		generator->jmp(done);
+		generator->L(div_zero);
+		MOV(lo, -1);
+		generator->movsxd(hi, src);
+		generator->L(done);
 	}
 	else
 	{
@@ -538,115 +1579,1522 @@ void JitDIV(IRInstruction i)
 	}
 }
 
-void JitIncPC()
-{
-    ADD(generator->r8, 4);
-}
+// MMI
+// Guest GPRs are used whole from XMM registers, see RegAllocatorX64::GetXmmReg.
+// HI and LO are used from the processor state, where the GPR allocator's
+// halves of them are written back to first. Results are built in scratch
+// registers when rd could also be a source
 
-void EEJitX64::TranslateBlock(Block *block)
+// HI:HI1 or LO:LO1 as one 128-bit operand
+Xbyak::Address JitHiLo(bool hi, bool write)
 {
-	printf("Translating block at 0x%08x\n", block->addr);
-    reg_alloc.Reset();
-
-    block->entryPoint = (blockEntry)generator->getCurr();
-
-    IRInstruction prev;
+    GuestRegister low = hi ? GuestRegister::HI : GuestRegister::LO;
+    GuestRegister high = hi ? GuestRegister::HI1 : GuestRegister::LO1;
 
-    for (auto& i : block->instructions)
+    if (write)
     {
-        if (i.instr != PROLOGUE && i.instr != EPILOGUE && i.instr != BRANCH && prev.instr != JUMP)
-            JitIncPC();
-        
-        switch (i.instr)
-        {
-        case NOP:
-            generator->nop();
-            break;
-        case PROLOGUE:
-            JitPrologue();
-            break;
-        case EPILOGUE:
-            JitEpilogue();
-            break;
-        case MOVE:
-            JitMov(i);
-            break;
-        case SLT:
-            JitSlt(i);
-            break;
-        case BRANCH:
-            JitBranch(i);
-            break;
-        case OR:
-            JitOr(i);
-            break;
-        case JUMP:
-            JitJump(i);
-            break;
-        case ADD:
-            JitAdd(i);
-            break;
-        case STORE:
-            JitStore(i);
-            break;
-		case AND:
-			JitAnd(i);
-			break;
-		case SHIFT:
-			JitShift(i);
-			break;
-		case MULT:
-			JitMULT(i);
-			break;
-		case DIV:
-			JitDIV(i);
-			break;
-		case BREAK:
-			generator->ud2();
-			break;
-        default:
-            printf("[EEJIT_X64]: Cannot emit unknown IR instruction %d\n", i.instr);
-            exit(1);
-        }
-
-        prev = i;
+        reg_alloc.Discard(low);
+        reg_alloc.Discard(high);
     }
+    else
+    {
+        reg_alloc.Flush(low);
+        reg_alloc.Flush(high);
+    }
+    return generator->xword[generator->rbp + reg_alloc.GetRegOffset(low)];
 }
 
-void EEJitX64::CacheBlock(Block *block)
+// dst = a op b, for the SSE ops that overwrite their first operand
+template <typename F>
+void JitMMIBinary(const Xbyak::Xmm& dst, const Xbyak::Xmm& a, const Xbyak::Xmm& b, F op)
 {
-    // TODO: Actually cache the block
-	blockMap[block->addr] = block;
-
-    if ((generator->getCurr() - generator->getCode()) >= (128*1024*1024))
+    if (dst == b && dst != a)
     {
-        delete[] generator;
-        generator = new Xbyak::CodeGenerator(0xffffffff, (void*)base);
-		blockMap.clear();
+        generator->movdqa(generator->xmm0, a);
+        op(generator->xmm0, b);
+        generator->movdqa(dst, generator->xmm0);
+        return;
     }
+
+    if (dst != a)
+        generator->movdqa(dst, a);
+    op(dst, b);
 }
 
-Block *EEJitX64::GetBlockForAddr(uint32_t addr)
+// Saturating 32-bit adds and subtracts, which SSE doesn't have. Lanes that
+// overflowed get INT32_MAX or INT32_MIN, whichever the wrapped result's sign
+// isn't
+void JitMMISaturateWords(const Xbyak::Xmm& dst, const Xbyak::Xmm& a, const Xbyak::Xmm& b, bool sub)
 {
-	return blockMap[addr];
+    auto& g = *generator;
+
+    g.movdqa(g.xmm1, a);
+    if (sub)
+        g.psubd(g.xmm1, b);
+    else
+        g.paddd(g.xmm1, b);
+
+    // Overflowed where the sign bit of the mask is set, all blendvps looks at
+    g.movdqa(g.xmm8, a);
+    g.pxor(g.xmm8, g.xmm1);
+    g.movdqa(g.xmm0, sub ? a : b);
+    g.pxor(g.xmm0, sub ? b : g.xmm1);
+    g.pand(g.xmm0, g.xmm8);
+
+    g.movdqa(g.xmm8, g.xmm1);
+    g.psrad(g.xmm8, 31);
+    g.pcmpeqd(g.xmm9, g.xmm9);
+    g.pslld(g.xmm9, 31);
+    g.pxor(g.xmm8, g.xmm9);
+    g.blendvps(g.xmm1, g.xmm8);
+    g.movdqa(dst, g.xmm1);
 }
 
-void EEJitX64::Initialize()
+// PMULTW and friends, the products of the even words end up in rd as
+// doublewords, and their halves sign extended in LO and HI
+void JitMMIMultiply(IRInstruction& i, const Xbyak::Xmm& rs, const Xbyak::Xmm& rt)
 {
-    base = (uint8_t*)mmap(nullptr, 0xffffffff, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    auto& g = *generator;
+    auto op = i.mmi_op;
+    bool is_unsigned = op == MMIOp::PMULTUW || op == MMIOp::PMADDUW;
 
-    if (base == MAP_FAILED)
-	{
-		printf("[EEJIT_X64]: Failed to map base! %s\n", strerror(errno));
-		exit(1);
-	}
+    g.movdqa(g.xmm0, rs);
+    if (is_unsigned)
+        g.pmuludq(g.xmm0, rt);
+    else
+        g.pmuldq(g.xmm0, rt);
+
+    if (op == MMIOp::PMADDW || op == MMIOp::PMADDUW || op == MMIOp::PMSUBW)
+    {
+        // HI:LO of the even words, as doublewords
+        g.movdqu(g.xmm1, JitHiLo(false, false));
+        g.pshufd(g.xmm1, g.xmm1, 0x08);
+        g.movdqu(g.xmm8, JitHiLo(true, false));
+        g.pshufd(g.xmm8, g.xmm8, 0x08);
+        g.punpckldq(g.xmm1, g.xmm8);
+
+        if (op == MMIOp::PMSUBW)
+        {
+            g.psubq(g.xmm1, g.xmm0);
+            g.movdqa(g.xmm0, g.xmm1);
+        }
+        else
+            g.paddq(g.xmm0, g.xmm1);
+    }
+
+    // Low words to LO, high words to HI
+    for (int hi = 0; hi < 2; hi++)
+    {
+        g.pshufd(g.xmm1, g.xmm0, hi ? 0xF5 : 0xA0);
+        g.movdqa(g.xmm8, g.xmm1);
+        g.psrad(g.xmm8, 31);
+        g.pblendw(g.xmm1, g.xmm8, 0xCC);
+        g.movdqu(JitHiLo(hi, true), g.xmm1);
+    }
 
-    generator = new Xbyak::CodeGenerator(0xffffffff, (void*)base);
+    if (i.args[0].GetReg())
+        g.movdqa(Xbyak::Xmm(reg_alloc.GetXmmReg((GuestRegister)i.args[0].GetReg(), true)), g.xmm0);
 }
 
-void EEJitX64::Dump()
+void JitMMI(IRInstruction& i)
 {
-    std::ofstream file("code.out", std::ios::binary);
-    file.write((char*)base, generator->getSize());
-    file.close();
+    auto& g = *generator;
+    auto op = i.mmi_op;
+
+    // Nothing to do if all it writes is $zero
+    if (!i.args[0].GetReg() && !MMIUsesHiLo(op))
+        return;
+
+    if (op == MMIOp::PLZCW)
+    {
+        // Only the low 64 bits of rs and rd, in GPRs
+        auto src = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
+        auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
+
+        // Leading zeros of x ^ (x >> 31), less one, as 31 - bsr of it
+        // shifted left with the low bit set, which is never zero
+        MOV(g.rdi, src);
+        for (int half = 0; half < 2; half++)
+        {
+            MOV(g.eax, g.edi);
+            MOV(g.edx, g.eax);
+            g.sar(g.edx, 31);
+            g.xor_(g.eax, g.edx);
+            g.lea(g.eax, g.ptr[g.rax + g.rax + 1]);
+            g.bsr(g.eax, g.eax);
+            MOV(half ? g.edx : g.ecx, 31);
+            g.sub(half ? g.edx : g.ecx, g.eax);
+            g.shr(g.rdi, 32);
+        }
+        g.shl(g.rdx, 32);
+        g.or_(g.rdx, g.rcx);
+        MOV(dst, g.rdx);
+        return;
+    }
+
+    // Sources first, so getting rd can't evict them
+    auto src = [&](int arg) { return Xbyak::Xmm(reg_alloc.GetXmmReg((GuestRegister)i.args[arg].GetReg())); };
+    auto dest = [&]() { return Xbyak::Xmm(reg_alloc.GetXmmReg((GuestRegister)i.args[0].GetReg(), true)); };
+
+    // rd = rs op rt, or rt op rs for the ones that take rt's lanes first
+    auto binary = [&](auto emit, bool rt_first = false)
+    {
+        auto rs = src(1), rt = src(2);
+        auto rd = dest();
+        if (rt_first)
+            JitMMIBinary(rd, rt, rs, emit);
+        else
+            JitMMIBinary(rd, rs, rt, emit);
+    };
+
+    // rd = rt shifted by the immediate
+    auto shift = [&](auto emit)
+    {
+        auto rt = src(2);
+        auto rd = dest();
+        if (rd != rt)
+            g.movdqa(rd, rt);
+        emit(rd, (int)i.args[1].GetImm());
+    };
+
+    // Halfwords of rt shuffled within each half
+    auto shuffle_halves = [&](uint8_t imm)
+    {
+        auto rt = src(2);
+        auto rd = dest();
+        g.pshuflw(rd, rt, imm);
+        g.pshufhw(rd, rd, imm);
+    };
+
+    auto shuffle_words = [&](uint8_t imm)
+    {
+        auto rt = src(2);
+        g.pshufd(dest(), rt, imm);
+    };
+
+    using X = const Xbyak::Xmm&;
+    using O = const Xbyak::Operand&;
+
+    switch (op)
+    {
+    case MMIOp::PADDW: binary([](X d, O s) { generator->paddd(d, s); }); break;
+    case MMIOp::PSUBW: binary([](X d, O s) { generator->psubd(d, s); }); break;
+    case MMIOp::PCGTW: binary([](X d, O s) { generator->pcmpgtd(d, s); }); break;
+    case MMIOp::PMAXW: binary([](X d, O s) { generator->pmaxsd(d, s); }); break;
+    case MMIOp::PADDH: binary([](X d, O s) { generator->paddw(d, s); }); break;
+    case MMIOp::PSUBH: binary([](X d, O s) { generator->psubw(d, s); }); break;
+    case MMIOp::PCGTH: binary([](X d, O s) { generator->pcmpgtw(d, s); }); break;
+    case MMIOp::PMAXH: binary([](X d, O s) { generator->pmaxsw(d, s); }); break;
+    case MMIOp::PADDB: binary([](X d, O s) { generator->paddb(d, s); }); break;
+    case MMIOp::PSUBB: binary([](X d, O s) { generator->psubb(d, s); }); break;
+    case MMIOp::PCGTB: binary([](X d, O s) { generator->pcmpgtb(d, s); }); break;
+    case MMIOp::PADDSH: binary([](X d, O s) { generator->paddsw(d, s); }); break;
+    case MMIOp::PSUBSH: binary([](X d, O s) { generator->psubsw(d, s); }); break;
+    case MMIOp::PADDSB: binary([](X d, O s) { generator->paddsb(d, s); }); break;
+    case MMIOp::PSUBSB: binary([](X d, O s) { generator->psubsb(d, s); }); break;
+    case MMIOp::PCEQW: binary([](X d, O s) { generator->pcmpeqd(d, s); }); break;
+    case MMIOp::PMINW: binary([](X d, O s) { generator->pminsd(d, s); }); break;
+    case MMIOp::PCEQH: binary([](X d, O s) { generator->pcmpeqw(d, s); }); break;
+    case MMIOp::PMINH: binary([](X d, O s) { generator->pminsw(d, s); }); break;
+    case MMIOp::PCEQB: binary([](X d, O s) { generator->pcmpeqb(d, s); }); break;
+    case MMIOp::PADDUH: binary([](X d, O s) { generator->paddusw(d, s); }); break;
+    case MMIOp::PSUBUH: binary([](X d, O s) { generator->psubusw(d, s); }); break;
+    case MMIOp::PADDUB: binary([](X d, O s) { generator->paddusb(d, s); }); break;
+    case MMIOp::PSUBUB: binary([](X d, O s) { generator->psubusb(d, s); }); break;
+    case MMIOp::PAND: binary([](X d, O s) { generator->pand(d, s); }); break;
+    case MMIOp::PXOR: binary([](X d, O s) { generator->pxor(d, s); }); break;
+    case MMIOp::POR: binary([](X d, O s) { generator->por(d, s); }); break;
+    case MMIOp::PNOR:
+        binary([](X d, O s)
+        {
+            generator->por(d, s);
+            generator->pcmpeqd(generator->xmm1, generator->xmm1);
+            generator->pxor(d, generator->xmm1);
+        });
+        break;
+
+    case MMIOp::PEXTLW: binary([](X d, O s) { generator->punpckldq(d, s); }, true); break;
+    case MMIOp::PEXTUW: binary([](X d, O s) { generator->punpckhdq(d, s); }, true); break;
+    case MMIOp::PEXTLH: binary([](X d, O s) { generator->punpcklwd(d, s); }, true); break;
+    case MMIOp::PEXTUH: binary([](X d, O s) { generator->punpckhwd(d, s); }, true); break;
+    case MMIOp::PEXTLB: binary([](X d, O s) { generator->punpcklbw(d, s); }, true); break;
+    case MMIOp::PEXTUB: binary([](X d, O s) { generator->punpckhbw(d, s); }, true); break;
+    case MMIOp::PCPYLD: binary([](X d, O s) { generator->punpcklqdq(d, s); }, true); break;
+    case MMIOp::PCPYUD: binary([](X d, O s) { generator->punpckhqdq(d, s); }); break;
+    case MMIOp::PPACW: binary([](X d, O s) { generator->shufps(d, s, 0x88); }, true); break;
+
+    case MMIOp::PPACH:
+    case MMIOp::PPACB:
+    {
+        // Clear the odd lanes, so packing with unsigned saturation truncates
+        int bits = op == MMIOp::PPACH ? 16 : 8;
+        auto rs = src(1), rt = src(2);
+        g.movdqa(g.xmm0, rt);
+        g.movdqa(g.xmm1, rs);
+        for (auto& x : {g.xmm0, g.xmm1})
+        {
+            if (op == MMIOp::PPACH)
+            {
+                g.pslld(x, bits);
+                g.psrld(x, bits);
+            }
+            else
+            {
+                g.psllw(x, bits);
+                g.psrlw(x, bits);
+            }
+        }
+        if (op == MMIOp::PPACH)
+            g.packusdw(g.xmm0, g.xmm1);
+        else
+            g.packuswb(g.xmm0, g.xmm1);
+        g.movdqa(dest(), g.xmm0);
+        break;
+    }
+
+    case MMIOp::PADDSW:
+    case MMIOp::PSUBSW:
+    {
+        auto rs = src(1), rt = src(2);
+        JitMMISaturateWords(dest(), rs, rt, op == MMIOp::PSUBSW);
+        break;
+    }
+
+    case MMIOp::PADDUW:
+    {
+        // Carried out where the sum is below rs, those lanes get all ones
+        auto rs = src(1), rt = src(2);
+        g.movdqa(g.xmm0, rs);
+        g.paddd(g.xmm0, rt);
+        g.movdqa(g.xmm1, g.xmm0);
+        g.pmaxud(g.xmm1, rs);
+        g.pcmpeqd(g.xmm1, g.xmm0);
+        g.pcmpeqd(g.xmm8, g.xmm8);
+        g.pxor(g.xmm1, g.xmm8);
+        g.por(g.xmm0, g.xmm1);
+        g.movdqa(dest(), g.xmm0);
+        break;
+    }
+
+    case MMIOp::PSUBUW:
+    {
+        auto rs = src(1), rt = src(2);
+        g.movdqa(g.xmm0, rs);
+        g.pmaxud(g.xmm0, rt);
+        g.psubd(g.xmm0, rt);
+        g.movdqa(dest(), g.xmm0);
+        break;
+    }
+
+    case MMIOp::PABSW:
+    case MMIOp::PABSH:
+    {
+        // The most negative value saturates, pabs leaves it as it is
+        auto rt = src(2);
+        bool word = op == MMIOp::PABSW;
+        if (word)
+            g.pabsd(g.xmm0, rt);
+        else
+            g.pabsw(g.xmm0, rt);
+        g.pcmpeqd(g.xmm1, g.xmm1);
+        if (word)
+        {
+            g.pslld(g.xmm1, 31);
+            g.pcmpeqd(g.xmm1, g.xmm0);
+        }
+        else
+        {
+            g.psllw(g.xmm1, 15);
+            g.pcmpeqw(g.xmm1, g.xmm0);
+        }
+        g.pxor(g.xmm0, g.xmm1);
+        g.movdqa(dest(), g.xmm0);
+        break;
+    }
+
+    case MMIOp::PSLLH: shift([](X d, int sa) { generator->psllw(d, sa & 15); }); break;
+    case MMIOp::PSRLH: shift([](X d, int sa) { generator->psrlw(d, sa & 15); }); break;
+    case MMIOp::PSRAH: shift([](X d, int sa) { generator->psraw(d, sa & 15); }); break;
+    case MMIOp::PSLLW: shift([](X d, int sa) { generator->pslld(d, sa); }); break;
+    case MMIOp::PSRLW: shift([](X d, int sa) { generator->psrld(d, sa); }); break;
+    case MMIOp::PSRAW: shift([](X d, int sa) { generator->psrad(d, sa); }); break;
+
+    case MMIOp::PSLLVW:
+    case MMIOp::PSRLVW:
+    case MMIOp::PSRAVW:
+    {
+        // No per lane shifts before AVX2, and there's only two of them
+        auto rs = src(1), rt = src(2);
+        for (int lane = 0; lane < 2; lane++)
+        {
+            g.pextrd(g.eax, rt, lane * 2);
+            g.pextrd(g.ecx, rs, lane * 2);
+            if (op == MMIOp::PSLLVW)
+                g.shl(g.eax, g.cl);
+            else if (op == MMIOp::PSRLVW)
+                g.shr(g.eax, g.cl);
+            else
+                g.sar(g.eax, g.cl);
+            g.movsxd(g.rax, g.eax);
+            g.pinsrq(g.xmm0, g.rax, lane);
+        }
+        g.movdqa(dest(), g.xmm0);
+        break;
+    }
+
+    case MMIOp::PEXEH: shuffle_halves(0xC6); break;
+    case MMIOp::PREVH: shuffle_halves(0x1B); break;
+    case MMIOp::PEXCH: shuffle_halves(0xD8); break;
+    case MMIOp::PCPYH: shuffle_halves(0x00); break;
+    case MMIOp::PEXEW: shuffle_words(0xC6); break;
+    case MMIOp::PROT3W: shuffle_words(0xC9); break;
+    case MMIOp::PEXCW: shuffle_words(0xD8); break;
+
+    case MMIOp::PINTH:
+    {
+        auto rs = src(1), rt = src(2);
+        g.movdqa(g.xmm0, rs);
+        g.punpckhqdq(g.xmm0, g.xmm0);
+        g.movdqa(g.xmm1, rt);
+        g.punpcklwd(g.xmm1, g.xmm0);
+        g.movdqa(dest(), g.xmm1);
+        break;
+    }
+
+    case MMIOp::PINTEH:
+    {
+        auto rs = src(1), rt = src(2);
+        g.movdqa(g.xmm0, rs);
+        g.pslld(g.xmm0, 16);
+        g.movdqa(g.xmm1, rt);
+        g.pblendw(g.xmm1, g.xmm0, 0xAA);
+        g.movdqa(dest(), g.xmm1);
+        break;
+    }
+
+    case MMIOp::PMULTW:
+    case MMIOp::PMADDW:
+    case MMIOp::PMSUBW:
+    case MMIOp::PMULTUW:
+    case MMIOp::PMADDUW:
+    {
+        auto rs = src(1), rt = src(2);
+        JitMMIMultiply(i, rs, rt);
+        break;
+    }
+
+    case MMIOp::PMFHI:
+    case MMIOp::PMFLO:
+        g.movdqu(dest(), JitHiLo(op == MMIOp::PMFHI, false));
+        break;
+    case MMIOp::PMTHI:
+    case MMIOp::PMTLO:
+    {
+        auto rs = src(1);
+        g.movdqu(JitHiLo(op == MMIOp::PMTHI, true), rs);
+        break;
+    }
+
+    case MMIOp::PMFHL_LW:
+        g.movdqu(g.xmm0, JitHiLo(false, false));
+        g.movdqu(g.xmm1, JitHiLo(true, false));
+        g.psllq(g.xmm1, 32);
+        g.pblendw(g.xmm0, g.xmm1, 0xCC);
+        g.movdqa(dest(), g.xmm0);
+        break;
+    case MMIOp::PMFHL_UW:
+        g.movdqu(g.xmm0, JitHiLo(false, false));
+        g.movdqu(g.xmm1, JitHiLo(true, false));
+        g.psrlq(g.xmm0, 32);
+        g.pblendw(g.xmm0, g.xmm1, 0xCC);
+        g.movdqa(dest(), g.xmm0);
+        break;
+    case MMIOp::PMFHL_LH:
+    case MMIOp::PMFHL_SH:
+        // Halfwords of LO and HI, then the middle words swapped so each half
+        // of rd has two from each
+        g.movdqu(g.xmm0, JitHiLo(false, false));
+        g.movdqu(g.xmm1, JitHiLo(true, false));
+        if (op == MMIOp::PMFHL_LH)
+        {
+            for (auto& x : {g.xmm0, g.xmm1})
+            {
+                g.pslld(x, 16);
+                g.psrld(x, 16);
+            }
+            g.packusdw(g.xmm0, g.xmm1);
+        }
+        else
+            g.packssdw(g.xmm0, g.xmm1);
+        g.pshufd(dest(), g.xmm0, 0xD8);
+        break;
+    case MMIOp::PMFHL_SLW:
+    {
+        // HI:LO of the even words as a 64-bit value, saturated to 32 bits
+        JitHiLo(false, false);
+        JitHiLo(true, false);
+        for (int lane = 0; lane < 2; lane++)
+        {
+            MOV(g.eax, g.dword[g.rbp + reg_alloc.GetRegOffset(GuestRegister::LO) + lane * 8]);
+            MOV(g.edx, g.dword[g.rbp + reg_alloc.GetRegOffset(GuestRegister::HI) + lane * 8]);
+            g.shl(g.rdx, 32);
+            g.or_(g.rax, g.rdx);
+            MOV(g.edx, INT32_MAX);
+            g.cmp(g.rax, g.rdx);
+            g.cmovg(g.rax, g.rdx);
+            MOV(g.rdx, (int64_t)INT32_MIN);
+            g.cmp(g.rax, g.rdx);
+            g.cmovl(g.rax, g.rdx);
+            g.pinsrq(g.xmm0, g.rax, lane);
+        }
+        g.movdqa(dest(), g.xmm0);
+        break;
+    }
+    case MMIOp::PMTHL_LW:
+    {
+        auto rs = src(1);
+        auto lo = JitHiLo(false, false);
+        auto hi = JitHiLo(true, false);
+        g.movdqu(g.xmm0, lo);
+        g.pblendw(g.xmm0, rs, 0x33);
+        g.movdqu(lo, g.xmm0);
+        g.movdqa(g.xmm1, rs);
+        g.psrlq(g.xmm1, 32);
+        g.movdqu(g.xmm0, hi);
+        g.pblendw(g.xmm0, g.xmm1, 0x33);
+        g.movdqu(hi, g.xmm0);
+        break;
+    }
+
+    default:
+        printf("[EEJIT_X64]: Cannot emit MMI instruction %d\n", (int)op);
+        exit(1);
+    }
+}
+
+// COP1
+// FPRs and ACC are used as memory operands, XMM0, XMM1, XMM8 and XMM9 are
+// scratch. How results are clamped is decided
+// here, when the block is compiled, see EmotionEngine::FPUClamp
+
+// Inf and NaN to +/-FLT_MAX, without branches. As integers, a signed min
+// catches the positive ones and an unsigned min the negative ones
+void JitClampFloat(const Xbyak::Xmm& x)
+{
+    auto& g = *generator;
+
+    MOV(g.ecx, 0x7F7FFFFF);
+    g.movd(g.xmm1, g.ecx);
+    g.pminsd(x, g.xmm1);
+    MOV(g.ecx, 0xFF7FFFFF);
+    g.movd(g.xmm1, g.ecx);
+    g.pminud(x, g.xmm1);
+}
+
+// Operands, clamped first in full mode
+void JitFpuOperand(const Xbyak::Xmm& x, const Xbyak::Address& src)
+{
+    generator->movss(x, src);
+    if (EmotionEngine::fpu_clamp == EmotionEngine::FPUClamp::Full)
+        JitClampFloat(x);
+}
+
+void JitFpuResult(const Xbyak::Address& dst, const Xbyak::Xmm& x)
+{
+    if (EmotionEngine::fpu_clamp != EmotionEngine::FPUClamp::None)
+        JitClampFloat(x);
+    generator->movss(dst, x);
+}
+
+// Clears the sign bit, for the square roots of the magnitude
+void JitFloatAbs(const Xbyak::Xmm& x)
+{
+    MOV(generator->ecx, 0x7FFFFFFF);
+    generator->movd(generator->xmm1, generator->ecx);
+    generator->pand(x, generator->xmm1);
+}
+
+void JitFPU(IRInstruction& i)
+{
+    auto& g = *generator;
+    auto op = i.fpu_op;
+
+    switch (op)
+    {
+    case FPUOp::ADD:
+    case FPUOp::SUB:
+    case FPUOp::MUL:
+    case FPUOp::DIV:
+    case FPUOp::MAX:
+    case FPUOp::MIN:
+    case FPUOp::ADDA:
+    case FPUOp::SUBA:
+    case FPUOp::MULA:
+        JitFpuOperand(g.xmm0, JitFpr(i.args[1]));
+        JitFpuOperand(g.xmm8, JitFpr(i.args[2]));
+        switch (op)
+        {
+        case FPUOp::ADD: case FPUOp::ADDA: g.addss(g.xmm0, g.xmm8); break;
+        case FPUOp::SUB: case FPUOp::SUBA: g.subss(g.xmm0, g.xmm8); break;
+        case FPUOp::MUL: case FPUOp::MULA: g.mulss(g.xmm0, g.xmm8); break;
+        case FPUOp::DIV: g.divss(g.xmm0, g.xmm8); break;
+        case FPUOp::MAX: g.maxss(g.xmm0, g.xmm8); break;
+        default: g.minss(g.xmm0, g.xmm8); break;
+        }
+        if (op == FPUOp::ADDA || op == FPUOp::SUBA || op == FPUOp::MULA)
+            JitFpuResult(JitAcc(), g.xmm0);
+        else
+            JitFpuResult(JitFpr(i.args[0]), g.xmm0);
+        break;
+    case FPUOp::MADD:
+    case FPUOp::MSUB:
+    case FPUOp::MADDA:
+    case FPUOp::MSUBA:
+        JitFpuOperand(g.xmm0, JitFpr(i.args[1]));
+        JitFpuOperand(g.xmm8, JitFpr(i.args[2]));
+        g.mulss(g.xmm0, g.xmm8);
+        JitFpuOperand(g.xmm9, JitAcc());
+        if (op == FPUOp::MADD || op == FPUOp::MADDA)
+            g.addss(g.xmm9, g.xmm0);
+        else
+            g.subss(g.xmm9, g.xmm0);
+        JitFpuResult(op == FPUOp::MADD || op == FPUOp::MSUB ? JitFpr(i.args[0]) : JitAcc(), g.xmm9);
+        break;
+    case FPUOp::SQRT:
+        JitFpuOperand(g.xmm0, JitFpr(i.args[2]));
+        JitFloatAbs(g.xmm0);
+        g.sqrtss(g.xmm0, g.xmm0);
+        JitFpuResult(JitFpr(i.args[0]), g.xmm0);
+        break;
+    case FPUOp::RSQRT:
+        JitFpuOperand(g.xmm0, JitFpr(i.args[1]));
+        JitFpuOperand(g.xmm8, JitFpr(i.args[2]));
+        JitFloatAbs(g.xmm8);
+        g.sqrtss(g.xmm8, g.xmm8);
+        g.divss(g.xmm0, g.xmm8);
+        JitFpuResult(JitFpr(i.args[0]), g.xmm0);
+        break;
+    case FPUOp::ABS:
+    case FPUOp::MOV:
+    case FPUOp::NEG:
+        // Sign bit operations, never clamped
+        MOV(g.eax, JitFpr(i.args[1]));
+        if (op == FPUOp::ABS)
+            g.and_(g.eax, 0x7FFFFFFF);
+        else if (op == FPUOp::NEG)
+            g.xor_(g.eax, 0x80000000);
+        MOV(JitFpr(i.args[0]), g.eax);
+        break;
+    case FPUOp::CVT_W:
+        // Out of range values come back as 0x80000000, the positive ones
+        // saturate to 0x7FFFFFFF instead
+        g.cvttss2si(g.eax, JitFpr(i.args[1]));
+        MOV(g.ecx, JitFpr(i.args[1]));
+        g.sar(g.ecx, 31);
+        g.xor_(g.ecx, 0x7FFFFFFF);
+        g.cmp(g.eax, 0x80000000);
+        g.cmove(g.eax, g.ecx);
+        MOV(JitFpr(i.args[0]), g.eax);
+        break;
+    case FPUOp::CVT_S:
+        g.cvtsi2ss(g.xmm0, JitFpr(i.args[1]));
+        g.movss(JitFpr(i.args[0]), g.xmm0);
+        break;
+    case FPUOp::C_F:
+        MOV(JitFpuCondition(), 0);
+        break;
+    case FPUOp::C_EQ:
+    case FPUOp::C_LT:
+    case FPUOp::C_LE:
+        // CMPSS is false for unordered operands, like the C++ comparisons
+        JitFpuOperand(g.xmm0, JitFpr(i.args[1]));
+        JitFpuOperand(g.xmm8, JitFpr(i.args[2]));
+        g.cmpss(g.xmm0, g.xmm8, op == FPUOp::C_EQ ? 0 : op == FPUOp::C_LT ? 1 : 2);
+        g.movd(g.eax, g.xmm0);
+        g.and_(g.eax, 1);
+        MOV(JitFpuCondition(), g.al);
+        break;
+    case FPUOp::CFC1:
+    {
+        // Only FCR0, the revision, and the C bit of FCR31 are kept
+        if (!i.args[0].GetReg())
+            break;
+        auto dst = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true));
+        if (i.args[1].GetImm() == 31)
+        {
+            g.movzx(dst.cvt32(), JitFpuCondition());
+            g.shl(dst.cvt32(), 23);
+        }
+        else
+            MOV(dst.cvt32(), i.args[1].GetImm() == 0 ? 0x2E00 : 0);
+        break;
+    }
+    case FPUOp::CTC1:
+        if (i.args[0].GetImm() == 31)
+        {
+            auto src = Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg()));
+            g.bt(src.cvt32(), 23);
+            g.setc(JitFpuCondition());
+        }
+        break;
+    }
+}
+
+// COP2
+// VF registers, ACC, I and Q are used as memory operands off RAX, which holds
+// the address of VU0's state. XMM0, XMM1 and XMM8-XMM9 are scratch. Operands
+// go through the same conversion as convert() in the interpreter, results
+// are stored as they come out. Lanes are in memory order, x in lane 0, and
+// dest masks the other way around, x in bit 3
+
+// Packed constants, each the same in all four lanes
+enum VUConstant
+{
+    FloatMax, NegativeFloatMax, AbsMask, SignMask, MaxDenormal,
+    ItofScale, // For 4, 12 and 15 fraction bits
+    FtoiScale = ItofScale + 3,
+    VUConstantCount = FtoiScale + 3,
+};
+
+#define SPLAT(x) {x, x, x, x}
+alignas(16) const uint32_t vuConstants[VUConstantCount][4] = {
+    SPLAT(0x7F7FFFFF), SPLAT(0xFF7FFFFF), SPLAT(0x7FFFFFFF), SPLAT(0x80000000), SPLAT(0x007FFFFF),
+    SPLAT(0x3D800000), SPLAT(0x39800000), SPLAT(0x38000000), // 2^-4, 2^-12, 2^-15
+    SPLAT(0x41800000), SPLAT(0x45800000), SPLAT(0x47000000), // 2^4, 2^12, 2^15
+};
+#undef SPLAT
+
+Xbyak::Address JitVf(int reg)
+{
+    return generator->xword[generator->rax + offsetof(VectorUnit::VU0::VectorState, vf) + reg * 16];
+}
+
+Xbyak::Address JitVuAcc()
+{
+    return generator->xword[generator->rax + offsetof(VectorUnit::VU0::VectorState, acc)];
+}
+
+// The constants are in the emulator's image like VU0's state, so they're
+// reached off RAX as well, and the offset stays valid for cached blocks
+Xbyak::Address JitVuConstant(VUConstant c)
+{
+    int64_t offset = (const uint8_t*)vuConstants[c] - (const uint8_t*)&VectorUnit::VU0::vu0_state;
+    if (offset != (int32_t)offset)
+    {
+        printf("[EEJIT_X64]: VU constants are too far from VU0's state\n");
+        exit(1);
+    }
+    return generator->xword[generator->rax + (int32_t)offset];
+}
+
+// Inf and NaN to +/-FLT_MAX like JitClampFloat does it, then denormals to
+// zero, keeping the sign
+void JitVuConvert(const Xbyak::Xmm& x)
+{
+    auto& g = *generator;
+
+    g.pminsd(x, JitVuConstant(FloatMax));
+    g.pminud(x, JitVuConstant(NegativeFloatMax));
+    g.movdqa(g.xmm1, x);
+    g.pand(g.xmm1, JitVuConstant(AbsMask));
+    g.pcmpgtd(g.xmm1, JitVuConstant(MaxDenormal));
+    g.por(g.xmm1, JitVuConstant(SignMask));
+    g.pand(x, g.xmm1);
+}
+
+void JitVuOperand(const Xbyak::Xmm& x, const Xbyak::Address& src)
+{
+    generator->movdqu(x, src);
+    JitVuConvert(x);
+}
+
+// ft of an upper instruction, with a field broadcast to all the lanes
+void JitVuBroadcast(const Xbyak::Xmm& x, IRInstruction& i)
+{
+    auto& g = *generator;
+
+    switch (i.vu_field)
+    {
+    case VUField::I:
+    case VUField::Q:
+        g.movd(x, g.dword[g.rax + (i.vu_field == VUField::I ? offsetof(VectorUnit::VU0::VectorState, i) : offsetof(VectorUnit::VU0::VectorState, q))]);
+        g.pshufd(x, x, 0x00);
+        break;
+    default:
+        g.movdqu(x, JitVf(i.args[2].GetReg()));
+        if (i.vu_field != VUField::Vector)
+            g.pshufd(x, x, (int)i.vu_field * 0x55);
+        break;
+    }
+
+    JitVuConvert(x);
+}
+
+// Writes the dest lanes of `x`, the others keep what `dst` had
+void JitVuResult(const Xbyak::Address& dst, const Xbyak::Xmm& x, uint8_t dest)
+{
+    if (dest != 0xF)
+    {
+        // Legacy SSE wants aligned memory operands, which the VF registers needn't be
+        int keep = ~(((dest & 1) << 3) | ((dest & 2) << 1) | ((dest & 4) >> 1) | ((dest & 8) >> 3)) & 0xF;
+        generator->movdqu(generator->xmm1, dst);
+        generator->blendps(x, generator->xmm1, keep);
+    }
+    generator->movdqu(dst, x);
+}
+
+void JitVU(IRInstruction& i)
+{
+    auto& g = *generator;
+    auto op = i.vu_op;
+
+    switch (op)
+    {
+    case VUOp::QMFC2:
+        if (i.args[0].GetReg())
+        {
+            auto dst = Xbyak::Xmm(reg_alloc.GetXmmReg((GuestRegister)i.args[0].GetReg(), true));
+            JitLoadHostAddress(&VectorUnit::VU0::vu0_state);
+            g.movdqu(dst, JitVf(i.args[1].GetReg()));
+        }
+        return;
+    case VUOp::QMTC2:
+        if (i.args[0].GetReg())
+        {
+            auto src = Xbyak::Xmm(reg_alloc.GetXmmReg((GuestRegister)i.args[1].GetReg()));
+            JitLoadHostAddress(&VectorUnit::VU0::vu0_state);
+            g.movdqu(JitVf(i.args[0].GetReg()), src);
+        }
+        return;
+    // The control registers and anything not translated go through vu.cpp
+    case VUOp::CFC2:
+        MOV(g.edi, i.args[1].GetImm());
+        JitCallHost(reinterpret_cast<const void*>(VectorUnit::VU0::ReadControl));
+        if (i.args[0].GetReg())
+            g.movsxd(Xbyak::Reg64(reg_alloc.GetHostReg((GuestRegister)i.args[0].GetReg(), true)), g.eax);
+        return;
+    case VUOp::CTC2:
+        if (i.args[1].GetReg())
+            MOV(g.esi, Xbyak::Reg32(reg_alloc.GetHostReg((GuestRegister)i.args[1].GetReg())));
+        else
+            g.xor_(g.esi, g.esi);
+        MOV(g.edi, i.args[0].GetImm());
+        JitCallHost(reinterpret_cast<const void*>(VectorUnit::VU0::WriteControl));
+        return;
+    case VUOp::CALL:
+        MOV(g.edi, i.opcode);
+        JitCallHost(reinterpret_cast<const void*>(VectorUnit::VU0::Macro));
+        return;
+    default:
+        break;
+    }
+
+    JitLoadHostAddress(&VectorUnit::VU0::vu0_state);
+
+    switch (op)
+    {
+    case VUOp::ADD: case VUOp::SUB: case VUOp::MUL: case VUOp::MAX: case VUOp::MINI:
+    case VUOp::ADDA: case VUOp::SUBA: case VUOp::MULA:
+    {
+        JitVuOperand(g.xmm0, JitVf(i.args[1].GetReg()));
+        JitVuBroadcast(g.xmm8, i);
+        switch (op)
+        {
+        case VUOp::ADD: case VUOp::ADDA: g.addps(g.xmm0, g.xmm8); break;
+        case VUOp::SUB: case VUOp::SUBA: g.subps(g.xmm0, g.xmm8); break;
+        case VUOp::MUL: case VUOp::MULA: g.mulps(g.xmm0, g.xmm8); break;
+        case VUOp::MAX: g.maxps(g.xmm0, g.xmm8); break;
+        default: g.minps(g.xmm0, g.xmm8); break;
+        }
+
+        bool to_acc = op == VUOp::ADDA || op == VUOp::SUBA || op == VUOp::MULA;
+        if (to_acc)
+            JitVuResult(JitVuAcc(), g.xmm0, i.vu_dest);
+        else if (i.args[0].GetReg())
+            JitVuResult(JitVf(i.args[0].GetReg()), g.xmm0, i.vu_dest);
+        break;
+    }
+
+    // The product is rounded before it's accumulated, like the interpreter
+    case VUOp::MADD: case VUOp::MSUB: case VUOp::MADDA: case VUOp::MSUBA:
+    case VUOp::OPMULA: case VUOp::OPMSUB:
+    {
+        bool outer = op == VUOp::OPMULA || op == VUOp::OPMSUB;
+        JitVuOperand(g.xmm0, JitVf(i.args[1].GetReg()));
+        if (outer)
+        {
+            // x = fs.y * ft.z, y = fs.z * ft.x, z = fs.x * ft.y
+            JitVuOperand(g.xmm8, JitVf(i.args[2].GetReg()));
+            g.pshufd(g.xmm0, g.xmm0, 0xC9);
+            g.pshufd(g.xmm8, g.xmm8, 0xD2);
+        }
+        else
+            JitVuBroadcast(g.xmm8, i);
+        g.mulps(g.xmm0, g.xmm8);
+
+        if (op == VUOp::OPMULA)
+        {
+            JitVuResult(JitVuAcc(), g.xmm0, i.vu_dest);
+            break;
+        }
+
+        JitVuOperand(g.xmm9, JitVuAcc());
+        if (op == VUOp::MADD || op == VUOp::MADDA)
+            g.addps(g.xmm9, g.xmm0);
+        else
+            g.subps(g.xmm9, g.xmm0);
+
+        if (op == VUOp::MADDA || op == VUOp::MSUBA)
+            JitVuResult(JitVuAcc(), g.xmm9, i.vu_dest);
+        else if (i.args[0].GetReg())
+            JitVuResult(JitVf(i.args[0].GetReg()), g.xmm9, i.vu_dest);
+        break;
+    }
+
+    case VUOp::ABS:
+    case VUOp::MOVE:
+    case VUOp::MR32:
+        if (!i.args[0].GetReg())
+            break;
+        g.movdqu(g.xmm0, JitVf(i.args[1].GetReg()));
+        if (op == VUOp::ABS)
+            g.pand(g.xmm0, JitVuConstant(AbsMask));
+        else if (op == VUOp::MR32)
+            g.pshufd(g.xmm0, g.xmm0, 0x39); // x takes y, y takes z, z takes w, w takes x
+        JitVuResult(JitVf(i.args[0].GetReg()), g.xmm0, i.vu_dest);
+        break;
+
+    case VUOp::ITOF:
+    {
+        if (!i.args[0].GetReg())
+            break;
+        int scale = i.args[2].GetImm() == 4 ? 0 : i.args[2].GetImm() == 12 ? 1 : 2;
+        g.movdqu(g.xmm0, JitVf(i.args[1].GetReg()));
+        g.cvtdq2ps(g.xmm0, g.xmm0);
+        if (i.args[2].GetImm())
+            g.mulps(g.xmm0, JitVuConstant((VUConstant)(ItofScale + scale)));
+        JitVuResult(JitVf(i.args[0].GetReg()), g.xmm0, i.vu_dest);
+        break;
+    }
+
+    // Truncates, and saturates anything out of range by its sign. CVTTPS2DQ
+    // gives 0x80000000 for those, and for -2^31 which saturates the same
+    case VUOp::FTOI:
+    {
+        if (!i.args[0].GetReg())
+            break;
+        int scale = i.args[2].GetImm() == 4 ? 0 : i.args[2].GetImm() == 12 ? 1 : 2;
+        JitVuOperand(g.xmm0, JitVf(i.args[1].GetReg()));
+        if (i.args[2].GetImm())
+            g.mulps(g.xmm0, JitVuConstant((VUConstant)(FtoiScale + scale)));
+        g.movdqa(g.xmm1, g.xmm0);
+        g.cvttps2dq(g.xmm0, g.xmm0);
+        g.psrad(g.xmm1, 31);
+        g.pxor(g.xmm1, JitVuConstant(AbsMask));
+        g.movdqa(g.xmm8, g.xmm0);
+        g.pcmpeqd(g.xmm8, JitVuConstant(SignMask));
+        g.pand(g.xmm1, g.xmm8);
+        g.pandn(g.xmm8, g.xmm0);
+        g.por(g.xmm8, g.xmm1);
+        JitVuResult(JitVf(i.args[0].GetReg()), g.xmm8, i.vu_dest);
+        break;
+    }
+
+    // Six flags, +x, -x, +y, -y, +z, -z against +/-|ft.w|, shifted into the
+    // clipping register. The above and below compares are interleaved to get
+    // them in that order
+    case VUOp::CLIP:
+        JitVuOperand(g.xmm0, JitVf(i.args[0].GetReg()));
+        JitVuOperand(g.xmm8, JitVf(i.args[1].GetReg()));
+        g.pshufd(g.xmm8, g.xmm8, 0xFF);
+        g.pand(g.xmm8, JitVuConstant(AbsMask));
+        g.movdqa(g.xmm9, g.xmm8);
+        g.cmpltps(g.xmm9, g.xmm0);
+        g.pxor(g.xmm8, JitVuConstant(SignMask));
+        g.cmpltps(g.xmm0, g.xmm8);
+        g.movdqa(g.xmm1, g.xmm9);
+        g.unpcklps(g.xmm9, g.xmm0);
+        g.unpckhps(g.xmm1, g.xmm0);
+        g.movmskps(g.ecx, g.xmm9);
+        g.movmskps(g.edx, g.xmm1);
+        g.and_(g.edx, 3);
+        g.shl(g.edx, 4);
+        g.or_(g.ecx, g.edx);
+        MOV(g.edx, g.dword[g.rax + offsetof(VectorUnit::VU0::VectorState, clipping)]);
+        g.shl(g.edx, 6);
+        g.or_(g.edx, g.ecx);
+        g.and_(g.edx, 0xFFFFFF);
+        MOV(g.dword[g.rax + offsetof(VectorUnit::VU0::VectorState, clipping)], g.edx);
+        break;
+
+    default:
+        printf("[EEJIT_X64]: Cannot emit VU instruction %d\n", (int)op);
+        exit(1);
+    }
+}
+
+void JitIncPC()
+{
+    ADD(generator->r8, 4);
+}
+
+void JitInstruction(IRInstruction& i)
+{
+    switch (i.instr)
+    {
+    case NOP:
+        // Also what the optimizer leaves behind, nothing to emit
+        break;
+    case MOVE:
+        JitMov(i);
+        break;
+    case SLT:
+        JitSlt(i);
+        break;
+    case OR:
+        JitOr(i);
+        break;
+    case JUMP:
+        JitJump(i);
+        break;
+    case ADD:
+        JitAdd(i);
+        break;
+    case STORE:
+        JitStore(i);
+        break;
+    case LOAD:
+        JitLoad(i);
+        break;
+	case AND:
+		JitAnd(i);
+		break;
+	case SHIFT:
+		JitShift(i);
+		break;
+	case MULT:
+		JitMULT(i);
+		break;
+	case DIV:
+		JitDIV(i);
+		break;
+	case BREAK:
+		generator->ud2();
+		break;
+    case MMI:
+        JitMMI(i);
+        break;
+    case FPU:
+        JitFPU(i);
+        break;
+    case VU:
+        JitVU(i);
+        break;
+    default:
+        printf("[EEJIT_X64]: Cannot emit unknown IR instruction %d\n", i.instr);
+        exit(1);
+    }
+}
+
+uint64_t EEJitX64::HashCode(const uint32_t* words, size_t count)
+{
+    return TranslationCache::Hash(words, count * 4);
+}
+
+uint64_t HashGuestCode(const TranslationCache::Span* spans, uint32_t count)
+{
+    static std::vector<uint32_t> words;
+    words.clear();
+    for (uint32_t span = 0; span < count; span++)
+        for (uint32_t i = 0; i < spans[span].size / 4; i++)
+            words.push_back(Bus::Read32(spans[span].addr + i * 4));
+    return EEJitX64::HashCode(words.data(), words.size());
+}
+
+TranslationCache::Entry EEJitX64::TranslatedBlock::GetEntry() const
+{
+    TranslationCache::Entry e;
+    e.addr = addr;
+    e.cycles = cycles;
+    e.size = size;
+    e.hash = hash;
+    e.spans = spans.data();
+    e.span_count = spans.size();
+    e.code = code.data();
+    e.code_size = code.size();
+    e.hot_size = hot_size;
+    e.relocs = relocs.data();
+    e.reloc_count = relocs.size();
+    e.links = links.data();
+    e.link_count = links.size();
+    e.sites = sites.data();
+    e.site_count = sites.size();
+    return e;
+}
+
+void EEJitX64::TranslateBlock(TranslatedBlock& block, IRArena& instrs)
+{
+	if (EmotionEngine::can_disassemble) printf("Translating block at 0x%08x\n", block.addr);
+
+    generator->reset();
+    reg_alloc.Reset();
+    reg_alloc.AnalyzeBlock(instrs);
+    slowPaths.clear();
+
+    block.relocs.clear();
+    block.links.clear();
+    block.sites.clear();
+
+    translating = &block;
+    guest_pc = block.addr;
+    blockCode = generator->getCurr();
+
+    JitCount(0);
+
+    // Where the block goes when it falls off the end
+    uint32_t exit_target = 0;
+    bool exit_static = true;
+    bool exit_return = false;
+    bool jumped = false;
+    // Set after a jump the trace follows, where its delay slot goes on to
+    uint32_t follow_target = 0;
+    bool following = false;
+
+    bool done = false;
+
+    // Every instruction the block runs on the way to an exit costs a cycle.
+    // instrs[0] is the prologue, so an exit at `idx` has cost idx - 1, and a
+    // branch at `idx` has cost idx + 1 by the end of its delay slot
+    for (size_t idx = 0; idx < instrs.size() && !done; idx++)
+    {
+        auto& i = instrs[idx];
+
+        reg_alloc.SetPosition(idx);
+
+        switch (i.instr)
+        {
+        case PROLOGUE:
+            // Host state is set up once by the dispatcher
+            continue;
+        case EPILOGUE:
+            if (!jumped)
+                exit_target = guest_pc;
+            if (exit_static)
+                JitExit(exit_target, true, idx - 1);
+            else if (exit_return)
+                JitReturnExit(idx - 1);
+            else
+                JitIndirectExit(idx - 1);
+            continue;
+        case BRANCH:
+        {
+            // The branch handles its delay slot on its own
+            bool ends_block = instrs[idx + 2].instr == EPILOGUE && !i.trace_taken;
+            JitBranch(i, instrs[idx + 1], ends_block, idx + 1);
+            done = ends_block;
+            if (i.trace_taken)
+                guest_pc = guest_pc + 4 + (int32_t)i.args[2].GetImm();
+            else
+                guest_pc += 8;
+            idx++;
+            continue;
+        }
+        }
+
+        // Delay slots of jumps run with R8 already pointing at the target
+        if (idx == 0 || instrs[idx - 1].instr != JUMP)
+            JitIncPC();
+
+        if (i.instr == JUMP && i.trace_taken)
+        {
+            following = true;
+            follow_target = ((guest_pc + 4) & 0xF0000000) | i.args[0].GetImm();
+        }
+        else if (i.instr == JUMP)
+        {
+            jumped = true;
+            exit_static = i.args[0].IsImm();
+            exit_return = i.args.size() == 1 && !i.should_link && i.args[0].IsReg() && i.args[0].GetReg() == 31;
+            exit_target = ((guest_pc + 4) & 0xF0000000) | i.args[0].GetImm();
+        }
+
+        JitInstruction(i);
+
+        guest_pc += 4;
+        if (following && i.instr != JUMP)
+        {
+            guest_pc = follow_target;
+            following = false;
+        }
+    }
+
+    // Keep the slow paths out of the way of the block itself
+    block.hot_size = generator->getCurr() - blockCode;
+    for (auto& slow_path : slowPaths)
+        slow_path();
+
+    block.code.assign(blockCode, generator->getCurr());
+}
+
+// Copies a block into the code cache and fixes it up for where it landed.
+// `translated` is where it came from, if it wasn't loaded from disk
+Block* Install(const TranslationCache::Entry& entry, const EEJitX64::TranslatedBlock* translated)
+{
+    // Link slots go right after the cold code, so they're reclaimed along
+    // with it and don't take up room in the hot code
+    size_t cold_size = entry.code_size - entry.hot_size;
+    size_t links_offs = (cold_size + alignof(BlockLink) - 1) & ~(alignof(BlockLink) - 1);
+    size_t cold_bytes = links_offs + entry.link_count * sizeof(BlockLink);
+
+    CodeCache::Range flushed;
+    size_t cold_offset;
+    size_t offset = CodeCache::Allocate(entry.hot_size, cold_bytes, cold_offset, flushed);
+    if (flushed.start != flushed.end)
+        EEJitX64::InvalidateCode(flushed);
+
+    Block* block = EEJitX64::AllocBlock();
+    block->addr = entry.addr;
+    block->cycles = entry.cycles;
+    block->size = entry.size;
+    block->host_size = entry.hot_size;
+    block->span_count = entry.span_count;
+    for (uint32_t i = 0; i < entry.span_count; i++)
+        block->spans[i] = {entry.spans[i].addr, entry.spans[i].size};
+
+    uint8_t* code = CodeCache::GetWriteBase() + offset;
+    uint8_t* cold = CodeCache::GetWriteBase() + cold_offset;
+    block->entryPoint = CodeCache::ToExec(code);
+    block->stats = EEJit::AddBlockStats(*block, translated ? translated->ir_count : 0, cold_size,
+        translated ? translated->compile_ns : 0, !translated);
+    memcpy(code, entry.code, entry.hot_size);
+    memcpy(cold, entry.code + entry.hot_size, cold_size);
+
+    // Where an offset into the translated code ended up
+    auto at = [&](uint32_t offs) { return offs < entry.hot_size ? code + offs : cold + (offs - entry.hot_size); };
+    // How much further the cold code is from the hot code than it was
+    int64_t moved = cold - (code + entry.hot_size);
+
+    for (uint32_t i = 0; i < entry.reloc_count; i++)
+    {
+        auto& reloc = entry.relocs[i];
+        uint8_t* p = at(reloc.offset);
+
+        switch (reloc.type)
+        {
+        case TranslationCache::RelocType::HostPointer:
+            *(uint64_t*)p = TranslationCache::FromImageOffset(reloc.value);
+            break;
+        case TranslationCache::RelocType::StaticJump:
+            *(int32_t*)p = (int32_t)(GetStaticTarget(reloc.value) - (p + 4));
+            break;
+        case TranslationCache::RelocType::ColdCrossing:
+            *(int32_t*)p += (int32_t)(reloc.value * moved);
+            break;
+        case TranslationCache::RelocType::BlockCounter:
+            *(uint64_t*)p = reloc.value ? (uint64_t)&block->stats->exits[reloc.value - 1] : (uint64_t)&block->stats->executions;
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < entry.site_count; i++)
+        fastmemSites[CodeCache::ToExec(at(entry.sites[i].site))] = CodeCache::ToExec(at(entry.sites[i].slow_path));
+
+    block->link_count = entry.link_count;
+    block->links = (BlockLink*)(cold + links_offs);
+    for (uint32_t i = 0; i < entry.link_count; i++)
+    {
+        BlockLink& link = block->links[i];
+        link.target = entry.links[i].target;
+        link.patch = at(entry.links[i].patch);
+        link.unlinked = (uint8_t*)dispatchLoop;
+        link.inline_cache = link.target == TranslationCache::INLINE_CACHE;
+        if (link.inline_cache)
+            inlineCaches[GetInlineCacheSite(&link)] = &link;
+    }
+
+    PerfMap::AddBlock(block->addr, block->entryPoint, entry.hot_size, CodeCache::ToExec(cold), cold_size);
+
+    CodeCache::Commit(offset + entry.hot_size, cold_offset);
+    EEJitX64::CacheBlock(block);
+    return block;
+}
+
+Block* EEJitX64::InstallBlock(const TranslatedBlock& block)
+{
+    // The guest code may have been overwritten while it was being compiled
+    if (HashGuestCode(block.spans.data(), block.spans.size()) != block.hash)
+        return nullptr;
+
+    auto entry = block.GetEntry();
+    TranslationCache::Store(entry);
+    return Install(entry, &block);
+}
+
+Block* EEJitX64::LoadCachedBlock(uint32_t addr)
+{
+    auto stored = TranslationCache::Find(addr);
+    if (!stored)
+        return nullptr;
+
+    for (auto& e : *stored)
+    {
+        if (HashGuestCode(e.spans, e.span_count) == e.hash)
+        {
+            TranslationCache::stats.loaded++;
+            return Install(e, nullptr);
+        }
+    }
+
+    // The guest code changed since, it has to be translated again
+    TranslationCache::stats.stale++;
+    return nullptr;
+}
+
+void SetLookup(uint32_t addr, Block* block)
+{
+    BlockPage*& page = blockPages[addr >> BLOCK_PAGE_SHIFT];
+    if (!page)
+    {
+        if (!block)
+            return;
+        page = new BlockPage();
+    }
+
+    int index = (addr & ((1 << BLOCK_PAGE_SHIFT) - 1)) >> 2;
+    page->entries[index] = block ? block->entryPoint : nullptr;
+    page->blocks[index] = block;
+}
+
+void EEJitX64::CacheBlock(Block *block)
+{
+    // One translation per key, any other alias maps this one
+    auto it = sharedBlocks.find(BlockKey(block->addr));
+    if (it != sharedBlocks.end())
+        InvalidateBlock(it->second.block);
+
+    SetLookup(block->addr, block);
+    sharedBlocks[BlockKey(block->addr)] = {block, {}};
+
+    LinkBlock(block);
+    AddCodePages(block);
+}
+
+Block* EEJitX64::MapAlias(uint32_t addr)
+{
+    auto it = sharedBlocks.find(BlockKey(addr));
+    if (it == sharedBlocks.end())
+        return nullptr;
+
+    SetLookup(addr, it->second.block);
+    it->second.aliases.push_back(addr);
+    aliasesMapped++;
+    return it->second.block;
+}
+
+Block *EEJitX64::GetBlockForAddr(uint32_t addr)
+{
+    BlockPage* page = blockPages[addr >> BLOCK_PAGE_SHIFT];
+    if (!page)
+        return nullptr;
+    return page->blocks[(addr & ((1 << BLOCK_PAGE_SHIFT) - 1)) >> 2];
+}
+
+void EEJitX64::InvalidatePage(uint32_t addr)
+{
+    BlockPage*& page = blockPages[addr >> BLOCK_PAGE_SHIFT];
+    if (!page)
+        return;
+
+    // Takes any aliases of the blocks along, wherever they are
+    for (int i = 0; i < BLOCK_PAGE_ENTRIES; i++)
+    {
+        if (page->blocks[i])
+            InvalidateBlock(page->blocks[i]);
+    }
+
+    delete page;
+    page = nullptr;
+}
+
+void EEJitX64::InvalidateBlock(Block* block)
+{
+    UnlinkBlock(block);
+    RemoveCodePages(block);
+
+    // Every cached block is the translation for its key, but don't take
+    // the aliases of another one with it if that ever stops being true
+    auto it = sharedBlocks.find(BlockKey(block->addr));
+    assert(it != sharedBlocks.end() && it->second.block == block);
+    if (it != sharedBlocks.end() && it->second.block == block)
+    {
+        for (auto alias : it->second.aliases)
+            SetLookup(alias, nullptr);
+        sharedBlocks.erase(it);
+    }
+    SetLookup(block->addr, nullptr);
+
+    if (block->stats)
+        block->stats->live = false;
+    FreeBlock(block);
+}
+
+void EEJitX64::InvalidateRange(uint32_t addr, uint32_t size)
+{
+    if (!size)
+        return;
+
+    // In 64 bits, a range at the top of the address space would wrap
+    uint64_t start = Translate(addr);
+    uint64_t end = std::min<uint64_t>(start + size, 1ULL << 32);
+    uint32_t last = (end - 1) >> CODE_PAGE_SHIFT;
+
+    for (uint32_t page = start >> CODE_PAGE_SHIFT; page <= last; page++)
+    {
+        // Big DMA writes mostly hit pages without code, skip 64 at a time
+        if (!codePages[page / 64])
+        {
+            page |= 63;
+            continue;
+        }
+
+        if (!IsCodePage(page))
+            continue;
+
+        // Copied, since invalidating blocks edits the list
+        auto blocks = pageBlocks[page];
+        for (auto block : blocks)
+        {
+            for (uint32_t i = 0; i < block->span_count; i++)
+            {
+                uint64_t span_start = Translate(block->spans[i].addr);
+                if (span_start < end && start < span_start + block->spans[i].size)
+                {
+                    InvalidateBlock(block);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+void EEJitX64::InvalidateAll()
+{
+    for (int i = 0; i < BLOCK_PAGE_COUNT; i++)
+        if (blockPages[i])
+            InvalidatePage(i << BLOCK_PAGE_SHIFT);
+    linksTo.clear();
+    sharedBlocks.clear();
+    inlineCaches.clear();
+    fastmemSites.clear();
+
+    CodeCache::Reset();
+}
+
+void EEJitX64::InvalidateCode(CodeCache::Range range)
+{
+    for (int i = 0; i < BLOCK_PAGE_COUNT; i++)
+    {
+        BlockPage* page = blockPages[i];
+        if (!page)
+            continue;
+
+        for (int j = 0; j < BLOCK_PAGE_ENTRIES; j++)
+        {
+            Block* block = page->blocks[j];
+            if (block && block->entryPoint >= range.start && block->entryPoint < range.end)
+                InvalidateBlock(block);
+        }
+    }
+
+    fastmemSites.erase(fastmemSites.lower_bound(range.start), fastmemSites.lower_bound(range.end));
+}
+
+void EEJitX64::Initialize()
+{
+    ClearReturnStack();
+
+    // The dispatcher stays, but nothing translated for the last run does
+    if (generator)
+    {
+        InvalidateAll();
+        return;
+    }
+
+    // The MMI are translated with SSE4.1
+    if (!Xbyak::util::Cpu().has(Xbyak::util::Cpu::tSSE41))
+    {
+        printf("[EEJIT_X64]: The JIT needs a host with SSE4.1\n");
+        exit(1);
+    }
+
+    CodeCache::Initialize();
+
+    generator = new Xbyak::CodeGenerator(CodeCache::GetSize(), CodeCache::GetWriteBase());
+    EmitDispatcher();
+    EmitHostCall();
+
+    if (generator->getSize() > CodeCache::STATIC_SIZE)
+    {
+        printf("[EEJIT_X64]: Dispatcher doesn't fit in the code cache's static area\n");
+        exit(1);
+    }
+
+    if (EEJit::perf_output != EEJit::PerfOutput::None)
+    {
+        PerfMap::Open(EEJit::perf_output == EEJit::PerfOutput::JitDump ? PerfMap::Format::JitDump : PerfMap::Format::Map, EEJit::symbol_file);
+        PerfMap::AddCode(CodeCache::ToExec(CodeCache::GetWriteBase()), generator->getSize(), "EE dispatcher");
+    }
+
+    // Everything emitted from now on goes through the staging area
+    delete generator;
+    generator = new Xbyak::CodeGenerator(CodeCache::STAGING_SIZE, CodeCache::GetStagingBase());
+
+    // Anything that changes what a block translates to
+    uint64_t config = (uint64_t)EEJitOpt::enabled_passes | ((uint64_t)EEJit::max_block_instrs << 32)
+        | ((uint64_t)EEJit::traces << 48) | ((uint64_t)EmotionEngine::fpu_clamp << 56)
+        | ((uint64_t)EEJit::profile_blocks << 60);
+    TranslationCache::Open(EEJit::cache_dir, TranslationCache::Hash(FastMem::GetBios(), 0x400000), config);
+
+    static bool handlerInstalled = false;
+    if (!handlerInstalled)
+    {
+        struct sigaction action = {};
+        action.sa_sigaction = SegvHandler;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &oldSegvAction);
+        handlerInstalled = true;
+    }
+}
+
+EEJitX64::DispatchExit EEJitX64::Dispatch()
+{
+    return (DispatchExit)dispatcher(EmotionEngine::GetState());
+}
+
+void EEJitX64::Dump()
+{
+    std::ofstream file("code.out", std::ios::binary);
+    file.write((char*)CodeCache::GetWriteBase(), CodeCache::GetStats().high_water);
+    file.close();
+}
+
+void EEJitX64::DumpStats()
+{
+    auto stats = CodeCache::GetStats();
+    printf("[EEJIT_X64]: Code cache: %zu/%zu KB used, generation %u, %lu region flushes, %lu full flushes\n",
+        stats.used / 1024, stats.size / 1024, stats.generation,
+        (unsigned long)stats.region_flushes, (unsigned long)stats.full_flushes);
+
+    printf("[EEJIT_X64]: %zu blocks, %lu aliases of them mapped\n", sharedBlocks.size(), (unsigned long)aliasesMapped);
+
+    printf("[EEJIT_X64]: Return stack: %lu hits, %lu misses. Inline caches: %lu misses\n",
+        (unsigned long)returnStack.hits, (unsigned long)returnStack.misses, (unsigned long)inlineCacheMisses);
+
+    if (TranslationCache::IsOpen())
+    {
+        auto& tc = TranslationCache::stats;
+        printf("[EEJIT_X64]: Translation cache: %lu blocks on disk, %lu loaded, %lu stale, %lu stored\n",
+            (unsigned long)tc.indexed, (unsigned long)tc.loaded, (unsigned long)tc.stale, (unsigned long)tc.stored);
+    }
 }
@@ -1,24 +1,95 @@
 #pragma once
 
 #include "GuestRegister.h"
+#include "CodeCache.h"
+#include "TranslationCache.h"
 #include <cstdint>
+#include <vector>
 
 struct Block;
+class IRArena;
 
 namespace EEJitX64
 {
 
-void JitStoreReg(GuestRegister reg);
+void JitStoreReg(GuestRegister reg, int hostReg);
 void JitLoadReg(GuestRegister reg, int hostReg);
+void JitZeroReg(int hostReg);
+void JitStoreXmm(GuestRegister reg, int xmm);
+void JitLoadXmm(GuestRegister reg, int xmm);
+void JitZeroXmm(int xmm);
 
-// Translate a JIT block from IR to host code
-// Modifies the `entry` pointer in the block
-void TranslateBlock(Block* block);
+// Block records are owned by the backend, released when invalidated
+Block* AllocBlock();
+
+// Host code for a block that hasn't been put in the code cache yet
+struct TranslatedBlock
+{
+    uint32_t addr, cycles;
+    uint32_t size; // Bytes of guest code
+    uint64_t hash; // Of the guest code, as it was decoded
+    uint32_t hot_size; // The cold code comes after it in `code`
+    std::vector<TranslationCache::Span> spans;
+    std::vector<uint8_t> code;
+    std::vector<TranslationCache::Reloc> relocs;
+    std::vector<TranslationCache::Link> links;
+    std::vector<TranslationCache::FastmemSite> sites;
+    uint32_t ir_count = 0;
+    uint64_t compile_ns = 0;
+
+    TranslationCache::Entry GetEntry() const;
+};
+
+uint64_t HashCode(const uint32_t* words, size_t count);
+
+// Translate a JIT block from IR to host code, `block` needs its guest side
+// filled in. Nothing outside the translator's own state is touched, so this
+// can run on another thread as long as only one block is translated at once
+void TranslateBlock(TranslatedBlock& block, IRArena& instrs);
+// Copy a translated block into the code cache and cache it. Returns nullptr
+// if the guest code doesn't match what it was translated from anymore
+Block* InstallBlock(const TranslatedBlock& block);
 void CacheBlock(Block* block);
+// Copy in the block at `addr` from the translation cache and cache it, if
+// there's one for the guest code that's there now
+Block* LoadCachedBlock(uint32_t addr);
+// Block the dispatcher runs at `addr`
 Block* GetBlockForAddr(uint32_t addr);
+// Block translated from the code at `addr`, through this address or any
+// alias of it
+Block* GetSharedBlock(uint32_t addr);
+// Have the dispatcher run the block translated through an alias of `addr`
+// at `addr` too. Returns it, or nullptr if there's none
+Block* MapAlias(uint32_t addr);
+
+// Drop every block starting in the 4 KB page containing `addr`
+void InvalidatePage(uint32_t addr);
+// Drop every block whose guest code overlaps [addr, addr+size)
+void InvalidateRange(uint32_t addr, uint32_t size);
+void InvalidateBlock(Block* block);
+// Drop every block whose code is in `range`, before it gets reused
+void InvalidateCode(CodeCache::Range range);
+// Drop every block and start the code cache over
+void InvalidateAll();
 
 void Initialize();
 
+// Why the dispatcher handed control back to C++
+enum class DispatchExit
+{
+    OutOfCycles,
+    Interrupt,
+    BlockMiss, // No block has been compiled for the current pc yet
+};
+
+// Run translated code from the current pc, staying in generated code until
+// one of the above happens
+DispatchExit Dispatch();
+
+// Code cache, block and translation cache stats, printed with the rest of
+// the JIT's at exit
+void DumpStats();
+// Write the code cache out to code.out
 void Dump();
 
 }
\ No newline at end of file
@@ -0,0 +1,182 @@
+#include "PerfMap.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+namespace PerfMap
+{
+
+// jitdump, as in tools/perf/Documentation/jitdump-specification.txt
+constexpr uint32_t JITDUMP_MAGIC = 0x4A695444; // "JiTD"
+constexpr uint32_t JITDUMP_VERSION = 1;
+constexpr uint32_t ELF_MACHINE_X86_64 = 62;
+constexpr uint32_t JIT_CODE_LOAD = 0;
+
+struct JitDumpHeader
+{
+    uint32_t magic, version, total_size, elf_mach, pad;
+    uint32_t pid;
+    uint64_t timestamp, flags;
+};
+
+struct RecordHeader
+{
+    uint32_t id, total_size;
+    uint64_t timestamp;
+};
+
+// Followed by the name, null terminated, then the code
+struct CodeLoad
+{
+    RecordHeader header;
+    uint32_t pid, tid;
+    uint64_t vma, code_addr, code_size, code_index;
+};
+
+FILE* file;
+Format format;
+uint64_t codeIndex;
+std::map<uint32_t, std::string> symbols;
+
+uint64_t Timestamp()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void LoadSymbols(const std::string& path)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        printf("[EEJIT_X64]: Couldn't open symbol file %s\n", path.c_str());
+        return;
+    }
+
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        std::string addr, name, type;
+        if (!(fields >> addr >> name))
+            continue;
+        // nm puts a type letter between the two
+        if (name.size() == 1 && fields >> type)
+            name = type;
+        symbols[(uint32_t)strtoul(addr.c_str(), nullptr, 16)] = name;
+    }
+
+    printf("[EEJIT_X64]: %zu guest symbols loaded from %s\n", symbols.size(), path.c_str());
+}
+
+// The guest function `addr` is in, and how far into it, or just the address
+std::string GuestName(uint32_t addr)
+{
+    char name[256];
+    auto it = symbols.upper_bound(addr);
+    if (it == symbols.begin())
+        snprintf(name, sizeof(name), "EE 0x%08x", addr);
+    else if (--it, it->first == addr)
+        snprintf(name, sizeof(name), "EE %s (0x%08x)", it->second.c_str(), addr);
+    else
+        snprintf(name, sizeof(name), "EE %s+0x%x (0x%08x)", it->second.c_str(), addr - it->first, addr);
+    return name;
+}
+
+void Open(Format f, const std::string& symbol_file)
+{
+    if (file)
+        return;
+
+    format = f;
+    if (!symbol_file.empty())
+        LoadSymbols(symbol_file);
+
+    char path[64];
+    snprintf(path, sizeof(path), format == Format::Map ? "/tmp/perf-%d.map" : "/tmp/jit-%d.dump", (int)getpid());
+
+    if (format == Format::Map)
+    {
+        file = fopen(path, "w");
+        if (!file)
+            printf("[EEJIT_X64]: Couldn't open perf map %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        printf("[EEJIT_X64]: Couldn't open jitdump %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    // perf finds the dump through an executable mapping of it, which it sees
+    // in the process' mmap events
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (mmap(nullptr, page_size, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0) == MAP_FAILED)
+    {
+        printf("[EEJIT_X64]: Couldn't map jitdump %s: %s\n", path, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    file = fdopen(fd, "wb");
+
+    JitDumpHeader header = {JITDUMP_MAGIC, JITDUMP_VERSION, sizeof(JitDumpHeader), ELF_MACHINE_X86_64, 0,
+        (uint32_t)getpid(), Timestamp(), 0};
+    fwrite(&header, sizeof(header), 1, file);
+    fflush(file);
+}
+
+bool IsOpen()
+{
+    return file != nullptr;
+}
+
+void AddCode(const uint8_t* code, size_t size, const char* name)
+{
+    if (!file || !size)
+        return;
+
+    if (format == Format::Map)
+        fprintf(file, "%lx %zx %s\n", (unsigned long)code, size, name);
+    else
+    {
+        size_t name_size = strlen(name) + 1;
+        CodeLoad record = {};
+        record.header = {JIT_CODE_LOAD, (uint32_t)(sizeof(CodeLoad) + name_size + size), Timestamp()};
+        record.pid = getpid();
+        record.tid = syscall(SYS_gettid);
+        record.vma = record.code_addr = (uint64_t)code;
+        record.code_size = size;
+        record.code_index = codeIndex++;
+        fwrite(&record, sizeof(record), 1, file);
+        fwrite(name, name_size, 1, file);
+        fwrite(code, size, 1, file);
+    }
+
+    // Whatever is in the file by the time the emulator dies is what perf gets
+    fflush(file);
+}
+
+void AddBlock(uint32_t addr, const uint8_t* hot, size_t hot_size, const uint8_t* cold, size_t cold_size)
+{
+    if (!file)
+        return;
+
+    std::string name = GuestName(addr);
+    AddCode(hot, hot_size, name.c_str());
+    AddCode(cold, cold_size, (name + " cold").c_str());
+}
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Tells Linux perf what the translated code is, so profiles show guest code
+// instead of an anonymous blob
+// With a perf map, every block is appended to /tmp/perf-<pid>.map as it's
+// installed, perf report picks that up as it is. With a jitdump, records
+// with the code bytes go to /tmp/jit-<pid>.dump, which `perf inject --jit`
+// turns into an image per block so perf annotate can show the host code.
+// That one needs `perf record -k 1`, the records are timestamped with
+// CLOCK_MONOTONIC
+// Blocks are named by guest pc, and by the guest function they're in when
+// there's a symbol file. Code the cache flushes gets reused, a perf map can't
+// tell the old and new blocks apart there but a jitdump can
+namespace PerfMap
+{
+
+enum class Format
+{
+    Map,
+    JitDump,
+};
+
+// `symbols` is a file of "address name" or nm style "address type name"
+// lines with the address in hex, can be empty
+void Open(Format format, const std::string& symbols);
+bool IsOpen();
+
+// Any code in the executable view of the code cache
+void AddCode(const uint8_t* code, size_t size, const char* name);
+// A block installed at `hot`, with its slow paths at `cold`
+void AddBlock(uint32_t addr, const uint8_t* hot, size_t hot_size, const uint8_t* cold, size_t cold_size);
+
+}
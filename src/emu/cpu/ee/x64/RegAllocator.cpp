@@ -2,12 +2,30 @@
 #include "EEJitx64.h"
 #include <emu/cpu/ee/EmotionEngine.h>
 
-struct HostRegister
-{
-    bool allocated;
-    GuestRegister mapping;
-    int used = 0;
-} regs[16];
+#include <emu/cpu/ee/EEJit.h>
+
+#include <cstring>
+
+HostRegister regs[16];
+HostRegister xmms[16];
+
+// Host registers guest registers can live in. Everything else is reserved:
+// RSP is used for the stack (and it should never be overwritten)
+// RBP is used to point to the processor state
+// RAX is used for return values and guest addresses
+// RDI and RSI are used for passing values to functions
+// RCX is for function pointers
+// RDX is scratch for multiplies, divides and 128-bit values
+// R8 holds the current value of pc
+// R14 holds the base of the fastmem arena
+// R15 holds the cycles left in the current dispatch
+// RBX, R12 and R13 are saved by the dispatcher, R9-R11 around helper calls
+static const int allocatable[] = {RBX, R9, R10, R11, R12, R13};
+
+// XMM registers guest registers can live in, the host call thunk keeps them
+// XMM0, XMM1 and XMM8-XMM13 are scratch for the MMI and LQ/SQ, XMM14 and
+// XMM15 stand in for $zero
+static const int allocatableXmm[] = {2, 3, 4, 5, 6, 7};
 
 size_t RegAllocatorX64::GetRegOffset(GuestRegister reg)
 {
@@ -56,124 +74,317 @@ size_t RegAllocatorX64::GetRegOffset(GuestRegister reg)
     }
 }
 
-int RegAllocatorX64::GetHostReg(GuestRegister reg, bool dest)
+void RegAllocatorX64::AnalyzeBlock(IRArena& instrs)
 {
-    for (int i = 0; i < 16; i++)
+    std::array<uint16_t, 64> next;
+    next.fill(NEVER);
+
+    nextUse.resize(instrs.size());
+
+    for (size_t idx = instrs.size(); idx-- > 0;)
     {
-        if (regs[i].mapping == reg)
+        uint64_t reads, writes;
+        instrs[idx].GetRegUsage(reads, writes);
+
+        // Reads happen before the write, so `add a0, a0, 1` keeps a0 live
+        for (int r = 0; r < 64; r++)
         {
-            regs[i].used++;
-            return i;
+            if (writes & (1ULL << r))
+                next[r] = NEVER;
+            if (reads & (1ULL << r))
+                next[r] = idx < NEVER ? idx : NEVER - 1;
         }
+
+        nextUse[idx] = next;
     }
 
-    // No reg found, replacement time
+    position = 0;
+}
 
-    // First look for unallocated registers
-    for (int i = 0; i < 16; i++)
+void RegAllocatorX64::SetPosition(size_t pos)
+{
+    position = pos;
+
+    // Clean registers nothing reads again can go, their value is in memory
+    for (int i : allocatable)
     {
-        if (!regs[i].allocated)
+        if (regs[i].allocated && !regs[i].dirty && NextUse(regs[i].mapping) == NEVER)
+            Free(i);
+    }
+    for (int i : allocatableXmm)
+    {
+        if (xmms[i].allocated && !xmms[i].dirty && NextUse(xmms[i].mapping) == NEVER)
+            FreeXmm(i);
+    }
+}
+
+size_t RegAllocatorX64::GetPosition()
+{
+    return position;
+}
+
+uint16_t RegAllocatorX64::NextUse(GuestRegister reg)
+{
+    if (position >= nextUse.size())
+        return NEVER;
+    return nextUse[position][reg];
+}
+
+void RegAllocatorX64::Free(int hostReg)
+{
+    regs[hostReg].allocated = false;
+    regs[hostReg].mapping = GuestRegister::NONE;
+    regs[hostReg].dirty = false;
+}
+
+void RegAllocatorX64::FreeXmm(int xmm)
+{
+    xmms[xmm].allocated = false;
+    xmms[xmm].mapping = GuestRegister::NONE;
+    xmms[xmm].dirty = false;
+}
+
+void RegAllocatorX64::FlushXmm(GuestRegister reg)
+{
+    for (int i : allocatableXmm)
+    {
+        if (xmms[i].allocated && xmms[i].mapping == reg)
         {
-            regs[i].allocated = true;
-            regs[i].mapping = reg;
-            regs[i].used = 1;
-            if (!dest)
-                EEJitX64::JitLoadReg(reg, i);
+            if (xmms[i].dirty)
+                EEJitX64::JitStoreXmm(reg, i);
+            FreeXmm(i);
+        }
+    }
+}
+
+int RegAllocatorX64::GetHostReg(GuestRegister reg, bool dest)
+{
+    if (reg == GuestRegister::NONE)
+    {
+        if (dest)
+            return RCX;
+        EEJitX64::JitZeroReg(RSI);
+        return RSI;
+    }
+
+    // Even when only the low 64 bits are written, the upper ones have to be
+    // in the processor state
+    FlushXmm(reg);
+
+    for (int i : allocatable)
+    {
+        if (regs[i].allocated && regs[i].mapping == reg)
+        {
+            regs[i].last_use = position;
+            regs[i].dirty |= dest;
             return i;
         }
     }
 
-    int index = 0;
-    int hitsLeast = -1;
+    int index = -1;
 
-    // Find the least used register
-    for (int i = 0; i < 16; i++)
+    for (int i : allocatable)
     {
-        if (regs[i].used > hitsLeast)
+        if (!regs[i].allocated)
         {
-            hitsLeast = regs[i].used;
             index = i;
+            break;
         }
     }
 
-    // Write back the register
-    EEJitX64::JitStoreReg(regs[index].mapping);
+    if (index < 0)
+    {
+        // Evict whatever is read again furthest away, preferring registers
+        // that don't need a writeback. Anything handed out for the current
+        // instruction has to stay
+        int best = -1;
+        for (int i : allocatable)
+        {
+            if (regs[i].last_use == position)
+                continue;
+            int score = NextUse(regs[i].mapping) * 2 + !regs[i].dirty;
+            if (score > best)
+            {
+                best = score;
+                index = i;
+            }
+        }
+
+        if (index < 0)
+        {
+            printf("[REGALLOC_X64]: Ran out of host registers\n");
+            exit(1);
+        }
 
+        if (regs[index].dirty)
+            EEJitX64::JitStoreReg(regs[index].mapping, index);
+    }
+
+    regs[index].allocated = true;
     regs[index].mapping = reg;
-    regs[index].used = 1;
+    regs[index].dirty = dest;
+    regs[index].last_use = position;
     if (!dest)
         EEJitX64::JitLoadReg(reg, index);
     return index;
 }
 
-void RegAllocatorX64::DoWriteback()
+int RegAllocatorX64::GetXmmReg(GuestRegister reg, bool dest)
 {
-    for (int i = 0; i < 16; i++)
+    if (reg == GuestRegister::NONE)
+    {
+        if (dest)
+            return 15;
+        EEJitX64::JitZeroXmm(14);
+        return 14;
+    }
+
+    // The GPR only has the low 64 bits, and none of them are needed if all
+    // 128 are about to be written
+    for (int i : allocatable)
     {
-        if (regs[i].allocated && regs[i].mapping != GuestRegister::NONE)
+        if (regs[i].allocated && regs[i].mapping == reg)
         {
-            EEJitX64::JitStoreReg(regs[i].mapping);
-            regs[i].allocated = false;
-            regs[i].mapping = GuestRegister::NONE;
-            regs[i].used = 0;
+            if (dest)
+                Free(i);
+            else
+                InvalidateRegister((HostRegisters)i);
         }
     }
+
+    for (int i : allocatableXmm)
+    {
+        if (xmms[i].allocated && xmms[i].mapping == reg)
+        {
+            xmms[i].last_use = position;
+            xmms[i].dirty |= dest;
+            return i;
+        }
+    }
+
+    int index = -1;
+
+    for (int i : allocatableXmm)
+    {
+        if (!xmms[i].allocated)
+        {
+            index = i;
+            break;
+        }
+    }
+
+    // Same eviction as for GPRs
+    if (index < 0)
+    {
+        int best = -1;
+        for (int i : allocatableXmm)
+        {
+            if (xmms[i].last_use == position)
+                continue;
+            int score = NextUse(xmms[i].mapping) * 2 + !xmms[i].dirty;
+            if (score > best)
+            {
+                best = score;
+                index = i;
+            }
+        }
+
+        if (index < 0)
+        {
+            printf("[REGALLOC_X64]: Ran out of XMM registers\n");
+            exit(1);
+        }
+
+        if (xmms[index].dirty)
+            EEJitX64::JitStoreXmm(xmms[index].mapping, index);
+    }
+
+    xmms[index].allocated = true;
+    xmms[index].mapping = reg;
+    xmms[index].dirty = dest;
+    xmms[index].last_use = position;
+    if (!dest)
+        EEJitX64::JitLoadXmm(reg, index);
+    return index;
+}
+
+void RegAllocatorX64::DoWriteback()
+{
+    for (int i : allocatable)
+    {
+        if (regs[i].allocated && regs[i].dirty)
+            EEJitX64::JitStoreReg(regs[i].mapping, i);
+        Free(i);
+    }
+    for (int i : allocatableXmm)
+    {
+        if (xmms[i].allocated && xmms[i].dirty)
+            EEJitX64::JitStoreXmm(xmms[i].mapping, i);
+        FreeXmm(i);
+    }
 }
 
 void RegAllocatorX64::InvalidateRegister(HostRegisters reg)
 {
-	if (regs[reg].allocated && regs[reg].mapping != GuestRegister::NONE)
-	{
-		EEJitX64::JitStoreReg(regs[reg].mapping);
-		regs[reg].allocated = false;
-		regs[reg].mapping = GuestRegister::NONE;
-		regs[reg].used = 0;
-	}
+	if (regs[reg].allocated && regs[reg].dirty)
+		EEJitX64::JitStoreReg(regs[reg].mapping, reg);
+	Free(reg);
+}
+
+void RegAllocatorX64::Flush(GuestRegister reg)
+{
+    if (reg == GuestRegister::NONE)
+        return;
+
+    for (int i : allocatable)
+    {
+        if (regs[i].allocated && regs[i].mapping == reg)
+            InvalidateRegister((HostRegisters)i);
+    }
+    FlushXmm(reg);
+}
+
+void RegAllocatorX64::Discard(GuestRegister reg)
+{
+    if (reg == GuestRegister::NONE)
+        return;
+
+    for (int i : allocatable)
+    {
+        if (regs[i].allocated && regs[i].mapping == reg)
+            Free(i);
+    }
+    for (int i : allocatableXmm)
+    {
+        if (xmms[i].allocated && xmms[i].mapping == reg)
+            FreeXmm(i);
+    }
 }
 
 void RegAllocatorX64::Reset()
 {
     for (int i = 0; i < 16; i++)
     {
-        regs[i].allocated = false;
-        regs[i].mapping = GuestRegister::NONE;
-        regs[i].used = 0;
-    }
-
-    // Mark RSP, RBP, RAX, RDI, RSI, RCX, and R8 as used
-    // RSP is used for the stack (and it should never be overwritten)
-    // RBP is used to point to the processor state
-    // RAX is used for return values
-    // RDI and RSI are used for passing values to functions
-    // R8 holds the current value of pc
-    // RCX is for function pointers
-    regs[RSP].allocated = true;
-    regs[RSP].mapping = GuestRegister::NONE;
-    regs[RSP].used = -1;
-    
-    regs[RBP].allocated = true;
-    regs[RBP].mapping = GuestRegister::NONE;
-    regs[RBP].used = -1;
-    
-    regs[RAX].allocated = true;
-    regs[RAX].mapping = GuestRegister::NONE;
-    regs[RAX].used = -1;
-    
-    regs[RCX].allocated = true;
-    regs[RCX].mapping = GuestRegister::NONE;
-    regs[RCX].used = -1;
-    
-    regs[RDI].allocated = true;
-    regs[RDI].mapping = GuestRegister::NONE;
-    regs[RDI].used = -1;
-    
-    regs[RSI].allocated = true;
-    regs[RSI].mapping = GuestRegister::NONE;
-    regs[RSI].used = -1;
-
-    regs[R8].allocated = true;
-    regs[R8].mapping = GuestRegister::NONE;
-    regs[R8].used = -1;
+        Free(i);
+        regs[i].last_use = 0;
+        FreeXmm(i);
+        xmms[i].last_use = 0;
+    }
+    position = 0;
+}
+
+RegAllocatorX64::State RegAllocatorX64::Save()
+{
+    State state;
+    memcpy(state.regs, regs, sizeof(regs));
+    memcpy(state.xmms, xmms, sizeof(xmms));
+    return state;
+}
+
+void RegAllocatorX64::Restore(const State& state)
+{
+    memcpy(regs, state.regs, sizeof(regs));
+    memcpy(xmms, state.xmms, sizeof(xmms));
 }
 
 RegAllocatorX64::RegAllocatorX64()
@@ -3,8 +3,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <array>
+#include <vector>
+
 #include "GuestRegister.h"
 
+class IRArena;
+
 enum HostRegisters
 {
     RAX,
@@ -25,14 +30,65 @@ enum HostRegisters
     R15
 };
 
+struct HostRegister
+{
+    bool allocated;
+    GuestRegister mapping;
+    bool dirty; // Written since it was loaded, needs a writeback
+    size_t last_use; // Instruction that last asked for it
+};
+
 class RegAllocatorX64
 {
 public:
+    struct State
+    {
+        HostRegister regs[16];
+        HostRegister xmms[16];
+    };
+
     RegAllocatorX64();
 
+    // Backward liveness pass over a block, has to run before translating it
+    // Records, for every instruction, where each guest register is next read
+    void AnalyzeBlock(IRArena& instrs);
+    // Index of the instruction being translated
+    void SetPosition(size_t pos);
+    size_t GetPosition();
+
+    // $zero is never mapped. Reading it gives a zeroed scratch register, and
+    // writes to it go to a scratch register nothing reads back
     int GetHostReg(GuestRegister reg, bool dest = false);
+    // XMM register holding all 128 bits of a guest GPR, for the MMI and
+    // LQ/SQ. A guest register is only ever in one kind of host register,
+    // asking for it as the other kind writes it back and moves it over
+    // $zero reads as a zeroed XMM14, and writes to it go to XMM15
+    int GetXmmReg(GuestRegister reg, bool dest = false);
     size_t GetRegOffset(GuestRegister reg);
     void DoWriteback();
 	void InvalidateRegister(HostRegisters reg);
+    // Write back and unmap a guest register, for code that uses it straight
+    // from the processor state
+    void Flush(GuestRegister reg);
+    // Unmap a guest register without writing it back, it's about to be
+    // overwritten in the processor state
+    void Discard(GuestRegister reg);
     void Reset();
-};
\ No newline at end of file
+
+    // Used to emit both arms of a branch from the same starting mappings
+    State Save();
+    void Restore(const State& state);
+
+private:
+    static constexpr uint16_t NEVER = 0xffff;
+
+    // nextUse[i][r] is the first instruction at or after i that reads guest
+    // register r, or NEVER if it's overwritten or the block ends first
+    std::vector<std::array<uint16_t, 64>> nextUse;
+    size_t position = 0;
+
+    uint16_t NextUse(GuestRegister reg);
+    void Free(int hostReg);
+    void FreeXmm(int xmm);
+    void FlushXmm(GuestRegister reg);
+};
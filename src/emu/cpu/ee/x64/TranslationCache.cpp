@@ -0,0 +1,313 @@
+#include "TranslationCache.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+
+TranslationCache::Stats TranslationCache::stats;
+
+namespace TranslationCache
+{
+
+constexpr uint32_t FILE_MAGIC = 0x434A4545; // "EEJC"
+constexpr uint32_t FILE_VERSION = 3;
+constexpr uint32_t RECORD_MAGIC = 0x424A4545; // "EEJB"
+
+struct FileHeader
+{
+    uint32_t magic, version;
+    uint64_t exe_hash; // Emitted code calls into the emulator, so it has to be the same build
+    uint64_t config;
+};
+
+// Followed by the code, padded to 8 bytes, then the relocations, links,
+// fastmem sites and guest spans
+struct RecordHeader
+{
+    uint32_t magic;
+    uint32_t addr, cycles, size;
+    uint64_t hash;
+    uint32_t code_size, hot_size, reloc_count, link_count, site_count, span_count;
+    uint64_t checksum; // Of everything after the header
+};
+
+FILE* file;
+std::string filePath;
+// Records written since the last flush. They're flushed in batches, so a
+// crash loses at most one batch to the torn tail Index() drops
+int unflushed;
+constexpr int FLUSH_BATCH = 32;
+const uint8_t* mapped;
+size_t mappedSize;
+
+std::unordered_map<uint32_t, std::vector<Entry>> entries;
+// (address, guest hash) of blocks written this run, a block can be translated
+// more than once if its code gets flushed
+std::unordered_set<uint64_t> storedThisRun;
+
+size_t PayloadSize(const RecordHeader& r)
+{
+    return ((r.code_size + 7) & ~7)
+        + (size_t)r.reloc_count * sizeof(Reloc)
+        + (size_t)r.link_count * sizeof(Link)
+        + (size_t)r.site_count * sizeof(FastmemSite)
+        + (size_t)r.span_count * sizeof(Span);
+}
+
+// Returns the offset the valid part of the file ends at. Anything after it
+// was cut off by a crash mid-write
+size_t Index(const uint8_t* base, size_t size)
+{
+    size_t offset = sizeof(FileHeader);
+
+    while (size - offset >= sizeof(RecordHeader))
+    {
+        auto r = (const RecordHeader*)(base + offset);
+        if (r->magic != RECORD_MAGIC)
+            break;
+
+        size_t payload = PayloadSize(*r);
+        const uint8_t* data = base + offset + sizeof(RecordHeader);
+        if (payload > size - offset - sizeof(RecordHeader) || Hash(data, payload) != r->checksum)
+            break;
+
+        Entry e;
+        e.addr = r->addr;
+        e.cycles = r->cycles;
+        e.size = r->size;
+        e.hash = r->hash;
+        e.code = data;
+        e.code_size = r->code_size;
+        e.hot_size = r->hot_size;
+        data += (r->code_size + 7) & ~7;
+        e.relocs = (const Reloc*)data;
+        e.reloc_count = r->reloc_count;
+        data += r->reloc_count * sizeof(Reloc);
+        e.links = (const Link*)data;
+        e.link_count = r->link_count;
+        data += r->link_count * sizeof(Link);
+        e.sites = (const FastmemSite*)data;
+        e.site_count = r->site_count;
+        data += r->site_count * sizeof(FastmemSite);
+        e.spans = (const Span*)data;
+        e.span_count = r->span_count;
+
+        entries[e.addr].push_back(e);
+        stats.indexed++;
+
+        offset += sizeof(RecordHeader) + payload;
+    }
+
+    return offset;
+}
+
+uint64_t HashExecutable()
+{
+    FILE* exe = fopen("/proc/self/exe", "rb");
+    if (!exe)
+        return 0;
+
+    static uint8_t buffer[1024 * 1024];
+    uint64_t hash = 0;
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), exe)) > 0)
+        hash = Hash(buffer, read, hash);
+
+    fclose(exe);
+    return hash;
+}
+
+void Open(const std::string& directory, uint64_t bios_hash, uint64_t config)
+{
+    if (directory.empty() || file)
+        return;
+
+    if (mkdir(directory.c_str(), 0755) < 0 && errno != EEXIST)
+    {
+        printf("[EEJIT_X64]: Couldn't create translation cache directory %s: %s\n", directory.c_str(), strerror(errno));
+        return;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016lx.jit", (unsigned long)bios_hash);
+    std::string path = directory + name;
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        printf("[EEJIT_X64]: Couldn't open translation cache %s: %s\n", path.c_str(), strerror(errno));
+        return;
+    }
+
+    FileHeader header = {FILE_MAGIC, FILE_VERSION, HashExecutable(), config};
+    size_t valid = 0;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(FileHeader))
+    {
+        void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED && !memcmp(map, &header, sizeof(header)))
+        {
+            mapped = (const uint8_t*)map;
+            mappedSize = st.st_size;
+            valid = Index(mapped, mappedSize);
+        }
+        else
+        {
+            printf("[EEJIT_X64]: Translation cache %s is from another build or JIT config, starting over\n", path.c_str());
+            if (map != MAP_FAILED)
+                munmap(map, st.st_size);
+        }
+    }
+
+    if (!valid)
+    {
+        if (ftruncate(fd, 0) < 0 || write(fd, &header, sizeof(header)) != sizeof(header))
+        {
+            printf("[EEJIT_X64]: Couldn't write translation cache %s: %s\n", path.c_str(), strerror(errno));
+            close(fd);
+            return;
+        }
+    }
+    else if (valid < mappedSize)
+    {
+        // New blocks go after the last good one. Only the part past it is
+        // dropped, so nothing indexed stops being mapped
+        printf("[EEJIT_X64]: Dropping %zu bytes of broken records from %s\n", mappedSize - valid, path.c_str());
+        if (ftruncate(fd, valid) < 0)
+        {
+            printf("[EEJIT_X64]: Couldn't write translation cache %s: %s\n", path.c_str(), strerror(errno));
+            close(fd);
+            return;
+        }
+    }
+
+    lseek(fd, 0, SEEK_END);
+    file = fdopen(fd, "ab");
+    if (!file)
+    {
+        printf("[EEJIT_X64]: Couldn't write translation cache %s: %s\n", path.c_str(), strerror(errno));
+        close(fd);
+        return;
+    }
+    filePath = path;
+    atexit(Close);
+    printf("[EEJIT_X64]: Translation cache %s, %lu blocks\n", path.c_str(), (unsigned long)stats.indexed);
+}
+
+void Close()
+{
+    if (!file)
+        return;
+
+    if (fflush(file) != 0)
+        printf("[EEJIT_X64]: Couldn't write translation cache %s: %s\n", filePath.c_str(), strerror(errno));
+    fclose(file);
+    file = nullptr;
+}
+
+bool IsOpen()
+{
+    return file != nullptr;
+}
+
+const std::vector<Entry>* Find(uint32_t addr)
+{
+    auto it = entries.find(addr);
+    return it == entries.end() ? nullptr : &it->second;
+}
+
+void Store(const Entry& entry)
+{
+    if (!file || !storedThisRun.insert(Hash(&entry.addr, sizeof(entry.addr), entry.hash)).second)
+        return;
+
+    RecordHeader r = {};
+    r.magic = RECORD_MAGIC;
+    r.addr = entry.addr;
+    r.cycles = entry.cycles;
+    r.size = entry.size;
+    r.hash = entry.hash;
+    r.code_size = entry.code_size;
+    r.hot_size = entry.hot_size;
+    r.reloc_count = entry.reloc_count;
+    r.link_count = entry.link_count;
+    r.site_count = entry.site_count;
+    r.span_count = entry.span_count;
+
+    std::vector<uint8_t> payload(PayloadSize(r));
+    uint8_t* data = payload.data();
+    memcpy(data, entry.code, entry.code_size);
+    data += (entry.code_size + 7) & ~7;
+    memcpy(data, entry.relocs, entry.reloc_count * sizeof(Reloc));
+    data += entry.reloc_count * sizeof(Reloc);
+    memcpy(data, entry.links, entry.link_count * sizeof(Link));
+    data += entry.link_count * sizeof(Link);
+    memcpy(data, entry.sites, entry.site_count * sizeof(FastmemSite));
+    data += entry.site_count * sizeof(FastmemSite);
+    memcpy(data, entry.spans, entry.span_count * sizeof(Span));
+
+    r.checksum = Hash(payload.data(), payload.size());
+
+    bool ok = fwrite(&r, sizeof(r), 1, file) == 1 && fwrite(payload.data(), payload.size(), 1, file) == 1;
+    if (ok && ++unflushed >= FLUSH_BATCH)
+    {
+        ok = fflush(file) == 0;
+        unflushed = 0;
+    }
+
+    if (!ok)
+    {
+        // Whatever made it out is a torn record the next Index() drops
+        printf("[EEJIT_X64]: Couldn't write translation cache %s, not storing blocks anymore: %s\n", filePath.c_str(), strerror(errno));
+        fclose(file);
+        file = nullptr;
+        return;
+    }
+    stats.stored++;
+}
+
+// Anything in the emulator moves by the same amount between runs, so host
+// pointers are stored relative to one of its functions
+int64_t ToImageOffset(const void* ptr)
+{
+    return (int64_t)((uintptr_t)ptr - reinterpret_cast<uintptr_t>(&Open));
+}
+
+uint64_t FromImageOffset(int64_t offset)
+{
+    return reinterpret_cast<uintptr_t>(&Open) + offset;
+}
+
+// Not cryptographic, just quick enough to run over the whole executable
+uint64_t Hash(const void* data, size_t size, uint64_t seed)
+{
+    constexpr uint64_t K = 0x9E3779B97F4A7C15ULL;
+
+    auto p = (const uint8_t*)data;
+    uint64_t h = seed ^ (size * K);
+
+    for (; size >= 8; p += 8, size -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        h = (h ^ v) * K;
+        h ^= h >> 32;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, p, size);
+    h = (h ^ tail) * K;
+    h ^= h >> 29;
+    h *= K;
+    return h ^ (h >> 32);
+}
+
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Translated EE blocks kept on disk between runs
+// There's one file per BIOS image. Blocks are appended to it as they're
+// translated, together with a hash of the guest code they came from and the
+// relocations needed to run them from another spot in the code cache, in
+// another process. On startup the file is mapped and indexed by guest
+// address, so a warm start can copy blocks in instead of translating them
+// The file also records which build of the emulator and which JIT settings
+// wrote it, if either changed it's thrown away
+namespace TranslationCache
+{
+
+enum class RelocType : uint32_t
+{
+    HostPointer, // imm64 holding the address of something in the emulator itself
+    StaticJump, // rel32 into the dispatcher, `value` is a StaticTarget
+    ColdCrossing, // rel32 from hot code to cold, `value` 1, or back, `value` -1
+    BlockCounter, // imm64 holding the address of one of the block's profile counters, `value` says which
+};
+
+// Dispatcher entry points translated code jumps to, and the thunk it calls
+// into the emulator through
+enum StaticTarget
+{
+    DispatchLoop,
+    DispatchOutOfCycles,
+    HostCall,
+};
+
+// Offsets are from the start of the block's code, which is the hot code
+// followed by the cold code
+struct Reloc
+{
+    uint32_t offset;
+    RelocType type;
+    int64_t value; // Address relative to the emulator's image for HostPointer
+};
+
+struct Link
+{
+    uint32_t target;
+    uint32_t patch;
+};
+
+// Target of the link in an inline cache, which starts out empty
+constexpr uint32_t INLINE_CACHE = 0xFFFFFFFF;
+
+struct FastmemSite
+{
+    uint32_t site;
+    uint32_t slow_path;
+};
+
+// Guest code a block was translated from
+struct Span
+{
+    uint32_t addr, size;
+};
+
+// A block as it's stored, pointers are into the mapped file
+struct Entry
+{
+    uint32_t addr, cycles, size;
+    uint64_t hash; // Of the guest code in all the spans, in order
+    const Span* spans;
+    uint32_t span_count;
+    const uint8_t* code;
+    uint32_t code_size;
+    uint32_t hot_size; // Bytes of the code that are hot, the rest is cold
+    const Reloc* relocs;
+    uint32_t reloc_count;
+    const Link* links;
+    uint32_t link_count;
+    const FastmemSite* sites;
+    uint32_t site_count;
+};
+
+// Open or create the cache file for a BIOS. `config` covers the JIT settings
+// that change what gets emitted. Does nothing if `directory` is empty
+void Open(const std::string& directory, uint64_t bios_hash, uint64_t config);
+// Flush what's been stored and stop storing, Open() registers it to run at
+// exit
+void Close();
+bool IsOpen();
+
+// Stored translations of the block at `addr`, or nullptr
+const std::vector<Entry>* Find(uint32_t addr);
+void Store(const Entry& entry);
+
+// Moves host pointers to and from image relative offsets
+int64_t ToImageOffset(const void* ptr);
+uint64_t FromImageOffset(int64_t offset);
+
+uint64_t Hash(const void* data, size_t size, uint64_t seed = 0);
+
+struct Stats
+{
+    uint64_t indexed; // Valid blocks found in the file on startup
+    uint64_t loaded;
+    uint64_t stale; // Found, but the guest code has changed since
+    uint64_t stored;
+};
+
+extern Stats stats;
+
+}
@@ -2,6 +2,7 @@
 // This code is licensed under MIT license (see LICENSE for details)
 
 #include <emu/memory/Bus.h>
+#include <emu/memory/FastMem.h>
 
 #include <emu/cpu/ee/vu.h>
 #include <emu/cpu/ee/vif.h>
@@ -18,9 +19,11 @@
 #include <emu/cpu/ee/dmac.hpp>
 #include "Bus.h"
 
+// BIOS, scratchpad and RAM are owned by FastMem, so the JIT can reach them
+// directly
 uint8_t* BiosRom;
-uint8_t spr[0x4000];
-uint8_t ram[0x2000000];
+uint8_t* spr;
+uint8_t* ram;
 uint8_t* iop_ram;
 
 uint32_t MCH_DRD, MCH_RICM;
@@ -54,7 +57,10 @@ std::ofstream console;
 
 void Bus::LoadBios(uint8_t *data)
 {
-	BiosRom = new uint8_t[0x400000];
+	FastMem::Initialize();
+	BiosRom = FastMem::GetBios();
+	spr = FastMem::GetScratchpad();
+	ram = FastMem::GetRam();
 	iop_ram = new uint8_t[0x200000];
 
 	memcpy(BiosRom, data, 0x400000);
@@ -358,6 +364,25 @@ void Bus::Write128(uint32_t addr, uint128_t data)
 	exit(1);
 }
 
+void Bus::WriteBurst128(uint32_t addr, const uint128_t* data, size_t count)
+{
+	if (!count)
+		return;
+
+	EmotionEngine::MarkDirty(addr, count * 16);
+
+	uint32_t phys = Translate(addr);
+
+	if (phys < 0x2000000 && phys + count * 16 <= 0x2000000)
+	{
+		memcpy(&ram[phys], data, count * 16);
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++)
+		Write128(addr + i * 16, data[i]);
+}
+
 void Bus::Write64(uint32_t addr, uint64_t data)
 {
 	EmotionEngine::MarkDirty(addr, sizeof(data));
@@ -374,63 +399,59 @@ void Bus::Write64(uint32_t addr, uint64_t data)
 		*reinterpret_cast<uint64_t*>(&ram[addr]) = data;
 		return;
 	}
-	if (addr >= 0x11008000 && addr < 0x1100C000)
+	if (auto handler = GetWrite64Handler(addr))
 	{
-		VectorUnit::WriteCodeMem64(1, addr, data);
+		handler(addr, data);
 		return;
 	}
 
+	printf("Write64 0x%08lx to unknown address 0x%08x\n", data, addr);
+	exit(1);
+}
+
+// Everything that isn't plain memory lives here, so the JIT can bind stores to
+// known registers directly
+Bus::Write64Handler Bus::GetWrite64Handler(uint32_t addr)
+{
+	if (addr >= 0x11008000 && addr < 0x1100C000)
+		return [](uint32_t addr, uint64_t data) { VectorUnit::WriteCodeMem64(1, addr, data); };
+
 	switch (addr)
 	{
 	case 0x12001000:
-		GS::WriteGSCSR(data);
-		return;
+		return [](uint32_t, uint64_t data) { GS::WriteGSCSR(data); };
 	case 0x12000000:
-		GS::WriteGSPMODE(data);
-		return;
+		return [](uint32_t, uint64_t data) { GS::WriteGSPMODE(data); };
 	case 0x12000010:
-		GS::WriteGSSMODE1(data);
-		return;
+		return [](uint32_t, uint64_t data) { GS::WriteGSSMODE1(data); };
 	case 0x12000020:
-		GS::WriteGSSMODE2(data);
-		return;
+		return [](uint32_t, uint64_t data) { GS::WriteGSSMODE2(data); };
 	case 0x12000030:
-		GS::WriteGSSRFSH(data);
-		return;
+		return [](uint32_t, uint64_t data) { GS::WriteGSSRFSH(data); };
 	case 0x12000040:
-		GS::WriteGSSYNCH1(data);
-		return;
+		return [](uint32_t, uint64_t data) { GS::WriteGSSYNCH1(data); };
 	case 0x12000050:
-		GS::WriteGSSYNCH2(data);
-		return;
+		return [](uint32_t, uint64_t data) { GS::WriteGSSYNCH2(data); };
 	case 0x12000060:
-		GS::WriteGSSYNCV(data);
-		return;
+		return [](uint32_t, uint64_t data) { GS::WriteGSSYNCV(data); };
 	case 0x12000070:
-		GS::WriteDISPFB1(data);
-		return;
+		return [](uint32_t, uint64_t data) { GS::WriteDISPFB1(data); };
 	case 0x12000080:
-		GS::WriteDISPLAY1(data);
-		return;
+		return [](uint32_t, uint64_t data) { GS::WriteDISPLAY1(data); };
 	case 0x12000090:
-		GS::WriteDISPFB2(data);
-		return;
+		return [](uint32_t, uint64_t data) { GS::WriteDISPFB2(data); };
 	case 0x120000A0:
-		GS::WriteDISPLAY2(data);
-		return;
+		return [](uint32_t, uint64_t data) { GS::WriteDISPLAY2(data); };
 	case 0x120000E0:
-		GS::WriteBGCOLOR(data);
-		return;
+		return [](uint32_t, uint64_t data) { GS::WriteBGCOLOR(data); };
 	case 0x12001010:
-		GS::WriteIMR(data);
-		return;
+		return [](uint32_t, uint64_t data) { GS::WriteIMR(data); };
 	case 0x10000800: // Timer 1
 	case 0x10000810:
-		return;
+		return [](uint32_t, uint64_t) {};
 	}
 
-	printf("Write64 0x%08lx to unknown address 0x%08x\n", data, addr);
-	exit(1);
+	return nullptr;
 }
 
 bool firstTime = true;
@@ -467,6 +488,18 @@ void Bus::Write32(uint32_t addr, uint32_t data)
 		return;
 	}
 
+	if (auto handler = GetWrite32Handler(addr))
+	{
+		handler(addr, data);
+		return;
+	}
+
+	printf("Write32 0x%08x to unknown address 0x%08x\n", data, addr);
+	exit(1);
+}
+
+Bus::Write32Handler Bus::GetWrite32Handler(uint32_t addr)
+{
 	switch (addr)
 	{
 	case 0x1000f100:  // Some weird RDRAM stuff
@@ -481,35 +514,37 @@ void Bus::Write32(uint32_t addr, uint32_t data)
 	case 0x1000f480:
 	case 0x1000f490:
 	case 0x1f80141c:
-		return;
+		return [](uint32_t, uint32_t) {};
 	case 0x1000f000:
-		printf("Writing 0x%08x to INTC_STAT\n", data);
-		INTC_STAT &= ~(data);
-		return;
+		return [](uint32_t, uint32_t data)
+		{
+			printf("Writing 0x%08x to INTC_STAT\n", data);
+			INTC_STAT &= ~(data);
+		};
 	case 0x1000f010:
-		printf("Writing 0x%08x to INTC_MASK\n", data);
-		INTC_MASK = data;
-		return;
+		return [](uint32_t, uint32_t data)
+		{
+			printf("Writing 0x%08x to INTC_MASK\n", data);
+			INTC_MASK = data;
+		};
 	case 0x1000f500:  // EE TLB enable?
-		return;
+		return [](uint32_t, uint32_t) {};
 	case 0x1000f430:
-	{
-		uint8_t SA = (data >> 16) & 0xFFF;
-		uint8_t SBC = (data >> 6) & 0xF;
+		return [](uint32_t, uint32_t data)
+		{
+			uint8_t SA = (data >> 16) & 0xFFF;
+			uint8_t SBC = (data >> 6) & 0xF;
 
-		if (SA == 0x21 && SBC == 0x1 && ((MCH_DRD >> 7) & 1) == 0)
-			rdram_sdevid = 0;
+			if (SA == 0x21 && SBC == 0x1 && ((MCH_DRD >> 7) & 1) == 0)
+				rdram_sdevid = 0;
 
-		MCH_RICM = data & ~0x80000000;
-		return;
-	}
+			MCH_RICM = data & ~0x80000000;
+		};
 	case 0x1000f440:
-		MCH_DRD = data;
-		return;
+		return [](uint32_t, uint32_t data) { MCH_DRD = data; };
 	// GIF
 	case 0x10003000:
-		GIF::WriteCtrl32(data);
-		return;
+		return [](uint32_t, uint32_t data) { GIF::WriteCtrl32(data); };
 	// Timers
 	case 0x10000000:
 	case 0x10000010:
@@ -528,23 +563,21 @@ void Bus::Write32(uint32_t addr, uint32_t data)
 	case 0x10001820:
 	case 0x10001830:
 	case 0x1000f510:
-		return;
+		return [](uint32_t, uint32_t) {};
 	case 0x10008000:
 	case 0x10008010:
 	case 0x10008030:
 	case 0x10008040:
 	case 0x10008050:
 	case 0x10008080:
-		DMAC::WriteVIF0Channel(addr, data);
-		return;
+		return [](uint32_t addr, uint32_t data) { DMAC::WriteVIF0Channel(addr, data); };
 	case 0x10009000:
 	case 0x10009010:
 	case 0x10009030:
 	case 0x10009040:
 	case 0x10009050:
 	case 0x10009080:
-		DMAC::WriteVIF1Channel(addr, data);
-		return;
+		return [](uint32_t addr, uint32_t data) { DMAC::WriteVIF1Channel(addr, data); };
 	case 0x1000A000:
 	case 0x1000A010:
 	case 0x1000A020:
@@ -552,24 +585,21 @@ void Bus::Write32(uint32_t addr, uint32_t data)
 	case 0x1000A040:
 	case 0x1000A050:
 	case 0x1000A080:
-		DMAC::WriteGIFChannel(addr, data);
-		return;
+		return [](uint32_t addr, uint32_t data) { DMAC::WriteGIFChannel(addr, data); };
 	case 0x1000B000:
 	case 0x1000B010:
 	case 0x1000B030:
 	case 0x1000B040:
 	case 0x1000B050:
 	case 0x1000B080:
-		DMAC::WriteIPUFROMChannel(addr, data);
-		return;
+		return [](uint32_t addr, uint32_t data) { DMAC::WriteIPUFROMChannel(addr, data); };
 	case 0x1000B400:
 	case 0x1000B410:
 	case 0x1000B430:
 	case 0x1000B440:
 	case 0x1000B450:
 	case 0x1000B480:
-		DMAC::WriteIPUTOChannel(addr, data);
-		return;
+		return [](uint32_t addr, uint32_t data) { DMAC::WriteIPUTOChannel(addr, data); };
 	case 0x1000C000:
 	case 0x1000C010:
 	case 0x1000C020:
@@ -577,8 +607,7 @@ void Bus::Write32(uint32_t addr, uint32_t data)
 	case 0x1000C040:
 	case 0x1000C050:
 	case 0x1000C080:
-		DMAC::WriteSIF0Channel(addr, data);
-		return;
+		return [](uint32_t addr, uint32_t data) { DMAC::WriteSIF0Channel(addr, data); };
 	case 0x1000C400:
 	case 0x1000C410:
 	case 0x1000C420:
@@ -586,86 +615,68 @@ void Bus::Write32(uint32_t addr, uint32_t data)
 	case 0x1000C440:
 	case 0x1000C450:
 	case 0x1000C480:
-		DMAC::WriteSIF1Channel(addr, data);
-		return;
+		return [](uint32_t addr, uint32_t data) { DMAC::WriteSIF1Channel(addr, data); };
 	case 0x1000C800:
 	case 0x1000C810:
 	case 0x1000C830:
 	case 0x1000C840:
 	case 0x1000C850:
 	case 0x1000C880:
-		DMAC::WriteSIF2Channel(addr, data);
-		return;
+		return [](uint32_t addr, uint32_t data) { DMAC::WriteSIF2Channel(addr, data); };
 	case 0x1000D000:
 	case 0x1000D010:
 	case 0x1000D030:
 	case 0x1000D040:
 	case 0x1000D050:
 	case 0x1000D080:
-		DMAC::WriteSPRFROMChannel(addr, data);
-		return;
+		return [](uint32_t addr, uint32_t data) { DMAC::WriteSPRFROMChannel(addr, data); };
 	case 0x1000D400:
 	case 0x1000D410:
 	case 0x1000D430:
 	case 0x1000D440:
 	case 0x1000D450:
 	case 0x1000D480:
-		DMAC::WriteSPRTOChannel(addr, data);
-		return;
+		return [](uint32_t addr, uint32_t data) { DMAC::WriteSPRTOChannel(addr, data); };
 	case 0x1000E000:
-		DMAC::WriteDCTRL(data);
-		return;
+		return [](uint32_t, uint32_t data) { DMAC::WriteDCTRL(data); };
 	case 0x1000E010:
-		DMAC::WriteDSTAT(data);
-		return;
+		return [](uint32_t, uint32_t data) { DMAC::WriteDSTAT(data); };
 	case 0x1000E020:
-		DMAC::WriteDPCR(data);
-		return;
+		return [](uint32_t, uint32_t data) { DMAC::WriteDPCR(data); };
 	case 0x1000E030:
-		DMAC::WriteSQWC(data);
+		return [](uint32_t, uint32_t data) { DMAC::WriteSQWC(data); };
 	case 0x1000E040:
 	case 0x1000E050:
-		return;
+		return [](uint32_t, uint32_t) {};
 	case 0x10003810:
-		VIF::WriteFBRST(0, data);
-		return;
+		return [](uint32_t, uint32_t data) { VIF::WriteFBRST(0, data); };
 	case 0x10003820:
 	case 0x10003830:
-		VIF::WriteMASK(0, data);
-		return;
+		return [](uint32_t, uint32_t data) { VIF::WriteMASK(0, data); };
 	case 0x10003c00:
-		return;
+		return [](uint32_t, uint32_t) {};
 	case 0x10003c10:
-		VIF::WriteFBRST(1, data);
-		return;
+		return [](uint32_t, uint32_t data) { VIF::WriteFBRST(1, data); };
 	case 0x10002000:
 	case 0x10002010:
-		return;
+		return [](uint32_t, uint32_t) {};
 	case 0x1000F200:
-		SIF::WriteMSCOM_EE(data);
-		return;
+		return [](uint32_t, uint32_t data) { SIF::WriteMSCOM_EE(data); };
 	case 0x1000F220:
-		SIF::WriteMSFLG_EE(data);
-		return;
+		return [](uint32_t, uint32_t data) { SIF::WriteMSFLG_EE(data); };
 	case 0x1000F230:
-		SIF::WriteSMFLG_EE(data);
-		return;
+		return [](uint32_t, uint32_t data) { SIF::WriteSMFLG_EE(data); };
 	case 0x1000F240:
-		SIF::WriteCTRL_EE(data);
-		return;
+		return [](uint32_t, uint32_t data) { SIF::WriteCTRL_EE(data); };
 	case 0x1000F260:
-		SIF::WriteBD6_EE(data);
-		return;
+		return [](uint32_t, uint32_t data) { SIF::WriteBD6_EE(data); };
 	case 0x1000F590:
-		DMAC::WriteDENABLE(data);
-		return;
+		return [](uint32_t, uint32_t data) { DMAC::WriteDENABLE(data); };
 	case 0x12001000:
-		GS::WriteGSCSR((GS::ReadGSCSR() & 0xffffffff00000000) | data);
-		return;
+		return [](uint32_t, uint32_t data) { GS::WriteGSCSR((GS::ReadGSCSR() & 0xffffffff00000000) | data); };
 	}
 
-	printf("Write32 0x%08x to unknown address 0x%08x\n", data, addr);
-	exit(1);
+	return nullptr;
 }
 
 void Bus::Write16(uint32_t addr, uint16_t data)
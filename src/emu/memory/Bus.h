@@ -40,6 +40,17 @@ void Write32(uint32_t addr, uint32_t data);
 void Write16(uint32_t addr, uint16_t data);
 void Write8(uint32_t addr, uint8_t data);
 
+// For DMA, writes `count` quadwords starting at `addr` and checks the whole
+// run against translated code at once
+void WriteBurst128(uint32_t addr, const uint128_t* data, size_t count);
+
+// Handlers for single MMIO registers, looked up by physical address
+// Returns nullptr for plain memory and unknown addresses
+typedef void (*Write64Handler)(uint32_t addr, uint64_t data);
+typedef void (*Write32Handler)(uint32_t addr, uint32_t data);
+Write64Handler GetWrite64Handler(uint32_t addr);
+Write32Handler GetWrite32Handler(uint32_t addr);
+
 extern uint32_t I_MASK, I_STAT, I_CTRL;
 extern uint32_t spu2_stat;
 
@@ -0,0 +1,124 @@
+// (c) Copyright 2022-2023 Ryan Ilari
+// This code is licensed under MIT license (see LICENSE for details)
+
+#include <emu/memory/FastMem.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace FastMem
+{
+
+// Layout of the shared memory file
+constexpr size_t RAM_OFFS = 0;
+constexpr size_t RAM_SIZE = 0x2000000;
+constexpr size_t BIOS_OFFS = RAM_OFFS + RAM_SIZE;
+constexpr size_t BIOS_SIZE = 0x400000;
+constexpr size_t SPR_OFFS = BIOS_OFFS + BIOS_SIZE;
+constexpr size_t SPR_SIZE = 0x4000;
+constexpr size_t FILE_SIZE = SPR_OFFS + SPR_SIZE;
+
+constexpr size_t ARENA_SIZE = 0x100000000;
+
+int fd = -1;
+uint8_t* memory; // The mapping used by the Bus
+uint8_t* arena;
+
+void MapView(uint32_t vaddr, size_t offs, size_t size, int prot)
+{
+	void* ptr = mmap(arena + vaddr, size, prot, MAP_SHARED | MAP_FIXED, fd, offs);
+
+	if (ptr == MAP_FAILED)
+	{
+		printf("[emu/FastMem]: Failed to map 0x%08x! %s\n", vaddr, strerror(errno));
+		exit(1);
+	}
+}
+
+void Initialize()
+{
+	if (arena)
+		return;
+
+	fd = memfd_create("ps2-memory", 0);
+
+	if (fd < 0 || ftruncate(fd, FILE_SIZE) < 0)
+	{
+		printf("[emu/FastMem]: Failed to create guest memory! %s\n", strerror(errno));
+		exit(1);
+	}
+
+	memory = (uint8_t*)mmap(nullptr, FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	arena = (uint8_t*)mmap(nullptr, ARENA_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (memory == MAP_FAILED || arena == MAP_FAILED)
+	{
+		printf("[emu/FastMem]: Failed to reserve the arena! %s\n", strerror(errno));
+		exit(1);
+	}
+
+	// Mirror what Translate() does: every 512 MB segment folds down onto the
+	// physical map, except 0x70000000 which holds the scratchpad
+	for (uint64_t seg = 0; seg < 8; seg++)
+	{
+		uint32_t segBase = seg << 29;
+
+		MapView(segBase, RAM_OFFS, RAM_SIZE, PROT_READ | PROT_WRITE);
+
+		if (segBase == 0x60000000)
+			MapView(0x70000000, SPR_OFFS, SPR_SIZE, PROT_READ | PROT_WRITE);
+		else
+			// Stores to the BIOS fault and end up in the Bus
+			MapView(segBase + 0x1FC00000, BIOS_OFFS, BIOS_SIZE, PROT_READ);
+	}
+}
+
+uint8_t* GetRam()
+{
+	return memory + RAM_OFFS;
+}
+
+uint8_t* GetBios()
+{
+	return memory + BIOS_OFFS;
+}
+
+uint8_t* GetScratchpad()
+{
+	return memory + SPR_OFFS;
+}
+
+uint8_t* GetBase()
+{
+	return arena;
+}
+
+bool Contains(const void* ptr)
+{
+	return ptr >= arena && ptr < arena + ARENA_SIZE;
+}
+
+bool IsWritable(uint32_t addr)
+{
+	return addr < RAM_SIZE || (addr >= 0x70000000 && addr < 0x70000000 + SPR_SIZE);
+}
+
+void SetWriteProtected(uint32_t addr, bool prot)
+{
+	int flags = prot ? PROT_READ : PROT_READ | PROT_WRITE;
+	addr &= ~0xFFF;
+
+	if (addr < RAM_SIZE)
+	{
+		for (uint64_t seg = 0; seg < 8; seg++)
+			mprotect(arena + (seg << 29) + addr, 0x1000, flags);
+	}
+	else if (IsWritable(addr))
+		mprotect(arena + addr, 0x1000, flags);
+}
+
+}  // namespace FastMem
@@ -0,0 +1,33 @@
+// (c) Copyright 2022-2023 Ryan Ilari
+// This code is licensed under MIT license (see LICENSE for details)
+
+#pragma once
+
+#include <cstdint>
+
+// Host view of the guest address space for the JIT
+// EE RAM, BIOS and scratchpad live in one shared memory file, which is mapped
+// once for the Bus and again at every guest address that reaches it inside a
+// 4 GB arena. So translated code can access `arena + vaddr` directly, and
+// anything else (MMIO, unmapped space) faults
+namespace FastMem
+{
+
+void Initialize();
+
+uint8_t* GetRam();
+uint8_t* GetBios();
+uint8_t* GetScratchpad();
+
+// Base of the 4 GB arena
+uint8_t* GetBase();
+bool Contains(const void* ptr);
+
+// RAM and scratchpad pages, the only ones SetWriteProtected can change. The
+// BIOS is always read-only
+bool IsWritable(uint32_t addr);
+// Make every mirror of the physical page at `addr` read-only in the arena, or
+// writable again
+void SetWriteProtected(uint32_t addr, bool prot);
+
+}  // namespace FastMem